@@ -0,0 +1,703 @@
+/// image16bit - A simple module for 16-bit images.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+
+#include "image16bit.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pgm.h"
+#include "threadpool.h"
+
+// The pixel kernels, specialized for 16-bit pixels (negativeLevel16, ...)
+#define PIXEL uint16
+#define PIXEL_SUFFIX 16
+#include "imageKernels.h"
+
+// The data structure
+//
+// As in image8bit, without layouts, clones or shared memory: the pixel
+// array is always a raster scan, owned by the image.  Levels are stored
+// in the byte order of the host, and converted from/to the big-endian
+// order of PGM files when loading/saving.
+
+// Maximum value you can store in a 16-bit pixel (maximum maxval accepted)
+const uint16 Pix16Max = 65535;
+
+// Internal structure for storing 16-bit graymap images
+struct image16 {
+  int width;
+  int height;
+  int maxval;     // maximum gray value (pixels with maxval are pure WHITE)
+  uint16* pixel;  // pixel data (a raster scan)
+};
+
+// Address of the pixel at (x, y)
+#define P(img, x, y) (&(img)->pixel[(size_t)(y) * (img)->width + (x)])
+
+
+/// Error handling functions
+
+// As in image8bit (see the explanation there).
+
+// Variable to preserve errno temporarily
+static _Thread_local int errsave = 0;
+
+// Error cause
+static _Thread_local char* errCause;
+
+/// Error cause, after some function of this module fails.
+char* Image16ErrMsg() { ///
+  return errCause;
+}
+
+// Check a condition and set errCause to failmsg in case of failure.
+// This may be used to chain a sequence of operations and verify its success.
+// Propagates the condition.
+// Preserves global errno!
+static int check(int condition, const char* failmsg) {
+  errCause = (char*)(condition ? "" : failmsg);
+  return condition;
+}
+
+
+/// Parallel execution
+
+// As in image8bit: bands of rows (or of pixels) are processed by the
+// worker pool with PoolRunIf, whose minimum work (in pixels) is set by
+// ImageSetParallelThreshold.
+
+// Number of rows of the given width that make a band of about 16K pixels.
+static size_t rowGrain(int width) {
+  return width >= (1 << 14) ? 1 : (size_t)(1 << 14) / (width > 0 ? width : 1);
+}
+
+
+/// Image management functions
+
+/// Create a new black image.
+Image16 Image16Create(int width, int height, uint16 maxval) { ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval);
+
+  Image16 img = (Image16)malloc(sizeof(struct image16));
+  if (img == NULL) {
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+
+  // Allocate the pixel array, initialized to zeros (black image)
+  img->pixel = (uint16*)calloc((size_t)width * height + 1, sizeof(uint16));
+  if (img->pixel == NULL) {
+    errCause = "Memory allocation for pixel array failed";
+    free(img);
+    return NULL;
+  }
+  return img;
+}
+
+/// Destroy the image pointed to by (*imgp).
+void Image16Destroy(Image16* imgp) { ///
+  assert(imgp != NULL);
+  if (*imgp != NULL) {
+    free((*imgp)->pixel);
+    free(*imgp);
+    *imgp = NULL;
+  }
+}
+
+/// Convert an 8-bit image to a 16-bit one.
+Image16 Image16FromImage(Image img) { ///
+  assert(img != NULL);
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image16 img16 = Image16Create(w, h, (uint16)ImageMaxval(img));
+  if (img16 == NULL) return NULL;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      *P(img16, x, y) = ImageGetPixel(img, x, y);
+    }
+  }
+  return img16;
+}
+
+/// Convert a 16-bit image to an 8-bit one.
+Image Image16ToImage(Image16 img) { ///
+  assert(img != NULL);
+  int maxval = img->maxval > PixMax ? PixMax : img->maxval;
+  Image img8 = ImageCreate(img->width, img->height, (uint8)maxval);
+  if (img8 == NULL) {
+    errCause = ImageErrMsg();
+    return NULL;
+  }
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0; x < img->width; x++) {
+      uint64_t level = *P(img, x, y);
+      if (img->maxval > PixMax) {
+        level = (level * PixMax + img->maxval / 2) / img->maxval;
+      }
+      ImageSetPixel(img8, x, y, (uint8)level);
+    }
+  }
+  return img8;
+}
+
+
+/// PGM file operations
+
+// Parse the header of a PGM image from file f (see PgmReadHeader).
+// Returns nonzero on success, 0 on failure (errCause set).
+static int readHeader(FILE* f, PgmHeader* hdr) {
+  const char* cause = PgmReadHeader(f, hdr);
+  return
+  check( cause == NULL , cause ) &&
+  check( hdr->format != PBM_RAW , "Invalid file format" );
+}
+
+// Write the header of a PGM image of the given format with the size and
+// maxval of img to file f.
+// Returns nonzero on success, 0 on failure (errno set by fwrite).
+static int writeHeader(FILE* f, int format, Image16 img) {
+  PgmHeader hdr = { format, img->width, img->height, img->maxval };
+  char buf[PGM_HEADER_MAX];
+  size_t len = PgmFormatHeader(buf, &hdr);
+  return fwrite(buf, 1, len, f) == len;
+}
+
+// Read the plain (ASCII) levels of img from file f.
+// Returns nonzero on success, 0 on failure (errCause set).
+static int readPlain(Image16 img, FILE* f) {
+  PgmReader r = PgmReaderCreate(f, img->maxval);
+  if (!check( r != NULL, "Memory allocation failed" )) return 0;
+  const char* cause = PgmReadLevels(r, img->pixel, sizeof(uint16),
+                                    (size_t)img->width * img->height);
+  PgmReaderDestroy(&r);
+  return check( cause == NULL, cause );
+}
+
+// Write the pixels of img to file f, as rows of plain (ASCII) levels.
+// Returns nonzero on success, 0 on failure (errCause set).
+static int writePlain(Image16 img, FILE* f) {
+  PgmWriter wr = PgmWriterCreate(f);
+  const char* cause = wr == NULL ? "Memory allocation failed" : NULL;
+  for (int y = 0; y < img->height && cause == NULL; y++) {
+    cause = PgmWriteLevels(wr, P(img, 0, y), sizeof(uint16), img->width);
+  }
+  const char* flushed = PgmWriterDestroy(&wr);
+  if (cause == NULL) cause = flushed;
+  return check( cause == NULL, cause );
+}
+
+// Convert n levels between the byte order of the host and big-endian.
+static void swapBytes(uint16* p, size_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (size_t i = 0; i < n; i++) p[i] = __builtin_bswap16(p[i]);
+#else
+  (void)p;
+  (void)n;
+#endif
+}
+
+// Read the pixels of img from file f, with one or two bytes per pixel.
+// Returns nonzero on success, 0 on failure (errno set by fread).
+static int readPixels(Image16 img, FILE* f) {
+  size_t n = (size_t)img->width * img->height;
+  if (img->maxval > PixMax) {
+    if (fread(img->pixel, sizeof(uint16), n, f) != n) return 0;
+    swapBytes(img->pixel, n);
+    return 1;
+  }
+  // One byte per pixel: read them into the upper half of the array, and
+  // widen them in place, from the start (pixel i overwrites bytes 2i and
+  // 2i+1, which come before byte n+i, the next one to be read)
+  uint8* bytes = (uint8*)img->pixel + n;
+  if (fread(bytes, sizeof(uint8), n, f) != n) return 0;
+  for (size_t i = 0; i < n; i++) img->pixel[i] = bytes[i];
+  return 1;
+}
+
+// Write the pixels of img to file f, a row at a time, with one or two
+// bytes per pixel.
+// Returns nonzero on success, 0 on failure (errno set by fwrite or malloc).
+static int writePixels(Image16 img, FILE* f) {
+  int w = img->width;
+  uint16* row = (uint16*)malloc(w > 0 ? w * sizeof(uint16) : 1);
+  if (row == NULL) return 0;
+  int y = 0;
+  while (y < img->height) {
+    size_t written;
+    if (img->maxval > PixMax) {
+      memcpy(row, P(img, 0, y), w * sizeof(uint16));
+      swapBytes(row, w);
+      written = fwrite(row, sizeof(uint16), w, f);
+    } else {
+      uint8* bytes = (uint8*)row;
+      for (int x = 0; x < w; x++) bytes[x] = (uint8)*P(img, x, y);
+      written = fwrite(bytes, sizeof(uint8), w, f);
+    }
+    if (written != (size_t)w) break;
+    y++;
+  }
+  free(row);
+  return y == img->height;
+}
+
+/// Load a PGM file, raw (P5) or plain (P2).
+Image16 Image16Load(const char* filename) { ///
+  PgmHeader hdr;
+  FILE* f = NULL;
+  Image16 img = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse PGM header
+  readHeader(f, &hdr) &&
+  // Allocate image
+  (img = Image16Create(hdr.width, hdr.height, (uint16)hdr.maxval)) != NULL &&
+  // Read pixels
+  (hdr.format == PGM_RAW ? check( readPixels(img, f) , "Reading pixels" )
+                         : readPlain(img, f));
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    Image16Destroy(&img);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return img;
+}
+
+/// Save image to PGM file.
+int Image16Save(Image16 img, const char* filename) { ///
+  assert (img != NULL);
+  FILE* f = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( writeHeader(f, PGM_RAW, img), "Writing header failed" ) &&
+  check( writePixels(img, f), "Writing pixels failed" );
+
+  // Cleanup
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+/// Save image to a plain PGM file (P2).
+int Image16SavePlain(Image16 img, const char* filename) { ///
+  assert (img != NULL);
+  FILE* f = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( writeHeader(f, PGM_PLAIN, img), "Writing header failed" ) &&
+  writePlain(img, f);
+
+  // Cleanup
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+
+/// Information queries
+
+/// Get image width
+int Image16Width(Image16 img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int Image16Height(Image16 img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Get image maximum gray level
+int Image16Maxval(Image16 img) { ///
+  assert (img != NULL);
+  return img->maxval;
+}
+
+/// Pixel stats
+
+// Arguments of statsJob, with the min and max found so far.
+struct statsArg {
+  Image16 img;
+  uint16 min, max;
+};
+
+// Find min and max in a band of rows, and merge them into the result.
+static void statsJob(void* p, size_t begin, size_t end) {
+  struct statsArg* a = (struct statsArg*)p;
+  Image16 img = a->img;
+  uint16 min = Pix16Max;
+  uint16 max = 0;
+  minMaxRun16(P(img, 0, begin), (end - begin) * img->width, &min, &max);
+
+  // Merge into the result, which other threads may be updating
+  uint16 cur = __atomic_load_n(&a->min, __ATOMIC_RELAXED);
+  while (min < cur && !__atomic_compare_exchange_n(&a->min, &cur, min, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+  cur = __atomic_load_n(&a->max, __ATOMIC_RELAXED);
+  while (max > cur && !__atomic_compare_exchange_n(&a->max, &cur, max, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+/// Find the minimum and maximum gray levels in image.
+void Image16Stats(Image16 img, uint16* min, uint16* max) { ///
+  assert (img != NULL);
+  struct statsArg a = { img, Pix16Max, 0 };
+  size_t pixels = (size_t)img->width * img->height;
+  PoolRunIf(pixels, img->height, rowGrain(img->width), statsJob, &a);
+  *min = a.min;
+  *max = a.max;
+}
+
+/// Check if pixel position (x,y) is inside img.
+int Image16ValidPos(Image16 img, int x, int y) { ///
+  assert (img != NULL);
+  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int Image16ValidRect(Image16 img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  return (0 <= x && 0 <= y && 0 <= w && 0 <= h &&
+          w <= img->width - x && h <= img->height - y);
+}
+
+
+/// Pixel get & set operations
+
+/// Get the pixel (level) at position (x,y).
+uint16 Image16GetPixel(Image16 img, int x, int y) { ///
+  assert (img != NULL);
+  assert (Image16ValidPos(img, x, y));
+  return *P(img, x, y);
+}
+
+/// Set the pixel at position (x,y) to new level.
+void Image16SetPixel(Image16 img, int x, int y, uint16 level) { ///
+  assert (img != NULL);
+  assert (Image16ValidPos(img, x, y));
+  *P(img, x, y) = level;
+}
+
+
+/// Pixel transformations
+
+// Arguments of the pixel transformation jobs
+struct pointArg {
+  Image16 img;
+  uint16 thr;
+  double factor;
+};
+
+static void negativeJob(void* p, size_t begin, size_t end) {
+  Image16 img = ((struct pointArg*)p)->img;
+  negativeRun16(img->pixel + begin, end - begin, img->maxval);
+}
+
+static void thresholdJob(void* p, size_t begin, size_t end) {
+  struct pointArg* a = (struct pointArg*)p;
+  thresholdRun16(a->img->pixel + begin, end - begin, a->thr, a->img->maxval);
+}
+
+static void brightenJob(void* p, size_t begin, size_t end) {
+  struct pointArg* a = (struct pointArg*)p;
+  brightenRun16(a->img->pixel + begin, end - begin, a->factor, a->img->maxval);
+}
+
+// Apply job to all pixels of img, in parallel bands of pixels.
+static void pointOp(Image16 img, PoolJob job, struct pointArg* a) {
+  size_t size = (size_t)img->width * img->height;
+  PoolRunIf(size, size, 1 << 15, job, a);
+}
+
+/// Transform image to negative image.
+void Image16Negative(Image16 img) { ///
+  assert (img != NULL);
+  struct pointArg a = { img, 0, 0.0 };
+  pointOp(img, negativeJob, &a);
+}
+
+/// Apply threshold to image.
+void Image16Threshold(Image16 img, uint16 thr) { ///
+  assert (img != NULL);
+  struct pointArg a = { img, thr, 0.0 };
+  pointOp(img, thresholdJob, &a);
+}
+
+/// Brighten image by a factor.
+void Image16Brighten(Image16 img, double factor) { ///
+  assert (img != NULL);
+  struct pointArg a = { img, 0, factor };
+  pointOp(img, brightenJob, &a);
+}
+
+
+/// Geometric transformations
+
+// Side of the blocks of ImageRotate
+#define BLOCK 64
+
+// Arguments of the geometric transformation jobs: src -> dst
+struct geomArg {
+  Image16 src;
+  Image16 dst;
+};
+
+// Rotate a band of rows of BLOCK x BLOCK blocks (as in image8bit).
+static void rotateJob(void* p, size_t begin, size_t end) {
+  struct geomArg* a = (struct geomArg*)p;
+  Image16 img = a->src;
+  int by0 = (int)begin * BLOCK;
+  int by1 = (int)end * BLOCK < img->height ? (int)end * BLOCK : img->height;
+  for (int by = by0; by < by1; by += BLOCK) {
+    for (int bx = 0; bx < img->width; bx += BLOCK) {
+      int ey = by + BLOCK < img->height ? by + BLOCK : img->height;
+      int ex = bx + BLOCK < img->width ? bx + BLOCK : img->width;
+      for (int y = by; y < ey; ++y) {
+        for (int x = bx; x < ex; ++x) {
+          *P(a->dst, y, img->width - 1 - x) = *P(img, x, y);
+        }
+      }
+    }
+  }
+}
+
+/// Rotate an image (90 degrees anti-clockwise).
+Image16 Image16Rotate(Image16 img) { ///
+  assert (img != NULL);
+  Image16 rotatedImg = Image16Create(img->height, img->width, img->maxval);
+  if (rotatedImg == NULL) return NULL;
+  struct geomArg a = { img, rotatedImg };
+  size_t blocks = ((size_t)img->height + BLOCK - 1) / BLOCK;
+  PoolRunIf((size_t)img->width * img->height, blocks, 1, rotateJob, &a);
+  return rotatedImg;
+}
+
+// Mirror a band of rows.
+static void mirrorJob(void* p, size_t begin, size_t end) {
+  struct geomArg* a = (struct geomArg*)p;
+  for (size_t y = begin; y < end; ++y) {
+    mirrorRun16(P(a->dst, 0, y), P(a->src, 0, y), a->src->width);
+  }
+}
+
+/// Mirror an image = flip left-right.
+Image16 Image16Mirror(Image16 img) { ///
+  assert (img != NULL);
+  Image16 mirroredImg = Image16Create(img->width, img->height, img->maxval);
+  if (mirroredImg == NULL) return NULL;
+  struct geomArg a = { img, mirroredImg };
+  PoolRunIf((size_t)img->width * img->height, img->height, rowGrain(img->width),
+            mirrorJob, &a);
+  return mirroredImg;
+}
+
+// Copy the w x h rectangle of src at (sx, sy) to dst at (dx, dy).
+static void copyRect(Image16 dst, int dx, int dy, Image16 src, int sx, int sy, int w, int h) {
+  for (int y = 0; y < h; y++) {
+    memcpy(P(dst, dx, dy + y), P(src, sx, sy + y), (size_t)w * sizeof(uint16));
+  }
+}
+
+/// Crop a rectangular subimage from img.
+Image16 Image16Crop(Image16 img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (Image16ValidRect(img, x, y, w, h));
+  Image16 croppedImg = Image16Create(w, h, img->maxval);
+  if (croppedImg == NULL) return NULL;
+  copyRect(croppedImg, 0, 0, img, x, y, w, h);
+  return croppedImg;
+}
+
+
+/// Operations on two images
+
+/// Paste img2 into position (x, y) of img1.
+void Image16Paste(Image16 img1, int x, int y, Image16 img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (Image16ValidRect(img1, x, y, img2->width, img2->height));
+  copyRect(img1, x, y, img2, 0, 0, img2->width, img2->height);
+}
+
+// Arguments of blendJob: blend img2 into img1 at (x, y)
+struct blendArg {
+  Image16 img1;
+  int x, y;
+  Image16 img2;
+  double alpha;
+};
+
+// Blend a band of rows of img2.
+static void blendJob(void* p, size_t begin, size_t end) {
+  struct blendArg* a = (struct blendArg*)p;
+  for (int cy = (int)begin; cy < (int)end; ++cy) {
+    blendRun16(P(a->img1, a->x, a->y + cy), P(a->img2, 0, cy), a->img2->width,
+               a->alpha, a->img1->maxval);
+  }
+}
+
+/// Blend img2 into position (x, y) of img1.
+void Image16Blend(Image16 img1, int x, int y, Image16 img2, double alpha) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (Image16ValidRect(img1, x, y, img2->width, img2->height));
+  struct blendArg a = { img1, x, y, img2, alpha };
+  PoolRunIf((size_t)img2->width * img2->height, img2->height, rowGrain(img2->width),
+            blendJob, &a);
+}
+
+// Compare img2 to the subimage of img1 at (x, y), row by row.
+static int match(Image16 img1, int x, int y, Image16 img2) {
+  for (int cy = 0; cy < img2->height; ++cy) {
+    size_t w = img2->width;
+    if (matchRun16(P(img1, x, y + cy), P(img2, 0, cy), w) < w) return 0;
+  }
+  return 1;
+}
+
+/// Compare an image to a subimage of a larger image.
+int Image16MatchSubImage(Image16 img1, int x, int y, Image16 img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (Image16ValidPos(img1, x, y));
+  if (!Image16ValidRect(img1, x, y, img2->width, img2->height)) {
+    return 0;
+  }
+  return match(img1, x, y, img2);
+}
+
+// Arguments of locateJob
+struct locateArg {
+  Image16 img1;
+  Image16 img2;
+  size_t found;  // index y*(width+1)+x of the first match found so far
+};
+
+// Search for img2 in a band of candidate rows of img1 (as in image8bit:
+// bands come in increasing order, so a band stops at any earlier match).
+static void locateJob(void* p, size_t begin, size_t end) {
+  struct locateArg* a = (struct locateArg*)p;
+  Image16 img1 = a->img1;
+  Image16 img2 = a->img2;
+  for (int y = (int)begin; y < (int)end; ++y) {
+    size_t row = (size_t)y * (img1->width + 1);  // (+1: img1 may be empty)
+    if (__atomic_load_n(&a->found, __ATOMIC_RELAXED) < row) break;
+    int last = img1->width - img2->width;
+    int x = 0;
+    while (x <= last && !match(img1, x, y, img2)) {
+      ++x;
+    }
+    if (x <= last) {
+      // If a match is found, record it, unless an earlier one is known
+      size_t cur = __atomic_load_n(&a->found, __ATOMIC_RELAXED);
+      while (row + x < cur && !__atomic_compare_exchange_n(&a->found, &cur, row + x, 0,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+      break;
+    }
+  }
+}
+
+/// Locate a subimage inside another image.
+int Image16LocateSubImage(Image16 img1, int* px, int* py, Image16 img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  struct locateArg a = { img1, img2, SIZE_MAX };
+  if (img2->width <= img1->width && img2->height <= img1->height) {
+    int rows = img1->height - img2->height + 1;
+    size_t work = (size_t)rows * (img1->width - img2->width + 1);
+    PoolRunIf(work, rows, 1, locateJob, &a);
+  }
+  if (a.found == SIZE_MAX) return 0;
+  *px = (int)(a.found % (img1->width + 1));
+  *py = (int)(a.found / (img1->width + 1));
+  return 1;
+}
+
+
+/// Filtering
+
+// As ImageBlur: the means of the windows come from a summed-area table of
+// 64-bit sums (which reach 65535*width*height), built in parallel by rows
+// and then by columns, as in image8bit.
+
+// Arguments of the blur jobs
+struct blurArg {
+  Image16 img;
+  int dx, dy;
+  int tWidth;               // width of the table (image width + 1)
+  uint64_t* integralImage;  // tWidth x (height+1) table, row-major
+};
+
+// Sum of the pixels in [0, x[ x [0, y[
+#define II(x, y) a->integralImage[(size_t)(y) * a->tWidth + (x)]
+
+// Prefix sums along a band of rows of the image.
+static void blurRowsJob(void* p, size_t begin, size_t end) {
+  struct blurArg* a = (struct blurArg*)p;
+  for (int y = (int)begin; y < (int)end; y++) {
+    II(0, y + 1) = 0;
+    prefixRun16(P(a->img, 0, y), a->img->width, 0, &II(1, y + 1));
+  }
+}
+
+// Prefix sums down a band of columns of the table.
+static void blurColumnsJob(void* p, size_t begin, size_t end) {
+  struct blurArg* a = (struct blurArg*)p;
+  for (int y = 2; y <= a->img->height; y++) {
+    for (int x = (int)begin; x < (int)end; x++) {
+      II(x, y) += II(x, y - 1);
+    }
+  }
+}
+
+// Compute a band of rows of the blurred image from the table.
+static void blurOutputJob(void* p, size_t begin, size_t end) {
+  struct blurArg* a = (struct blurArg*)p;
+  Image16 img = a->img;
+  for (int Y = (int)begin; Y < (int)end; Y++) {
+    // The window rows, clipped to the image, are [y0, y1[
+    int y0 = Y - a->dy > 0 ? Y - a->dy : 0;
+    int y1 = Y + a->dy < img->height ? Y + a->dy + 1 : img->height;
+    meanRun16(&II(0, y0), &II(0, y1), img->width, a->dx, y1 - y0, 0, img->width,
+              P(img, 0, Y));
+  }
+}
+
+#undef II
+
+/// Blur an image by applying a (2dx+1)x(2dy+1) mean filter.
+void Image16Blur(Image16 img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+
+  struct blurArg a = { img, dx, dy, img->width + 1, NULL };
+  size_t cells = (size_t)a.tWidth * (img->height + 1);
+  a.integralImage = (uint64_t*)malloc(cells * sizeof(uint64_t));
+  if (a.integralImage == NULL) {
+    errCause = "Memory allocation failed";
+    return;
+  }
+
+  if (img->width > 0 && img->height > 0) {
+    memset(a.integralImage, 0, a.tWidth * sizeof(uint64_t));  // first row
+    size_t pixels = (size_t)img->width * img->height;
+    PoolRunIf(pixels, img->height, rowGrain(img->width), blurRowsJob, &a);
+    PoolRunIf(cells, a.tWidth, 1024, blurColumnsJob, &a);
+    PoolRunIf(pixels, img->height, rowGrain(img->width), blurOutputJob, &a);
+  }
+  free(a.integralImage);
+}
@@ -0,0 +1,175 @@
+/// image16bit - A simple module for 16-bit images.
+///
+/// The 16-bit counterpart of image8bit: graymaps with maxval up to 65535,
+/// as in PGM files with two bytes per sample.  The operations do the same
+/// as their image8bit namesakes (Image16Blur as ImageBlur, ...), with the
+/// same rounding and saturation: both modules compute pixel levels with
+/// the kernels of imageKernels.h, specialized for each pixel type.
+///
+/// 16-bit images are simpler than 8-bit ones: their pixels are always a
+/// raster scan in a private array (no layouts, clones or shared memory),
+/// and operations are not instrumented.  Bulk operations run in parallel
+/// in the worker pool of the threadpool module (see ImageSetThreads and
+/// ImageSetParallelThreshold, which apply to this module too).
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+
+#ifndef IMAGE16BIT_H
+#define IMAGE16BIT_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "image8bit.h"
+
+// Type for 16-bit pixel levels
+typedef uint16_t uint16;
+
+// Maximum value you can store in a 16-bit pixel (maximum maxval accepted)
+extern const uint16 Pix16Max;
+
+// Type Image16 is a pointer to 16-bit image objects
+typedef struct image16 *Image16;
+
+/// Error handling functions
+
+/// Error cause, after some function of this module fails.
+/// As ImageErrMsg, for the functions of this module.
+char* Image16ErrMsg() ;
+
+/// Image management functions
+
+/// Create a new black image.
+/// Requires: width and height must be non-negative, 0 < maxval <= Pix16Max.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Create(int width, int height, uint16 maxval) ;
+
+/// Destroy the image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void Image16Destroy(Image16* imgp) ;
+
+/// Convert an 8-bit image to a 16-bit one, with the same size, maxval and
+/// pixel levels.
+/// On success, a new image is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16FromImage(Image img) ;
+
+/// Convert a 16-bit image to an 8-bit one (with raster layout).
+/// If the maxval of img exceeds PixMax, levels are rescaled (rounding to
+/// the nearest) to maxval PixMax; otherwise, they are kept as they are.
+/// On success, a new image is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image Image16ToImage(Image16 img) ;
+
+/// PGM file operations
+
+/// Load a PGM file, raw (P5) or plain (P2).
+/// Raw files with maxval up to 255 have one byte per pixel, and those with
+/// larger maxvals have two, most significant byte first (big-endian).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image16 Image16Load(const char* filename) ;
+
+/// Save image to PGM file, with one or two bytes per pixel, depending on
+/// its maxval (as in Image16Load).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int Image16Save(Image16 img, const char* filename) ;
+
+/// Save image to a plain PGM file (P2), with levels in decimal ASCII.
+/// Otherwise, as Image16Save.
+int Image16SavePlain(Image16 img, const char* filename) ;
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int Image16Width(Image16 img) ;
+
+/// Get image height
+int Image16Height(Image16 img) ;
+
+/// Get image maximum gray level
+int Image16Maxval(Image16 img) ;
+
+/// Pixel stats
+/// Find the minimum and maximum gray levels in image, as ImageStats.
+void Image16Stats(Image16 img, uint16* min, uint16* max) ;
+
+/// Check if pixel position (x,y) is inside img.
+int Image16ValidPos(Image16 img, int x, int y) ;
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int Image16ValidRect(Image16 img, int x, int y, int w, int h) ;
+
+/// Pixel get & set operations
+
+/// Get the pixel (level) at position (x,y).
+uint16 Image16GetPixel(Image16 img, int x, int y) ;
+
+/// Set the pixel at position (x,y) to new level.
+void Image16SetPixel(Image16 img, int x, int y, uint16 level) ;
+
+/// Pixel transformations, in-place, as ImageNegative, ...
+/// They never fail.
+
+/// Transform image to negative image.
+void Image16Negative(Image16 img) ;
+
+/// Apply threshold to image.
+void Image16Threshold(Image16 img, uint16 thr) ;
+
+/// Brighten image by a factor.
+void Image16Brighten(Image16 img, double factor) ;
+
+/// Geometric transformations, as ImageRotate, ...
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+/// Rotate an image (90 degrees anti-clockwise).
+Image16 Image16Rotate(Image16 img) ;
+
+/// Mirror an image = flip left-right.
+Image16 Image16Mirror(Image16 img) ;
+
+/// Crop a rectangular subimage from img.
+/// Requires: the rectangle must be inside the original image.
+Image16 Image16Crop(Image16 img, int x, int y, int w, int h) ;
+
+/// Operations on two images, as ImagePaste, ...
+
+/// Paste img2 into position (x, y) of img1.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Paste(Image16 img1, int x, int y, Image16 img2) ;
+
+/// Blend img2 into position (x, y) of img1.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Blend(Image16 img1, int x, int y, Image16 img2, double alpha) ;
+
+/// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
+/// Returns 0, otherwise (including if img2 does not fit in img1 at (x, y)).
+/// Requires: (x, y) must be a valid position of img1.
+int Image16MatchSubImage(Image16 img1, int x, int y, Image16 img2) ;
+
+/// Searches for img2 inside img1.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int Image16LocateSubImage(Image16 img1, int* px, int* py, Image16 img2) ;
+
+/// Filtering
+
+/// Blur an image by applying a (2dx+1)x(2dy+1) mean filter, as ImageBlur.
+/// Window sums are 64-bit, so they never overflow.
+/// On failure (if the table of sums cannot be allocated), img is left
+/// unchanged and errno/errCause are set accordingly.
+void Image16Blur(Image16 img, int dx, int dy) ;
+
+#endif
@@ -0,0 +1,448 @@
+/// image1bit - A simple module for binary (1-bit) images.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+
+#include "image1bit.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pgm.h"
+#include "threadpool.h"
+
+// The data structure
+//
+// Each row is a run of stride 64-bit words: pixel x of the row is bit
+// x % 64 (counting from the least significant) of word x / 64.  The bits
+// past the width, in the last word of each row, are always 0, so that
+// whole words can be combined and counted with no masking.
+
+struct image1 {
+  int width;
+  int height;
+  size_t stride;  // words per row
+  uint64_t* word; // pixel data (height x stride words)
+};
+
+// Address of the first word of row y
+#define ROW(img, y) (&(img)->word[(size_t)(y) * (img)->stride])
+
+// Mask of the pixels of the last word of a row of the given width
+static inline uint64_t lastMask(int width) {
+  return width % 64 == 0 ? ~(uint64_t)0 : ((uint64_t)1 << (width % 64)) - 1;
+}
+
+// Convert a word between the byte order of the host and little-endian,
+// in which byte k of a word (in memory) holds pixels 8k to 8k+7.
+static inline uint64_t littleEndian(uint64_t w) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return w;
+#else
+  return __builtin_bswap64(w);
+#endif
+}
+
+
+/// Error handling functions
+
+// As in image8bit (see the explanation there).
+
+// Variable to preserve errno temporarily
+static _Thread_local int errsave = 0;
+
+// Error cause
+static _Thread_local char* errCause;
+
+/// Error cause, after some function of this module fails.
+char* Image1ErrMsg() { ///
+  return errCause;
+}
+
+// Check a condition and set errCause to failmsg in case of failure.
+// This may be used to chain a sequence of operations and verify its success.
+// Propagates the condition.
+// Preserves global errno!
+static int check(int condition, const char* failmsg) {
+  errCause = (char*)(condition ? "" : failmsg);
+  return condition;
+}
+
+
+/// Parallel execution
+
+// As in image8bit: bands of rows are processed by the worker pool with
+// PoolRunIf, whose minimum work (in pixels) is set by
+// ImageSetParallelThreshold.
+
+// Number of rows of the given width that make a band of about 64K pixels
+// (bit operations are cheap per pixel, so bands are larger than in image8bit).
+static size_t rowGrain(int width) {
+  return width >= (1 << 16) ? 1 : (size_t)(1 << 16) / (width > 0 ? width : 1);
+}
+
+
+/// Image management functions
+
+/// Create a new binary image, with all pixels 0 (black).
+Image1 Image1Create(int width, int height) { ///
+  assert(width >= 0);
+  assert(height >= 0);
+
+  Image1 img = (Image1)malloc(sizeof(struct image1));
+  if (img == NULL) {
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  img->width = width;
+  img->height = height;
+  img->stride = ((size_t)width + 63) / 64;
+
+  // Allocate the pixel array, initialized to zeros (black image)
+  img->word = (uint64_t*)calloc(img->stride * height + 1, sizeof(uint64_t));
+  if (img->word == NULL) {
+    errCause = "Memory allocation for pixel array failed";
+    free(img);
+    return NULL;
+  }
+  return img;
+}
+
+/// Destroy the image pointed to by (*imgp).
+void Image1Destroy(Image1* imgp) { ///
+  assert(imgp != NULL);
+  if (*imgp != NULL) {
+    free((*imgp)->word);
+    free(*imgp);
+    *imgp = NULL;
+  }
+}
+
+// Rows are converted from/to 8-bit images in segments of SEGMENT pixels
+// (a multiple of 64), through a buffer of levels.
+#define SEGMENT 512
+
+// Arguments of the conversion jobs
+struct convertArg {
+  Image img8;
+  Image1 img1;
+  uint8 level;  // thr (to binary) or maxval (from binary)
+};
+
+// Threshold a band of rows of img8 into img1.
+// Each 8 levels become 8 bytes 0 or 1 (a loop that the compiler
+// vectorizes), which a multiplication gathers into the top byte of a word:
+// byte k (value b) times byte 7-k of the constant (value 2^k) is b << 8*7+k.
+static void thresholdJob(void* p, size_t begin, size_t end) {
+  struct convertArg* a = (struct convertArg*)p;
+  Image1 img = a->img1;
+  uint8 levels[SEGMENT];
+  uint8 bytes[SEGMENT];
+  for (int y = (int)begin; y < (int)end; y++) {
+    uint64_t* row = ROW(img, y);
+    for (int x = 0; x < img->width; x += SEGMENT) {
+      int len = img->width - x < SEGMENT ? img->width - x : SEGMENT;
+      ImageGetRow(a->img8, x, y, len, levels);
+      for (int i = 0; i < len; i++) bytes[i] = levels[i] >= a->level;
+      for (int i = len; i % 64 != 0; i++) bytes[i] = 0;  // (past the width)
+      for (int i = 0; i < len; i += 64) {
+        uint64_t w = 0;
+        for (int k = 0; k < 8; k++) {
+          uint64_t b;
+          memcpy(&b, &bytes[i + 8 * k], 8);
+          w |= ((littleEndian(b) * 0x0102040810204080) >> 56) << 8 * k;
+        }
+        row[(x + i) / 64] = w;
+      }
+    }
+  }
+}
+
+/// Threshold img into a new binary image.
+Image1 ImageThresholdToBinary(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  Image1 img1 = Image1Create(ImageWidth(img), ImageHeight(img));
+  if (img1 == NULL) return NULL;
+  struct convertArg a = { img, img1, thr };
+  size_t pixels = (size_t)img1->width * img1->height;
+  PoolRunIf(pixels, img1->height, rowGrain(img1->width), thresholdJob, &a);
+  return img1;
+}
+
+// Expand a band of rows of img1 into img8.
+// Each 8 bits are spread to the bytes of a word (the byte k of a copy of
+// the 8 bits in each byte keeps bit k, which is carried to bit 7 by
+// adding 0x7F), and the resulting bytes 0 or 1 are multiplied by maxval.
+static void expandJob(void* p, size_t begin, size_t end) {
+  struct convertArg* a = (struct convertArg*)p;
+  Image1 img = a->img1;
+  uint8 levels[SEGMENT];
+  for (int y = (int)begin; y < (int)end; y++) {
+    const uint64_t* row = ROW(img, y);
+    for (int x = 0; x < img->width; x += SEGMENT) {
+      int len = img->width - x < SEGMENT ? img->width - x : SEGMENT;
+      for (int i = 0; i < len; i += 64) {
+        uint64_t w = row[(x + i) / 64];
+        for (int k = 0; k < 8; k++) {
+          uint64_t b = ((w >> 8 * k) & 0xFF) * 0x0101010101010101;
+          b = (((b & 0x8040201008040201) + 0x7F7F7F7F7F7F7F7F) >> 7) & 0x0101010101010101;
+          b = littleEndian(b * a->level);
+          memcpy(&levels[i + 8 * k], &b, 8);
+        }
+      }
+      ImageSetRow(a->img8, x, y, len, levels);
+    }
+  }
+}
+
+/// Convert a binary image to an 8-bit one.
+Image Image1ToImage(Image1 img, uint8 maxval) { ///
+  assert (img != NULL);
+  assert (0 < maxval);
+  Image img8 = ImageCreate(img->width, img->height, maxval);
+  if (img8 == NULL) {
+    errCause = ImageErrMsg();
+    return NULL;
+  }
+  struct convertArg a = { img8, img, maxval };
+  size_t pixels = (size_t)img->width * img->height;
+  PoolRunIf(pixels, img->height, rowGrain(img->width), expandJob, &a);
+  return img8;
+}
+
+
+/// PBM file operations
+
+// Reverse the order of the bits of each byte of w (in 3 steps, swapping
+// bits, pairs and nibbles), between the order of the image (first pixel in
+// the least significant bit) and that of PBM files (in the most).
+static inline uint64_t reverseBytes(uint64_t w) {
+  w = ((w >> 1) & 0x5555555555555555) | ((w & 0x5555555555555555) << 1);
+  w = ((w >> 2) & 0x3333333333333333) | ((w & 0x3333333333333333) << 2);
+  w = ((w >> 4) & 0x0F0F0F0F0F0F0F0F) | ((w & 0x0F0F0F0F0F0F0F0F) << 4);
+  return w;
+}
+
+// Convert a word of a PBM file, as read into memory, to a word of the
+// image: its bytes hold 8 pixels each, the first in the most significant
+// bit, and 1 for black.  Only the pixels in mask are kept.
+static inline uint64_t fromFile(uint64_t w, uint64_t mask) {
+  return ~reverseBytes(littleEndian(w)) & mask;
+}
+
+// Convert the pixels in mask of a word of the image to a word of a PBM
+// file, to be written from memory (the others are 0).
+static inline uint64_t toFile(uint64_t w, uint64_t mask) {
+  return littleEndian(reverseBytes(~w & mask));
+}
+
+// Read the rows of img from file f, in place: the bytes of each row are
+// read into its words, which are then converted.
+// Returns nonzero on success, 0 on failure (errno set by fread).
+static int readPixels(Image1 img, FILE* f) {
+  if (img->stride == 0) return 1;  // (no pixels)
+  size_t bytes = ((size_t)img->width + 7) / 8;
+  size_t last = img->stride - 1;
+  for (int y = 0; y < img->height; y++) {
+    uint64_t* row = ROW(img, y);
+    if (fread(row, 1, bytes, f) != bytes) return 0;
+    for (size_t i = 0; i < last; i++) row[i] = fromFile(row[i], ~(uint64_t)0);
+    row[last] = fromFile(row[last], lastMask(img->width));
+  }
+  return 1;
+}
+
+// Write the pixels of img to file f, a row at a time.
+// Returns nonzero on success, 0 on failure (errno set by fwrite or malloc).
+static int writePixels(Image1 img, FILE* f) {
+  if (img->stride == 0) return 1;  // (no pixels)
+  size_t bytes = ((size_t)img->width + 7) / 8;
+  size_t last = img->stride - 1;
+  uint64_t* buf = (uint64_t*)malloc(img->stride > 0 ? img->stride * sizeof(uint64_t) : 1);
+  if (buf == NULL) return 0;
+  int y = 0;
+  while (y < img->height) {
+    const uint64_t* row = ROW(img, y);
+    for (size_t i = 0; i < last; i++) buf[i] = toFile(row[i], ~(uint64_t)0);
+    buf[last] = toFile(row[last], lastMask(img->width));
+    if (fwrite(buf, 1, bytes, f) != bytes) break;
+    y++;
+  }
+  free(buf);
+  return y == img->height;
+}
+
+// Parse the header of a PBM image from file f (see PgmReadHeader).
+// Returns nonzero on success, 0 on failure (errCause set).
+static int readHeader(FILE* f, PgmHeader* hdr) {
+  const char* cause = PgmReadHeader(f, hdr);
+  return
+  check( cause == NULL , cause ) &&
+  check( hdr->format == PBM_RAW , "Invalid file format" );
+}
+
+/// Load a raw PBM file (P4).
+Image1 Image1Load(const char* filename) { ///
+  PgmHeader hdr;
+  FILE* f = NULL;
+  Image1 img = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse PBM header
+  readHeader(f, &hdr) &&
+  // Allocate image
+  (img = Image1Create(hdr.width, hdr.height)) != NULL &&
+  // Read pixels
+  check( readPixels(img, f) , "Reading pixels" );
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    Image1Destroy(&img);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return img;
+}
+
+/// Save image to a raw PBM file (P4).
+int Image1Save(Image1 img, const char* filename) { ///
+  assert (img != NULL);
+  FILE* f = NULL;
+  PgmHeader hdr = { PBM_RAW, img->width, img->height, 1 };
+  char buf[PGM_HEADER_MAX];
+  size_t len = PgmFormatHeader(buf, &hdr);
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fwrite(buf, 1, len, f) == len, "Writing header failed" ) &&
+  check( writePixels(img, f), "Writing pixels failed" );
+
+  // Cleanup
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+
+/// Information queries
+
+/// Get image width
+int Image1Width(Image1 img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int Image1Height(Image1 img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+// Arguments of countJob, with the count so far.
+struct countArg {
+  Image1 img;
+  uint64_t count;
+};
+
+// Count the 1 pixels of a band of rows, and add them to the result.
+static void countJob(void* p, size_t begin, size_t end) {
+  struct countArg* a = (struct countArg*)p;
+  const uint64_t* w = ROW(a->img, begin);
+  size_t n = (end - begin) * a->img->stride;  // (rows are contiguous)
+  uint64_t count = 0;
+  for (size_t i = 0; i < n; i++) count += (uint64_t)__builtin_popcountll(w[i]);
+  __atomic_fetch_add(&a->count, count, __ATOMIC_RELAXED);
+}
+
+/// Count the pixels that are 1.
+uint64_t Image1Count(Image1 img) { ///
+  assert (img != NULL);
+  struct countArg a = { img, 0 };
+  size_t pixels = (size_t)img->width * img->height;
+  PoolRunIf(pixels, img->height, rowGrain(img->width), countJob, &a);
+  return a.count;
+}
+
+
+/// Pixel get & set operations
+
+/// Get the pixel (0 or 1) at position (x,y).
+int Image1GetPixel(Image1 img, int x, int y) { ///
+  assert (img != NULL);
+  assert (0 <= x && x < img->width && 0 <= y && y < img->height);
+  return (int)(ROW(img, y)[x / 64] >> (x % 64)) & 1;
+}
+
+/// Set the pixel at position (x,y) to bit.
+void Image1SetPixel(Image1 img, int x, int y, int bit) { ///
+  assert (img != NULL);
+  assert (0 <= x && x < img->width && 0 <= y && y < img->height);
+  uint64_t mask = (uint64_t)1 << (x % 64);
+  uint64_t* w = &ROW(img, y)[x / 64];
+  *w = bit ? *w | mask : *w & ~mask;
+}
+
+
+/// Logical operations
+
+// Operations of logicJob
+enum { LOGIC_NOT, LOGIC_AND, LOGIC_OR, LOGIC_XOR };
+
+// Arguments of logicJob
+struct logicArg {
+  Image1 img1, img2;
+  int op;
+};
+
+// Apply the operation to a band of rows, a word at a time (rows are
+// contiguous, so the band is a single run of words).  The bits past the
+// width stay 0: they are 0 in both images, except after a NOT.
+static void logicJob(void* p, size_t begin, size_t end) {
+  struct logicArg* a = (struct logicArg*)p;
+  uint64_t* w1 = ROW(a->img1, begin);
+  const uint64_t* w2 = a->img2 != NULL ? ROW(a->img2, begin) : NULL;
+  size_t n = (end - begin) * a->img1->stride;
+  switch (a->op) {
+  case LOGIC_NOT:
+    for (size_t i = 0; i < n; i++) w1[i] = ~w1[i];
+    for (size_t y = begin; y < end; y++) {
+      ROW(a->img1, y)[a->img1->stride - 1] &= lastMask(a->img1->width);
+    }
+    break;
+  case LOGIC_AND: for (size_t i = 0; i < n; i++) w1[i] &= w2[i]; break;
+  case LOGIC_OR: for (size_t i = 0; i < n; i++) w1[i] |= w2[i]; break;
+  case LOGIC_XOR: for (size_t i = 0; i < n; i++) w1[i] ^= w2[i]; break;
+  }
+}
+
+// Apply the operation to img1 (and img2, if not NULL).
+static void logic(Image1 img1, Image1 img2, int op) {
+  assert (img1 != NULL);
+  assert (op == LOGIC_NOT ||
+          (img2 != NULL && img2->width == img1->width && img2->height == img1->height));
+  if (img1->stride == 0) return;
+  struct logicArg a = { img1, img2, op };
+  size_t pixels = (size_t)img1->width * img1->height;
+  PoolRunIf(pixels, img1->height, rowGrain(img1->width), logicJob, &a);
+}
+
+/// Invert each pixel of img.
+void Image1Not(Image1 img) { ///
+  logic(img, NULL, LOGIC_NOT);
+}
+
+/// Combine each pixel of img1 with the pixel of img2 at the same position.
+void Image1And(Image1 img1, Image1 img2) { ///
+  logic(img1, img2, LOGIC_AND);
+}
+
+void Image1Or(Image1 img1, Image1 img2) { ///
+  logic(img1, img2, LOGIC_OR);
+}
+
+void Image1Xor(Image1 img1, Image1 img2) { ///
+  logic(img1, img2, LOGIC_XOR);
+}
@@ -0,0 +1,113 @@
+/// image1bit - A simple module for binary (1-bit) images.
+///
+/// Binary images are masks, such as the result of a threshold: each pixel
+/// is a bit, 1 for white (the pixels at or above the threshold, which
+/// ImageThreshold sets to maxval) and 0 for black.  Bits are packed 64 to
+/// a 64-bit word, so a mask takes 1/8 of the memory of an 8-bit image, and
+/// every operation works a word (64 pixels) at a time: logical operations
+/// are single word operations, and counting is a popcount per word.
+///
+/// As image16bit, binary images are always a raster scan in a private
+/// array (no layouts, clones or shared memory), and operations are not
+/// instrumented.  Bulk operations run in parallel in the worker pool of
+/// the threadpool module (see ImageSetThreads and
+/// ImageSetParallelThreshold, which apply to this module too).
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+
+#ifndef IMAGE1BIT_H
+#define IMAGE1BIT_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "image8bit.h"
+
+// Type Image1 is a pointer to binary image objects
+typedef struct image1 *Image1;
+
+/// Error handling functions
+
+/// Error cause, after some function of this module fails.
+/// As ImageErrMsg, for the functions of this module.
+char* Image1ErrMsg() ;
+
+/// Image management functions
+
+/// Create a new binary image, with all pixels 0 (black).
+/// Requires: width and height must be non-negative.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image1 Image1Create(int width, int height) ;
+
+/// Destroy the image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void Image1Destroy(Image1* imgp) ;
+
+/// Threshold img into a new binary image: pixels with levels >= thr are 1,
+/// and the others 0 (as ImageThreshold, with 1 for maxval).
+/// On success, a new image is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image1 ImageThresholdToBinary(Image img, uint8 thr) ;
+
+/// Convert a binary image to an 8-bit one (with raster layout), with
+/// levels maxval for 1 and 0 for 0.
+/// Requires: 0 < maxval.
+/// On success, a new image is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image Image1ToImage(Image1 img, uint8 maxval) ;
+
+/// PBM file operations
+
+/// Load a raw PBM file (P4): 8 pixels per byte, the first in the most
+/// significant bit, with 1 for black (so bits are inverted: a white pixel
+/// of the file is a 1 pixel of the image).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image1 Image1Load(const char* filename) ;
+
+/// Save image to a raw PBM file (P4), as read by Image1Load.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int Image1Save(Image1 img, const char* filename) ;
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int Image1Width(Image1 img) ;
+
+/// Get image height
+int Image1Height(Image1 img) ;
+
+/// Count the pixels that are 1.
+uint64_t Image1Count(Image1 img) ;
+
+/// Pixel get & set operations
+
+/// Get the pixel (0 or 1) at position (x,y).
+int Image1GetPixel(Image1 img, int x, int y) ;
+
+/// Set the pixel at position (x,y) to bit (1 if nonzero).
+void Image1SetPixel(Image1 img, int x, int y, int bit) ;
+
+/// Logical operations, in-place
+/// They never fail.
+
+/// Invert each pixel of img.
+void Image1Not(Image1 img) ;
+
+/// Combine each pixel of img1 with the pixel of img2 at the same position,
+/// with logical and, or, exclusive or.
+/// Requires: img1 and img2 must have the same size.
+void Image1And(Image1 img1, Image1 img2) ;
+void Image1Or(Image1 img1, Image1 img2) ;
+void Image1Xor(Image1 img1, Image1 img2) ;
+
+#endif
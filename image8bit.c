@@ -21,22 +21,46 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "instrumentation.h"
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pgm.h"
+#include "threadpool.h"
+
+// The pixel kernels, specialized for 8-bit pixels (negativeLevel8, ...)
+#define PIXEL uint8
+#define PIXEL_SUFFIX 8
+#include "imageKernels.h"
 
 // The data structure
 //
-// An image is stored in a structure containing 3 fields:
+// An image is stored in a structure containing these fields:
 // Two integers store the image width and height.
-// The other field is a pointer to an array that stores the 8-bit gray
+// Another field is a pointer to an array that stores the 8-bit gray
 // level of each pixel in the image.  The pixel array is one-dimensional
 // and corresponds to a "raster scan" of the image from left to right,
 // top to bottom.
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//
+// The pixel array may be shared by several images (see ImageClone).
+// A reference count, shared by all those images, records how many of them
+// use the array.  Functions that modify pixels must call unshare() first,
+// so that a private copy is made before the first write (copy-on-write).
+// The reference count is updated atomically, so that clones of an image
+// may be used (and destroyed) concurrently by different threads.
+//
+// The pixel array is usually allocated with malloc, but it may also be
+// mapped from a POSIX shared memory object (see ImageCreateShared), which
+// is unmapped instead of freed.  Arrays mapped read-only (by
+// ImageOpenShared) are never written: unshare() always copies them.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -50,9 +74,123 @@ struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8* pixel; // pixel data (a raster scan)
+  int layout;   // storage layout of the pixel array (IMAGE_RASTER, ...)
+  uint8* pixel; // pixel data (a raster scan, unless layout says otherwise)
+  int* refs;    // number of images sharing the pixel array
+  size_t mapped;  // size of the shared memory mapping that holds the pixel
+                  // array (after a header), or 0 if it was malloc'ed
+  int readonly;   // nonzero if the pixel array must not be written
+};
+
+
+// Pixel layouts
+//
+// Besides the raster scan (IMAGE_RASTER), the pixel array may be organized
+// in square tiles of TILE x TILE pixels, so that pixels that are close in
+// 2D are also close in memory.  This favours column-wise and window-wise
+// access patterns, as in ImageRotate, ImageBlur or ImageMatchSubImage.
+//
+// In the tiled layouts, the image is padded to a whole number of tiles.
+// Tiles are stored in raster order (left to right, top to bottom), each
+// occupying TILE*TILE consecutive bytes.  Inside a tile, pixels are stored
+// either in raster order (IMAGE_TILED) or in Z-order (IMAGE_ZORDER),
+// where the bits of the x and y offsets are interleaved (a Morton code).
+// For example, with IMAGE_TILED in a 100-pixel wide image,
+//   pixel position (x,y) = (70,1) is stored in img->pixel[4096+64+6].
+// The padding pixels are never read, and they are left in any state.
+
+#define TILE_BITS 6
+#define TILE (1 << TILE_BITS)        // tile side: 64 pixels
+#define TILE_MASK (TILE - 1)
+
+// Spread the 6 bits of v into the even bits of the result: abcdef -> 0a0b0c0d0e0f
+static const uint16_t zspread[TILE] = {
+  0x000, 0x001, 0x004, 0x005, 0x010, 0x011, 0x014, 0x015,
+  0x040, 0x041, 0x044, 0x045, 0x050, 0x051, 0x054, 0x055,
+  0x100, 0x101, 0x104, 0x105, 0x110, 0x111, 0x114, 0x115,
+  0x140, 0x141, 0x144, 0x145, 0x150, 0x151, 0x154, 0x155,
+  0x400, 0x401, 0x404, 0x405, 0x410, 0x411, 0x414, 0x415,
+  0x440, 0x441, 0x444, 0x445, 0x450, 0x451, 0x454, 0x455,
+  0x500, 0x501, 0x504, 0x505, 0x510, 0x511, 0x514, 0x515,
+  0x540, 0x541, 0x544, 0x545, 0x550, 0x551, 0x554, 0x555,
 };
 
+// Number of tiles needed to cover n pixels
+static inline int tiles(int n) {
+  return (n + TILE_MASK) >> TILE_BITS;
+}
+
+// Number of bytes in the pixel array of a width x height image with layout.
+// Sizes and offsets are 64-bit: width*height may well exceed INT_MAX.
+static size_t storageSize(int width, int height, int layout) {
+  if (layout == IMAGE_RASTER) return (size_t)width * height;
+  return ((size_t)tiles(width) * tiles(height)) << (2*TILE_BITS);
+}
+
+// Transform (x, y) coords into linear pixel index.
+// This internal function is used in ImageGetPixel / ImageSetPixel
+// and in every operation that accesses pixels directly.
+// The returned index must satisfy (0 <= index < storage size)
+static inline size_t G(Image img, int x, int y) {
+  assert (0 <= x && x < img->width && 0 <= y && y < img->height);
+  if (img->layout == IMAGE_RASTER) {
+    return (size_t)y * img->width + x;
+  }
+  size_t tile = (size_t)(y >> TILE_BITS) * tiles(img->width) + (x >> TILE_BITS);
+  size_t offset;
+  if (img->layout == IMAGE_TILED) {
+    offset = ((y & TILE_MASK) << TILE_BITS) | (x & TILE_MASK);
+  } else {  // IMAGE_ZORDER
+    offset = (zspread[y & TILE_MASK] << 1) | zspread[x & TILE_MASK];
+  }
+  return (tile << (2*TILE_BITS)) | offset;
+}
+
+// Copy n pixels of row y of img, starting at column x, into buf.
+// In the tiled layout, row segments inside each tile are contiguous.
+static void getRow(Image img, int x, int y, int n, uint8* buf) {
+  if (img->layout == IMAGE_ZORDER) {
+    for (int i = 0; i < n; i++) buf[i] = img->pixel[G(img, x + i, y)];
+    return;
+  }
+  while (n > 0) {
+    int len = (img->layout == IMAGE_RASTER) ? n : TILE - (x & TILE_MASK);
+    if (len > n) len = n;
+    memcpy(buf, &img->pixel[G(img, x, y)], len);
+    buf += len; x += len; n -= len;
+  }
+}
+
+// Copy n pixels from buf into row y of img, starting at column x.
+static void putRow(Image img, int x, int y, int n, const uint8* buf) {
+  if (img->layout == IMAGE_ZORDER) {
+    for (int i = 0; i < n; i++) img->pixel[G(img, x + i, y)] = buf[i];
+    return;
+  }
+  while (n > 0) {
+    int len = (img->layout == IMAGE_RASTER) ? n : TILE - (x & TILE_MASK);
+    if (len > n) len = n;
+    memcpy(&img->pixel[G(img, x, y)], buf, len);
+    buf += len; x += len; n -= len;
+  }
+}
+
+// Copy n pixels from row sy of src (starting at column sx)
+// to row dy of dst (starting at column dx).  Works for any layouts.
+static void copyRow(Image dst, int dx, int dy, Image src, int sx, int sy, int n) {
+  if (src->layout == IMAGE_RASTER && n > 0) {
+    putRow(dst, dx, dy, n, &src->pixel[G(src, sx, sy)]);
+    return;
+  }
+  uint8 buf[TILE];
+  while (n > 0) {
+    int len = n < TILE ? n : TILE;
+    getRow(src, sx, sy, len, buf);
+    putRow(dst, dx, dy, len, buf);
+    sx += len; dx += len; n -= len;
+  }
+}
+
 
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
@@ -72,12 +210,16 @@ struct image {
 // this purpose.
 //
 // Additional information:  man 3 errno;  man 3 error;
+//
+// Like errno, errCause is thread-local: each thread sees the cause of its
+// own failures, so the module may be used by several threads at once
+// (as long as each Image is used by one thread at a time).
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
 // Error cause
-static char* errCause;
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -142,10 +284,11 @@ static int check(int condition, const char* failmsg) {
 
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of counters.
+/// (Instrumentation is calibrated only if and when calibrated times are shown.)
 void ImageInit(void) { ///
-  InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "comps";   // InstrCount[1] will count comparisons or sums
   // Name other counters here...
   
 }
@@ -154,7 +297,92 @@ void ImageInit(void) { ///
 #define PIXMEM InstrCount[0]
 // Add more macros here...
 
+// Macros to count, according to IMAGE_INSTR_LEVEL (see image8bit.h):
+// COUNT adds n to a counter, unless instrumentation is off;
+// COUNT_PIXEL adds n only at the per-pixel level.
+// When disabled, n is not even evaluated.
+#if IMAGE_INSTR_LEVEL >= IMAGE_INSTR_BULK
+#define COUNT(counter, n) ((counter) += (n))
+#else
+#define COUNT(counter, n) ((void)0)
+#endif
+#if IMAGE_INSTR_LEVEL >= IMAGE_INSTR_PIXEL
+#define COUNT_PIXEL(counter, n) ((counter) += (n))
+#else
+#define COUNT_PIXEL(counter, n) ((void)0)
+#endif
+
+// Macros to measure an operation in its own instrumentation scope
+// (see InstrBegin), unless instrumentation is off.
+// Every path out of the operation must end the scope it began, giving
+// the image operated on (or NULL) and the number of pixel bytes processed.
+#if IMAGE_INSTR_LEVEL >= IMAGE_INSTR_BULK
+#define SCOPE_BEGIN(name) InstrBegin(name)
+#define SCOPE_END(img, bytes) endOp(img, bytes)
+#else
+#define SCOPE_BEGIN(name) ((void)0)
+#define SCOPE_END(img, bytes) ((void)(img), (void)(bytes))
+#endif
+
+static ImageMetricsHook metricsHook = NULL;
+static void* metricsArg = NULL;
+
+/// Set the function called with the metrics of each operation.
+void ImageSetMetricsHook(ImageMetricsHook hook, void* arg) { ///
+  metricsArg = arg;
+  metricsHook = hook;
+}
+
+#if IMAGE_INSTR_LEVEL >= IMAGE_INSTR_BULK
+// End the scope of an operation, and pass its metrics to the hook.
+// Preserves global errno!
+static void endOp(Image img, size_t bytes) {
+  InstrSample sample;
+  if (!InstrEndSample(&sample) || metricsHook == NULL) return;
+  ImageMetrics m;
+  m.op = sample.name;
+  m.width = img != NULL ? img->width : 0;
+  m.height = img != NULL ? img->height : 0;
+  m.bytes = bytes;
+  m.sample = sample;
+  errsave = errno;
+  metricsHook(&m, metricsArg);
+  errno = errsave;
+}
+#endif
+
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+//
+// Operations that run in parallel (see below) do not update the counters
+// from worker threads: they compute the counts and add them afterwards.
+
+
+/// Parallel execution
+
+// The bulk operations split their work into bands of rows (or of bytes,
+// for pixel transformations) that are processed by the worker pool of the
+// threadpool module, with PoolRunIf: operations on fewer pixels than its
+// minimum work run serially, as the overhead of waking the workers would
+// dominate.  ImageSetParallelThreshold sets that minimum, for all the
+// modules that run operations in the pool.
+
+/// Set the number of threads used by image operations.
+/// n <= 1 means serial execution.
+/// The default comes from the IMAGE_THREADS environment variable, or is
+/// the number of processors if that is not set.
+void ImageSetThreads(int n) { ///
+  PoolSetThreads(n);
+}
+
+/// Set the minimum number of pixels for an operation to run in parallel.
+void ImageSetParallelThreshold(size_t pixels) { ///
+  PoolSetMinWork(pixels);
+}
+
+// Number of rows of the given width that make a band of about 16K pixels.
+static size_t rowGrain(int width) {
+  return width >= (1 << 14) ? 1 : (size_t)(1 << 14) / (width > 0 ? width : 1);
+}
 
 
 /// Image management functions
@@ -167,10 +395,25 @@ void ImageInit(void) { ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) {
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  return ImageCreateLayout(width, height, maxval, IMAGE_RASTER);
+}
+
+/// Create a new black image with a given pixel layout.
+///   width, height, maxval : as in ImageCreate.
+///   layout: how pixels are stored: IMAGE_RASTER, IMAGE_TILED or IMAGE_ZORDER.
+/// The layout is transparent to clients: every operation accepts images
+/// of any layout, but 2D-local operations run faster on tiled layouts.
+/// Images created from other images (ImageRotate, ...) keep their layout.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateLayout(int width, int height, uint8 maxval, int layout) {
   assert(width >= 0);
   assert(height >= 0);
   assert(0 < maxval && maxval <= PixMax);
+  assert(layout == IMAGE_RASTER || layout == IMAGE_TILED || layout == IMAGE_ZORDER);
 
   // Allocate memory for the image structure
   Image img = (Image)malloc(sizeof(struct image));
@@ -185,9 +428,11 @@ Image ImageCreate(int width, int height, uint8 maxval) {
   img->width = width;
   img->height = height;
   img->maxval = maxval;
+  img->layout = layout;
+  size_t size = storageSize(width, height, layout);
 
   // Allocate memory for the pixel array
-  img->pixel = (uint8*)malloc(sizeof(uint8) * width * height);
+  img->pixel = (uint8*)malloc(sizeof(uint8) * size);
 
   // Check if memory allocation was successful
   if (img->pixel == NULL) {
@@ -196,13 +441,48 @@ Image ImageCreate(int width, int height, uint8 maxval) {
     return NULL;
   }
 
+  // Allocate the reference count of the (not yet shared) pixel array
+  img->refs = (int*)malloc(sizeof(int));
+  if (img->refs == NULL) {
+    errCause = "Memory allocation failed";
+    free(img->pixel);
+    free(img);
+    return NULL;
+  }
+  *img->refs = 1;
+  img->mapped = 0;
+  img->readonly = 0;
+
   // Initialize the pixel array to zeros (black image)
-  memset(img->pixel, 0, sizeof(uint8) * width * height);
+  memset(img->pixel, 0, sizeof(uint8) * size);
 
   // Return the created image
   return img;
 }
 
+// Header of a shared memory image, followed by its pixels (a raster scan).
+struct shmHeader {
+  char magic[8];     // SHM_MAGIC
+  int32_t width;
+  int32_t height;
+  int32_t maxval;
+  int32_t layout;    // always IMAGE_RASTER, for now
+};
+
+#define SHM_MAGIC "IMAGE8\n"
+#define SHM_HEADER 64  // header size, so that pixels are cache line aligned
+
+// Release the pixel array of img, and its reference count,
+// when img was the last one using them.
+static void freePixels(Image img) {
+  if (img->mapped > 0) {
+    munmap(img->pixel - SHM_HEADER, img->mapped);
+  } else {
+    free(img->pixel);
+  }
+  free(img->refs);
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -213,8 +493,10 @@ void ImageDestroy(Image* imgp) {
 
   // Check if the pointer is not NULL
   if (*imgp != NULL) {
-    // Free the memory occupied by the pixel array
-    free((*imgp)->pixel);
+    // Free the pixel array, unless other clones still use it
+    if (__atomic_sub_fetch((*imgp)->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+      freePixels(*imgp);
+    }
 
     // Free the memory occupied by the image structure
     free(*imgp);
@@ -224,51 +506,403 @@ void ImageDestroy(Image* imgp) {
   }
 }
 
+// Arguments of copyJob: copy a w-wide rectangle of src at (sx, sy)
+// to dst at (dx, dy), one row per index.
+struct copyArg {
+  Image dst; int dx, dy;
+  Image src; int sx, sy;
+  int w;
+};
+
+static void copyJob(void* p, size_t begin, size_t end) {
+  struct copyArg* a = (struct copyArg*)p;
+  for (size_t i = begin; i < end; ++i) {
+    copyRow(a->dst, a->dx, a->dy + (int)i, a->src, a->sx, a->sy + (int)i, a->w);
+  }
+}
+
+// Copy the w x h rectangle of src at (sx, sy) to dst at (dx, dy).
+static void copyRect(Image dst, int dx, int dy, Image src, int sx, int sy, int w, int h) {
+  struct copyArg a = { dst, dx, dy, src, sx, sy, w };
+  PoolRunIf((size_t)w * h, h, rowGrain(w), copyJob, &a);
+  COUNT(PIXMEM, 2ul * w * h);  // count pixel memory accesses
+}
+
+/// Convert an image to another pixel layout.
+/// Returns a copy of img whose pixels are stored with the given layout.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageConvertLayout(Image img, int layout) { ///
+  assert (img != NULL);
+
+  SCOPE_BEGIN("convert");
+  Image converted = ImageCreateLayout(img->width, img->height, img->maxval, layout);
+  if (converted != NULL) {
+    copyRect(converted, 0, 0, img, 0, 0, img->width, img->height);
+  }
+  SCOPE_END(converted, converted != NULL ? 2 * (size_t)img->width * img->height : 0);
+  return converted;
+}
+
+/// Clone an image.
+/// Returns a new image with the same size, maxval and pixels as img.
+/// The clone shares the pixel array with img: no pixels are copied until
+/// either of them is modified (copy-on-write).
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) { ///
+  assert (img != NULL);
+
+  Image clone = (Image)malloc(sizeof(struct image));
+  if (clone == NULL) {
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+
+  // Same fields, same pixel array: just one more reference to it
+  *clone = *img;
+  __atomic_add_fetch(clone->refs, 1, __ATOMIC_RELAXED);
+  return clone;
+}
+
+// Make sure img is the only user of its pixel array.
+// If the array is shared with clones, img gets a private copy of it.
+// Must be called before modifying the pixels of img.
+// On success, returns nonzero.
+// On failure, returns 0, img is left untouched and errno/errCause are set.
+static int unshare(Image img) {
+  // Already private (and writable): nothing to do
+  if (__atomic_load_n(img->refs, __ATOMIC_ACQUIRE) == 1 && !img->readonly) return 1;
+
+  size_t size = sizeof(uint8) * storageSize(img->width, img->height, img->layout);
+  uint8* pixel = (uint8*)malloc(size);
+  int* refs = (int*)malloc(sizeof(int));
+  if (pixel == NULL || refs == NULL) {
+    errsave = errno;
+    free(pixel);
+    free(refs);
+    errno = errsave;
+    errCause = "Memory allocation failed";
+    return 0;
+  }
+  memcpy(pixel, img->pixel, size);
+  COUNT(PIXMEM, (unsigned long)size);  // count pixel memory accesses
+
+  // Drop our reference to the shared array and adopt the copy.
+  // (If the other users dropped theirs meanwhile, the array is ours to free.)
+  if (__atomic_sub_fetch(img->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    freePixels(img);
+  }
+  img->pixel = pixel;
+  img->refs = refs;
+  *img->refs = 1;
+  img->mapped = 0;
+  img->readonly = 0;
+  return 1;
+}
+
+/// Unshare an image.
+/// Give img a private copy of its pixel array if it is shared with clones.
+/// Modifying operations do this implicitly; call it explicitly to know
+/// in advance that they will not need to allocate memory.
+/// On success, returns nonzero.
+/// On failure, returns 0, img is left untouched and errno/errCause are set.
+int ImageUnshare(Image img) { ///
+  assert (img != NULL);
+  return unshare(img);
+}
+
+/// Shared memory images
+
+// Build the POSIX name ("/name") of the shared memory object called name
+// (with or without the leading /) in buf.
+// Returns 0 if name is not a valid name, with errno set.
+static int shmPath(const char* name, char* buf, size_t size) {
+  const char* base = name[0] == '/' ? name + 1 : name;
+  if (*base == '\0' || strchr(base, '/') != NULL || strlen(base) + 2 > size) {
+    errno = EINVAL;
+    return 0;
+  }
+  snprintf(buf, size, "/%s", base);
+  return 1;
+}
+
+// Create an image whose pixels are those of a shared memory mapping of
+// size bytes at map (after the header).
+static Image mapImage(uint8* map, size_t size, int width, int height,
+                      int maxval, int readonly) {
+  Image img = (Image)malloc(sizeof(struct image));
+  int* refs = (int*)malloc(sizeof(int));
+  if (img == NULL || refs == NULL) {
+    errsave = errno;
+    free(img);
+    free(refs);
+    errno = errsave;
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+  img->layout = IMAGE_RASTER;
+  img->pixel = map + SHM_HEADER;
+  img->refs = refs;
+  *img->refs = 1;
+  img->mapped = size;
+  img->readonly = readonly;
+  return img;
+}
+
+/// Create a new black image in shared memory.
+///   name : name of the POSIX shared memory object (as in shm_open, but
+///          the leading / is optional).
+///   width, height, maxval : as in ImageCreate.
+/// A shared memory object with that name is replaced: processes that have
+/// it open keep the old one.
+/// The image has raster layout, and its pixels are modified in place.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateShared(const char* name, int width, int height, uint8 maxval) { ///
+  assert(name != NULL);
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+  char path[256];
+  int fd = -1;
+  void* map = MAP_FAILED;
+  Image img = NULL;
+  size_t size = SHM_HEADER + (size_t)width * height;
+  int errentry = errno;  // to restore, if the object did not exist
+
+  int success =
+  check( shmPath(name, path, sizeof(path)), "Invalid shared memory name" ) &&
+  check( shm_unlink(path) == 0 || errno == ENOENT, "Replacing shared memory failed" ) &&
+  // A new object is filled with zeros (a black image)
+  check( (fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0,
+         "Creating shared memory failed" ) &&
+  check( ftruncate(fd, (off_t)size) == 0, "Sizing shared memory failed" ) &&
+  check( (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED,
+         "Mapping shared memory failed" ) &&
+  (img = mapImage((uint8*)map, size, width, height, maxval, 0)) != NULL;
+
+  if (success) {
+    // Fill in the header, with the magic string last: readers that open
+    // the object meanwhile find it invalid, rather than half written
+    struct shmHeader* hdr = (struct shmHeader*)map;
+    hdr->width = width;
+    hdr->height = height;
+    hdr->maxval = maxval;
+    hdr->layout = IMAGE_RASTER;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, SHM_MAGIC, sizeof(hdr->magic));
+  }
+
+  // Cleanup
+  errsave = success ? errentry : errno;
+  if (!success && map != MAP_FAILED) munmap(map, size);
+  if (!success && fd >= 0) shm_unlink(path);
+  if (fd >= 0) close(fd);
+  errno = errsave;
+  return img;
+}
+
+/// Open an image in shared memory, created by ImageCreateShared (usually
+/// by another process).
+///   name : as in ImageCreateShared.
+/// The pixels are mapped read-only, never copied: operations that modify
+/// the image copy them first, as for a clone (copy-on-write).  But changes
+/// by the creator of the shared image are seen through it.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageOpenShared(const char* name) { ///
+  assert(name != NULL);
+  char path[256];
+  int fd = -1;
+  struct stat st;
+  void* map = MAP_FAILED;
+  const struct shmHeader* hdr = NULL;
+  Image img = NULL;
+
+  int success =
+  check( shmPath(name, path, sizeof(path)), "Invalid shared memory name" ) &&
+  check( (fd = shm_open(path, O_RDONLY, 0)) >= 0, "Opening shared memory failed" ) &&
+  check( fstat(fd, &st) == 0 && st.st_size >= SHM_HEADER, "Invalid shared image" ) &&
+  check( (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED,
+         "Mapping shared memory failed" ) &&
+  (hdr = (const struct shmHeader*)map) != NULL &&
+  check( memcmp(hdr->magic, SHM_MAGIC, sizeof(hdr->magic)) == 0 &&
+         hdr->width >= 0 && hdr->height >= 0 &&
+         0 < hdr->maxval && hdr->maxval <= PixMax && hdr->layout == IMAGE_RASTER &&
+         SHM_HEADER + (size_t)hdr->width * hdr->height <= (size_t)st.st_size,
+         "Invalid shared image" ) &&
+  (img = mapImage((uint8*)map, st.st_size, hdr->width, hdr->height, hdr->maxval, 1)) != NULL;
+
+  // Cleanup
+  errsave = errno;
+  if (!success && map != MAP_FAILED) munmap(map, st.st_size);
+  if (fd >= 0) close(fd);
+  errno = errsave;
+  return img;
+}
+
+/// Remove the name of a shared memory image.
+/// Processes that have it open may still use it; it is freed when the
+/// last one destroys its image.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageUnlinkShared(const char* name) { ///
+  assert(name != NULL);
+  char path[256];
+  return check( shmPath(name, path, sizeof(path)), "Invalid shared memory name" ) &&
+         check( shm_unlink(path) == 0, "Removing shared memory failed" );
+}
+
 /// PGM file operations
 
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+// Read the h rows of w pixels of img from file f, converting from
+// the raster scan in the file to the layout of img.
+// Returns nonzero on success, 0 on failure (errno set by fread or malloc).
+static int readPixels(Image img, FILE* f) {
+  int w = img->width;
+  int h = img->height;
+  if (img->layout == IMAGE_RASTER) {
+    size_t n = (size_t)w * h;
+    return fread(img->pixel, sizeof(uint8), n, f) == n;
   }
-  return i;
+  uint8* row = (uint8*)malloc(w > 0 ? w : 1);
+  if (row == NULL) return 0;
+  int y = 0;
+  while (y < h && fread(row, sizeof(uint8), w, f) == w) {
+    putRow(img, 0, y, w, row);
+    y++;
+  }
+  free(row);
+  return y == h;
+}
+
+// Write the pixels of img to file f, as a raster scan.
+// Returns nonzero on success, 0 on failure (errno set by fwrite or malloc).
+static int writePixels(Image img, FILE* f) {
+  int w = img->width;
+  int h = img->height;
+  if (img->layout == IMAGE_RASTER) {
+    size_t n = (size_t)w * h;
+    return fwrite(img->pixel, sizeof(uint8), n, f) == n;
+  }
+  uint8* row = (uint8*)malloc(w > 0 ? w : 1);
+  if (row == NULL) return 0;
+  int y = 0;
+  while (y < h) {
+    getRow(img, 0, y, w, row);
+    if (fwrite(row, sizeof(uint8), w, f) != w) break;
+    y++;
+  }
+  free(row);
+  return y == h;
+}
+
+// Read the h rows of w plain (ASCII) levels of img from file f, converting
+// from the raster scan in the file to the layout of img.
+// Returns nonzero on success, 0 on failure (errCause set).
+static int readPlain(Image img, FILE* f) {
+  PgmReader r = PgmReaderCreate(f, img->maxval);
+  if (!check( r != NULL, "Memory allocation failed" )) return 0;
+  const char* cause = NULL;
+  if (img->layout == IMAGE_RASTER) {
+    cause = PgmReadLevels(r, img->pixel, sizeof(uint8), (size_t)img->width * img->height);
+  } else {
+    // Row segments of up to a tile
+    uint8 buf[TILE];
+    for (int y = 0; y < img->height && cause == NULL; y++) {
+      for (int x = 0; x < img->width && cause == NULL; x += TILE) {
+        int len = img->width - x < TILE ? img->width - x : TILE;
+        cause = PgmReadLevels(r, buf, sizeof(uint8), len);
+        putRow(img, x, y, len, buf);
+      }
+    }
+  }
+  PgmReaderDestroy(&r);
+  return check( cause == NULL, cause );
+}
+
+// Write the pixels of img to file f, as rows of plain (ASCII) levels.
+// Returns nonzero on success, 0 on failure (errCause set).
+static int writePlain(Image img, FILE* f) {
+  PgmWriter wr = PgmWriterCreate(f);
+  uint8* row = (uint8*)malloc(img->width > 0 ? img->width : 1);
+  const char* cause = (wr == NULL || row == NULL) ? "Memory allocation failed" : NULL;
+  for (int y = 0; y < img->height && cause == NULL; y++) {
+    getRow(img, 0, y, img->width, row);
+    cause = PgmWriteLevels(wr, row, sizeof(uint8), img->width);
+  }
+  const char* flushed = PgmWriterDestroy(&wr);
+  if (cause == NULL) cause = flushed;
+  free(row);
+  return check( cause == NULL, cause );
+}
+
+// Parse the header of a PGM image from file f (see PgmReadHeader),
+// which must have a maxval of up to PixMax.
+// Returns nonzero on success, 0 on failure (errCause set).
+static int readHeader(FILE* f, PgmHeader* hdr) {
+  const char* cause = PgmReadHeader(f, hdr);
+  return
+  check( cause == NULL , cause ) &&
+  check( hdr->format != PBM_RAW , "Invalid file format" ) &&
+  check( hdr->maxval <= (int)PixMax , "Invalid maxval" );
+}
+
+// Write the header of a PGM image of the given format with the size and
+// maxval of img to file f.
+// Returns nonzero on success, 0 on failure (errno set by fwrite).
+static int writeHeader(FILE* f, int format, Image img) {
+  PgmHeader hdr = { format, img->width, img->height, img->maxval };
+  char buf[PGM_HEADER_MAX];
+  size_t len = PgmFormatHeader(buf, &hdr);
+  return fwrite(buf, 1, len, f) == len;
 }
 
-/// Load a raw PGM file.
+/// Load a PGM file, raw (P5) or plain (P2).
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
-  int w, h;
-  int maxval;
-  char c;
+  return ImageLoadLayout(filename, IMAGE_RASTER);
+}
+
+/// Load a PGM file into an image with the given pixel layout.
+/// Pixels are converted from the raster scan in the file while reading.
+/// Otherwise, as ImageLoad.
+Image ImageLoadLayout(const char* filename, int layout) { ///
+  PgmHeader hdr;
   FILE* f = NULL;
   Image img = NULL;
 
+  SCOPE_BEGIN("load");
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  readHeader(f, &hdr) &&
   // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  (img = ImageCreateLayout(hdr.width, hdr.height, (uint8)hdr.maxval, layout)) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  (hdr.format == PGM_RAW ? check( readPixels(img, f) , "Reading pixels" )
+                         : readPlain(img, f));
+  if (success) COUNT(PIXMEM, (unsigned long)img->width * img->height);  // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -277,10 +911,12 @@ Image ImageLoad(const char* filename) { ///
     errno = errsave;
   }
   if (f != NULL) fclose(f);
+  SCOPE_END(img, img != NULL ? (size_t)img->width * img->height : 0);
   return img;
 }
 
 /// Save image to PGM file.
+/// Pixels are always written as a raster scan, whatever the layout of img.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
@@ -288,130 +924,977 @@ int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
   int w = img->width;
   int h = img->height;
-  uint8 maxval = img->maxval;
   FILE* f = NULL;
 
+  SCOPE_BEGIN("save");
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( writeHeader(f, PGM_RAW, img), "Writing header failed" ) &&
+  check( writePixels(img, f), "Writing pixels failed" );
+  COUNT(PIXMEM, (unsigned long)w * h);  // count pixel memory accesses
 
   // Cleanup
   if (f != NULL) fclose(f);
+  SCOPE_END(img, success ? (size_t)w * h : 0);
   return success;
 }
 
+/// Save image to a plain PGM file (P2), with levels in decimal ASCII.
+/// Otherwise, as ImageSave.
+int ImageSavePlain(Image img, const char* filename) { ///
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  FILE* f = NULL;
 
-/// Information queries
-
-/// These functions do not modify the image and never fail.
+  SCOPE_BEGIN("save");
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( writeHeader(f, PGM_PLAIN, img), "Writing header failed" ) &&
+  writePlain(img, f);
+  COUNT(PIXMEM, (unsigned long)w * h);  // count pixel memory accesses
 
-/// Get image width
-int ImageWidth(Image img) { ///
-  assert (img != NULL);
-  return img->width;
+  // Cleanup
+  if (f != NULL) fclose(f);
+  SCOPE_END(img, success ? (size_t)w * h : 0);
+  return success;
 }
 
-/// Get image height
-int ImageHeight(Image img) { ///
-  assert (img != NULL);
-  return img->height;
+/// PGM streams
+
+// A stream is a sequence of raw PGM images (frames), one right after the
+// other (separated by whitespace, at most), read from or written to a
+// file, a FIFO or a pipe, sequentially.
+
+struct imageStream {
+  FILE* f;
+  int std;                // f is stdin or stdout (not to be closed)
+};
+
+// Open stream filename ("-" for std) with mode.
+static ImageStream openStream(const char* filename, const char* mode, FILE* std) {
+  ImageStream s = (ImageStream)malloc(sizeof(struct imageStream));
+  if (s == NULL) {
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  s->std = strcmp(filename, "-") == 0;
+  s->f = s->std ? std : fopen(filename, mode);
+  if (s->f == NULL) {
+    errsave = errno;
+    free(s);
+    errno = errsave;
+    errCause = "Open failed";
+    return NULL;
+  }
+  return s;
 }
 
-/// Get image maximum gray level
-int ImageMaxval(Image img) { ///
-  assert (img != NULL);
-  return img->maxval;
+/// Open a stream of PGM images for reading, from file filename
+/// (a regular file, a FIFO, ...) or from stdin if filename is "-".
+///
+/// On success, a new stream is returned.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamOpenRead(const char* filename) { ///
+  assert (filename != NULL);
+  return openStream(filename, "rb", stdin);
 }
 
-/// Pixel stats
-/// Find the minimum and maximum gray levels in image.
-/// On return,
-/// *min is set to the minimum gray level in the image,
-/// *max is set to the maximum.
-void ImageStats(Image img, uint8* min, uint8* max) {
-  assert(img != NULL);
+/// Open a stream of PGM images for writing, to file filename
+/// (a regular file, a FIFO, ...) or to stdout if filename is "-".
+/// Otherwise, as ImageStreamOpenRead.
+ImageStream ImageStreamOpenWrite(const char* filename) { ///
+  assert (filename != NULL);
+  return openStream(filename, "wb", stdout);
+}
 
-  // Initialize min and max with the first pixel value
-  *min = *max = img->pixel[0];
+/// Close the stream pointed to by (*sp) (but not stdin or stdout, which
+/// are just flushed).
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+/// On success, returns nonzero.
+/// On failure (if buffered frames cannot be written), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageStreamClose(ImageStream* sp) { ///
+  assert (sp != NULL);
+  ImageStream s = *sp;
+  if (s == NULL) return 1;
+  // (Not check: errCause is kept on success, for closes in cleanup code.)
+  int success = (s->std ? fflush(s->f) : fclose(s->f)) == 0;
+  if (!success) errCause = "Writing pixels failed";
+  free(s);
+  *sp = NULL;
+  return success;
+}
 
-  // Iterate through the pixel array to find the min and max values
-  for (int i = 1; i < img->width * img->height; ++i) {
-    if (img->pixel[i] < *min) {
-      *min = img->pixel[i];
-    } else if (img->pixel[i] > *max) {
-      *max = img->pixel[i];
+/// Read the next frame of stream s into (*imgp).
+/// If (*imgp) is an image of the size and maxval of the frame, whose
+/// pixels are not shared (nor read-only), the frame is read into its
+/// pixel array, with no allocation.  Otherwise, (*imgp) is destroyed (if
+/// not NULL) and replaced by a new image, with raster layout.  So, to
+/// read frames with no allocations, keep passing the same image.
+/// Returns 1 if a frame was read, 0 at the end of the stream, and -1 on
+/// failure (then errno/errCause are set, and (*imgp) may be NULL).
+int ImageStreamRead(ImageStream s, Image* imgp) { ///
+  assert (s != NULL);
+  assert (imgp != NULL);
+  PgmHeader hdr;
+
+  // Skip whitespace between frames, and detect the end of the stream
+  int c;
+  do {
+    c = getc(s->f);
+  } while (c != EOF && isspace(c));
+  if (c == EOF) {
+    if (ferror(s->f)) {
+      errCause = "Reading pixels";
+      return -1;
     }
+    return 0;
+  }
+  ungetc(c, s->f);
+
+  SCOPE_BEGIN("read");
+  Image img = *imgp;
+  // Plain frames are not accepted: their reader would read ahead
+  int success = readHeader(s->f, &hdr) &&
+                check( hdr.format == PGM_RAW , "Invalid file format" );
+  int w = success ? hdr.width : 0;
+  int h = success ? hdr.height : 0;
+  if (success && !(img != NULL && img->width == w && img->height == h &&
+                   img->maxval == hdr.maxval &&
+                   __atomic_load_n(img->refs, __ATOMIC_ACQUIRE) == 1 && !img->readonly)) {
+    // Cannot reuse the image
+    ImageDestroy(imgp);
+    success = (*imgp = ImageCreate(w, h, (uint8)hdr.maxval)) != NULL;
+    img = *imgp;
   }
+  success = success && check( readPixels(img, s->f), "Reading pixels" );
+  if (success) COUNT(PIXMEM, (unsigned long)w * h);  // count pixel memory accesses
+  SCOPE_END(img, success ? (size_t)w * h : 0);
+  return success ? 1 : -1;
 }
 
-/// Check if pixel position (x,y) is inside img.
-int ImageValidPos(Image img, int x, int y) { ///
+/// Write img as the next frame of stream s.
+/// The stream is flushed after each frame, so that readers at the other
+/// end of a pipe get it right away.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageStreamWrite(ImageStream s, Image img) { ///
+  assert (s != NULL);
   assert (img != NULL);
-  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
-}
 
-/// Check if rectangular area (x,y,w,h) is completely inside img.
-int ImageValidRect(Image img, int x, int y, int w, int h) { ///
-  assert (img != NULL);
-  
-  // Check if the rectangle is completely inside the image
-  return (x >= 0) && (y >= 0) && (x + w <= img->width) && (y + h <= img->height);
-}  
+  SCOPE_BEGIN("write");
+  int success =
+  check( writeHeader(s->f, PGM_RAW, img), "Writing header failed" ) &&
+  check( writePixels(img, s->f), "Writing pixels failed" ) &&
+  check( fflush(s->f) == 0, "Writing pixels failed" );
+  COUNT(PIXMEM, (unsigned long)img->width * img->height);  // count pixel memory accesses
+  SCOPE_END(img, success ? (size_t)img->width * img->height : 0);
+  return success;
+}
 
 
-/// Pixel get & set operations
+/// Compressed tiled files and virtual images
 
-/// These are the primitive operations to access and modify a single pixel
-/// in the image.
-/// These are very simple, but fundamental operations, which may be used to 
-/// implement more complex operations.
+// File layout (all integers are little-endian):
+//   magic "IMAGE8T\n"                        8 bytes
+//   width, height, maxval, tile side         4 x uint32
+//   offset of each tile in the file, and     (tiles+1) x uint64
+//     of the end of the last one
+//   the compressed tiles, in raster order of tiles
+// Tiles are side x side pixels, except at the right and bottom edges,
+// where they are clipped to the image.  Each is compressed on its own,
+// so that it may be decoded without the others.
+//
+// The codec: each pixel is replaced by its difference (mod 256) from the
+// pixel to its left (or above it, in the first column of the tile), which
+// turns smooth areas into small values, and flat areas into runs of
+// zeros.  The differences are then encoded in packets that start with a
+// byte c:
+//   c < 64       : c+1 literal bytes follow;
+//   64 <= c < 128: c-64+1 bytes follow, each with two differences in
+//                  [-8, 7], as 4-bit nibbles (the low one first);
+//   c >= 128     : the byte that follows is repeated c-128+3 times.
+// A tile that would not get smaller is stored raw (as its pixels): the
+// decoder recognizes it by its size.
+
+#define IMT_MAGIC "IMAGE8T\n"
+#define IMT_HEADER 24           // magic and 4 integers
+#define IMT_SIDE 256            // default tile side
+#define IMT_MAXSIDE (1 << 15)   // largest tile side
+#define IMT_MAXRUN (127 + 3)    // longest run of a packet
+#define IMT_MAXLIT 64           // most literals in a packet
+#define IMT_MAXNIB 128          // most nibbles in a packet
+
+static void putLE(uint8* p, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) p[i] = (uint8)(v >> (8 * i));
+}
 
-// Transform (x, y) coords into linear pixel index.
-// This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index = y * img->width + x;
-  assert (0 <= index && index < img->width*img->height);
-  return index;
+static uint64_t getLE(const uint8* p, int bytes) {
+  uint64_t v = 0;
+  for (int i = bytes - 1; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
 }
 
-/// Get the pixel (level) at position (x,y).
-uint8 ImageGetPixel(Image img, int x, int y) { ///
-  assert (img != NULL);
-  assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (read)
-  return img->pixel[G(img, x, y)];
-} 
+// Is difference d (mod 256) in [-8, 7]?
+#define SMALL(d) ((uint8)((d) + 8) < 16)
+
+// Length of the run of values equal to d[i] at i (at most max).
+static size_t runLength(const uint8* d, size_t i, size_t n, size_t max) {
+  size_t run = 1;
+  while (i + run < n && run < max && d[i + run] == d[i]) run++;
+  return run;
+}
+
+// Number of consecutive small differences at i (at most max).
+static size_t smallLength(const uint8* d, size_t i, size_t n, size_t max) {
+  size_t k = 0;
+  while (i + k < n && k < max && SMALL(d[i + k])) k++;
+  return k;
+}
+
+// Compress the w x h tile of img at (x, y) into out (room for w*h bytes),
+// using tmp (w*h bytes) for the differences.  Returns the size of the
+// compressed tile, which is w*h if it is stored raw.
+static size_t encodeTile(Image img, int x, int y, int w, int h, uint8* tmp, uint8* out) {
+  size_t n = (size_t)w * h;
+  for (int r = 0; r < h; r++) {
+    getRow(img, x, y + r, w, tmp + (size_t)r * w);
+  }
+  // Differences, from the end back, so that predictors are still pixels
+  for (size_t i = n; i-- > 1; ) {
+    size_t pred = i % w != 0 ? i - 1 : i - w;
+    tmp[i] = (uint8)(tmp[i] - tmp[pred]);
+  }
+
+  size_t len = 0;
+  size_t i = 0;
+  while (i < n) {
+    size_t run = runLength(tmp, i, n, IMT_MAXRUN);
+    if (run >= 3) {
+      if (len + 2 > n) break;
+      out[len++] = (uint8)(128 + run - 3);
+      out[len++] = tmp[i];
+      i += run;
+      continue;
+    }
+    // Small differences, up to the next long run
+    size_t nib = 0;
+    while (i + nib < n && nib < IMT_MAXNIB && SMALL(tmp[i + nib]) &&
+           runLength(tmp, i + nib, n, 8) < 8) {
+      nib++;
+    }
+    if (nib >= 4) {
+      nib &= ~(size_t)1;
+      if (len + 1 + nib / 2 > n) break;
+      out[len++] = (uint8)(64 + nib / 2 - 1);
+      for (size_t j = 0; j < nib; j += 2) {
+        out[len++] = (uint8)((tmp[i + j] & 15) | (tmp[i + j + 1] << 4));
+      }
+      i += nib;
+      continue;
+    }
+    // Literals, up to the next run or stretch of small differences
+    size_t lit = 0;
+    while (i + lit < n && lit < IMT_MAXLIT &&
+           (lit == 0 || (runLength(tmp, i + lit, n, 3) < 3 &&
+                         smallLength(tmp, i + lit, n, 8) < 8))) {
+      lit++;
+    }
+    if (len + 1 + lit > n) break;
+    out[len++] = (uint8)(lit - 1);
+    memcpy(out + len, tmp + i, lit);
+    len += lit;
+    i += lit;
+  }
+  if (i < n || len >= n) {
+    // Not smaller: store raw
+    for (int r = 0; r < h; r++) {
+      getRow(img, x, y + r, w, out + (size_t)r * w);
+    }
+    return n;
+  }
+  return len;
+}
+
+// Decompress a w x h tile of len bytes from in to out (a raster scan).
+// Returns 0 if the data is corrupt.
+static int decodeTile(const uint8* in, size_t len, int w, int h, uint8* out) {
+  size_t n = (size_t)w * h;
+  if (len == n) {
+    memcpy(out, in, n);
+    return 1;
+  }
+  size_t i = 0;
+  size_t k = 0;
+  while (k < len) {
+    uint8 c = in[k++];
+    if (c >= 128) {
+      size_t run = (size_t)c - 128 + 3;
+      if (k >= len || i + run > n) return 0;
+      memset(out + i, in[k++], run);
+      i += run;
+    } else if (c >= 64) {
+      size_t bytes = (size_t)c - 64 + 1;
+      if (k + bytes > len || i + 2 * bytes > n) return 0;
+      for (size_t j = 0; j < bytes; j++) {
+        uint8 b = in[k++];
+        // Sign-extend each nibble
+        out[i++] = (uint8)(((b & 15) ^ 8) - 8);
+        out[i++] = (uint8)(((b >> 4) ^ 8) - 8);
+      }
+    } else {
+      size_t lit = (size_t)c + 1;
+      if (k + lit > len || i + lit > n) return 0;
+      memcpy(out + i, in + k, lit);
+      k += lit;
+      i += lit;
+    }
+  }
+  if (i != n) return 0;
+  // Undo the differences
+  for (i = 1; i < n; i++) {
+    size_t pred = i % w != 0 ? i - 1 : i - w;
+    out[i] = (uint8)(out[i] + out[pred]);
+  }
+  return 1;
+}
+
+// Arguments of encodeJob: compress a row of tiles of img
+struct encodeArg {
+  Image img;
+  int side;
+  int y;          // top of the row of tiles
+  uint8** buf;    // 2 * side * side bytes for each tile: output and temporary
+  size_t* len;    // compressed size of each tile
+};
+
+static void encodeJob(void* p, size_t begin, size_t end) {
+  struct encodeArg* a = (struct encodeArg*)p;
+  size_t area = (size_t)a->side * a->side;
+  for (size_t t = begin; t < end; t++) {
+    int x = (int)t * a->side;
+    int w = a->img->width - x < a->side ? a->img->width - x : a->side;
+    int h = a->img->height - a->y < a->side ? a->img->height - a->y : a->side;
+    a->len[t] = encodeTile(a->img, x, a->y, w, h, a->buf[t] + area, a->buf[t]);
+  }
+}
+
+/// Save image to a compressed tiled file.
+///   side : side of the tiles, in pixels (0 for the default, 256).
+/// Requires: 0 <= side <= 32768.
+/// Each tile is compressed on its own (lossless), so that a virtual
+/// image (see VImageOpen) can read parts of the image without the rest.
+/// Tiles are compressed in parallel, a row of tiles at a time.
+/// On success, returns nonzero.
+/// On failure (also if the image would have more than INT_MAX tiles),
+/// returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveCompressed(Image img, const char* filename, int side) { ///
+  assert (img != NULL);
+  assert (0 <= side && side <= IMT_MAXSIDE);
+  if (side == 0) side = IMT_SIDE;
+  int tilesX = (int)(((size_t)img->width + side - 1) / side);
+  int tilesY = (int)(((size_t)img->height + side - 1) / side);
+  size_t ntiles = (size_t)tilesX * tilesY;
+  size_t area = (size_t)side * side;
+  FILE* f = NULL;
+  uint8* index = NULL;
+  uint8** buf = NULL;
+  size_t* len = NULL;
+  uint8 header[IMT_HEADER];
+  size_t packed = 0;
+
+  SCOPE_BEGIN("savez");
+  int success =
+  check( ntiles <= INT_MAX, "Too many tiles" ) &&
+  check( (index = (uint8*)malloc((ntiles + 1) * 8)) != NULL &&
+         (buf = (uint8**)calloc(tilesX + 1, sizeof(uint8*))) != NULL &&
+         (len = (size_t*)malloc((tilesX + 1) * sizeof(size_t))) != NULL,
+         "Memory allocation failed" );
+  for (int t = 0; success && t < tilesX; t++) {
+    success = check( (buf[t] = (uint8*)malloc(2 * area)) != NULL, "Memory allocation failed" );
+  }
+  if (success) {
+    memcpy(header, IMT_MAGIC, 8);
+    putLE(header + 8, img->width, 4);
+    putLE(header + 12, img->height, 4);
+    putLE(header + 16, img->maxval, 4);
+    putLE(header + 20, side, 4);
+    success =
+    check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+    check( fwrite(header, 1, IMT_HEADER, f) == IMT_HEADER, "Writing header failed" ) &&
+    // The index is written once the offsets are known
+    check( fseek(f, (long)((ntiles + 1) * 8), SEEK_CUR) == 0, "Writing header failed" );
+  }
+  uint64_t offset = IMT_HEADER + (ntiles + 1) * 8;
+  for (int ty = 0; success && ty < tilesY; ty++) {
+    struct encodeArg a = { img, side, ty * side, buf, len };
+    PoolRunIf((size_t)tilesX * side * side, tilesX, 1, encodeJob, &a);
+    for (int tx = 0; success && tx < tilesX; tx++) {
+      putLE(index + ((size_t)ty * tilesX + tx) * 8, offset, 8);
+      success = check( fwrite(buf[tx], 1, len[tx], f) == len[tx], "Writing pixels failed" );
+      offset += len[tx];
+      packed += len[tx];
+    }
+  }
+  if (success) {
+    putLE(index + ntiles * 8, offset, 8);
+    success =
+    check( fseek(f, IMT_HEADER, SEEK_SET) == 0 &&
+           fwrite(index, 8, ntiles + 1, f) == ntiles + 1, "Writing header failed" );
+  }
+  COUNT(PIXMEM, 2ul * img->width * img->height);  // count pixel memory accesses
+
+  // Cleanup
+  errsave = errno;
+  if (f != NULL && fclose(f) != 0 && success) {
+    success = check( 0, "Writing pixels failed" );
+    errsave = errno;
+  }
+  for (int t = 0; buf != NULL && t < tilesX; t++) free(buf[t]);
+  free(buf);
+  free(len);
+  free(index);
+  errno = errsave;
+  SCOPE_END(img, success ? (size_t)img->width * img->height + packed : 0);
+  return success;
+}
+
+// A virtual image
+//
+// The tile index is read when the file is opened; tiles are read and
+// decoded on demand, into a cache of decoded tiles with a fixed number of
+// slots.  When the cache is full, the least recently used tile is
+// evicted: slots are kept in a doubly linked list, from the most to the
+// least recently used, and a table maps each tile to its slot (or -1).
+
+struct vslot {
+  int tile;           // tile in the slot, or -1
+  int prev, next;     // neighbours in the LRU list (-1 at the ends)
+  uint8* pixel;       // the decoded tile (a raster scan of its pixels)
+};
+
+struct vimage {
+  int fd;
+  int width, height, maxval;
+  int side;           // side of the tiles
+  int tilesX, tilesY; // number of tiles in each row and column
+  uint64_t* index;    // offset of each tile, and of the end of the last one
+  int* slotOf;        // slot of each tile, or -1
+  struct vslot* slot; // the cache slots
+  int capacity;       // number of slots
+  int used;           // number of slots used
+  int head, tail;     // most and least recently used slots
+  uint8* packed;      // a compressed tile, as read
+  unsigned long hits, misses;
+};
+
+/// Open a compressed tiled file (see ImageSaveCompressed) as a virtual
+/// image: its pixels are read and decoded on demand, a tile at a time,
+/// and decoded tiles are kept in a cache of (about) cacheBytes bytes,
+/// at least one tile.  So parts of very large images may be read using
+/// memory proportional to those parts only.
+/// A virtual image must not be used by several threads at once.
+///
+/// On success, a new virtual image is returned.
+/// (The caller is responsible for closing the returned virtual image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+VImage VImageOpen(const char* filename, size_t cacheBytes) { ///
+  assert (filename != NULL);
+  VImage v = NULL;
+  uint8 header[IMT_HEADER];
+  uint8* raw = NULL;
+  struct stat st;
+  int fd = -1;
+  int w = 0, h = 0, maxval = 0, side = 0;
+
+  int success =
+  check( (fd = open(filename, O_RDONLY)) >= 0, "Open failed" ) &&
+  check( fstat(fd, &st) == 0, "Open failed" ) &&
+  check( pread(fd, header, IMT_HEADER, 0) == IMT_HEADER &&
+         memcmp(header, IMT_MAGIC, 8) == 0, "Invalid file format" ) &&
+  check( (w = (int)getLE(header + 8, 4)) >= 0 &&
+         (h = (int)getLE(header + 12, 4)) >= 0, "Invalid size" ) &&
+  check( (maxval = (int)getLE(header + 16, 4)) > 0 && maxval <= PixMax, "Invalid maxval" ) &&
+  check( (side = (int)getLE(header + 20, 4)) > 0 && side <= IMT_MAXSIDE, "Invalid tile side" ) &&
+  // (tiles are numbered with ints)
+  check( (((size_t)w + side - 1) / side) * (((size_t)h + side - 1) / side) <= INT_MAX,
+         "Too many tiles" ) &&
+  check( (v = (VImage)calloc(1, sizeof(struct vimage))) != NULL, "Memory allocation failed" );
+  if (success) {
+    v->fd = fd;
+    v->width = w;
+    v->height = h;
+    v->maxval = maxval;
+    v->side = side;
+    v->tilesX = (int)(((size_t)w + side - 1) / side);
+    v->tilesY = (int)(((size_t)h + side - 1) / side);
+    size_t ntiles = (size_t)v->tilesX * v->tilesY;
+    size_t area = (size_t)side * side;
+    size_t capacity = cacheBytes / area;
+    if (capacity < 1) capacity = 1;
+    if (capacity > ntiles) capacity = ntiles > 0 ? ntiles : 1;
+    v->capacity = (int)capacity;
+    v->head = v->tail = -1;
+    success =
+    check( (v->index = (uint64_t*)malloc((ntiles + 1) * sizeof(uint64_t))) != NULL &&
+           (raw = (uint8*)malloc((ntiles + 1) * 8)) != NULL &&
+           (v->slotOf = (int*)malloc((ntiles > 0 ? ntiles : 1) * sizeof(int))) != NULL &&
+           (v->slot = (struct vslot*)calloc(capacity, sizeof(struct vslot))) != NULL &&
+           (v->packed = (uint8*)malloc(area)) != NULL, "Memory allocation failed" ) &&
+    check( pread(fd, raw, (ntiles + 1) * 8, IMT_HEADER) == (ssize_t)((ntiles + 1) * 8),
+           "Invalid tile index" );
+    for (size_t t = 0; success && t <= ntiles; t++) {
+      v->index[t] = getLE(raw + 8 * t, 8);
+      // Offsets must be increasing, inside the file, and tiles not larger than raw
+      success = check( t == 0 ? v->index[0] >= IMT_HEADER + (ntiles + 1) * 8 :
+                       v->index[t] >= v->index[t-1] && v->index[t] - v->index[t-1] <= area,
+                       "Invalid tile index" );
+    }
+    success = success && check( v->index[ntiles] <= (uint64_t)st.st_size, "Invalid tile index" );
+    for (size_t t = 0; success && t < ntiles; t++) v->slotOf[t] = -1;
+  }
+
+  // Cleanup
+  errsave = errno;
+  free(raw);
+  if (!success) {
+    if (v != NULL) v->fd = -1;
+    VImageClose(&v);
+    if (fd >= 0) close(fd);
+  }
+  errno = errsave;
+  return v;
+}
+
+/// Close the virtual image pointed to by (*vp), and free its cache.
+/// If (*vp)==NULL, no operation is performed.
+/// Ensures: (*vp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void VImageClose(VImage* vp) { ///
+  assert (vp != NULL);
+  VImage v = *vp;
+  if (v == NULL) return;
+  errsave = errno;
+  if (v->fd >= 0) close(v->fd);
+  for (int s = 0; v->slot != NULL && s < v->capacity; s++) free(v->slot[s].pixel);
+  free(v->slot);
+  free(v->slotOf);
+  free(v->index);
+  free(v->packed);
+  free(v);
+  *vp = NULL;
+  errno = errsave;
+}
+
+/// Get the width, height and maximum gray level of a virtual image.
+int VImageWidth(VImage v) { ///
+  assert (v != NULL);
+  return v->width;
+}
+
+int VImageHeight(VImage v) { ///
+  assert (v != NULL);
+  return v->height;
+}
+
+int VImageMaxval(VImage v) { ///
+  assert (v != NULL);
+  return v->maxval;
+}
+
+/// Get the number of tiles found in the cache (hits) and read from the
+/// file (misses), since the virtual image was opened.
+void VImageCacheStats(VImage v, unsigned long* hits, unsigned long* misses) { ///
+  assert (v != NULL);
+  *hits = v->hits;
+  *misses = v->misses;
+}
+
+// Unlink slot s from the LRU list.
+static void lruRemove(VImage v, int s) {
+  struct vslot* sl = &v->slot[s];
+  if (sl->prev >= 0) v->slot[sl->prev].next = sl->next; else v->head = sl->next;
+  if (sl->next >= 0) v->slot[sl->next].prev = sl->prev; else v->tail = sl->prev;
+}
+
+// Link slot s at the back of the LRU list (the next to be evicted).
+static void lruAppend(VImage v, int s) {
+  v->slot[s].prev = v->tail;
+  v->slot[s].next = -1;
+  if (v->tail >= 0) v->slot[v->tail].next = s; else v->head = s;
+  v->tail = s;
+}
+
+// Link slot s at the front of the LRU list (most recently used).
+static void lruPush(VImage v, int s) {
+  v->slot[s].prev = -1;
+  v->slot[s].next = v->head;
+  if (v->head >= 0) v->slot[v->head].prev = s; else v->tail = s;
+  v->head = s;
+}
+
+// Get the decoded tile (tx, ty) of v, reading it if it is not cached.
+// Returns NULL on failure, with errno/errCause set.
+static const uint8* getTile(VImage v, int tx, int ty) {
+  size_t t = (size_t)ty * v->tilesX + tx;
+  int s = v->slotOf[t];
+  if (s >= 0) {
+    v->hits++;
+    if (s != v->head) {
+      lruRemove(v, s);
+      lruPush(v, s);
+    }
+    return v->slot[s].pixel;
+  }
+
+  // Take a free slot, or evict the least recently used tile
+  if (v->used < v->capacity) {
+    s = v->used;
+    size_t area = (size_t)v->side * v->side;
+    if (!check( (v->slot[s].pixel = (uint8*)malloc(area)) != NULL, "Memory allocation failed" )) {
+      return NULL;
+    }
+    v->used++;
+  } else {
+    s = v->tail;
+    lruRemove(v, s);
+    if (v->slot[s].tile >= 0) v->slotOf[v->slot[s].tile] = -1;
+  }
+  v->slot[s].tile = -1;
+
+  int w = v->width - tx * v->side < v->side ? v->width - tx * v->side : v->side;
+  int h = v->height - ty * v->side < v->side ? v->height - ty * v->side : v->side;
+  size_t len = v->index[t + 1] - v->index[t];
+  int success =
+  check( pread(v->fd, v->packed, len, (off_t)v->index[t]) == (ssize_t)len, "Reading pixels" ) &&
+  check( decodeTile(v->packed, len, w, h, v->slot[s].pixel), "Corrupt tile" );
+  if (!success) {
+    lruAppend(v, s);  // empty: reuse it first
+    return NULL;
+  }
+  lruPush(v, s);
+  v->slot[s].tile = (int)t;  // (at most INT_MAX tiles: see VImageOpen)
+  v->slotOf[t] = s;
+  v->misses++;
+  COUNT(PIXMEM, (unsigned long)w * h);  // count pixel memory accesses
+  return v->slot[s].pixel;
+}
+
+/// Get the pixel level at (x, y) of a virtual image.
+/// Requires: (x, y) must be a valid position of v.
+/// Returns the level, or -1 on failure (if its tile cannot be read),
+/// with errno/errCause set.
+int VImageGetPixel(VImage v, int x, int y) { ///
+  assert (v != NULL);
+  assert (0 <= x && x < v->width && 0 <= y && y < v->height);
+  int tx = x / v->side;
+  int ty = y / v->side;
+  const uint8* tile = getTile(v, tx, ty);
+  if (tile == NULL) return -1;
+  int w = v->width - tx * v->side < v->side ? v->width - tx * v->side : v->side;
+  return tile[(size_t)(y - ty * v->side) * w + (x - tx * v->side)];
+}
+
+/// Crop a rectangular subimage from a virtual image, as ImageCrop.
+/// Only the tiles that overlap the rectangle are read (unless cached).
+/// Requires: the rectangle must be inside the virtual image.
+///
+/// On success, a new image is returned, with raster layout.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image VImageCrop(VImage v, int x, int y, int w, int h) { ///
+  assert (v != NULL);
+  assert (0 <= x && 0 <= w && w <= v->width - x);
+  assert (0 <= y && 0 <= h && h <= v->height - y);
+
+  SCOPE_BEGIN("vcrop");
+  Image img = ImageCreate(w, h, (uint8)v->maxval);
+  if (img == NULL || w == 0 || h == 0) {
+    SCOPE_END(img, 0);
+    return img;
+  }
+  int side = v->side;
+  for (int ty = y / side; ty <= (y + h - 1) / side; ty++) {
+    for (int tx = x / side; tx <= (x + w - 1) / side; tx++) {
+      const uint8* tile = getTile(v, tx, ty);
+      if (tile == NULL) {
+        ImageDestroy(&img);
+        SCOPE_END(img, 0);
+        return NULL;
+      }
+      // The part of the tile inside the rectangle: [x0, x1[ x [y0, y1[
+      int tw = v->width - tx * side < side ? v->width - tx * side : side;
+      int x0 = x > tx * side ? x : tx * side;
+      int x1 = x + w < tx * side + tw ? x + w : tx * side + tw;
+      int y0 = y > ty * side ? y : ty * side;
+      int y1 = y + h < (ty + 1) * side ? y + h : (ty + 1) * side;
+      for (int r = y0; r < y1; r++) {
+        memcpy(img->pixel + (size_t)(r - y) * w + (x0 - x),
+               tile + (size_t)(r - ty * side) * tw + (x0 - tx * side), x1 - x0);
+      }
+    }
+  }
+  COUNT(PIXMEM, (unsigned long)w * h);  // count pixel stores
+  SCOPE_END(img, (size_t)w * h);
+  return img;
+}
+
+/// Locate a subimage inside a virtual image, as ImageLocateSubImage.
+/// The virtual image is searched in strips of rows, of the height of a
+/// tile plus that of img2 (minus 1), decoded into an ordinary image:
+/// only one strip is in memory at a time, so the search needs at most
+/// width x (tile side + img2 height) bytes, besides the tile cache.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure (if some strip cannot be read), returns -1, with
+/// errno/errCause set.
+int VImageLocateSubImage(VImage v, int* px, int* py, Image img2) { ///
+  assert (v != NULL);
+  assert (img2 != NULL);
+  // A strip holds exactly the candidate positions of its first side rows
+  // (the rest are the rows the template covers below them), and strips
+  // are searched top to bottom, so the first match found is the first
+  // one in the image, in raster order.
+  if (img2->width > v->width) return 0;
+  for (int y0 = 0; y0 <= v->height - img2->height; y0 += v->side) {
+    int h = v->side + img2->height - 1;
+    if (h > v->height - y0) h = v->height - y0;
+    Image strip = VImageCrop(v, 0, y0, v->width, h);
+    if (strip == NULL) return -1;
+    int x, y;
+    int found = ImageLocateSubImage(strip, &x, &y, img2);
+    ImageDestroy(&strip);
+    if (found) {
+      *px = x;
+      *py = y0 + y;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Get image maximum gray level
+int ImageMaxval(Image img) { ///
+  assert (img != NULL);
+  return img->maxval;
+}
+
+/// Get image pixel layout (IMAGE_RASTER, IMAGE_TILED or IMAGE_ZORDER)
+int ImageLayout(Image img) { ///
+  assert (img != NULL);
+  return img->layout;
+}
+
+// Arguments of statsJob, with the min and max found so far.
+struct statsArg {
+  Image img;
+  uint8 min, max;
+};
+
+// Find min and max in a band of rows (raster layout)
+// or of rows of tiles (tiled layouts), and merge them into the result.
+static void statsJob(void* p, size_t begin, size_t end) {
+  struct statsArg* a = (struct statsArg*)p;
+  Image img = a->img;
+  uint8 min = PixMax;
+  uint8 max = 0;
+
+  if (img->layout == IMAGE_RASTER) {
+    // Scan the pixel array of the band to find the min and max values
+    size_t first = begin * img->width;
+    minMaxRun8(img->pixel + first, end * img->width - first, &min, &max);
+  } else {
+    // Tiled layouts: scan each tile, skipping the padding pixels
+    int ty0 = (int)begin * TILE;
+    int ty1 = (int)end * TILE < img->height ? (int)end * TILE : img->height;
+    for (int ty = ty0; ty < ty1; ty += TILE) {
+      for (int tx = 0; tx < img->width; tx += TILE) {
+        for (int y = ty; y < ty + TILE && y < img->height; ++y) {
+          for (int x = tx; x < tx + TILE && x < img->width; ++x) {
+            uint8 level = img->pixel[G(img, x, y)];
+            if (level < min) min = level;
+            if (level > max) max = level;
+          }
+        }
+      }
+    }
+  }
+
+  // Merge into the result, which other threads may be updating
+  uint8 cur = __atomic_load_n(&a->min, __ATOMIC_RELAXED);
+  while (min < cur && !__atomic_compare_exchange_n(&a->min, &cur, min, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+  cur = __atomic_load_n(&a->max, __ATOMIC_RELAXED);
+  while (max > cur && !__atomic_compare_exchange_n(&a->max, &cur, max, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+/// Pixel stats
+/// Find the minimum and maximum gray levels in image.
+/// On return,
+/// *min is set to the minimum gray level in the image,
+/// *max is set to the maximum.
+void ImageStats(Image img, uint8* min, uint8* max) {
+  assert(img != NULL);
+
+  SCOPE_BEGIN("stats");
+  struct statsArg a = { img, PixMax, 0 };
+  size_t pixels = (size_t)img->width * img->height;
+  if (img->layout == IMAGE_RASTER) {
+    PoolRunIf(pixels, img->height, rowGrain(img->width), statsJob, &a);
+  } else {
+    PoolRunIf(pixels, tiles(img->height), 1, statsJob, &a);
+  }
+  COUNT(PIXMEM, (unsigned long)pixels);  // count pixel memory accesses
+  SCOPE_END(img, pixels);
+
+  *min = a.min;
+  *max = a.max;
+}
+
+/// Check if pixel position (x,y) is inside img.
+int ImageValidPos(Image img, int x, int y) { ///
+  assert (img != NULL);
+  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int ImageValidRect(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  
+  // Check if the rectangle is completely inside the image
+  // (comparing w <= width - x, rather than x + w <= width, cannot overflow)
+  return (x >= 0) && (y >= 0) && (w >= 0) && (h >= 0) &&
+         (x <= img->width) && (w <= img->width - x) &&
+         (y <= img->height) && (h <= img->height - y);
+}  
+
+
+/// Pixel get & set operations
+
+/// These are the primitive operations to access and modify a single pixel
+/// in the image.
+/// These are very simple, but fundamental operations, which may be used to 
+/// implement more complex operations.
+
+// The (x, y) coords are transformed into a linear pixel index by G(),
+// defined above, which takes the pixel layout into account.
+
+/// Get the pixel (level) at position (x,y).
+uint8 ImageGetPixel(Image img, int x, int y) { ///
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  COUNT_PIXEL(PIXMEM, 1);  // count one pixel access (read)
+  return img->pixel[G(img, x, y)];
+} 
 
 /// Set the pixel at position (x,y) to new level.
+/// If img shares its pixels with a clone, they are copied first.
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (store)
+  if (!unshare(img)) return;  // copy-on-write
+  COUNT_PIXEL(PIXMEM, 1);  // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
 } 
 
+/// Get the n pixels of row y starting at column x into array buf.
+void ImageGetRow(Image img, int x, int y, int n, uint8* buf) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, n, 1));
+  COUNT(PIXMEM, (unsigned long)n);  // count pixel accesses (loads)
+  getRow(img, x, y, n, buf);
+}
+
+/// Set the n pixels of row y starting at column x from array buf.
+void ImageSetRow(Image img, int x, int y, int n, const uint8* buf) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, n, 1));
+  if (!unshare(img)) return;  // copy-on-write
+  COUNT(PIXMEM, (unsigned long)n);  // count pixel accesses (stores)
+  putRow(img, x, y, n, buf);
+}
+
 
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// unless the pixels are shared with a clone and must be copied first.
+/// They never fail, except if that copy cannot be allocated: then the
+/// image is left unchanged and errno/errCause are set accordingly.
+
+
+// Pixel transformations are applied to the whole pixel array, including
+// the padding of tiled layouts (which is harmless), in bands of bytes.
+
+// Arguments of the pixel transformation jobs
+struct pointArg {
+  Image img;
+  uint8 thr;
+  double factor;
+};
+
+// Apply job to all pixels of img, in parallel bands of bytes.
+static void pointOp(Image img, PoolJob job, struct pointArg* a) {
+  size_t size = storageSize(img->width, img->height, img->layout);
+  PoolRunIf(size, size, 1 << 16, job, a);
+  COUNT(PIXMEM, 2ul * img->width * img->height);  // count pixel reads and stores
+}
+
+// The transformations of each band are the kernels of imageKernels.h
+// (the level functions are shared with ImageApplyStages).
+static void negativeJob(void* p, size_t begin, size_t end) {
+  Image img = ((struct pointArg*)p)->img;
+  negativeRun8(img->pixel + begin, end - begin, img->maxval);
+}
+
+static void thresholdJob(void* p, size_t begin, size_t end) {
+  struct pointArg* a = (struct pointArg*)p;
+  thresholdRun8(a->img->pixel + begin, end - begin, a->thr, a->img->maxval);
+}
 
+static void brightenJob(void* p, size_t begin, size_t end) {
+  struct pointArg* a = (struct pointArg*)p;
+  brightenRun8(a->img->pixel + begin, end - begin, a->factor, a->img->maxval);
+}
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
 void ImageNegative(Image img) { ///
   assert (img != NULL);
-  
-  // Iterate through the pixel array and calculate the negative value for each pixel
-  for (int i = 0; i < img->width * img->height; ++i) {
-    img->pixel[i] = PixMax - img->pixel[i];
+
+  SCOPE_BEGIN("negative");
+  size_t bytes = 0;
+  if (unshare(img)) {  // copy-on-write
+    struct pointArg a = { img };
+    pointOp(img, negativeJob, &a);
+    bytes = 2 * (size_t)img->width * img->height;
   }
+  SCOPE_END(img, bytes);
 }
 
 /// Apply threshold to image.
@@ -419,11 +1902,15 @@ void ImageNegative(Image img) { ///
 /// all pixels with level>=thr to white (maxval).
 void ImageThreshold(Image img, uint8 thr) { ///
   assert (img != NULL);
-  
-  // Iterate through the pixel array and apply the threshold
-  for (int i = 0; i < img->width * img->height; ++i) {
-    img->pixel[i] = (img->pixel[i] < thr) ? 0 : img->maxval;
+
+  SCOPE_BEGIN("threshold");
+  size_t bytes = 0;
+  if (unshare(img)) {  // copy-on-write
+    struct pointArg a = { img, thr };
+    pointOp(img, thresholdJob, &a);
+    bytes = 2 * (size_t)img->width * img->height;
   }
+  SCOPE_END(img, bytes);
 }
 
 /// Brighten image by a factor.
@@ -433,22 +1920,14 @@ void ImageThreshold(Image img, uint8 thr) { ///
 void ImageBrighten(Image img, double factor) { ///
   assert(img != NULL);
 
-  // Iterate through the pixels of the image
-  for (int i = 0; i < img->width * img->height; ++i) {
-    // Get the current pixel level
-    uint8 currentLevel = img->pixel[i];
-
-    // Calculate the new pixel level after applying brightness factor
-    uint8 newLevel = (uint8)(currentLevel * factor + 0.5);
-
-    // Check if the new level exceeds the maximum pixel value
-    if (newLevel > PixMax) {
-        newLevel = PixMax; // Saturate to the maximum pixel value
-    }
-
-    // Set the new pixel level
-    img->pixel[i] = newLevel;
+  SCOPE_BEGIN("brighten");
+  size_t bytes = 0;
+  if (unshare(img)) {  // copy-on-write
+    struct pointArg a = { img, 0, factor };
+    pointOp(img, brightenJob, &a);
+    bytes = 2 * (size_t)img->width * img->height;
   }
+  SCOPE_END(img, bytes);
 }
 
 
@@ -465,6 +1944,40 @@ void ImageBrighten(Image img, double factor) { ///
 // Implementation hint: 
 // Call ImageCreate whenever you need a new image!
 
+// Arguments of the geometric transformation jobs: src -> dst
+struct geomArg {
+  Image src;
+  Image dst;
+};
+
+// Rotate a band of rows of TILE x TILE blocks.
+// Rows of a block become columns in the rotated image, so blocking keeps
+// both the reads and the writes within a few cache lines (and within a
+// single tile, for tiled layouts).
+static void rotateJob(void* p, size_t begin, size_t end) {
+  struct geomArg* a = (struct geomArg*)p;
+  Image img = a->src;
+  Image rotatedImg = a->dst;
+  int by0 = (int)begin * TILE;
+  int by1 = (int)end * TILE < img->height ? (int)end * TILE : img->height;
+  for (int by = by0; by < by1; by += TILE) {
+    for (int bx = 0; bx < img->width; bx += TILE) {
+      int ey = by + TILE < img->height ? by + TILE : img->height;
+      int ex = bx + TILE < img->width ? bx + TILE : img->width;
+      for (int y = by; y < ey; ++y) {
+        for (int x = bx; x < ex; ++x) {
+          // Calculate rotated coordinates
+          int rotatedX = y;
+          int rotatedY = img->width - 1 - x;
+
+          // Copy the pixel to the rotated image
+          rotatedImg->pixel[G(rotatedImg, rotatedX, rotatedY)] = img->pixel[G(img, x, y)];
+        }
+      }
+    }
+  }
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -476,27 +1989,44 @@ void ImageBrighten(Image img, double factor) { ///
 Image ImageRotate(Image img) { ///
   assert (img != NULL);
   
+  SCOPE_BEGIN("rotate");
   // Create a new image with swapped width and height
-  Image rotatedImg = ImageCreate(img->height, img->width, img->maxval);
+  Image rotatedImg = ImageCreateLayout(img->height, img->width, img->maxval, img->layout);
 
   // Check if image creation was successful
   if (rotatedImg == NULL) {
+    SCOPE_END(NULL, 0);
     return NULL;
   }
 
-  // Iterate through the pixels and copy them to the rotated image
-  for (int y = 0; y < img->height; ++y) {
+  // Iterate through the pixels in bands of TILE x TILE blocks
+  // and copy them to the rotated image
+  struct geomArg a = { img, rotatedImg };
+  PoolRunIf((size_t)img->width * img->height, tiles(img->height), 1, rotateJob, &a);
+  COUNT(PIXMEM, 2ul * img->width * img->height);  // count pixel memory accesses
+  SCOPE_END(rotatedImg, 2 * (size_t)img->width * img->height);
+
+  return rotatedImg;
+}
+
+// Mirror a band of rows.
+static void mirrorJob(void* p, size_t begin, size_t end) {
+  struct geomArg* a = (struct geomArg*)p;
+  Image img = a->src;
+  Image mirroredImg = a->dst;
+  for (int y = (int)begin; y < (int)end; ++y) {
+    if (img->layout == IMAGE_RASTER && img->width > 0) {
+      mirrorRun8(&mirroredImg->pixel[G(mirroredImg, 0, y)], &img->pixel[G(img, 0, y)], img->width);
+      continue;
+    }
     for (int x = 0; x < img->width; ++x) {
-      // Calculate rotated coordinates
-      int rotatedX = y;
-      int rotatedY = img->width - 1 - x;
+      // Calculate mirrored x-coordinate
+      int mirroredX = img->width - 1 - x;
 
-      // Copy the pixel to the rotated image
-      ImageSetPixel(rotatedImg, rotatedX, rotatedY, ImageGetPixel(img, x, y));
+      // Copy the pixel to the mirrored image
+      mirroredImg->pixel[G(mirroredImg, mirroredX, y)] = img->pixel[G(img, x, y)];
     }
   }
-
-  return rotatedImg;
 }
 
 /// Mirror an image = flip left-right.
@@ -509,24 +2039,21 @@ Image ImageRotate(Image img) { ///
 Image ImageMirror(Image img) { ///
   assert (img != NULL);
   
+  SCOPE_BEGIN("mirror");
   // Create a new image with the same dimensions
-  Image mirroredImg = ImageCreate(img->width, img->height, img->maxval);
+  Image mirroredImg = ImageCreateLayout(img->width, img->height, img->maxval, img->layout);
 
   // Check if image creation was successful
   if (mirroredImg == NULL) {
+    SCOPE_END(NULL, 0);
     return NULL;
   }
 
-  // Iterate through the pixels and copy them in a mirrored fashion
-  for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      // Calculate mirrored x-coordinate
-      int mirroredX = img->width - 1 - x;
-
-      // Copy the pixel to the mirrored image
-      ImageSetPixel(mirroredImg, mirroredX, y, ImageGetPixel(img, x, y));
-    }
-  }
+  // Iterate through the rows and copy them in a mirrored fashion
+  struct geomArg a = { img, mirroredImg };
+  PoolRunIf((size_t)img->width * img->height, img->height, rowGrain(img->width), mirrorJob, &a);
+  COUNT(PIXMEM, 2ul * img->width * img->height);  // count pixel memory accesses
+  SCOPE_END(mirroredImg, 2 * (size_t)img->width * img->height);
 
   return mirroredImg;
 }
@@ -547,21 +2074,19 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   assert (ImageValidRect(img, x, y, w, h));
   
+  SCOPE_BEGIN("crop");
   // Create a new image with the specified width and height
-  Image croppedImg = ImageCreate(w, h, img->maxval);
+  Image croppedImg = ImageCreateLayout(w, h, img->maxval, img->layout);
 
   // Check if image creation was successful
   if (croppedImg == NULL) {
+    SCOPE_END(NULL, 0);
     return NULL;
   }
 
-  // Iterate through the pixels and copy the cropped region
-  for (int cy = 0; cy < h; ++cy) {
-    for (int cx = 0; cx < w; ++cx) {
-      // Copy the pixel to the cropped image
-      ImageSetPixel(croppedImg, cx, cy, ImageGetPixel(img, x + cx, y + cy));
-    }
-  }
+  // Copy the cropped region, row by row
+  copyRect(croppedImg, 0, 0, img, x, y, w, h);
+  SCOPE_END(croppedImg, 2 * (size_t)w * h);
 
   return croppedImg;
 }
@@ -571,25 +2096,61 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (unless shared).
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  
-  // Iterate through the pixels of the smaller image and paste them into the larger image
-  for (int cy = 0; cy < img2->height; ++cy) {
-    for (int cx = 0; cx < img2->width; ++cx) {
-      // Copy the pixel from the smaller image to the specified position in the larger image
-      ImageSetPixel(img1, x + cx, y + cy, ImageGetPixel(img2, cx, cy));
+
+  SCOPE_BEGIN("paste");
+  size_t bytes = 0;
+  if (unshare(img1)) {  // copy-on-write
+    // Copy the rows of the smaller image into the larger image
+    copyRect(img1, x, y, img2, 0, 0, img2->width, img2->height);
+    bytes = 2 * (size_t)img2->width * img2->height;
+  }
+  SCOPE_END(img1, bytes);
+}
+
+// Arguments of blendJob: blend img2 into img1 at (x, y)
+struct blendArg {
+  Image img1;
+  int x, y;
+  Image img2;
+  double alpha;
+};
+
+// Blend a band of rows of img2.
+static void blendJob(void* p, size_t begin, size_t end) {
+  struct blendArg* a = (struct blendArg*)p;
+  Image img1 = a->img1;
+  Image img2 = a->img2;
+  double alpha = a->alpha;
+  double maxval = img1->maxval;
+  for (int cy = (int)begin; cy < (int)end; ++cy) {
+    if (img1->layout == IMAGE_RASTER && img2->layout == IMAGE_RASTER) {
+      if (img2->width > 0) {
+        blendRun8(&img1->pixel[G(img1, a->x, a->y + cy)], &img2->pixel[G(img2, 0, cy)],
+                  img2->width, alpha, maxval);
+      }
+      continue;
+    }
+    // Other layouts: blend the row in segments, through row buffers
+    uint8 buf1[TILE], buf2[TILE];
+    for (int cx = 0; cx < img2->width; cx += TILE) {
+      int len = img2->width - cx < TILE ? img2->width - cx : TILE;
+      getRow(img1, a->x + cx, a->y + cy, len, buf1);
+      getRow(img2, cx, cy, len, buf2);
+      blendRun8(buf1, buf2, len, alpha, maxval);
+      putRow(img1, a->x + cx, a->y + cy, len, buf1);
     }
   }
 }
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (unless shared).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
@@ -597,41 +2158,113 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  
-  // Iterate through the pixels of the smaller image and blend them into the larger image
-  for (int cy = 0; cy < img2->height; ++cy) {
-    for (int cx = 0; cx < img2->width; ++cx) {
-      // Calculate the blended pixel value using alpha
-      uint8 blendedValue = (uint8)((1.0 - alpha) * ImageGetPixel(img1, x + cx, y + cy) +
-                                   alpha * ImageGetPixel(img2, cx, cy) + 0.5);
 
-      // Set the blended pixel value in the larger image
-      ImageSetPixel(img1, x + cx, y + cy, blendedValue);
+  SCOPE_BEGIN("blend");
+  size_t bytes = 0;
+  if (unshare(img1)) {  // copy-on-write
+    // Iterate through the rows of the smaller image and blend them into the larger image
+    struct blendArg a = { img1, x, y, img2, alpha };
+    size_t pixels = (size_t)img2->width * img2->height;
+    PoolRunIf(pixels, img2->height, rowGrain(img2->width), blendJob, &a);
+    COUNT(PIXMEM, 3ul * img2->width * img2->height);  // count pixel memory accesses
+    bytes = 3 * pixels;
+  }
+  SCOPE_END(img1, bytes);
+}
+
+// Compare img2 to the subimage of img1 at (x, y).
+// Adds the number of pixel memory accesses to (*memops), once per row.
+static int match(Image img1, int x, int y, Image img2, unsigned long* memops) {
+  // Iterate through the pixels of the smaller image and compare them with the corresponding pixels in the larger image
+  for (int cy = 0; cy < img2->height; ++cy) {
+    // Compare the pixel values, up to the first one that differs
+    int cx = 0;
+    if (img1->layout == IMAGE_RASTER && img2->layout == IMAGE_RASTER) {
+      if (img2->width > 0) {
+        cx = (int)matchRun8(&img1->pixel[G(img1, x, y + cy)], &img2->pixel[G(img2, 0, cy)],
+                            img2->width);
+      }
+    } else {
+      while (cx < img2->width &&
+             img1->pixel[G(img1, x + cx, y + cy)] == img2->pixel[G(img2, cx, cy)]) {
+        ++cx;
+      }
+    }
+    // count pixel memory accesses (including the differing pixel, if any)
+    COUNT(*memops, 2ul * (cx < img2->width ? cx + 1 : cx));
+    if (cx < img2->width) {
+      // If any pixel does not match, return false
+      return 0;
     }
   }
+
+  // All pixels match, return true
+  return 1;
 }
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
-/// Returns 0, otherwise.
+/// Returns 0, otherwise (including if img2 does not fit in img1 at (x, y)).
+/// Requires: (x, y) must be a valid position of img1.
 int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidPos(img1, x, y));
-  
-  // Iterate through the pixels of the smaller image and compare them with the corresponding pixels in the larger image
-  for (int cy = 0; cy < img2->height; ++cy) {
-    for (int cx = 0; cx < img2->width; ++cx) {
-      // Compare the pixel values
-      if (ImageGetPixel(img1, x + cx, y + cy) != ImageGetPixel(img2, cx, cy)) {
-        // If any pixel does not match, return false
-        return 0;
-      }
+
+  // img2 cannot match if it sticks out of img1
+  if (!ImageValidRect(img1, x, y, img2->width, img2->height)) {
+    return 0;
+  }
+
+  unsigned long memops = 0;
+  int matches = match(img1, x, y, img2, &memops);
+  COUNT(PIXMEM, memops);
+  return matches;
+}
+
+// Arguments of locateJob
+struct locateArg {
+  Image img1;
+  Image img2;
+  size_t found;        // index y*(width+1)+x of the first match found so far
+  unsigned long memops;
+  unsigned long comps;
+};
+
+// Search for img2 in a band of candidate rows of img1.
+// Bands are handed out in increasing order, so a band can stop as soon as
+// a match is known in an earlier row: that match comes first.
+static void locateJob(void* p, size_t begin, size_t end) {
+  struct locateArg* a = (struct locateArg*)p;
+  Image img1 = a->img1;
+  Image img2 = a->img2;
+  unsigned long memops = 0;
+  unsigned long comps = 0;
+
+  // Iterate through the pixels of the larger image to find a match with the smaller image
+  for (int y = (int)begin; y < (int)end; ++y) {
+    size_t row = (size_t)y * (img1->width + 1);  // (+1: img1 may be empty)
+    if (__atomic_load_n(&a->found, __ATOMIC_RELAXED) < row) break;
+    // Check if the subimage starting at (x, y) matches img2, for each x
+    int last = img1->width - img2->width;
+    int x = 0;
+    while (x <= last && !match(img1, x, y, img2, &memops)) {
+      ++x;
+    }
+    // count the positions tried (including the matching one, if any)
+    COUNT(memops, 3ul * (x <= last ? x + 1 : x));
+    COUNT(comps, (unsigned long)(x <= last ? x + 1 : x));
+    if (x <= last) {
+      // If a match is found, record it, unless an earlier one is known
+      size_t cur = __atomic_load_n(&a->found, __ATOMIC_RELAXED);
+      while (row + x < cur && !__atomic_compare_exchange_n(&a->found, &cur, row + x, 0,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+      break;  // no need to look further in this band
     }
   }
 
-  // All pixels match, return true
-  return 1;
+  __atomic_fetch_add(&a->memops, memops, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&a->comps, comps, __ATOMIC_RELAXED);
 }
 
 /// Locate a subimage inside another image.
@@ -642,204 +2275,1300 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
 
-  InstrName[0] = "memops";
-  InstrName[1] = "comps";
-  InstrCalibrate();  // Call once, to measure CTU
+  SCOPE_BEGIN("locate");
+  struct locateArg a = { img1, img2, SIZE_MAX, 0, 0 };
+  if (img2->width <= img1->width && img2->height <= img1->height) {
+    int rows = img1->height - img2->height + 1;
+    size_t work = (size_t)rows * (img1->width - img2->width + 1);
+    PoolRunIf(work, rows, 1, locateJob, &a);
+  }
+  COUNT(InstrCount[0], a.memops);
+  COUNT(InstrCount[1], a.comps);
+  SCOPE_END(img1, a.memops);
 
-  InstrReset();
-  
-  // Iterate through the pixels of the larger image to find a match with the smaller image
-  for (int y = 0; y <= img1->height - img2->height; ++y) {
-    for (int x = 0; x <= img1->width - img2->width; ++x) {
-      InstrCount[0] += 3;
-      InstrCount[1] += 1;
-      // Check if the subimage starting at (x, y) matches img2
-      if (ImageMatchSubImage(img1, x, y, img2)) {
-        // If a match is found, set the position and return true
-        *px = x;
-        *py = y;
-
-        InstrPrint();
-
-        return 1;
+  if (a.found == SIZE_MAX) {
+    // No match found, return false
+    return 0;
+  }
+
+  // A match was found, set the position and return true
+  *px = (int)(a.found % (img1->width + 1));
+  *py = (int)(a.found / (img1->width + 1));
+  return 1;
+}
+
+
+/// Temporal operations
+
+/// These functions combine an image with another one of the same size,
+/// usually the next frame of a stream (see ImageStreamRead), to detect
+/// changes or to accumulate statistics over time.
+/// They modify img1 in-place: no allocation involved (unless shared, as
+/// for the pixel transformations), and img2 is not modified.
+/// Requires: img1 and img2 must have the same size.
+
+// When both images have the same layout, their pixel arrays correspond
+// byte by byte, and they are combined in loops over bands of bytes, which
+// the compiler vectorizes.  Otherwise, they are combined a row at a
+// time, the rows of img2 converted to the layout of img1 in a buffer.
+
+// Arguments of the temporal jobs
+struct temporalArg {
+  Image img1;
+  Image img2;
+  int weight;   // weight of img2 in the running average, in 1/256
+  void (*combine)(uint8* restrict p1, const uint8* restrict p2, size_t n, int weight);
+};
+
+// Apply the expression of p1[i] and p2[i] OP to the n bytes of p1 and p2,
+// in blocks of VBLOCK bytes and then the rest: at -O2, the compiler
+// vectorizes loops of a fixed number of iterations only.
+#define VBLOCK 64
+#define COMBINE(OP) \
+  for (; n >= VBLOCK; n -= VBLOCK, p1 += VBLOCK, p2 += VBLOCK) { \
+    for (int i = 0; i < VBLOCK; i++) p1[i] = (OP); \
+  } \
+  for (size_t i = 0; i < n; i++) p1[i] = (OP)
+
+static void diffBytes(uint8* restrict p1, const uint8* restrict p2, size_t n, int weight) {
+  (void)weight;
+  COMBINE(p1[i] > p2[i] ? p1[i] - p2[i] : p2[i] - p1[i]);
+}
+
+static void averageBytes(uint8* restrict p1, const uint8* restrict p2, size_t n, int weight) {
+  COMBINE((uint8)((p1[i] * (256 - weight) + p2[i] * weight + 128) >> 8));
+}
+
+static void minBytes(uint8* restrict p1, const uint8* restrict p2, size_t n, int weight) {
+  (void)weight;
+  COMBINE(p1[i] < p2[i] ? p1[i] : p2[i]);
+}
+
+static void maxBytes(uint8* restrict p1, const uint8* restrict p2, size_t n, int weight) {
+  (void)weight;
+  COMBINE(p1[i] > p2[i] ? p1[i] : p2[i]);
+}
+
+#undef COMBINE
+
+// Combine a band of bytes of images with the same layout.
+static void temporalBytesJob(void* p, size_t begin, size_t end) {
+  struct temporalArg* a = (struct temporalArg*)p;
+  a->combine(a->img1->pixel + begin, a->img2->pixel + begin, end - begin, a->weight);
+}
+
+// Combine a band of rows of images with different layouts.
+static void temporalRowsJob(void* p, size_t begin, size_t end) {
+  struct temporalArg* a = (struct temporalArg*)p;
+  int w = a->img1->width;
+  uint8* buf = (uint8*)malloc(2 * (size_t)w);
+  if (buf == NULL) {
+    // No memory for rows: a pixel at a time
+    for (int y = (int)begin; y < (int)end; y++) {
+      for (int x = 0; x < w; x++) {
+        a->combine(&a->img1->pixel[G(a->img1, x, y)],
+                   &a->img2->pixel[G(a->img2, x, y)], 1, a->weight);
       }
     }
+    return;
   }
+  for (int y = (int)begin; y < (int)end; y++) {
+    getRow(a->img1, 0, y, w, buf);
+    getRow(a->img2, 0, y, w, buf + w);
+    a->combine(buf, buf + w, w, a->weight);
+    putRow(a->img1, 0, y, w, buf);
+  }
+  free(buf);
+}
 
-  InstrPrint();
+// Combine img2 into img1, in an operation named name.
+static void temporalOp(const char* name, struct temporalArg* a) {
+  Image img1 = a->img1;
+  Image img2 = a->img2;
+  assert (img1 != NULL && img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+
+  SCOPE_BEGIN(name);
+  size_t pixels = (size_t)img1->width * img1->height;
+  if (!unshare(img1)) {  // copy-on-write
+    SCOPE_END(img1, 0);
+    return;
+  }
+  if (img1->layout == img2->layout) {
+    size_t size = storageSize(img1->width, img1->height, img1->layout);
+    PoolRunIf(size, size, 1 << 16, temporalBytesJob, a);
+  } else {
+    PoolRunIf(pixels, img1->height, rowGrain(img1->width), temporalRowsJob, a);
+  }
+  COUNT(PIXMEM, 3ul * pixels);  // count pixel reads and stores
+  SCOPE_END(img1, 3 * pixels);
+}
 
-  // No match found, return false
-  return 0;
+/// Frame difference: set each pixel of img1 to the absolute difference
+/// between it and the pixel of img2 at the same position.
+void ImageDifference(Image img1, Image img2) { ///
+  struct temporalArg a = { img1, img2, 0, diffBytes };
+  temporalOp("difference", &a);
 }
 
+/// Exponential running average: set each pixel of img1 to
+/// (1-alpha)*img1 + alpha*img2, rounded, where alpha is in [0.0, 1.0].
+/// alpha is rounded to a multiple of 1/256 (so that the average is
+/// computed with 16-bit integers, in vectors).  Note that, with 8-bit
+/// levels, the average stops moving when alpha times its difference to
+/// the new frames is below 1/2.
+void ImageRunningAverage(Image img1, Image img2, double alpha) { ///
+  assert (0.0 <= alpha && alpha <= 1.0);
+  struct temporalArg a = { img1, img2, (int)(alpha * 256 + 0.5), averageBytes };
+  temporalOp("average", &a);
+}
 
-/// Filtering
+/// Running minimum and maximum: set each pixel of img1 to the minimum
+/// (maximum) of it and the pixel of img2 at the same position.
+void ImageRunningMin(Image img1, Image img2) { ///
+  struct temporalArg a = { img1, img2, 0, minBytes };
+  temporalOp("min", &a);
+}
 
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
+void ImageRunningMax(Image img1, Image img2) { ///
+  struct temporalArg a = { img1, img2, 0, maxBytes };
+  temporalOp("max", &a);
+}
 
-/* Original implementation
-void ImageBlur(Image img, int dx, int dy) {
-  assert(img != NULL);
-  assert(dx >= 0 && dy >= 0);
 
-  InstrName[0] = "memops";
-  InstrName[1] = "comps";
-  InstrCalibrate();  // Call once, to measure CTU
-  InstrReset();
+/// Integral images
 
-  // Create a copy of the image
-  Image blurredImg = ImageCreate(img->width, img->height, img->maxval);
+struct imageIntegral {
+  int width, height;  // of the image
+  size_t stride;      // width of the tables (image width + 1)
+  uint64_t* sums;     // stride x (height+1) tables, row-major
+  uint64_t* squares;  // (NULL in the tables of ImageBlur, which needs no squares)
+};
 
-  // Check if image creation was successful
-  if (blurredImg == NULL) {
-    InstrPrint();
-    return;
+// The tables are built in two parallel passes: prefix sums along each row
+// (in bands of rows), then prefix sums down each column (in bands of
+// columns, each swept top to bottom).  Row y+1 of the tables holds the
+// sums of image row y; row 0 and column 0 are zeros.
+
+// Arguments of the integral jobs
+struct integralArg {
+  Image img;
+  ImageIntegral ii;
+};
+
+// Sum of the pixels in [0, x[ x [0, y[ (in table t, of width stride)
+#define IT(t, x, y) (t)[(size_t)(y) * stride + (x)]
+
+// The jobs keep the fields of the integral image in locals: the stores to
+// the tables (uint64_t) could alias them, and they would be reloaded for
+// every sum, which would keep the loops from being vectorized.
+
+// Prefix sums along a band of rows of the image.
+static void integralRowsJob(void* p, size_t begin, size_t end) {
+  struct integralArg* a = (struct integralArg*)p;
+  Image img = a->img;
+  uint64_t* sums = a->ii->sums;
+  uint64_t* squares = a->ii->squares;
+  size_t stride = a->ii->stride;
+  for (int y = (int)begin; y < (int)end; y++) {
+    IT(sums, 0, y + 1) = 0;
+    if (squares != NULL) IT(squares, 0, y + 1) = 0;
+    if (img->layout == IMAGE_RASTER) {
+      const uint8* row = &img->pixel[(size_t)y * img->width];
+      prefixRun8(row, img->width, 0, &IT(sums, 1, y + 1));
+      if (squares != NULL) prefixSquaresRun8(row, img->width, 0, &IT(squares, 1, y + 1));
+      continue;
+    }
+    // Other layouts: sum the row in segments, through a row buffer
+    uint8 buf[TILE];
+    uint64_t sum = 0;
+    uint64_t sumSq = 0;
+    for (int x = 0; x < img->width; x += TILE) {
+      int len = img->width - x < TILE ? img->width - x : TILE;
+      getRow(img, x, y, len, buf);
+      sum = prefixRun8(buf, len, sum, &IT(sums, x + 1, y + 1));
+      if (squares != NULL) {
+        sumSq = prefixSquaresRun8(buf, len, sumSq, &IT(squares, x + 1, y + 1));
+      }
+    }
   }
+}
 
-  // Iterate through the pixels of the original image to apply the blur
-  for (int y = 0; y < img->height; y++) {
-    for (int x = 0; x < img->width; x++) {
-      double sum = 0;
-      double count = 0;
-      // Iterate through the pixels in the neighborhood to calculate the mean
-      for (int cy = y - dy; cy <= y + dy; cy++) {
-        for (int cx = x - dx; cx <= x + dx; cx++) {
-          // Check if the current neighbor pixel is within the image bounds
-          if (ImageValidPos(img, cx, cy)) {
-            InstrCount[1] += 1;
-            // Accumulate pixel values and count valid pixels
-            sum += ImageGetPixel(img, cx, cy);
-            count++;
-          }
-        }
+// Prefix sums down a band of columns of the tables.
+static void integralColumnsJob(void* p, size_t begin, size_t end) {
+  struct integralArg* a = (struct integralArg*)p;
+  uint64_t* sums = a->ii->sums;
+  uint64_t* squares = a->ii->squares;
+  size_t stride = a->ii->stride;
+  int height = a->ii->height;
+  for (int y = 2; y <= height; y++) {
+    for (int x = (int)begin; x < (int)end; x++) {
+      IT(sums, x, y) += IT(sums, x, y - 1);
+    }
+    if (squares == NULL) continue;
+    for (int x = (int)begin; x < (int)end; x++) {
+      IT(squares, x, y) += IT(squares, x, y - 1);
+    }
+  }
+}
+
+// Create the integral image of img, with the table of squares or not.
+static ImageIntegral createIntegral(Image img, int squares) {
+  ImageIntegral ii = (ImageIntegral)malloc(sizeof(struct imageIntegral));
+  if (ii == NULL) {
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  ii->width = img->width;
+  ii->height = img->height;
+  ii->stride = (size_t)img->width + 1;
+  size_t cells = ii->stride * (img->height + 1);
+  ii->sums = (uint64_t*)malloc(cells * sizeof(uint64_t));
+  ii->squares = squares ? (uint64_t*)malloc(cells * sizeof(uint64_t)) : NULL;
+  if (ii->sums == NULL || (squares && ii->squares == NULL)) {
+    ImageIntegralDestroy(&ii);
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+
+  // First row
+  memset(ii->sums, 0, ii->stride * sizeof(uint64_t));
+  if (squares) memset(ii->squares, 0, ii->stride * sizeof(uint64_t));
+  if (img->width > 0 && img->height > 0) {
+    struct integralArg a = { img, ii };
+    size_t pixels = (size_t)img->width * img->height;
+    PoolRunIf(pixels, img->height, rowGrain(img->width), integralRowsJob, &a);
+    PoolRunIf(cells, ii->stride, 1024, integralColumnsJob, &a);
+    COUNT(PIXMEM, (unsigned long)pixels + (squares ? 2 : 1) * cells);  // count pixel reads and stores
+  }
+  return ii;
+}
+
+/// Create the integral image of img.
+/// On success, a new integral image is returned.
+/// (The caller is responsible for destroying the returned integral image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIntegral ImageIntegralCreate(Image img) { ///
+  assert (img != NULL);
+  SCOPE_BEGIN("integral");
+  ImageIntegral ii = createIntegral(img, 1);
+  SCOPE_END(img, ii != NULL ? (size_t)img->width * img->height : 0);
+  return ii;
+}
+
+/// Destroy the integral image pointed to by (*iip).
+/// If (*iip)==NULL, no operation is performed.
+/// Ensures: (*iip)==NULL.
+void ImageIntegralDestroy(ImageIntegral* iip) { ///
+  assert (iip != NULL);
+  ImageIntegral ii = *iip;
+  if (ii == NULL) return;
+  errsave = errno;
+  free(ii->sums);
+  free(ii->squares);
+  free(ii);
+  errno = errsave;
+  *iip = NULL;
+}
+
+/// Get the width and height of the image of ii.
+int ImageIntegralWidth(ImageIntegral ii) { ///
+  assert (ii != NULL);
+  return ii->width;
+}
+
+int ImageIntegralHeight(ImageIntegral ii) { ///
+  assert (ii != NULL);
+  return ii->height;
+}
+
+/// Get the tables of ii.
+const uint64_t* ImageIntegralSums(ImageIntegral ii) { ///
+  assert (ii != NULL);
+  return ii->sums;
+}
+
+const uint64_t* ImageIntegralSquares(ImageIntegral ii) { ///
+  assert (ii != NULL);
+  return ii->squares;
+}
+
+// Sum of table t over the rectangle (x,y,w,h), from its 4 corners.
+static inline uint64_t rectSum(ImageIntegral ii, const uint64_t* t, int x, int y, int w, int h) {
+  size_t stride = ii->stride;
+  return IT(t, x + w, y + h) - IT(t, x, y + h) - IT(t, x + w, y) + IT(t, x, y);
+}
+
+// Check that the rectangle (x,y,w,h) is inside the image of ii.
+static int integralRect(ImageIntegral ii, int x, int y, int w, int h) {
+  return 0 <= x && 0 <= w && x <= ii->width - w &&
+         0 <= y && 0 <= h && y <= ii->height - h;
+}
+
+/// Sum of the pixels of the rectangle.
+uint64_t ImageRectSum(ImageIntegral ii, int x, int y, int w, int h) { ///
+  assert (ii != NULL);
+  assert (integralRect(ii, x, y, w, h));
+  return rectSum(ii, ii->sums, x, y, w, h);
+}
+
+/// Mean of the pixels of the rectangle.
+double ImageRectMean(ImageIntegral ii, int x, int y, int w, int h) { ///
+  assert (ii != NULL);
+  assert (integralRect(ii, x, y, w, h) && w > 0 && h > 0);
+  return (double)rectSum(ii, ii->sums, x, y, w, h) / ((double)w * h);
+}
+
+/// Variance of the pixels of the rectangle.
+double ImageRectVariance(ImageIntegral ii, int x, int y, int w, int h) { ///
+  assert (ii != NULL);
+  assert (ii->squares != NULL);
+  assert (integralRect(ii, x, y, w, h) && w > 0 && h > 0);
+  // n^2 * variance = n * sum(p^2) - sum(p)^2, which is exact in 128 bits
+  // (n * sum(p^2) reaches 2^16 n^2), unlike its two terms in doubles
+  unsigned __int128 n = (uint64_t)w * h;
+  unsigned __int128 sum = rectSum(ii, ii->sums, x, y, w, h);
+  unsigned __int128 sumSq = rectSum(ii, ii->squares, x, y, w, h);
+  return (double)(n * sumSq - sum * sum) / ((double)n * (double)n);
+}
+
+#undef IT
+
+/// Connected components
+
+// Labeling works on the runs of each row: the maximal horizontal segments
+// of nonzero pixels.  The image is split into bands of rows, and:
+//
+// 1. Each band counts its runs (in parallel), so that the runs of the
+//    image get consecutive indices, band after band and row after row.
+// 2. Each band finds its runs, and joins each one with the runs of the
+//    row above that it touches, in a union-find forest of parent links
+//    (in parallel).  A join links the greater root to the lesser, so the
+//    root of each tree is its first run, and parent[i] <= i.  Each band
+//    then points its runs straight to their roots.
+// 3. The forests of consecutive bands are joined where they meet (the
+//    first row of each band and the last row of the previous one),
+//    serially: it takes 2 rows per band.
+// 4. The remaining roots are the components: each band numbers its own,
+//    in order, after those of the previous bands (in parallel).
+// 5. Each band writes the labels of its rows and the statistics of its
+//    components (in parallel).  A component whose first run is in an
+//    earlier band gets the statistics of this band in a partial entry of
+//    the band, which are added to it at the end, serially.
+//
+// There are several bands per thread, so that threads that get cheaper
+// bands take more of them.  Runs are indexed by uint32_t (half the memory
+// of size_t): an image must have fewer than 2^32-1 runs.
+
+struct imageComponents {
+  int width, height;     // of the image
+  size_t count;          // number of components
+  uint32_t* labels;      // width x height labels, row-major
+  ImageComponent* table; // the component of label l at index l-1
+};
+
+// A band of rows of the image
+struct labelBand {
+  int y0, y1;          // rows [y0, y1[
+  size_t first;        // its runs are [first, first+runs[
+  size_t runs;
+  size_t roots;        // the number of its runs that are roots
+  size_t label;        // its components get the labels after this one
+  size_t slots;        // number of its partial entries
+  ImageComponent* partial;  // its partial entries
+  uint8* buf;          // a row buffer (for layouts other than raster)
+};
+
+// Arguments of the labeling jobs
+struct labelArg {
+  Image img;
+  int touch;           // 0 for 4-connectivity, 1 for 8-connectivity
+  struct labelBand* band;
+  int bands;
+  uint32_t* rowFirst;  // the runs of row y are [rowFirst[y], rowFirst[y+1][
+  uint32_t* start;     // run i is columns [start[i], end[i][ of its row
+  uint32_t* end;
+  uint32_t* parent;    // the union-find forest
+  uint32_t* label;     // label of each root, and index of the partial
+                       // entry of runs joined to a root of an earlier band
+  ImageComponents c;
+};
+
+// No run
+#define NORUN UINT32_MAX
+
+// Each byte b of a 64-bit word
+#define BYTES(b) ((b) * 0x0101010101010101ull)
+
+// The high bit of each nonzero byte of x
+static inline uint64_t nonzeroBytes(uint64_t x) {
+  return (((x & BYTES(0x7F)) + BYTES(0x7F)) | x) & BYTES(0x80);
+}
+
+// Get row y of the image of band (its pixels, in the raster layout, or a
+// copy in the row buffer of the band).
+static const uint8* labelRow(Image img, struct labelBand* band, int y) {
+  if (img->layout == IMAGE_RASTER) return &img->pixel[(size_t)y * img->width];
+  getRow(img, 0, y, img->width, band->buf);
+  return band->buf;
+}
+
+// Number of runs of the n pixels of row p.
+// A run starts at each nonzero pixel after a zero one (or at column 0).
+static size_t countRuns(const uint8* p, int n) {
+  size_t runs = 0;
+  int x = 0;
+  int last = 0;  // the pixel before x is nonzero
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // 8 pixels at a time (the first in the lowest byte): the starts are the
+  // nonzero bytes whose previous byte (the next lower) is zero
+  uint64_t prev = 0;  // high bit of the previous byte, moved to bit 7
+  for (; x + 8 <= n; x += 8) {
+    uint64_t w;
+    memcpy(&w, p + x, 8);
+    uint64_t nz = nonzeroBytes(w);
+    uint64_t starts = nz & ~(nz << 8 | prev);
+    runs += ((starts >> 7) * BYTES(1)) >> 56;  // the sum of the bytes
+    prev = nz >> 56;
+  }
+  last = prev != 0;
+#endif
+  for (; x < n; x++) {
+    int cur = p[x] != 0;
+    runs += cur & !last;
+    last = cur;
+  }
+  return runs;
+}
+
+// Find the runs of the n pixels of row p, and store them from index i of
+// arrays start and end.  Returns the index after the last.
+static uint32_t findRuns(const uint8* p, int n, uint32_t* start, uint32_t* end, uint32_t i) {
+  int x = 0;
+  int open = 0;  // the pixel before x is nonzero: run i is open
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // 8 pixels at a time: a run starts or ends at each byte that differs
+  // from the previous one (zero or nonzero)
+  uint64_t prev = 0;
+  for (; x + 8 <= n; x += 8) {
+    uint64_t w;
+    memcpy(&w, p + x, 8);
+    uint64_t nz = nonzeroBytes(w);
+    uint64_t edges = nz ^ (nz << 8 | prev);
+    prev = nz >> 56;
+    while (edges != 0) {
+      uint32_t at = (uint32_t)(x + (__builtin_ctzll(edges) >> 3));
+      if (open) end[i++] = at; else start[i] = at;
+      open = !open;
+      edges &= edges - 1;
+    }
+  }
+#endif
+  for (; x < n; x++) {
+    if ((p[x] != 0) == open) continue;
+    if (open) end[i++] = (uint32_t)x; else start[i] = (uint32_t)x;
+    open = !open;
+  }
+  if (open) end[i++] = (uint32_t)n;
+  return i;
+}
+
+// Find the root of the tree of run i, halving the path to it (each node
+// on the way is linked to its grandparent).
+static inline uint32_t findRoot(uint32_t* parent, uint32_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+// Join the trees of runs i and j: the greater root is linked to the lesser.
+// Returns the root that was linked, or NORUN if they are already one tree.
+static inline uint32_t joinRuns(uint32_t* parent, uint32_t i, uint32_t j) {
+  i = findRoot(parent, i);
+  j = findRoot(parent, j);
+  if (i == j) return NORUN;
+  if (i < j) { uint32_t t = i; i = j; j = t; }
+  parent[i] = j;
+  return i;
+}
+
+// Join the runs [i, iEnd[ of a row with the runs [j, jEnd[ of the row
+// above that they touch: those that share a column (or, in 8-connectivity,
+// that also end next to their start).  The roots that are linked are
+// stored in array linked, if not NULL.
+// Returns the number of joins.
+// The search for roots starts at the parents of the runs, and only links
+// roots, so that runs that point straight to their roots keep doing so.
+static size_t joinRows(const struct labelArg* a, uint32_t i, uint32_t iEnd,
+                       uint32_t j, uint32_t jEnd, uint32_t* linked) {
+  uint32_t* parent = a->parent;
+  const uint32_t* start = a->start;
+  const uint32_t* end = a->end;
+  uint32_t touch = (uint32_t)a->touch;
+  size_t joins = 0;
+  for (; i < iEnd; i++) {
+    // Skip the runs above that end before run i (and so before the next)
+    while (j < jEnd && end[j] + touch <= start[i]) j++;
+    for (uint32_t k = j; k < jEnd && start[k] < end[i] + touch; k++) {
+      uint32_t root = joinRuns(parent, parent[i], parent[k]);
+      if (root == NORUN) continue;
+      if (linked != NULL) linked[joins] = root;
+      joins++;
+    }
+  }
+  return joins;
+}
+
+// Count the runs of a band of bands.
+static void countRunsJob(void* p, size_t begin, size_t end) {
+  struct labelArg* a = (struct labelArg*)p;
+  Image img = a->img;
+  for (size_t b = begin; b < end; b++) {
+    struct labelBand* band = &a->band[b];
+    size_t runs = 0;
+    for (int y = band->y0; y < band->y1; y++) {
+      runs += countRuns(labelRow(img, band, y), img->width);
+    }
+    band->runs = runs;
+  }
+}
+
+// Find the runs of a band of bands, and build their forests.
+static void findRunsJob(void* p, size_t begin, size_t end) {
+  struct labelArg* a = (struct labelArg*)p;
+  Image img = a->img;
+  uint32_t* rowFirst = a->rowFirst;
+  uint32_t* parent = a->parent;
+  for (size_t b = begin; b < end; b++) {
+    struct labelBand* band = &a->band[b];
+    uint32_t i = (uint32_t)band->first;
+    size_t joins = 0;
+    for (int y = band->y0; y < band->y1; y++) {
+      rowFirst[y] = i;
+      uint32_t next = findRuns(labelRow(img, band, y), img->width, a->start, a->end, i);
+      for (uint32_t k = i; k < next; k++) parent[k] = k;
+      if (y > band->y0) joins += joinRows(a, i, next, rowFirst[y - 1], i, NULL);
+      i = next;
+    }
+    // Point each run to its root (parents come first, and already do)
+    for (uint32_t k = (uint32_t)band->first; k < i; k++) parent[k] = parent[parent[k]];
+    band->roots = band->runs - joins;
+  }
+}
+
+// Number the components of a band of bands, and start their statistics
+// with their first run.  Each component is kept as x, y, and the column
+// and row after its last, until labeling ends.
+static void labelRootsJob(void* p, size_t begin, size_t end) {
+  struct labelArg* a = (struct labelArg*)p;
+  const uint32_t* rowFirst = a->rowFirst;
+  const uint32_t* parent = a->parent;
+  uint32_t* label = a->label;
+  ImageComponent* table = a->c->table;
+  for (size_t b = begin; b < end; b++) {
+    struct labelBand* band = &a->band[b];
+    uint32_t l = (uint32_t)band->label;
+    for (int y = band->y0; y < band->y1; y++) {
+      for (uint32_t i = rowFirst[y]; i < rowFirst[y + 1]; i++) {
+        if (parent[i] != i) continue;
+        label[i] = ++l;
+        ImageComponent* comp = &table[l - 1];
+        comp->x = (int)a->start[i];
+        comp->y = y;
+        comp->width = (int)a->end[i];
+        comp->height = y + 1;
+        comp->area = 0;
       }
-      // Calculate the mean value and set the blurred pixel in the temporary image
-      uint8 meanValue = (count > 0) ? (uint8)((sum / count) + 0.5) : 0;
-      ImageSetPixel(blurredImg, x, y, meanValue);
+    }
+    // The partial entries start empty
+    for (size_t s = 0; s < band->slots; s++) {
+      ImageComponent* part = &band->partial[s];
+      part->x = a->img->width;
+      part->y = a->img->height;
+      part->width = part->height = 0;
+      part->area = 0;
     }
   }
+}
 
-  InstrPrint();
+// Write the labels of a band of bands, and the statistics of their runs.
+static void labelPixelsJob(void* p, size_t begin, size_t end) {
+  struct labelArg* a = (struct labelArg*)p;
+  const uint32_t* rowFirst = a->rowFirst;
+  const uint32_t* start = a->start;
+  const uint32_t* stop = a->end;
+  const uint32_t* parent = a->parent;
+  const uint32_t* label = a->label;
+  ImageComponent* table = a->c->table;
+  uint32_t* labels = a->c->labels;
+  uint32_t width = (uint32_t)a->img->width;
+  for (size_t b = begin; b < end; b++) {
+    struct labelBand* band = &a->band[b];
+    uint32_t first = (uint32_t)band->first;
+    for (int y = band->y0; y < band->y1; y++) {
+      uint32_t* out = &labels[(size_t)y * width];
+      uint32_t x = 0;
+      for (uint32_t i = rowFirst[y]; i < rowFirst[y + 1]; i++) {
+        // Each run points to its root in the band, or to the root of its
+        // component, and so does that root (steps 2 and 3)
+        uint32_t r = parent[i];
+        uint32_t root = parent[r];
+        uint32_t l = label[root];
+        ImageComponent* comp = root >= first ? &table[l - 1] :
+                               &band->partial[label[r >= first ? r : i]];
+        uint32_t x0 = start[i];
+        uint32_t x1 = stop[i];
+        for (; x < x0; x++) out[x] = 0;
+        for (; x < x1; x++) out[x] = l;
+        comp->area += x1 - x0;
+        if ((int)x0 < comp->x) comp->x = (int)x0;
+        if ((int)x1 > comp->width) comp->width = (int)x1;
+        if (y < comp->y) comp->y = y;
+        comp->height = y + 1;
+      }
+      for (; x < width; x++) out[x] = 0;
+    }
+  }
+}
 
-  // Copy the blurred result back to the original image
-  memcpy(img->pixel, blurredImg->pixel, img->width * img->height * sizeof(uint8));
-  
-  // Destroy the temporary image
-  ImageDestroy(&blurredImg);
+// Turn the last column and row of a band of components into their sizes.
+static void componentSizesJob(void* p, size_t begin, size_t end) {
+  ImageComponent* table = (ImageComponent*)p;
+  for (size_t l = begin; l < end; l++) {
+    table[l].width -= table[l].x;
+    table[l].height -= table[l].y;
+  }
+}
+
+// The band of run i.
+static struct labelBand* bandOf(const struct labelArg* a, uint32_t i) {
+  int lo = 0;
+  int hi = a->bands - 1;
+  while (lo < hi) {  // the last band whose first run is <= i
+    int mid = (lo + hi + 1) / 2;
+    if (a->band[mid].first <= i) lo = mid; else hi = mid - 1;
+  }
+  return &a->band[lo];
+}
+
+// Join the forests of the bands (step 3), and give each root linked to a
+// root of an earlier band a partial entry of its band.
+// On success, returns the array of linked roots, and sets (*n) to their
+// number.  On failure, returns NULL.
+static uint32_t* joinBands(struct labelArg* a, size_t* n) {
+  const uint32_t* rowFirst = a->rowFirst;
+  size_t capacity = 1;
+  for (int b = 1; b < a->bands; b++) {
+    int y = a->band[b].y0;
+    capacity += rowFirst[y + 1] - rowFirst[y - 1];
+  }
+  uint32_t* linked = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+  if (linked == NULL) return NULL;
+
+  size_t joins = 0;
+  for (int b = 1; b < a->bands; b++) {
+    int y = a->band[b].y0;
+    joins += joinRows(a, rowFirst[y], rowFirst[y + 1], rowFirst[y - 1], rowFirst[y],
+                      linked + joins);
+  }
+  // Point the linked roots straight to their roots, as the other runs
+  for (size_t k = 0; k < joins; k++) {
+    a->parent[linked[k]] = findRoot(a->parent, linked[k]);
+  }
+  for (size_t k = 0; k < joins; k++) {
+    uint32_t i = linked[k];
+    struct labelBand* band = bandOf(a, i);
+    band->roots--;
+    if (a->parent[i] < band->first) a->label[i] = (uint32_t)band->slots++;
+  }
+  *n = joins;
+  return linked;
+}
+
+// Free the temporary arrays of a.
+static void labelFree(struct labelArg* a) {
+  if (a->band != NULL) {
+    for (int b = 0; b < a->bands; b++) free(a->band[b].buf);
+    free(a->band[0].partial);  // (a single array)
+  }
+  free(a->band);
+  free(a->rowFirst);
+  free(a->start);
+  free(a->end);
+  free(a->parent);
+  free(a->label);
 }
-*/
+
+// Label the components of img (steps 1 to 5).
+// Returns nonzero on success, or 0 on failure (errno/errCause are set).
+static int labelComponents(struct labelArg* a) {
+  Image img = a->img;
+  ImageComponents c = a->c;
+  size_t pixels = (size_t)img->width * img->height;
+  int threads = PoolThreads();
+  a->bands = pixels < PoolMinWork() || threads <= 1 ? 1 : 4 * threads;
+  if (a->bands > img->height) a->bands = img->height;
+  a->band = (struct labelBand*)calloc(a->bands, sizeof(struct labelBand));
+  a->rowFirst = (uint32_t*)malloc((img->height + 1) * sizeof(uint32_t));
+  if (!check( a->band != NULL && a->rowFirst != NULL, "Memory allocation failed" )) return 0;
+  for (int b = 0; b < a->bands; b++) {
+    struct labelBand* band = &a->band[b];
+    band->y0 = (int)((size_t)img->height * b / a->bands);
+    band->y1 = (int)((size_t)img->height * (b + 1) / a->bands);
+    if (img->layout != IMAGE_RASTER) {
+      band->buf = (uint8*)malloc(img->width);
+      if (!check( band->buf != NULL, "Memory allocation failed" )) return 0;
+    }
+  }
+
+  // 1. Count the runs, and allocate their arrays
+  PoolRunIf(pixels, a->bands, 1, countRunsJob, a);
+  size_t runs = 0;
+  for (int b = 0; b < a->bands; b++) {
+    a->band[b].first = runs;
+    runs += a->band[b].runs;
+  }
+  if (!check( runs < NORUN, "Too many runs of nonzero pixels" )) return 0;
+  a->rowFirst[img->height] = (uint32_t)runs;
+  size_t size = (runs + 1) * sizeof(uint32_t);
+  a->start = (uint32_t*)malloc(size);
+  a->end = (uint32_t*)malloc(size);
+  a->parent = (uint32_t*)malloc(size);
+  a->label = (uint32_t*)malloc(size);
+  if (!check( a->start != NULL && a->end != NULL && a->parent != NULL && a->label != NULL,
+              "Memory allocation failed" )) return 0;
+
+  // 2. and 3. Build the forests of the bands, and join them
+  PoolRunIf(pixels, a->bands, 1, findRunsJob, a);
+  size_t joins;
+  uint32_t* linked = joinBands(a, &joins);
+  if (!check( linked != NULL, "Memory allocation failed" )) return 0;
+
+  // 4. Number the components, and allocate the table and partial entries
+  size_t slots = 0;
+  c->count = 0;
+  for (int b = 0; b < a->bands; b++) {
+    a->band[b].label = c->count;
+    c->count += a->band[b].roots;
+    slots += a->band[b].slots;
+  }
+  c->table = (ImageComponent*)malloc((c->count + 1) * sizeof(ImageComponent));
+  ImageComponent* partial = (ImageComponent*)malloc((slots + 1) * sizeof(ImageComponent));
+  a->band[0].partial = partial;
+  if (!check( c->table != NULL && partial != NULL, "Memory allocation failed" )) {
+    free(linked);
+    return 0;
+  }
+  for (int b = 0; b < a->bands; b++) {
+    a->band[b].partial = partial;
+    partial += a->band[b].slots;
+  }
+  PoolRunIf(runs, a->bands, 1, labelRootsJob, a);
+
+  // 5. Write the labels and statistics, and add up the partial entries
+  PoolRunIf(pixels, a->bands, 1, labelPixelsJob, a);
+  for (size_t k = 0; k < joins; k++) {
+    uint32_t i = linked[k];
+    struct labelBand* band = bandOf(a, i);
+    if (a->parent[i] >= band->first) continue;
+    const ImageComponent* part = &band->partial[a->label[i]];
+    ImageComponent* comp = &c->table[a->label[a->parent[i]] - 1];
+    comp->area += part->area;
+    if (part->x < comp->x) comp->x = part->x;
+    if (part->width > comp->width) comp->width = part->width;
+    if (part->height > comp->height) comp->height = part->height;
+  }
+  free(linked);
+  PoolRunIf(c->count, c->count, 1 << 16, componentSizesJob, c->table);
+  return 1;
+}
+
+/// Label the connected components of the nonzero pixels of img, with the
+/// given connectivity (4 or 8).
+/// On success, a new labeling is returned.
+/// (The caller is responsible for destroying the returned labeling!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageComponents ImageLabelComponents(Image img, int connectivity) { ///
+  assert (img != NULL);
+  assert (connectivity == 4 || connectivity == 8);
+  SCOPE_BEGIN("label");
+  size_t pixels = (size_t)img->width * img->height;
+  ImageComponents c = (ImageComponents)calloc(1, sizeof(struct imageComponents));
+  if (c != NULL) {
+    c->width = img->width;
+    c->height = img->height;
+    c->labels = (uint32_t*)malloc((pixels + 1) * sizeof(uint32_t));
+  }
+  int success = check( c != NULL && c->labels != NULL, "Memory allocation failed" );
+  if (success && pixels == 0) {
+    c->table = (ImageComponent*)malloc(sizeof(ImageComponent));
+    success = check( c->table != NULL, "Memory allocation failed" );
+  } else if (success) {
+    struct labelArg a = { img, connectivity == 8, NULL, 0, NULL, NULL, NULL, NULL, NULL, c };
+    success = labelComponents(&a);
+    errsave = errno;
+    labelFree(&a);
+    errno = errsave;
+    COUNT(PIXMEM, (unsigned long)pixels * 3);  // count pixel reads (twice) and label stores
+  }
+  if (!success) ImageComponentsDestroy(&c);
+  SCOPE_END(img, success ? pixels : 0);
+  return c;
+}
+
+/// Destroy the labeling pointed to by (*cp).
+/// If (*cp)==NULL, no operation is performed.
+/// Ensures: (*cp)==NULL.
+void ImageComponentsDestroy(ImageComponents* cp) { ///
+  assert (cp != NULL);
+  ImageComponents c = *cp;
+  if (c == NULL) return;
+  errsave = errno;
+  free(c->labels);
+  free(c->table);
+  free(c);
+  errno = errsave;
+  *cp = NULL;
+}
+
+/// Get the width and height of the image of c.
+int ImageComponentsWidth(ImageComponents c) { ///
+  assert (c != NULL);
+  return c->width;
+}
+
+int ImageComponentsHeight(ImageComponents c) { ///
+  assert (c != NULL);
+  return c->height;
+}
+
+/// Get the number of components of c.
+size_t ImageComponentsCount(ImageComponents c) { ///
+  assert (c != NULL);
+  return c->count;
+}
+
+/// Get the label image of c.
+const uint32_t* ImageComponentsLabels(ImageComponents c) { ///
+  assert (c != NULL);
+  return c->labels;
+}
+
+/// Get the component table of c.
+const ImageComponent* ImageComponentsTable(ImageComponents c) { ///
+  assert (c != NULL);
+  return c->table;
+}
+
+#undef BYTES
+#undef NORUN
+
+/// Filtering
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// The image is changed in-place (pixels shared with a clone are copied first).
+/// Needs a temporary table of 8 bytes per pixel: if it cannot be allocated,
+/// img is left unchanged and errno/errCause are set accordingly.
+
+// The original implementation, pixel by pixel, is kept as RefBlur in
+// imageRef.c, as the reference that this one is tested against.
 
 // Optimized implementation
+//
+// The mean of each window is computed in constant time from the sums of
+// an integral image (without squares).  Windows are clipped to the image,
+// as in the original implementation: near the borders, the mean is that
+// of the pixels of the window that are inside the image.
+// The output is computed in bands of rows.
+
+// Arguments of the blur jobs
+struct blurArg {
+  Image img;
+  int dx, dy;
+  ImageIntegral ii;
+};
+
+// Sum of the pixels in [0, x[ x [0, y[
+#define II(x, y) a->ii->sums[(size_t)(y) * a->ii->stride + (x)]
+
+// Compute a band of rows of the blurred image from the table.
+static void blurOutputJob(void* p, size_t begin, size_t end) {
+  struct blurArg* a = (struct blurArg*)p;
+  Image img = a->img;
+  for (int Y = (int)begin; Y < (int)end; Y++) {
+    // The window, clipped to the image, is [x0, x1[ x [y0, y1[
+    int y0 = Y - a->dy > 0 ? Y - a->dy : 0;
+    int y1 = Y + a->dy < img->height ? Y + a->dy + 1 : img->height;
+    const uint64_t* top = &II(0, y0);
+    const uint64_t* bottom = &II(0, y1);
+    if (img->layout == IMAGE_RASTER) {
+      meanRun8(top, bottom, img->width, a->dx, y1 - y0, 0, img->width,
+               &img->pixel[(size_t)Y * img->width]);
+      continue;
+    }
+    // Other layouts: compute the row in segments, through a row buffer
+    uint8 buf[TILE];
+    for (int X = 0; X < img->width; X += TILE) {
+      int len = img->width - X < TILE ? img->width - X : TILE;
+      meanRun8(top, bottom, img->width, a->dx, y1 - y0, X, len, buf);
+      putRow(img, X, Y, len, buf);
+    }
+  }
+}
+
+#undef II
+
+// Blur img from the sums of ii (already unshared).
+static void blurFrom(Image img, ImageIntegral ii, int dx, int dy) {
+  struct blurArg a = { img, dx, dy, ii };
+  size_t pixels = (size_t)img->width * img->height;
+  if (pixels == 0) return;
+  PoolRunIf(pixels, img->height, rowGrain(img->width), blurOutputJob, &a);
+  COUNT(PIXMEM, (unsigned long)pixels);  // count pixel stores
+  COUNT(InstrCount[1], pixels);
+}
+
 void ImageBlur(Image img, int dx, int dy) {
   assert(img != NULL);
   assert(dx >= 0 && dy >= 0);
 
-  InstrName[0] = "memops";
-  InstrName[1] = "comps";
-  InstrCalibrate();  // Call once, to measure CTU
-  InstrReset();
+  SCOPE_BEGIN("blur");
+  if (!unshare(img)) {  // copy-on-write
+    SCOPE_END(img, 0);
+    return;
+  }
 
-  int height = img->height;
-  int width = img->width;
-  int nx, ny;
-  int x, y;
-  int pixelVal;
-  int A, B, C, D, sum;
+  // A table of sums only (64-bit: on large images, the sums reach
+  // 255*width*height, which overflows 32-bit integers)
+  ImageIntegral ii = createIntegral(img, 0);
+  if (ii == NULL) {
+    SCOPE_END(img, 0);
+    return;
+  }
+  blurFrom(img, ii, dx, dy);
+  ImageIntegralDestroy(&ii);
+  SCOPE_END(img, 2 * (size_t)img->width * img->height);
+}
 
-  int rectHeight = 2 * dy;
-  int rectWidth = 2 * dx;
+/// Blur an image, as ImageBlur, with the sums of an existing integral
+/// image of it.
+void ImageBlurIntegral(Image img, ImageIntegral ii, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (ii != NULL);
+  assert (ii->width == img->width && ii->height == img->height);
+  assert (dx >= 0 && dy >= 0);
+
+  SCOPE_BEGIN("blur");
+  if (!unshare(img)) {  // copy-on-write
+    SCOPE_END(img, 0);
+    return;
+  }
+  blurFrom(img, ii, dx, dy);
+  SCOPE_END(img, (size_t)img->width * img->height);
+}
+
+/// Fused pipelines
+
+// A chain of stages is compiled into kernels: each run of consecutive
+// pixel transformations becomes a single lookup table of 256 levels
+// (computed with the same functions as the operations, so it is exact),
+// and each blur is a kernel of its own.
+//
+// Without blurs, the image is transformed in-place through the table,
+// as a single pixel transformation.
+//
+// With blurs, each tile of the image is computed from a region of the
+// input that extends it by a halo of (dx, dy) pixels for each blur in
+// the chain (clipped to the image).  The region is loaded into a raster
+// buffer and the kernels are applied to the buffer, each blur shrinking
+// the region that holds valid levels to the one the following kernels
+// need.  Blurs compute the same clipped windows as ImageBlur, from a
+// summed-area table of the buffer, with the same rounding, so the
+// results are identical.  Since tiles read their halos from the input,
+// the output goes to a new pixel array, which then replaces that of img.
+
+// Side of the tiles (0: chosen from the size of the L2 cache)
+static int stageTile = 0;
+
+/// Set the side of the tiles of ImageApplyStages, in pixels.
+/// 0 (the default) chooses it so that the buffers of a tile fit in the
+/// L2 cache.  Other values are meant for testing and tuning.
+void ImageSetStageTile(int side) { ///
+  assert (side >= 0);
+  stageTile = side;
+}
 
-  int nHeight = height + 2 * dy;
-  int nWidth = width + 2 * dx;
+// A kernel of a compiled chain
+struct kernel {
+  int blur;           // 1 for a blur, 0 for a lookup table
+  int dx, dy;         // blur radii
+  int haloX, haloY;   // sum of the radii of the blurs from this one on
+  uint8 lut[256];     // new level of each level
+};
 
-  // Sum table para integral image
-  int **integralImage = (int **)malloc(nWidth * sizeof(int *));
+// Arguments of the stage jobs
+struct stagesArg {
+  Image src;
+  Image dst;
+  const struct kernel* kernel;
+  int kernels;
+  int side;             // side of the tiles
+  int tilesX;           // number of tiles in each row
+  int failed;           // set if the buffers of some tile were not allocated
+  unsigned long memops; // pixel reads and stores (updated atomically)
+};
+
+// A rectangle [x0, x1[ x [y0, y1[
+struct rect {
+  int x0, y0, x1, y1;
+};
 
-  // Check if memory was allocated
-  if (integralImage == NULL) {
-    perror("Erro na alocacao de memoria");
-    exit(1);
+// Rectangle r extended by (hx, hy) on each side, clipped to img.
+static struct rect extendRect(struct rect r, int hx, int hy, Image img) {
+  r.x0 = r.x0 - hx > 0 ? r.x0 - hx : 0;
+  r.y0 = r.y0 - hy > 0 ? r.y0 - hy : 0;
+  r.x1 = r.x1 + hx < img->width ? r.x1 + hx : img->width;
+  r.y1 = r.y1 + hy < img->height ? r.y1 + hy : img->height;
+  return r;
+}
+
+// Transform the pixel array through the table (the kernel of the job).
+static void lutJob(void* p, size_t begin, size_t end) {
+  struct stagesArg* a = (struct stagesArg*)p;
+  uint8* pixel = a->src->pixel;
+  const uint8* lut = a->kernel->lut;
+  for (size_t i = begin; i < end; ++i) {
+    pixel[i] = lut[pixel[i]];
   }
+}
 
-  for (int i = 0; i < nWidth; ++i) {
-    integralImage[i] = (int *)malloc(nHeight * sizeof(int));
-    if (integralImage[i] == NULL) {
-      perror("Erro na alocacao de memoria");
-      exit(1);
+// Blur region in of the buffer buf, which holds region b of the image,
+// into region out (inside in), using table: a summed-area table of
+// (in.x1-in.x0+1) x (in.y1-in.y0+1) cells.
+static void blurTile(uint8* buf, struct rect b, struct rect in, struct rect out,
+                     uint64_t* table, int dx, int dy, Image img) {
+  int stride = b.x1 - b.x0;
+  int tw = in.x1 - in.x0 + 1;
+  // Sum of the pixels in [in.x0, x[ x [in.y0, y[
+#define T(x, y) table[(size_t)((y) - in.y0) * tw + ((x) - in.x0)]
+  memset(table, 0, tw * sizeof(uint64_t));  // first row
+  for (int y = in.y0; y < in.y1; y++) {
+    const uint8* row = buf + (size_t)(y - b.y0) * stride;
+    uint64_t rowSum = 0;
+    T(in.x0, y + 1) = 0;
+    for (int x = in.x0; x < in.x1; x++) {
+      rowSum += row[x - b.x0];
+      T(x + 1, y + 1) = T(x + 1, y) + rowSum;
     }
   }
+  for (int Y = out.y0; Y < out.y1; Y++) {
+    // The window, clipped to the image (thus inside in), is [x0, x1[ x [y0, y1[
+    int y0 = Y - dy > 0 ? Y - dy : 0;
+    int y1 = Y + dy < img->height ? Y + dy + 1 : img->height;
+    uint8* row = buf + (size_t)(Y - b.y0) * stride;
+    for (int X = out.x0; X < out.x1; X++) {
+      int x0 = X - dx > 0 ? X - dx : 0;
+      int x1 = X + dx < img->width ? X + dx + 1 : img->width;
+      uint64_t sum = T(x1, y1) - T(x0, y1) - T(x1, y0) + T(x0, y0);
+      double count = (double)(x1 - x0) * (y1 - y0);
+      row[X - b.x0] = meanLevel8(sum, count);
+    }
+  }
+#undef T
+}
 
-  // Calculate the area of the rectangle
-  double area = (2 * dx + 1) * (2 * dy + 1);
-
-  // Calculate the summed area table of the rectangle
-  for (y = 0; y < nHeight; y++) {
-    for (x = 0; x < nWidth; x++) {
-      if (x - dx < 0) {               // x is in the left margin
-        nx = 0;
-      } else if (x - dx >= width) {   // x is in the right margin
-        nx = width - 1;
-      } else {
-        nx = x - dx;
-      }
+// Compute a range of tiles of dst from src.
+static void stagesJob(void* p, size_t begin, size_t end) {
+  struct stagesArg* a = (struct stagesArg*)p;
+  Image src = a->src;
+  for (size_t t = begin; t < end; t++) {
+    struct rect out;
+    out.x0 = (int)(t % a->tilesX) * a->side;
+    out.y0 = (int)(t / a->tilesX) * a->side;
+    out.x1 = out.x0 + a->side < src->width ? out.x0 + a->side : src->width;
+    out.y1 = out.y0 + a->side < src->height ? out.y0 + a->side : src->height;
+
+    // Load the region the whole chain needs
+    struct rect in = extendRect(out, a->kernel[0].haloX, a->kernel[0].haloY, src);
+    int bw = in.x1 - in.x0;
+    int bh = in.y1 - in.y0;
+    uint8* buf = (uint8*)malloc((size_t)bw * bh);
+    uint64_t* table = (uint64_t*)malloc((size_t)(bw + 1) * (bh + 1) * sizeof(uint64_t));
+    if (buf == NULL || table == NULL) {
+      free(buf);
+      free(table);
+      __atomic_store_n(&a->failed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    for (int y = in.y0; y < in.y1; y++) {
+      getRow(src, in.x0, y, bw, buf + (size_t)(y - in.y0) * bw);
+    }
 
-      if (y - dy < 0) {               // y is in the upper margin
-        ny = 0;
-      } else if (y - dy >= height) {  // y is in the lower margin
-        ny = height - 1;
+    // Apply the kernels, on shrinking regions
+    struct rect cur = in;
+    for (int k = 0; k < a->kernels; k++) {
+      const struct kernel* kn = &a->kernel[k];
+      if (kn->blur) {
+        struct rect next = out;
+        if (k + 1 < a->kernels) {
+          next = extendRect(out, kn[1].haloX, kn[1].haloY, src);
+        }
+        blurTile(buf, in, cur, next, table, kn->dx, kn->dy, src);
+        cur = next;
       } else {
-        ny = y - dy;
-      }
-
-      // Get the pixel value
-      pixelVal = ImageGetPixel(img, nx, ny);
-
-      if (x > 0) {
-        pixelVal += integralImage[x - 1][y];
-      }
-      if (y > 0) {
-        pixelVal += integralImage[x][y - 1];
-      }
-      if (x > 0 && y > 0) {
-        pixelVal -= integralImage[x - 1][y - 1];
+        for (int y = cur.y0; y < cur.y1; y++) {
+          uint8* row = buf + (size_t)(y - in.y0) * bw;
+          for (int x = cur.x0; x < cur.x1; x++) {
+            row[x - in.x0] = kn->lut[row[x - in.x0]];
+          }
+        }
       }
+    }
 
-      // Set the pixel value
-      integralImage[x][y] = pixelVal;
+    // Store the tile
+    for (int y = out.y0; y < out.y1; y++) {
+      putRow(a->dst, out.x0, y, out.x1 - out.x0,
+             buf + (size_t)(y - in.y0) * bw + (out.x0 - in.x0));
     }
+    __atomic_add_fetch(&a->memops, (unsigned long)bw * bh +
+                       (unsigned long)(out.x1 - out.x0) * (out.y1 - out.y0),
+                       __ATOMIC_RELAXED);
+    free(buf);
+    free(table);
   }
+}
+
+// Side of the tiles for a chain with the given halo (the largest radius
+// sum), such that the buffer and table of a tile fill about half the L2.
+static int stageTileSide(int halo) {
+  if (stageTile > 0) return stageTile;
+  long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (l2 <= 0) l2 = 256 * 1024;
+  // 1 byte of buffer + 8 bytes of table per pixel of the region
+  long side = 16;
+  while ((side + 1) * (side + 1) * 9 <= l2 / 2) side++;
+  side -= 2 * (long)halo;
+  if (side < 32) side = 32;
+  if (side >= TILE) side &= ~(long)TILE_MASK;  // align to the storage tiles
+  return (int)side;
+}
 
-  // Calculate the integral image of the rectangle
-  for (int Y = 0; Y < height; Y++) {
-    for (int X = 0; X < width; X++) {
-      A = 0, B = 0, C = 0, D = 0, sum = 0;
+/// Apply a chain of n stages to img, in order.
+/// The result is exactly the same as that of calling the operations of
+/// the stages one after the other, but the image is processed in tiles
+/// that fit in the L2 cache (see ImageSetStageTile), in parallel: each
+/// tile goes through the whole chain while it is in cache.  Blurs make
+/// tiles read a halo of neighbouring pixels, which are read again by
+/// the neighbouring tiles (the cost of fusing the blurs).
+/// The image is changed in-place (pixels shared with a clone are copied
+/// first).  With blurs, this needs a new pixel array (then the old one
+/// is freed) and buffers for each tile being processed.
+/// On success, returns nonzero.
+/// On failure, returns 0, img is left unchanged and errno/errCause are set.
+int ImageApplyStages(Image img, const ImageStage* stages, int n) { ///
+  assert (img != NULL);
+  assert (n >= 0);
 
-      if (X > 0 && Y > 0) {
-        A = integralImage[X - 1][Y - 1];
-      }
-      if (X > 0) {
-        B = integralImage[X - 1][Y + rectHeight];
-      }
-      if (Y > 0) {
-        C = integralImage[X + rectWidth][Y - 1];
-      }
-      D = integralImage[X + rectWidth][Y + rectHeight];
+  SCOPE_BEGIN("stages");
+  struct kernel* kernel = (struct kernel*)malloc((n > 0 ? n : 1) * sizeof(struct kernel));
+  if (kernel == NULL) {
+    errCause = "Memory allocation failed";
+    SCOPE_END(img, 0);
+    return 0;
+  }
 
-      sum = A - B - C + D;
-      ImageSetPixel(img, X, Y, (uint8)((sum / area) + 0.5));
-      InstrCount[1] += 1;
+  // Compile the chain
+  int kernels = 0;
+  for (int i = 0; i < n; i++) {
+    const ImageStage* s = &stages[i];
+    if (s->op == STAGE_BLUR) {
+      assert (s->dx >= 0 && s->dy >= 0);
+      kernel[kernels].blur = 1;
+      kernel[kernels].dx = s->dx;
+      kernel[kernels].dy = s->dy;
+      kernels++;
+      continue;
+    }
+    assert (s->op == STAGE_NEGATIVE || s->op == STAGE_THRESHOLD ||
+            s->op == STAGE_BRIGHTEN);
+    if (kernels == 0 || kernel[kernels-1].blur) {  // start a new table
+      struct kernel* kn = &kernel[kernels++];
+      kn->blur = 0;
+      kn->dx = kn->dy = 0;
+      for (int v = 0; v < 256; v++) kn->lut[v] = (uint8)v;
+    }
+    uint8* lut = kernel[kernels-1].lut;
+    for (int v = 0; v < 256; v++) {
+      if (s->op == STAGE_NEGATIVE) lut[v] = negativeLevel8(lut[v], img->maxval);
+      else if (s->op == STAGE_THRESHOLD) lut[v] = thresholdLevel8(lut[v], s->thr, img->maxval);
+      else lut[v] = brightenLevel8(lut[v], s->factor, img->maxval);
     }
   }
-  
-  InstrPrint();
+  int haloX = 0;
+  int haloY = 0;
+  for (int k = kernels - 1; k >= 0; k--) {
+    if (kernel[k].blur) {
+      haloX += kernel[k].dx;
+      haloY += kernel[k].dy;
+    }
+    kernel[k].haloX = haloX;
+    kernel[k].haloY = haloY;
+  }
 
-  // Free allocated memory
-  for (int i = 0; i < nHeight; ++i) {
-    free(integralImage[i]);
+  struct stagesArg a = { img, img, kernel, kernels };
+  size_t pixels = (size_t)img->width * img->height;
+  int ok = 1;
+  if (kernels == 0 || pixels == 0) {
+    // Nothing to do
+  } else if (kernels == 1 && !kernel[0].blur) {
+    // A single pixel transformation
+    ok = unshare(img);  // copy-on-write
+    if (ok) {
+      size_t size = storageSize(img->width, img->height, img->layout);
+      PoolRunIf(size, size, 1 << 16, lutJob, &a);
+      COUNT(PIXMEM, 2ul * pixels);  // count pixel reads and stores
+    }
+  } else {
+    a.dst = ImageCreateLayout(img->width, img->height, img->maxval, img->layout);
+    ok = a.dst != NULL;
+    if (ok) {
+      a.side = stageTileSide(haloX > haloY ? haloX : haloY);
+      a.tilesX = (img->width + a.side - 1) / a.side;
+      size_t tilesY = (img->height + a.side - 1) / a.side;
+      PoolRunIf(pixels, a.tilesX * tilesY, 1, stagesJob, &a);
+      ok = !a.failed;
+      if (!ok) {
+        errno = ENOMEM;
+        errCause = "Memory allocation failed";
+      }
+    }
+    if (ok && img->mapped > 0 && !img->readonly &&
+        __atomic_load_n(img->refs, __ATOMIC_ACQUIRE) == 1) {
+      // Keep the pixels in the shared memory object img is mapped from
+      copyRect(img, 0, 0, a.dst, 0, 0, img->width, img->height);
+    } else if (ok) {
+      // Adopt the new pixel array (and drop the old one, with a.dst)
+      struct image t = *img;
+      img->pixel = a.dst->pixel;
+      img->refs = a.dst->refs;
+      img->mapped = a.dst->mapped;
+      img->readonly = a.dst->readonly;
+      a.dst->pixel = t.pixel;
+      a.dst->refs = t.refs;
+      a.dst->mapped = t.mapped;
+      a.dst->readonly = t.readonly;
+    }
+    ImageDestroy(&a.dst);
+    COUNT(PIXMEM, a.memops);
+    for (int k = 0; ok && k < kernels; k++) {
+      if (kernel[k].blur) COUNT(InstrCount[1], pixels);  // as ImageBlur
+    }
   }
-  free(integralImage);
-  integralImage = NULL;
+  free(kernel);
+  SCOPE_END(img, ok ? 2 * pixels : 0);
+  return ok;
 }
@@ -13,6 +13,8 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include "instrumentation.h"
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -23,6 +25,13 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Pixel storage layouts (see ImageCreateLayout)
+enum {
+  IMAGE_RASTER = 0,  // raster scan: left to right, top to bottom
+  IMAGE_TILED = 1,   // 64x64 tiles, each stored in raster order
+  IMAGE_ZORDER = 2,  // 64x64 tiles, each stored in Z-order (Morton order)
+};
+
 /// Error handling functions
 
 /// Error cause.
@@ -35,10 +44,71 @@ typedef struct image *Image;
 /// the previous error cause).  It is not meant to be used in that situation!
 char* ImageErrMsg() ;
 
+/// Instrumentation levels
+/// The level is chosen at compile time, by defining IMAGE_INSTR_LEVEL
+/// (with -DIMAGE_INSTR_LEVEL=0, for instance) when compiling image8bit.c:
+///   IMAGE_INSTR_OFF: counters are compiled out (for production builds).
+///   IMAGE_INSTR_BULK: operations count pixel accesses in bulk, per row or
+///     per band of rows, not in their inner loops (the default).
+///   IMAGE_INSTR_PIXEL: ImageGetPixel and ImageSetPixel also count each
+///     access (for teaching and analysis builds).
+#define IMAGE_INSTR_OFF 0
+#define IMAGE_INSTR_BULK 1
+#define IMAGE_INSTR_PIXEL 2
+
+#ifndef IMAGE_INSTR_LEVEL
+#define IMAGE_INSTR_LEVEL IMAGE_INSTR_BULK
+#endif
+
+/// Unless instrumentation is off, each operation on whole images (load,
+/// save, stats, negative, ..., locate, blur) is measured in an
+/// instrumentation scope of its own, named after it (see InstrBegin).
+/// Operations never reset or print the instrumentation counters.
+
+/// Metrics of one operation, passed to the metrics hook
+typedef struct {
+  const char* op;      // operation name: "load", "blur", ... (as its scope)
+  int width, height;   // size of the image produced, modified or searched
+                       // (0x0 if the operation failed to produce it)
+  size_t bytes;        // number of pixel bytes read and written
+  InstrSample sample;  // wall and cpu times, counters (see InstrEndSample)
+} ImageMetrics;
+
+/// Function called with the metrics of each operation, and an argument.
+typedef void (*ImageMetricsHook)(const ImageMetrics* metrics, void* arg);
+
+/// Set the function called with the metrics of each operation, when it
+/// ends (NULL for none, the default).  Embedding programs may use it to
+/// forward the metrics to their own monitoring.
+/// The hook is called in the thread that called the operation, so it
+/// must be thread safe if several threads call operations.  It must not
+/// call image operations itself.  Set it before starting any operation.
+/// Nothing is reported if instrumentation is off (IMAGE_INSTR_OFF).
+void ImageSetMetricsHook(ImageMetricsHook hook, void* arg) ;
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of counters.
+/// (Instrumentation is calibrated only if and when calibrated times are shown.)
 void ImageInit(void) ;
 
+/// Parallel execution
+
+/// Bulk operations (pixel transformations, geometric transformations,
+/// paste, blend, stats, blur and locate) split their work into bands of
+/// rows that are processed by a pool of worker threads.
+
+/// Set the number of threads used by image operations.
+/// n <= 1 means serial execution.
+/// The default comes from the IMAGE_THREADS environment variable, or is
+/// the number of processors if that is not set.
+void ImageSetThreads(int n) ;
+
+/// Set the minimum number of pixels for an operation to run in parallel.
+/// Smaller operations run serially in the calling thread.
+/// This sets the minimum work of the threadpool module (PoolSetMinWork),
+/// so it applies to all the modules that run operations in the pool.
+void ImageSetParallelThreshold(size_t pixels) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -51,6 +121,18 @@ void ImageInit(void) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Create a new black image with a given pixel layout.
+///   width, height, maxval : as in ImageCreate.
+///   layout: how pixels are stored: IMAGE_RASTER, IMAGE_TILED or IMAGE_ZORDER.
+/// The layout is transparent to clients: every operation accepts images
+/// of any layout, but 2D-local operations run faster on tiled layouts.
+/// Images created from other images (ImageRotate, ...) keep their layout.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateLayout(int width, int height, uint8 maxval, int layout) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -58,21 +140,217 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Convert an image to another pixel layout.
+/// Returns a copy of img whose pixels are stored with the given layout.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageConvertLayout(Image img, int layout) ;
+
+/// Clone an image.
+/// Returns a new image with the same size, maxval and pixels as img.
+/// The clone shares the pixel array with img: no pixels are copied until
+/// either of them is modified (copy-on-write).
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) ;
+
+/// Unshare an image.
+/// Give img a private copy of its pixel array if it is shared with clones.
+/// Modifying operations do this implicitly; call it explicitly to know
+/// in advance that they will not need to allocate memory.
+/// On success, returns nonzero.
+/// On failure, returns 0, img is left untouched and errno/errCause are set.
+int ImageUnshare(Image img) ;
+
+/// Shared memory images
+
+/// Images may be kept in POSIX shared memory objects, to hand them over
+/// to other processes with no copying.  Each object holds a small header,
+/// with the size and maxval, followed by the pixels, as a raster scan.
+/// These are ordinary images otherwise: every operation accepts them,
+/// and ImageDestroy unmaps them (but the object remains, until unlinked).
+/// Processes must agree on how to synchronize their accesses to the pixels.
+
+/// Create a new black image in shared memory.
+///   name : name of the POSIX shared memory object (as in shm_open, but
+///          the leading / is optional).
+///   width, height, maxval : as in ImageCreate.
+/// A shared memory object with that name is replaced: processes that have
+/// it open keep the old one.
+/// The image has raster layout, and its pixels are modified in place.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreateShared(const char* name, int width, int height, uint8 maxval) ;
+
+/// Open an image in shared memory, created by ImageCreateShared (usually
+/// by another process).
+///   name : as in ImageCreateShared.
+/// The pixels are mapped read-only, never copied: operations that modify
+/// the image copy them first, as for a clone (copy-on-write).  But changes
+/// by the creator of the shared image are seen through it.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageOpenShared(const char* name) ;
+
+/// Remove the name of a shared memory image.
+/// Processes that have it open may still use it; it is freed when the
+/// last one destroys its image.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageUnlinkShared(const char* name) ;
+
 /// PGM file operations
 
-/// Load a raw PGM file.
+/// Load a PGM file, raw (P5) or plain (P2).
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a PGM file into an image with the given pixel layout.
+/// Pixels are converted from the raster scan in the file while reading.
+/// Otherwise, as ImageLoad.
+Image ImageLoadLayout(const char* filename, int layout) ;
+
 /// Save image to PGM file.
+/// Pixels are always written as a raster scan, whatever the layout of img.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Save image to a plain PGM file (P2), with levels in decimal ASCII.
+/// Otherwise, as ImageSave.
+int ImageSavePlain(Image img, const char* filename) ;
+
+/// PGM streams
+
+// Type ImageStream is a pointer to stream objects: sequences of raw PGM
+// images (frames), one right after the other, read from or written to a
+// file, a FIFO or a pipe, sequentially
+typedef struct imageStream *ImageStream;
+
+/// Open a stream of PGM images for reading, from file filename
+/// (a regular file, a FIFO, ...) or from stdin if filename is "-".
+///
+/// On success, a new stream is returned.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamOpenRead(const char* filename) ;
+
+/// Open a stream of PGM images for writing, to file filename
+/// (a regular file, a FIFO, ...) or to stdout if filename is "-".
+/// Otherwise, as ImageStreamOpenRead.
+ImageStream ImageStreamOpenWrite(const char* filename) ;
+
+/// Close the stream pointed to by (*sp) (but not stdin or stdout, which
+/// are just flushed).
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+/// On success, returns nonzero.
+/// On failure (if buffered frames cannot be written), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageStreamClose(ImageStream* sp) ;
+
+/// Read the next frame of stream s into (*imgp).
+/// If (*imgp) is an image of the size and maxval of the frame, whose
+/// pixels are not shared (nor read-only), the frame is read into its
+/// pixel array, with no allocation.  Otherwise, (*imgp) is destroyed (if
+/// not NULL) and replaced by a new image, with raster layout.  So, to
+/// read frames with no allocations, keep passing the same image.
+/// Returns 1 if a frame was read, 0 at the end of the stream, and -1 on
+/// failure (then errno/errCause are set, and (*imgp) may be NULL).
+int ImageStreamRead(ImageStream s, Image* imgp) ;
+
+/// Write img as the next frame of stream s.
+/// The stream is flushed after each frame, so that readers at the other
+/// end of a pipe get it right away.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageStreamWrite(ImageStream s, Image img) ;
+
+/// Compressed tiled files and virtual images
+
+// Type VImage is a pointer to virtual image objects: images in compressed
+// tiled files, read on demand (see VImageOpen)
+typedef struct vimage *VImage;
+
+/// Save image to a compressed tiled file.
+///   side : side of the tiles, in pixels (0 for the default, 256).
+/// Requires: 0 <= side <= 32768.
+/// Each tile is compressed on its own (lossless), so that a virtual
+/// image (see VImageOpen) can read parts of the image without the rest.
+/// Tiles are compressed in parallel, a row of tiles at a time.
+/// On success, returns nonzero.
+/// On failure (also if the image would have more than INT_MAX tiles),
+/// returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveCompressed(Image img, const char* filename, int side) ;
+
+/// Open a compressed tiled file (see ImageSaveCompressed) as a virtual
+/// image: its pixels are read and decoded on demand, a tile at a time,
+/// and decoded tiles are kept in a cache of (about) cacheBytes bytes,
+/// at least one tile.  So parts of very large images may be read using
+/// memory proportional to those parts only.
+/// A virtual image must not be used by several threads at once.
+///
+/// On success, a new virtual image is returned.
+/// (The caller is responsible for closing the returned virtual image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+VImage VImageOpen(const char* filename, size_t cacheBytes) ;
+
+/// Close the virtual image pointed to by (*vp), and free its cache.
+/// If (*vp)==NULL, no operation is performed.
+/// Ensures: (*vp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void VImageClose(VImage* vp) ;
+
+/// Get the width, height and maximum gray level of a virtual image.
+int VImageWidth(VImage v) ;
+int VImageHeight(VImage v) ;
+int VImageMaxval(VImage v) ;
+
+/// Get the number of tiles found in the cache (hits) and read from the
+/// file (misses), since the virtual image was opened.
+void VImageCacheStats(VImage v, unsigned long* hits, unsigned long* misses) ;
+
+/// Get the pixel level at (x, y) of a virtual image.
+/// Requires: (x, y) must be a valid position of v.
+/// Returns the level, or -1 on failure (if its tile cannot be read),
+/// with errno/errCause set.
+int VImageGetPixel(VImage v, int x, int y) ;
+
+/// Crop a rectangular subimage from a virtual image, as ImageCrop.
+/// Only the tiles that overlap the rectangle are read (unless cached).
+/// Requires: the rectangle must be inside the virtual image.
+///
+/// On success, a new image is returned, with raster layout.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image VImageCrop(VImage v, int x, int y, int w, int h) ;
+
+/// Locate a subimage inside a virtual image, as ImageLocateSubImage.
+/// The virtual image is searched in strips of rows, of the height of a
+/// tile plus that of img2 (minus 1), decoded into an ordinary image:
+/// only one strip is in memory at a time, so the search needs at most
+/// width x (tile side + img2 height) bytes, besides the tile cache.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure (if some strip cannot be read), returns -1, with
+/// errno/errCause set.
+int VImageLocateSubImage(VImage v, int* px, int* py, Image img2) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -86,6 +364,9 @@ int ImageHeight(Image img) ;
 /// Get image maximum gray level
 int ImageMaxval(Image img) ;
 
+/// Get image pixel layout (IMAGE_RASTER, IMAGE_TILED or IMAGE_ZORDER)
+int ImageLayout(Image img) ;
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
@@ -110,14 +391,25 @@ int ImageValidRect(Image img, int x, int y, int w, int h) ;
 uint8 ImageGetPixel(Image img, int x, int y) ;
 
 /// Set the pixel at position (x,y) to new level.
+/// If img shares its pixels with a clone, they are copied first.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Get the n pixels of row y starting at column x into array buf, or set
+/// them from it, whatever the layout of img (as a raster scan would).
+/// Requires: the row segment (x,y,n,1) must be inside img.
+/// ImageSetRow copies the pixels of img first, if it shares them with a
+/// clone (and leaves img unchanged if that copy cannot be allocated).
+void ImageGetRow(Image img, int x, int y, int n, uint8* buf) ;
+void ImageSetRow(Image img, int x, int y, int n, const uint8* buf) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// unless the pixels are shared with a clone and must be copied first.
+/// They never fail, except if that copy cannot be allocated: then the
+/// image is left unchanged and errno/errCause are set accordingly.
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
@@ -182,13 +474,13 @@ Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (unless shared).
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place: no allocation involved (unless shared).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
@@ -196,7 +488,8 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
-/// Returns 0, otherwise.
+/// Returns 0, otherwise (including if img2 does not fit in img1 at (x, y)).
+/// Requires: (x, y) must be a valid position of img1.
 int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 
 /// Locate a subimage inside another image.
@@ -205,12 +498,192 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Temporal operations
+
+/// These functions combine an image with another one of the same size,
+/// usually the next frame of a stream (see ImageStreamRead), to detect
+/// changes or to accumulate statistics over time.
+/// They modify img1 in-place: no allocation involved (unless shared, as
+/// for the pixel transformations), and img2 is not modified.
+/// Requires: img1 and img2 must have the same size.
+
+/// Frame difference: set each pixel of img1 to the absolute difference
+/// between it and the pixel of img2 at the same position.
+void ImageDifference(Image img1, Image img2) ;
+
+/// Exponential running average: set each pixel of img1 to
+/// (1-alpha)*img1 + alpha*img2, rounded, where alpha is in [0.0, 1.0].
+/// alpha is rounded to a multiple of 1/256 (so that the average is
+/// computed with 16-bit integers, in vectors).  Note that, with 8-bit
+/// levels, the average stops moving when alpha times its difference to
+/// the new frames is below 1/2.
+void ImageRunningAverage(Image img1, Image img2, double alpha) ;
+
+/// Running minimum and maximum: set each pixel of img1 to the minimum
+/// (maximum) of it and the pixel of img2 at the same position.
+void ImageRunningMin(Image img1, Image img2) ;
+void ImageRunningMax(Image img1, Image img2) ;
+
+/// Integral images
+
+/// An integral image (summed-area table) of an image holds, for each
+/// position (x,y), the sum of the pixels in [0, x[ x [0, y[, and the sum
+/// of their squares.  The sum, mean or variance of the pixels of any
+/// rectangle is then computed in constant time, from the sums at its 4
+/// corners.  It is a snapshot: later changes to the image do not change it.
+
+// Type ImageIntegral is a pointer to integral image objects
+typedef struct imageIntegral *ImageIntegral;
+
+/// Create the integral image of img.
+/// The tables are built in parallel (see ImageSetThreads), in two passes.
+/// Needs 16 bytes per pixel.
+/// On success, a new integral image is returned.
+/// (The caller is responsible for destroying the returned integral image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIntegral ImageIntegralCreate(Image img) ;
+
+/// Destroy the integral image pointed to by (*iip).
+/// If (*iip)==NULL, no operation is performed.
+/// Ensures: (*iip)==NULL.
+void ImageIntegralDestroy(ImageIntegral* iip) ;
+
+/// Get the width and height of the image of ii.
+int ImageIntegralWidth(ImageIntegral ii) ;
+int ImageIntegralHeight(ImageIntegral ii) ;
+
+/// Get the tables of ii: (width+1) x (height+1) 64-bit sums, contiguous
+/// and row-major, with the sum for (x,y) at index y*(width+1)+x (so the
+/// first row and column are zeros).  Sums never overflow.
+const uint64_t* ImageIntegralSums(ImageIntegral ii) ;
+const uint64_t* ImageIntegralSquares(ImageIntegral ii) ;
+
+/// Rectangle statistics, in constant time.
+/// Requires: the rectangle (x,y,w,h) must be inside the image of ii
+/// (and, for mean and variance, not empty).
+/// They never fail.
+
+/// Sum of the pixels of the rectangle.
+uint64_t ImageRectSum(ImageIntegral ii, int x, int y, int w, int h) ;
+
+/// Mean of the pixels of the rectangle.
+double ImageRectMean(ImageIntegral ii, int x, int y, int w, int h) ;
+
+/// Variance of the pixels of the rectangle (the population variance: the
+/// mean of their squares minus the square of their mean, computed exactly
+/// in integers before the final division).
+double ImageRectVariance(ImageIntegral ii, int x, int y, int w, int h) ;
+
+/// Connected components
+
+/// The connected components of an image are the maximal sets of nonzero
+/// pixels (for instance, the white pixels after ImageThreshold) that are
+/// connected through neighbouring nonzero pixels: the 4 pixels that share
+/// a side with each one (4-connectivity), or also the 4 that share a
+/// corner (8-connectivity).  Labeling them gives each pixel the number of
+/// its component (its label), and each component its area and bounding
+/// box.  Like integral images, the result is a snapshot of the image.
+
+/// A connected component
+typedef struct {
+  int x, y;           // top left corner of the bounding box
+  int width, height;  // size of the bounding box
+  uint64_t area;      // number of pixels
+} ImageComponent;
+
+// Type ImageComponents is a pointer to labelings of connected components
+typedef struct imageComponents *ImageComponents;
+
+/// Label the connected components of the nonzero pixels of img, with the
+/// given connectivity (4 or 8).
+/// Components are numbered from 1, in the raster order of their first
+/// pixel (the topmost, then leftmost); zero pixels get label 0.
+/// Labeling runs in parallel (see ImageSetThreads), in bands of rows.
+/// Needs 4 bytes per pixel for the labels, 24 bytes per component, and 16
+/// bytes per run of nonzero pixels of a row while labeling.
+/// On success, a new labeling is returned.
+/// (The caller is responsible for destroying the returned labeling!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageComponents ImageLabelComponents(Image img, int connectivity) ;
+
+/// Destroy the labeling pointed to by (*cp).
+/// If (*cp)==NULL, no operation is performed.
+/// Ensures: (*cp)==NULL.
+void ImageComponentsDestroy(ImageComponents* cp) ;
+
+/// Get the width and height of the image of c.
+int ImageComponentsWidth(ImageComponents c) ;
+int ImageComponentsHeight(ImageComponents c) ;
+
+/// Get the number of components of c.
+size_t ImageComponentsCount(ImageComponents c) ;
+
+/// Get the label image of c: width x height labels, contiguous and
+/// row-major, with the label of (x,y) at index y*width+x.
+const uint32_t* ImageComponentsLabels(ImageComponents c) ;
+
+/// Get the component table of c: count components, with that of label l
+/// at index l-1.
+const ImageComponent* ImageComponentsTable(ImageComponents c) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// The image is changed in-place (pixels shared with a clone are copied first).
+/// Needs a temporary table of 8 bytes per pixel: if it cannot be allocated,
+/// img is left unchanged and errno/errCause are set accordingly.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Blur an image, as ImageBlur, with the sums of an existing integral
+/// image of it (so that several blurs of the same image, or a blur and
+/// rectangle statistics, share one table).
+/// Requires: ii must be the integral image of img as it is now (at least,
+/// of an image of the same size, whose blur is then written into img).
+/// Needs no table: it only fails if the pixels of img are shared with a
+/// clone and cannot be copied (then, errno/errCause are set).
+void ImageBlurIntegral(Image img, ImageIntegral ii, int dx, int dy) ;
+
+/// Fused pipelines
+
+/// A chain of in-place operations (pixel transformations and blurs) may
+/// be applied in a single pass over the image, instead of one pass per
+/// operation: see ImageApplyStages.
+
+// Operations that may be fused
+enum {
+  STAGE_NEGATIVE,   // ImageNegative(img)
+  STAGE_THRESHOLD,  // ImageThreshold(img, thr)
+  STAGE_BRIGHTEN,   // ImageBrighten(img, factor)
+  STAGE_BLUR,       // ImageBlur(img, dx, dy)
+};
+
+// A stage of a chain: an operation and its arguments
+typedef struct {
+  int op;           // STAGE_NEGATIVE, ...
+  uint8 thr;        // for STAGE_THRESHOLD
+  double factor;    // for STAGE_BRIGHTEN
+  int dx, dy;       // for STAGE_BLUR (non-negative)
+} ImageStage;
+
+/// Apply a chain of n stages to img, in order.
+/// The result is exactly the same as that of calling the operations of
+/// the stages one after the other, but the image is processed in tiles
+/// that fit in the L2 cache (see ImageSetStageTile), in parallel: each
+/// tile goes through the whole chain while it is in cache.  Blurs make
+/// tiles read a halo of neighbouring pixels, which are read again by
+/// the neighbouring tiles (the cost of fusing the blurs).
+/// The image is changed in-place (pixels shared with a clone are copied
+/// first).  With blurs, this needs a new pixel array (then the old one
+/// is freed) and buffers for each tile being processed.
+/// On success, returns nonzero.
+/// On failure, returns 0, img is left unchanged and errno/errCause are set.
+int ImageApplyStages(Image img, const ImageStage* stages, int n) ;
+
+/// Set the side of the tiles of ImageApplyStages, in pixels.
+/// 0 (the default) chooses it so that the buffers of a tile fit in the
+/// L2 cache.  Other values are meant for testing and tuning.
+void ImageSetStageTile(int side) ;
+
 #endif
@@ -0,0 +1,603 @@
+// imageBench - Benchmark the operations of the image8bit module.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+//
+// It generates synthetic images of several sizes, runs every operation of
+// the module on them, and reports the median and 95th percentile of the
+// wall-clock times, and the throughput in MB/s (of pixel bytes processed).
+// Results may be saved as a baseline, and later runs compared to it.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image8bit.h"
+#include "image1bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [OPTION...]\n"
+    "  Benchmark the operations of the image8bit module on synthetic images.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --sizes N,...     Image sizes, for NxN images (default 256,1024,4096,16384)\n"
+    "  --kinds K,...     Image kinds (default noise,gradient,flat,worst):\n"
+    "                    noise: random levels; gradient: smooth ramps;\n"
+    "                    flat: a single level (best case for locate);\n"
+    "                    worst: worst case for locate (only locate and match)\n"
+    "  --layouts L,...   Pixel layouts: raster, tiled, zorder (default raster)\n"
+    "  --ops OP,...      Run only these operations (default all)\n"
+    "  --reps N          Timed repetitions of each case (default 5)\n"
+    "  --warmup N        Untimed repetitions before those (default 1)\n"
+    "  --max-time S      Stop repeating a case after S seconds (default 2)\n"
+    "  --budget N        Skip cases that compare more than N pixels (default 1e9)\n"
+    "  --save FILE       Save the results as a baseline\n"
+    "  --compare FILE    Compare the results with a baseline\n"
+    "  --threshold P     Flag regressions of more than P percent (default 10)\n"
+    "\n"
+    "  Exits with status 1 if any regression is flagged.\n"
+    ;
+
+// Options
+static int sizes[16] = { 256, 1024, 4096, 16384 };
+static int nsizes = 4;
+static const char* kinds = "noise,gradient,flat,worst";
+static const char* layouts = "raster";
+static const char* ops = NULL;
+static int reps = 5;
+static int warmup = 1;
+static double maxTime = 2.0;
+static double budget = 1e9;
+static double threshold = 10.0;
+
+// Check if name is in the comma-separated list.
+static int inList(const char* list, const char* name) {
+  size_t len = strlen(name);
+  for (const char* p = list; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) return 1;
+  }
+  return 0;
+}
+
+
+// Synthetic images
+
+// A simple pseudo-random generator (xorshift), for reproducible images.
+static uint32_t rng = 2463534242u;
+
+static uint32_t nextRandom(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+// Create an n x n image of the given kind, in the given layout.
+static Image makeImage(const char* kind, int n, int layout) {
+  Image img = ImageCreate(n, n, PixMax);
+  if (img == NULL) return NULL;
+  if (strcmp(kind, "noise") == 0) {
+    for (int y = 0; y < n; y++)
+      for (int x = 0; x < n; x++)
+        ImageSetPixel(img, x, y, (uint8)(nextRandom() >> 24));
+  } else if (strcmp(kind, "gradient") == 0) {
+    for (int y = 0; y < n; y++)
+      for (int x = 0; x < n; x++)
+        ImageSetPixel(img, x, y, (uint8)((x + y) * 255L / (2L * n)));
+  }
+  // flat and worst images are all black
+  if (layout != IMAGE_RASTER) {
+    Image converted = ImageConvertLayout(img, layout);
+    ImageDestroy(&img);
+    img = converted;
+  }
+  return img;
+}
+
+// Create the t x t template to search in img.
+// Normally, it is the bottom right corner of img, found at the last position.
+// For worst images, it is black but for the last pixel, so it is not found,
+// and every position is compared up to the last pixel.
+static Image makeTemplate(Image img, const char* kind, int t) {
+  int n = ImageWidth(img);
+  Image tmpl = ImageCrop(img, n - t, n - t, t, t);
+  if (tmpl != NULL && strcmp(kind, "worst") == 0) {
+    ImageSetPixel(tmpl, t - 1, t - 1, 1);
+  }
+  return tmpl;
+}
+
+
+// Benchmark cases
+
+// State of a case: the source image and the images used by the operation
+struct bench {
+  const char* kind;
+  int layout;
+  Image img;       // source image (not modified)
+  Image work;      // copy of img, for operations that modify it
+  Image small;     // a smaller image, to paste, blend or search
+                   // (or the threshold of img, to label)
+  Image result;    // image produced by the operation
+  ImageIntegral integral;  // integral image of img, for rectangle queries
+  Image1 mask, mask2;      // binary images thresholded from img
+  const char* tmpfile;
+  const char* plainfile;  // the same, as a plain PGM file
+  int param;       // radius for blur, template size for locate
+  size_t bytes;    // pixel bytes processed, when not reported by the module
+};
+
+static volatile unsigned sink;  // keeps results of loops that only read
+
+static int runCreate(struct bench* b) {
+  b->result = ImageCreateLayout(ImageWidth(b->img), ImageHeight(b->img), PixMax, b->layout);
+  b->bytes = (size_t)ImageWidth(b->img) * ImageHeight(b->img);
+  return b->result != NULL;
+}
+static int runLoad(struct bench* b) {
+  b->result = ImageLoadLayout(b->tmpfile, b->layout);
+  return b->result != NULL;
+}
+static int runSave(struct bench* b) {
+  return ImageSave(b->img, b->tmpfile);
+}
+static int runLoadPlain(struct bench* b) {
+  b->result = ImageLoadLayout(b->plainfile, b->layout);
+  return b->result != NULL;
+}
+static int runSavePlain(struct bench* b) {
+  return ImageSavePlain(b->img, b->plainfile);
+}
+static int runClone(struct bench* b) {
+  b->result = ImageClone(b->img);
+  b->bytes = 2 * (size_t)ImageWidth(b->img) * ImageHeight(b->img);
+  return b->result != NULL && ImageUnshare(b->result);
+}
+static int runConvert(struct bench* b) {
+  b->result = ImageConvertLayout(b->img, b->layout == IMAGE_RASTER ? IMAGE_TILED : IMAGE_RASTER);
+  return b->result != NULL;
+}
+static int runStats(struct bench* b) {
+  uint8 min, max;
+  ImageStats(b->img, &min, &max);
+  sink = min + max;
+  return 1;
+}
+static int runGetPixel(struct bench* b) {
+  int w = ImageWidth(b->img);
+  int h = ImageHeight(b->img);
+  unsigned sum = 0;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      sum += ImageGetPixel(b->img, x, y);
+  sink = sum;
+  b->bytes = (size_t)w * h;
+  return 1;
+}
+static int runSetPixel(struct bench* b) {
+  int w = ImageWidth(b->work);
+  int h = ImageHeight(b->work);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(b->work, x, y, (uint8)(x ^ y));
+  b->bytes = (size_t)w * h;
+  return 1;
+}
+static int runNegative(struct bench* b) {
+  ImageNegative(b->work);
+  return errno != ENOMEM;
+}
+static int runThreshold(struct bench* b) {
+  ImageThreshold(b->work, 128);
+  return errno != ENOMEM;
+}
+static int runBrighten(struct bench* b) {
+  ImageBrighten(b->work, 1.1);
+  return errno != ENOMEM;
+}
+static int runRotate(struct bench* b) {
+  b->result = ImageRotate(b->img);
+  return b->result != NULL;
+}
+static int runMirror(struct bench* b) {
+  b->result = ImageMirror(b->img);
+  return b->result != NULL;
+}
+static int runCrop(struct bench* b) {
+  int n = ImageWidth(b->img);
+  b->result = ImageCrop(b->img, n / 4, n / 4, n / 2, n / 2);
+  return b->result != NULL;
+}
+static int runPaste(struct bench* b) {
+  int n = ImageWidth(b->work);
+  ImagePaste(b->work, n / 4, n / 4, b->small);
+  return 1;
+}
+static int runBlend(struct bench* b) {
+  int n = ImageWidth(b->work);
+  ImageBlend(b->work, n / 4, n / 4, b->small, 0.5);
+  return 1;
+}
+static int runMatch(struct bench* b) {
+  int n = ImageWidth(b->img);
+  int t = ImageWidth(b->small);
+  sink = ImageMatchSubImage(b->img, n - t, n - t, b->small);
+  b->bytes = 2 * (size_t)t * t;  // at most (match has no scope)
+  return 1;
+}
+static int runLocate(struct bench* b) {
+  int x, y;
+  sink = ImageLocateSubImage(b->img, &x, &y, b->small);
+  return 1;
+}
+static int runIntegral(struct bench* b) {
+  ImageIntegral ii = ImageIntegralCreate(b->img);
+  ImageIntegralDestroy(&ii);
+  return errno != ENOMEM;
+}
+// Queries of RECTS rectangles of side param, at scattered positions
+#define RECTS 10000
+static int runRectStats(struct bench* b) {
+  int n = ImageWidth(b->img);
+  int t = b->param < n ? b->param : n;
+  double sum = 0.0;
+  for (int i = 0; i < RECTS && t > 0; i++) {
+    int x = (int)((i * 7919u) % (unsigned)(n - t + 1));
+    int y = (int)((i * 104729u) % (unsigned)(n - t + 1));
+    sum += ImageRectMean(b->integral, x, y, t, t) + ImageRectVariance(b->integral, x, y, t, t);
+  }
+  sink = (unsigned)sum;
+  b->bytes = (size_t)RECTS * t * t;  // the pixels a scan of each rectangle would read
+  return 1;
+}
+static int runToBinary(struct bench* b) {
+  Image1 mask = ImageThresholdToBinary(b->img, 128);
+  Image1Destroy(&mask);
+  b->bytes = (size_t)ImageWidth(b->img) * ImageHeight(b->img);
+  return errno != ENOMEM;
+}
+static int runBinaryAnd(struct bench* b) {
+  Image1And(b->mask, b->mask2);
+  b->bytes = 2 * (((size_t)Image1Width(b->mask) + 63) / 64 * 8) * Image1Height(b->mask);
+  return 1;
+}
+static int runLabel(struct bench* b) {
+  ImageComponents comps = ImageLabelComponents(b->small, b->param);
+  if (comps == NULL) return 0;
+  sink = (unsigned)ImageComponentsCount(comps);
+  ImageComponentsDestroy(&comps);
+  return 1;
+}
+static int runBlur(struct bench* b) {
+  ImageBlur(b->work, b->param, b->param);
+  return errno != ENOMEM;
+}
+
+// What an operation needs, besides the source image
+enum { USE_NONE = 0, USE_WORK = 1, USE_HALF = 2, USE_TEMPLATE = 4, USE_FILE = 8,
+       USE_PLAIN = 16, USE_INTEGRAL = 32, USE_BINARY = 64,
+       USE_THRESHOLD = 128 };
+
+static const struct op {
+  const char* name;
+  int (*run)(struct bench*);  // returns 0 on failure
+  int needs;
+  int param;
+} OPS[] = {
+  { "create", runCreate, USE_NONE, 0 },
+  { "load", runLoad, USE_FILE, 0 },
+  { "save", runSave, USE_FILE, 0 },
+  { "loadplain", runLoadPlain, USE_PLAIN, 0 },
+  { "saveplain", runSavePlain, USE_PLAIN, 0 },
+  { "clone", runClone, USE_NONE, 0 },
+  { "convert", runConvert, USE_NONE, 0 },
+  { "stats", runStats, USE_NONE, 0 },
+  { "getpixel", runGetPixel, USE_NONE, 0 },
+  { "setpixel", runSetPixel, USE_WORK, 0 },
+  { "negative", runNegative, USE_WORK, 0 },
+  { "threshold", runThreshold, USE_WORK, 0 },
+  { "brighten", runBrighten, USE_WORK, 0 },
+  { "rotate", runRotate, USE_NONE, 0 },
+  { "mirror", runMirror, USE_NONE, 0 },
+  { "crop", runCrop, USE_NONE, 0 },
+  { "paste", runPaste, USE_WORK | USE_HALF, 0 },
+  { "blend", runBlend, USE_WORK | USE_HALF, 0 },
+  { "match", runMatch, USE_TEMPLATE, 32 },
+  { "locate", runLocate, USE_TEMPLATE, 8 },
+  { "locate", runLocate, USE_TEMPLATE, 32 },
+  { "locate", runLocate, USE_TEMPLATE, 128 },
+  { "blur", runBlur, USE_WORK, 1 },
+  { "blur", runBlur, USE_WORK, 4 },
+  { "blur", runBlur, USE_WORK, 16 },
+  { "integral", runIntegral, USE_NONE, 0 },
+  { "rectstats", runRectStats, USE_INTEGRAL, 32 },
+  { "tobinary", runToBinary, USE_NONE, 0 },
+  { "binaryand", runBinaryAnd, USE_BINARY, 0 },
+  { "label", runLabel, USE_THRESHOLD, 4 },
+  { "label", runLabel, USE_THRESHOLD, 8 },
+};
+#define NUMOPS (int)(sizeof(OPS) / sizeof(OPS[0]))
+
+// Estimated number of pixel comparisons of locate and match cases
+static double comparisons(const struct op* op, const char* kind, int n) {
+  double t = op->param;
+  double positions = op->run == runLocate ? (n - t + 1) * (n - t + 1) : 1.0;
+  if (strcmp(kind, "worst") == 0) return positions * t * t;
+  if (strcmp(kind, "flat") == 0) return t * t;  // found at once
+  return positions + t * t;
+}
+
+// Bytes reported by the module, through the metrics hook
+static size_t reported;
+
+static void countBytes(const ImageMetrics* m, void* arg) {
+  (void)arg;
+  reported += m->bytes;
+}
+
+
+// Results
+
+struct result {
+  char key[128];   // "op kind layout size"
+  double median;   // seconds
+};
+
+static struct result* baseline = NULL;
+static int nbaseline = 0;
+static int regressions = 0;
+
+static int compareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static void loadBaseline(const char* filename) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) error(2, errno, "Opening baseline %s", filename);
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] == '#') continue;
+    struct result r;
+    char op[32], kind[32], layout[32];
+    int size;
+    if (sscanf(line, "%31s %31s %31s %d %lf", op, kind, layout, &size, &r.median) != 5) continue;
+    snprintf(r.key, sizeof(r.key), "%s %s %s %d", op, kind, layout, size);
+    struct result* p = (struct result*)realloc(baseline, (nbaseline + 1) * sizeof(*p));
+    if (p == NULL) error(3, errno, "Loading baseline");
+    baseline = p;
+    baseline[nbaseline++] = r;
+  }
+  fclose(f);
+}
+
+static const struct result* findBaseline(const char* key) {
+  for (int i = 0; i < nbaseline; i++)
+    if (strcmp(baseline[i].key, key) == 0) return &baseline[i];
+  return NULL;
+}
+
+// Run one case, and print (and save) its results.
+static void runCase(const struct op* op, const char* kind, const char* layoutName,
+                    struct bench* b, FILE* save) {
+  char name[32];
+  if (op->param > 0 && op->run != runMatch)
+    snprintf(name, sizeof(name), "%s-%d", op->name, op->param);
+  else
+    snprintf(name, sizeof(name), "%s", op->name);
+  int n = ImageWidth(b->img);
+  char key[128];
+  snprintf(key, sizeof(key), "%s %s %s %d", name, kind, layoutName, n);
+  printf("%-12s %-9s %-7s %6d", name, kind, layoutName, n);
+  fflush(stdout);
+
+  if ((op->needs & USE_TEMPLATE) && comparisons(op, kind, n) > budget) {
+    printf("  skipped (over budget)\n");
+    return;
+  }
+
+  b->param = op->param;
+  b->small = NULL;
+  if (op->needs & USE_HALF) {
+    b->small = ImageCrop(b->img, 0, 0, n / 2, n / 2);
+  } else if (op->needs & USE_TEMPLATE) {
+    if (op->param > n) { printf("  skipped (template too large)\n"); return; }
+    b->small = makeTemplate(b->img, kind, op->param);
+  } else if (op->needs & USE_THRESHOLD) {
+    b->small = ImageConvertLayout(b->img, b->layout);
+    if (b->small != NULL) ImageThreshold(b->small, 128);
+  }
+  b->integral = NULL;
+  if (op->needs & USE_INTEGRAL) {
+    b->integral = ImageIntegralCreate(b->img);
+  }
+  b->mask = b->mask2 = NULL;
+  if (op->needs & USE_BINARY) {
+    b->mask = ImageThresholdToBinary(b->img, 128);
+    b->mask2 = ImageThresholdToBinary(b->img, 64);
+  }
+
+  double* times = (double*)malloc((reps > 0 ? reps : 1) * sizeof(double));
+  if (times == NULL) error(3, errno, "Allocating");
+  int timed = 0;
+  int failed = ((op->needs & (USE_HALF | USE_TEMPLATE | USE_THRESHOLD)) && b->small == NULL) ||
+               ((op->needs & USE_INTEGRAL) && b->integral == NULL) ||
+               ((op->needs & USE_BINARY) && (b->mask == NULL || b->mask2 == NULL));
+  double total = 0.0;
+  size_t bytes = 0;
+  for (int r = 0; !failed && r < warmup + reps; r++) {
+    b->work = NULL;
+    if (op->needs & USE_WORK) {
+      b->work = ImageConvertLayout(b->img, b->layout);
+      if (b->work == NULL) { failed = 1; break; }
+    }
+    b->result = NULL;
+    b->bytes = 0;
+    reported = 0;
+    errno = 0;
+    double t0 = wall_time();
+    int ok = op->run(b);
+    double t = wall_time() - t0;
+    bytes = reported > 0 ? reported : b->bytes;
+    failed = !ok;
+    ImageDestroy(&b->result);
+    ImageDestroy(&b->work);
+    if (r >= warmup) {
+      times[timed++] = t;
+      total += t;
+      if (total > maxTime) break;
+    }
+  }
+  ImageDestroy(&b->small);
+  ImageIntegralDestroy(&b->integral);
+  Image1Destroy(&b->mask);
+  Image1Destroy(&b->mask2);
+
+  if (failed || timed == 0) {
+    printf("  failed: %s\n", ImageErrMsg());
+    free(times);
+    return;
+  }
+  qsort(times, timed, sizeof(double), compareDoubles);
+  double median = timed % 2 ? times[timed / 2] : (times[timed / 2 - 1] + times[timed / 2]) / 2;
+  double p95 = times[(int)ceil(0.95 * timed) - 1];
+  printf("  %4d %12.3f %12.3f %10.1f", timed, median * 1e3, p95 * 1e3,
+         median > 0.0 ? bytes / median / 1e6 : 0.0);
+  const struct result* base = findBaseline(key);
+  if (base != NULL) {
+    double change = (median / base->median - 1.0) * 100.0;
+    printf(" %12.3f %+7.1f%%", base->median * 1e3, change);
+    if (change > threshold) {
+      printf("  REGRESSION");
+      regressions++;
+    }
+  }
+  printf("\n");
+  if (save != NULL) fprintf(save, "%s %.9f\n", key, median);
+  free(times);
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  const char* saveFile = NULL;
+  const char* compareFile = NULL;
+
+  for (int k = 1; k < ac; k++) {
+    const char* arg = k + 1 < ac ? av[k + 1] : NULL;
+    if (strcmp(av[k], "--help") == 0) {
+      printf("%s", USAGE);
+      return 0;
+    } else if (strcmp(av[k], "--sizes") == 0 && arg != NULL) {
+      nsizes = 0;
+      for (char* p = av[++k]; p != NULL && nsizes < 16; p = strchr(p, ',')) {
+        if (*p == ',') p++;
+        sizes[nsizes] = atoi(p);
+        if (sizes[nsizes] <= 0) error(1, 0, "Invalid size: %s", p);
+        nsizes++;
+      }
+    } else if (strcmp(av[k], "--kinds") == 0 && arg != NULL) {
+      kinds = av[++k];
+    } else if (strcmp(av[k], "--layouts") == 0 && arg != NULL) {
+      layouts = av[++k];
+    } else if (strcmp(av[k], "--ops") == 0 && arg != NULL) {
+      ops = av[++k];
+    } else if (strcmp(av[k], "--reps") == 0 && arg != NULL) {
+      reps = atoi(av[++k]);
+    } else if (strcmp(av[k], "--warmup") == 0 && arg != NULL) {
+      warmup = atoi(av[++k]);
+    } else if (strcmp(av[k], "--max-time") == 0 && arg != NULL) {
+      maxTime = atof(av[++k]);
+    } else if (strcmp(av[k], "--budget") == 0 && arg != NULL) {
+      budget = atof(av[++k]);
+    } else if (strcmp(av[k], "--save") == 0 && arg != NULL) {
+      saveFile = av[++k];
+    } else if (strcmp(av[k], "--compare") == 0 && arg != NULL) {
+      compareFile = av[++k];
+    } else if (strcmp(av[k], "--threshold") == 0 && arg != NULL) {
+      threshold = atof(av[++k]);
+    } else {
+      error(1, 0, "Invalid option: %s\n%s", av[k], USAGE);
+    }
+  }
+  if (reps < 1 || warmup < 0) error(1, 0, "Invalid number of repetitions");
+
+  ImageInit();
+  ImageSetMetricsHook(countBytes, NULL);
+  if (compareFile != NULL) loadBaseline(compareFile);
+  FILE* save = NULL;
+  if (saveFile != NULL && (save = fopen(saveFile, "w")) == NULL) {
+    error(2, errno, "Creating %s", saveFile);
+  }
+  if (save != NULL) fprintf(save, "# imageBench baseline: op kind layout size median(s)\n");
+
+  // Temporary files for load and save, raw and plain
+  char tmpfile[] = "/tmp/imageBenchXXXXXX";
+  char plainfile[] = "/tmp/imageBenchXXXXXX";
+  int fd = mkstemp(tmpfile);
+  if (fd < 0) error(2, errno, "Creating temporary file");
+  close(fd);
+  fd = mkstemp(plainfile);
+  if (fd < 0) error(2, errno, "Creating temporary file");
+  close(fd);
+
+  printf("#%-11s %-9s %-7s %6s  %4s %12s %12s %10s", "op", "kind", "layout", "size",
+         "reps", "median(ms)", "p95(ms)", "MB/s");
+  if (compareFile != NULL) printf(" %12s %8s", "base(ms)", "change");
+  printf("\n");
+
+  static const char* layoutNames[] = { "raster", "tiled", "zorder" };
+  static const char* kindNames[] = { "noise", "gradient", "flat", "worst" };
+  for (int s = 0; s < nsizes; s++) {
+    for (int l = 0; l < 3; l++) {
+      if (!inList(layouts, layoutNames[l])) continue;
+      for (int kd = 0; kd < 4; kd++) {
+        const char* kind = kindNames[kd];
+        if (!inList(kinds, kind)) continue;
+        struct bench b = { kind, l };
+        b.tmpfile = tmpfile;
+        b.plainfile = plainfile;
+        b.img = makeImage(kind, sizes[s], l);
+        if (b.img == NULL) {
+          printf("# %s %s %d: cannot create image: %s\n", kind, layoutNames[l], sizes[s], ImageErrMsg());
+          continue;
+        }
+        int saved = 0;
+        int savedPlain = 0;
+        for (int i = 0; i < NUMOPS; i++) {
+          const struct op* op = &OPS[i];
+          if (ops != NULL && !inList(ops, op->name)) continue;
+          // worst images are only meant to search in
+          if (strcmp(kind, "worst") == 0 && !(op->needs & USE_TEMPLATE)) continue;
+          if ((op->needs & USE_FILE) && !saved) {
+            saved = ImageSave(b.img, tmpfile);
+          }
+          if ((op->needs & USE_PLAIN) && !savedPlain) {
+            savedPlain = ImageSavePlain(b.img, plainfile);
+          }
+          runCase(op, kind, layoutNames[l], &b, save);
+        }
+        ImageDestroy(&b.img);
+      }
+    }
+  }
+
+  remove(tmpfile);
+  remove(plainfile);
+  if (save != NULL) fclose(save);
+  free(baseline);
+  if (regressions > 0) {
+    printf("# %d regression(s) above %.1f%%\n", regressions, threshold);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,350 @@
+// imageComplexity - Empirical complexity analysis of image8bit operations.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+//
+// It sweeps image, template and window sizes for ImageLocateSubImage,
+// ImageMatchSubImage and ImageBlur, on best, average and worst case inputs,
+// measuring the instrumentation counters and the times of each run.
+// For each sweep, it fits y = c * x^k by least squares on log-log scales
+// and compares the growth exponent k of the pixel accesses (the pixmem
+// counter) with the expected one.
+// All measurements are written to a CSV file, with a gnuplot script to
+// plot them.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageComplexity [OPTION...]\n"
+    "  Measure how the costs of locate, match and blur grow with input size.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --out PREFIX      Write PREFIX.csv and PREFIX.gp (default complexity)\n"
+    "  --min-time S      Repeat each run for at least S seconds (default 0.05)\n"
+    "  --tolerance K     Accept exponents within K of expected (default 0.25)\n"
+    "\n"
+    "  Exits with status 1 if pixel accesses grow faster than expected.\n"
+    ;
+
+static double minTime = 0.05;
+static double tolerance = 0.25;
+
+
+// Synthetic images
+
+static uint32_t rng = 2463534242u;
+
+static uint32_t nextRandom(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+// Create an n x n image, filled with random levels, or black if !noise.
+static Image makeImage(int n, int noise) {
+  Image img = ImageCreate(n, n, PixMax);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  if (noise) {
+    for (int y = 0; y < n; y++)
+      for (int x = 0; x < n; x++)
+        ImageSetPixel(img, x, y, (uint8)(nextRandom() >> 24));
+  }
+  return img;
+}
+
+
+// Runs
+
+// Inputs of one run
+struct run {
+  Image img1;   // image searched in, or blurred
+  Image img2;   // template
+  int x, y;     // match position
+  int r;        // blur radius
+};
+
+static void doLocate(struct run* r) {
+  int x, y;
+  ImageLocateSubImage(r->img1, &x, &y, r->img2);
+}
+static void doMatch(struct run* r) { ImageMatchSubImage(r->img1, r->x, r->y, r->img2); }
+static void doBlur(struct run* r) { ImageBlur(r->img1, r->r, r->r); }
+
+// Results of one run (averages per call)
+struct point {
+  double x;
+  double wall;
+  double pixmem;
+  double comps;
+  int reps;
+};
+
+// Run op repeatedly, for at least minTime seconds, and average the results.
+static struct point measure(void (*op)(struct run*), struct run* r, double x) {
+  struct point p = { x };
+  InstrReset();
+  double t0 = wall_time();
+  double t;
+  do {
+    op(r);
+    p.reps++;
+    t = wall_time() - t0;
+  } while (t < minTime);
+  p.wall = t / p.reps;
+  p.pixmem = (double)InstrRead(0) / p.reps;
+  p.comps = (double)InstrRead(1) / p.reps;
+  return p;
+}
+
+
+// Sweeps
+
+#define MAXPOINTS 16
+
+// A sweep: one case of one experiment, varying x
+struct sweep {
+  const char* experiment;
+  const char* var;       // name of x
+  const char* kase;      // best, average or worst
+  double expected;       // expected growth exponent of pixmem
+  struct point p[MAXPOINTS];
+  int n;
+};
+
+// Least squares fit of log(y) = log(c) + k log(x): returns k.
+// Points with y <= 0 are ignored (they have no logarithm).
+static double fitExponent(const struct sweep* s, size_t offset) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  int m = 0;
+  for (int i = 0; i < s->n; i++) {
+    double y = *(const double*)((const char*)&s->p[i] + offset);
+    if (y <= 0) continue;
+    double lx = log(s->p[i].x);
+    double ly = log(y);
+    sx += lx; sy += ly; sxx += lx * lx; sxy += lx * ly;
+    m++;
+  }
+  if (m < 2 || m * sxx - sx * sx == 0) return 0.0;
+  return (m * sxy - sx * sy) / (m * sxx - sx * sx);
+}
+
+static int failures = 0;
+
+// Print the fitted exponents of a sweep, and write its points to csv.
+static void report(const struct sweep* s, FILE* csv) {
+  for (int i = 0; i < s->n; i++) {
+    fprintf(csv, "%s,%s,%s,%g,%d,%.9f,%.1f,%.1f\n", s->experiment, s->kase, s->var,
+            s->p[i].x, s->p[i].reps, s->p[i].wall, s->p[i].pixmem, s->p[i].comps);
+  }
+  double kc = fitExponent(s, offsetof(struct point, comps));
+  double km = fitExponent(s, offsetof(struct point, pixmem));
+  double kt = fitExponent(s, offsetof(struct point, wall));
+  int ok = km <= s->expected + tolerance;
+  if (!ok) failures++;
+  printf("%-10s %-8s %-4s %9.2f %9.2f %9.2f %9.2f  %s\n", s->experiment, s->kase, s->var,
+         s->expected, km, kc, kt, ok ? "ok" : "FASTER THAN EXPECTED");
+}
+
+// Image side, template side and radius values of the sweeps
+static const int LOCATE_N[] = { 32, 64, 128, 256, 512 };
+static const int LOCATE_T[] = { 2, 4, 8, 16, 32 };
+static const int MATCH_T[] = { 8, 16, 32, 64, 128, 256, 512 };
+static const int BLUR_N[] = { 128, 256, 512, 1024, 2048 };
+static const int BLUR_R[] = { 1, 2, 4, 8, 16, 32, 64 };
+#define LEN(a) (int)(sizeof(a) / sizeof(a[0]))
+
+// ImageLocateSubImage on an n x n image, with a t x t template.
+// best: black image and template, found at the first position.
+// average: random image, template cut from a random position.
+// worst: black image, template black but for the last pixel (not found).
+static struct point locate(const char* kase, int n, int t, double x) {
+  struct run r = { 0 };
+  int noise = strcmp(kase, "average") == 0;
+  r.img1 = makeImage(n, noise);
+  if (noise) {
+    int px = (int)(nextRandom() % (n - t + 1));
+    int py = (int)(nextRandom() % (n - t + 1));
+    r.img2 = ImageCrop(r.img1, px, py, t, t);
+  } else {
+    r.img2 = makeImage(t, 0);
+    if (strcmp(kase, "worst") == 0) ImageSetPixel(r.img2, t - 1, t - 1, 1);
+  }
+  if (r.img2 == NULL) error(2, errno, "Creating template: %s", ImageErrMsg());
+  struct point p = measure(doLocate, &r, x);
+  ImageDestroy(&r.img1);
+  ImageDestroy(&r.img2);
+  return p;
+}
+
+// ImageMatchSubImage of a t x t template against a t x t image.
+// best: they differ in the first pixel.
+// average: both random.
+// worst: they are equal.
+static struct point match(const char* kase, int t) {
+  struct run r = { 0 };
+  r.img1 = makeImage(t, 1);
+  if (strcmp(kase, "worst") == 0) {
+    r.img2 = ImageCrop(r.img1, 0, 0, t, t);
+  } else if (strcmp(kase, "best") == 0) {
+    r.img2 = ImageCrop(r.img1, 0, 0, t, t);
+    if (r.img2 != NULL) ImageSetPixel(r.img2, 0, 0, ~ImageGetPixel(r.img1, 0, 0));
+  } else {
+    r.img2 = makeImage(t, 1);
+  }
+  if (r.img2 == NULL) error(2, errno, "Creating template: %s", ImageErrMsg());
+  struct point p = measure(doMatch, &r, t);
+  ImageDestroy(&r.img1);
+  ImageDestroy(&r.img2);
+  return p;
+}
+
+// ImageBlur of a random n x n image with radius rad (the same in any case).
+static struct point blur(int n, int rad, double x) {
+  struct run r = { 0 };
+  r.img1 = makeImage(n, 1);
+  r.r = rad;
+  struct point p = measure(doBlur, &r, x);
+  ImageDestroy(&r.img1);
+  return p;
+}
+
+// Write a gnuplot script that plots pixmem and time of each experiment.
+static void writeGnuplot(const char* prefix, struct sweep* sweeps, int nsweeps) {
+  char filename[4096];
+  snprintf(filename, sizeof(filename), "%s.gp", prefix);
+  FILE* gp = fopen(filename, "w");
+  if (gp == NULL) error(2, errno, "Creating %s", filename);
+  fprintf(gp, "# Plot %s.csv: gnuplot %s.gp\n", prefix, prefix);
+  fprintf(gp, "set datafile separator ','\n");
+  fprintf(gp, "set logscale xy\n");
+  fprintf(gp, "set key top left\n");
+  fprintf(gp, "set terminal pngcairo size 1200,480\n");
+  for (int i = 0; i < nsweeps; i++) {
+    const char* e = sweeps[i].experiment;
+    if (i > 0 && strcmp(e, sweeps[i-1].experiment) == 0) continue;
+    fprintf(gp, "\nset output '%s-%s.png'\n", prefix, e);
+    fprintf(gp, "set multiplot layout 1,2 title '%s'\n", e);
+    for (int m = 0; m < 2; m++) {
+      fprintf(gp, "set xlabel '%s'\nset ylabel '%s'\nplot", sweeps[i].var, m ? "wall time (s)" : "pixmem");
+      for (int j = i; j < nsweeps && strcmp(sweeps[j].experiment, e) == 0; j++) {
+        fprintf(gp, "%s '%s.csv' using (strcol(1) eq '%s' && strcol(2) eq '%s' ? $4 : 1/0):%d"
+                " with linespoints title '%s'", j > i ? ", \\\n    " : " ",
+                prefix, e, sweeps[j].kase, m ? 6 : 7, sweeps[j].kase);
+      }
+      fprintf(gp, "\n");
+    }
+    fprintf(gp, "unset multiplot\n");
+  }
+  fclose(gp);
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  const char* prefix = "complexity";
+  for (int k = 1; k < ac; k++) {
+    const char* arg = k + 1 < ac ? av[k + 1] : NULL;
+    if (strcmp(av[k], "--help") == 0) {
+      printf("%s", USAGE);
+      return 0;
+    } else if (strcmp(av[k], "--out") == 0 && arg != NULL) {
+      prefix = av[++k];
+    } else if (strcmp(av[k], "--min-time") == 0 && arg != NULL) {
+      minTime = atof(av[++k]);
+    } else if (strcmp(av[k], "--tolerance") == 0 && arg != NULL) {
+      tolerance = atof(av[++k]);
+    } else {
+      error(1, 0, "Invalid option: %s\n%s", av[k], USAGE);
+    }
+  }
+
+  ImageInit();
+  // Run serially: counters and times should reflect the algorithms.
+  ImageSetThreads(1);
+
+  static const char* KASES[] = { "best", "average", "worst" };
+  // Expected exponents of pixmem, for best, average and worst cases:
+  //   locate-n: template found at once; ~n^2 positions tried
+  //             (half on average); each with ~1, ~1 and t^2 comparisons.
+  //   locate-t: t^2 comparisons at the first position; ~n^2 positions with
+  //             ~1 comparison each; ~(n-t)^2 positions with t^2 each.
+  //   match-t:  1 comparison; ~1 comparison; t^2 comparisons.
+  //   blur-n:   a sum table of (n+2r)^2 entries, n^2 pixels: n^2.
+  //   blur-r:   the same, whatever the radius: r^0 (for r << n).
+  static const double EXPECTED[5][3] = {
+    { 0, 2, 2 }, { 2, 0, 2 }, { 0, 0, 2 }, { 2, 2, 2 }, { 0, 0, 0 },
+  };
+  struct sweep sweeps[5 * 3];
+  int nsweeps = 0;
+
+  printf("#%-9s %-8s %-4s %9s %9s %9s %9s\n", "experiment", "case", "x",
+         "expected", "pixmem", "comps", "time");
+  char filename[4096];
+  snprintf(filename, sizeof(filename), "%s.csv", prefix);
+  FILE* csv = fopen(filename, "w");
+  if (csv == NULL) error(2, errno, "Creating %s", filename);
+  fprintf(csv, "experiment,case,var,x,reps,wall,pixmem,comps\n");
+
+  for (int e = 0; e < 5; e++) {
+    for (int c = 0; c < 3; c++) {
+      const char* kase = KASES[c];
+      // Blur does not depend on pixel values: average case only
+      if (e >= 3 && c != 1) continue;
+      struct sweep* s = &sweeps[nsweeps++];
+      memset(s, 0, sizeof(*s));
+      s->kase = kase;
+      s->expected = EXPECTED[e][c];
+      switch (e) {
+      case 0:
+        s->experiment = "locate-n";
+        s->var = "n";
+        for (int i = 0; i < LEN(LOCATE_N); i++)
+          s->p[s->n++] = locate(kase, LOCATE_N[i], 8, LOCATE_N[i]);
+        break;
+      case 1:
+        s->experiment = "locate-t";
+        s->var = "t";
+        for (int i = 0; i < LEN(LOCATE_T); i++)
+          s->p[s->n++] = locate(kase, 256, LOCATE_T[i], LOCATE_T[i]);
+        break;
+      case 2:
+        s->experiment = "match-t";
+        s->var = "t";
+        for (int i = 0; i < LEN(MATCH_T); i++)
+          s->p[s->n++] = match(kase, MATCH_T[i]);
+        break;
+      case 3:
+        s->experiment = "blur-n";
+        s->var = "n";
+        for (int i = 0; i < LEN(BLUR_N); i++)
+          s->p[s->n++] = blur(BLUR_N[i], 4, BLUR_N[i]);
+        break;
+      case 4:
+        s->experiment = "blur-r";
+        s->var = "r";
+        for (int i = 0; i < LEN(BLUR_R); i++)
+          s->p[s->n++] = blur(512, BLUR_R[i], BLUR_R[i]);
+        break;
+      }
+      report(s, csv);
+      fflush(stdout);
+    }
+  }
+  fclose(csv);
+  writeGnuplot(prefix, sweeps, nsweeps);
+  printf("# Wrote %s.csv and %s.gp\n", prefix, prefix);
+
+  return failures > 0;
+}
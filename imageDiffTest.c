@@ -0,0 +1,942 @@
+// imageDiffTest - Randomized differential testing of image8bit.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+//
+// It runs each optimized operation of image8bit and its reference
+// implementation (imageRef) on the same random inputs: random sizes
+// (around the 64x64 tile size, too), maxvals, pixel layouts, radii,
+// alphas, positions, and numbers of threads.  The results must be equal,
+// byte for byte.
+// Chains of stages (ImageApplyStages) are compared with the reference
+// operations applied one at a time, with random tile sides.
+// The operations of image16bit are compared with the same references,
+// on 16-bit images with the same levels, or with levels scaled by 257
+// (for operations that commute with scaling): that exercises the 16-bit
+// specializations of the pixel kernels, and the high byte of levels.
+// PGM files of 16-bit images are saved and loaded back (io16), raw and
+// plain, and so are plain PGM files of 8-bit images, in every layout (plain).
+// Rectangle statistics from integral images are compared with sums of the
+// pixels of each rectangle, and blurs from them with RefBlur (rect).
+// Binary images (image1bit) are thresholded from img1 and img2, combined
+// with a logical operation, counted, and saved to and loaded from a PBM
+// file, and compared with the threshold and the operation level by level
+// (binary).
+// Connected components are labeled in the threshold of img1, and compared
+// with a flood fill from the first pixel of each component (label).
+// A failing case is shrunk to a minimal one (smaller images, positions,
+// radii, fewer levels, ...) that still fails, which is reported, and
+// whose input images are saved, to be reproduced with imageTool.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image8bit.h"
+#include "image16bit.h"
+#include "image1bit.h"
+#include "imageRef.h"
+
+static const char* USAGE =
+    "USAGE: imageDiffTest [OPTION...]\n"
+    "  Compare the image8bit operations with their reference implementations\n"
+    "  on random inputs.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --cases N      Number of random cases per operation (default 300)\n"
+    "  --seed S       Seed of the random inputs (default 1)\n"
+    "  --max-size N   Maximum width and height of the images (default 160)\n"
+    "  --threads N    Maximum number of threads (default 4)\n"
+    "  --ops LIST     Comma-separated operations to test (default all):\n"
+    "                 stats,neg,thr,bri,rotate,mirror,crop,paste,blend,\n"
+    "                 match,locate,blur,stages,diff,avg,min,max,io16,\n"
+    "                 plain,rect,binary,label\n"
+    "\n"
+    "  Exits with status 1 if any operation differs from its reference.\n"
+    "  The inputs of the minimal failing case of each operation are saved\n"
+    "  to diff-OP-1.pgm (and diff-OP-2.pgm, for operations on two images).\n"
+    ;
+
+static int numCases = 300;
+static int maxSize = 160;
+static int maxThreads = 4;
+
+
+// Random numbers
+
+static uint32_t rng = 1;
+
+static uint32_t nextRandom(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+// Random integer in [lo, hi]
+static int randomInt(int lo, int hi) {
+  return lo + (int)(nextRandom() % (uint32_t)(hi - lo + 1));
+}
+
+// Random double in [lo, hi)
+static double randomDouble(double lo, double hi) {
+  return lo + (hi - lo) * (nextRandom() >> 8) / (double)(1 << 24);
+}
+
+// Random image size in [0, maxSize], often small or around a tile edge
+static int randomSize(void) {
+  static const int edges[] = { 0, 1, 2, 63, 64, 65, 127, 128, 129 };
+  int n;
+  switch (randomInt(0, 3)) {
+  case 0: n = randomInt(0, 8); break;
+  case 1: n = edges[randomInt(0, sizeof(edges) / sizeof(edges[0]) - 1)]; break;
+  default: n = randomInt(0, maxSize); break;
+  }
+  return n < maxSize ? n : maxSize;
+}
+
+
+// Operations
+
+enum { STATS, NEG, THR, BRI, ROTATE, MIRROR, CROP, PASTE, BLEND, MATCH, LOCATE, BLUR, STAGES,
+       DIFF, AVG, MIN, MAX, IO16, PLAIN, RECT, BINARY, LABEL, NUMOPS };
+
+static const char* opName[NUMOPS] = {
+  "stats", "neg", "thr", "bri", "rotate", "mirror", "crop", "paste", "blend",
+  "match", "locate", "blur", "stages", "diff", "avg", "min", "max", "io16",
+  "plain", "rect", "binary", "label",
+};
+
+static const char* layoutName[] = { "raster", "tiled", "zorder" };
+
+// One test case: everything needed to build its inputs and run it
+struct testCase {
+  int op;
+  int w1, h1, layout1;  // img1 (the only image of single image operations)
+  int w2, h2, layout2;  // img2, or the size of the crop
+  int maxval;           // of both images
+  int levels;           // pixel levels are random in [0, levels-1]
+  uint32_t seed;        // of the random pixel levels
+  int x, y;             // position of img2 in img1, or of the crop
+  int sub;              // img2 is cut from img1 at (x, y) (match, locate)
+  int flip;             // ... with one of its pixels changed, if >= 0
+  int dx, dy;           // blur radii
+  int thr;              // threshold
+  double factor;        // brighten factor or blend alpha
+  int threads;
+  int stages;           // number of stages of the chain (stages)
+  uint32_t stageSeed;   // ... of their random operations and arguments
+  int tile;             // ... and side of the tiles
+  int scale;            // 16-bit levels are the 8-bit ones times scale (0: no 16-bit run)
+  int logic;            // logical operation of binary images: not, and, or, xor
+  int connectivity;     // of connected components: 4 or 8
+};
+
+static const char* logicName[] = { "not", "and", "or", "xor" };
+
+#define MAXSTAGES 6
+
+// Temporal operations combine img1 with an img2 of the same size
+static int temporal(int op) {
+  return op == DIFF || op == AVG || op == MIN || op == MAX;
+}
+
+// Operations with an img2 of the size of img1
+static int sameSize(int op) {
+  return temporal(op) || op == BINARY;
+}
+
+static int twoImages(int op) {
+  return op == PASTE || op == BLEND || op == MATCH || op == LOCATE || sameSize(op);
+}
+
+// Operations of image16bit, and those whose results scale exactly with
+// the levels of the inputs
+static int wide(int op) {
+  return op <= BLUR || op == IO16;
+}
+
+static int scalable(int op) {
+  return wide(op) && op != BRI && op != BLEND && op != BLUR;
+}
+
+// Check that the case is well formed (the requirements of the operation).
+static int validCase(const struct testCase* c) {
+  if (c->w1 < 0 || c->h1 < 0 || c->w2 < 0 || c->h2 < 0) return 0;
+  if (c->levels < 1 || c->levels > c->maxval + 1) return 0;
+  if (c->threads < 1) return 0;
+  if (c->op == STAGES && (c->stages < 1 || c->tile < 1)) return 0;
+  if (c->op == CROP || c->op == RECT || c->op == PASTE || c->op == BLEND || c->sub) {
+    // The rectangle (x, y, w2, h2) must be inside img1
+    if (c->x < 0 || c->y < 0) return 0;
+    if (c->w2 > c->w1 - c->x || c->h2 > c->h1 - c->y) return 0;
+  }
+  if (c->op == MATCH) {
+    // (x, y) must be a position of img1
+    if (c->x < 0 || c->x >= c->w1 || c->y < 0 || c->y >= c->h1) return 0;
+  }
+  if (c->flip >= (long)c->w2 * c->h2) return 0;
+  return 1;
+}
+
+static struct testCase randomCase(int op) {
+  static const int maxvals[] = { 1, 2, 15, 127, 200, 254, 255 };
+  struct testCase c;
+  memset(&c, 0, sizeof(c));
+  c.op = op;
+  c.w1 = randomSize();
+  c.h1 = randomSize();
+  c.layout1 = randomInt(0, 2);
+  c.layout2 = randomInt(0, 2);
+  c.maxval = maxvals[randomInt(0, sizeof(maxvals) / sizeof(maxvals[0]) - 1)];
+  // Few levels make equal pixels, and matches, more likely
+  c.levels = randomInt(0, 1) ? c.maxval + 1 : randomInt(1, c.maxval < 3 ? c.maxval + 1 : 3);
+  c.seed = nextRandom() | 1;
+  c.threads = randomInt(1, maxThreads);
+  c.flip = -1;
+  if (op == CROP || op == RECT || (twoImages(op) && !sameSize(op))) {
+    c.w2 = randomInt(0, c.w1);
+    c.h2 = randomInt(0, c.h1);
+    c.x = randomInt(0, c.w1 - c.w2);
+    c.y = randomInt(0, c.h1 - c.h2);
+  }
+  if (op == MATCH || op == LOCATE) {
+    // Mostly templates cut from img1, some with a pixel changed
+    c.sub = randomInt(0, 3) != 0;
+    if (c.sub && c.w2 * c.h2 > 0 && randomInt(0, 1)) {
+      c.flip = randomInt(0, c.w2 * c.h2 - 1);
+    }
+    if (op == MATCH && c.w1 > 0 && c.h1 > 0 && randomInt(0, 7) == 0) {
+      // Positions where img2 may stick out of img1
+      c.x = randomInt(0, c.w1 - 1);
+      c.y = randomInt(0, c.h1 - 1);
+      c.sub = 0;
+    }
+  }
+  c.dx = randomInt(0, 3) ? randomInt(0, 8) : randomInt(0, c.w1 + 2);
+  c.dy = randomInt(0, 3) ? randomInt(0, 8) : randomInt(0, c.h1 + 2);
+  c.thr = randomInt(0, c.maxval + 1 < PixMax ? c.maxval + 1 : PixMax);
+  if (op == BLEND) {
+    c.factor = randomDouble(-0.5, 1.5);
+  } else if (op == AVG) {
+    c.factor = randomInt(0, 3) ? randomDouble(0.0, 1.0) : randomInt(0, 4) * 0.25;
+  } else {
+    c.factor = randomInt(0, 3) ? randomDouble(0.0, 4.0) : randomInt(0, 4) * 0.5;
+  }
+  if (op == STAGES) {
+    c.stages = randomInt(1, MAXSTAGES);
+    c.stageSeed = nextRandom() | 1;
+    c.tile = randomInt(0, 3) ? randomInt(1, 80) : randomInt(1, maxSize + 1);
+  }
+  c.logic = randomInt(0, 3);
+  c.connectivity = randomInt(0, 1) ? 8 : 4;
+  if (wide(op)) {
+    c.scale = scalable(op) && randomInt(0, 1) ? 257 : 1;
+  }
+  return c;
+}
+
+static void printCase(FILE* f, const struct testCase* c) {
+  fprintf(f, "%s img1=%dx%d,%s maxval=%d levels=%d seed=%u threads=%d",
+          opName[c->op], c->w1, c->h1, layoutName[c->layout1], c->maxval,
+          c->levels, c->seed, c->threads);
+  switch (c->op) {
+  case THR: fprintf(f, " thr=%d", c->thr); break;
+  case BRI: fprintf(f, " factor=%.17g", c->factor); break;
+  case CROP: fprintf(f, " rect=%d,%d,%d,%d", c->x, c->y, c->w2, c->h2); break;
+  case BLUR: fprintf(f, " radii=%d,%d", c->dx, c->dy); break;
+  case RECT:
+    fprintf(f, " rect=%d,%d,%d,%d radii=%d,%d", c->x, c->y, c->w2, c->h2, c->dx, c->dy);
+    break;
+  case STAGES:
+    fprintf(f, " stages=%d stageseed=%u tile=%d", c->stages, c->stageSeed, c->tile);
+    break;
+  case PASTE: case BLEND: case MATCH: case LOCATE:
+    fprintf(f, " img2=%dx%d,%s pos=%d,%d", c->w2, c->h2, layoutName[c->layout2], c->x, c->y);
+    if (c->sub) fprintf(f, " cut");
+    if (c->flip >= 0) fprintf(f, " flip=%d", c->flip);
+    if (c->op == BLEND) fprintf(f, " alpha=%.17g", c->factor);
+    break;
+  case LABEL:
+    fprintf(f, " thr=%d connectivity=%d", c->thr, c->connectivity);
+    break;
+  case BINARY:
+    fprintf(f, " img2=%s thr=%d logic=%s", layoutName[c->layout2], c->thr, logicName[c->logic]);
+    break;
+  case DIFF: case AVG: case MIN: case MAX:
+    fprintf(f, " img2=%s", layoutName[c->layout2]);
+    if (c->op == AVG) fprintf(f, " alpha=%.17g", c->factor);
+    break;
+  }
+  if (c->scale > 0) fprintf(f, " scale=%d", c->scale);
+  fprintf(f, "\n");
+}
+
+
+// Inputs
+
+static Image newImage(int w, int h, int maxval, int layout) {
+  Image img = ImageCreateLayout(w, h, (uint8)maxval, layout);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  return img;
+}
+
+// Build the input images of case c, in its layouts.
+// The reference gets its own copies, built independently.
+static void makeInputs(const struct testCase* c, int layout1, int layout2,
+                       Image* img1, Image* img2) {
+  rng = c->seed;
+  *img1 = newImage(c->w1, c->h1, c->maxval, layout1);
+  for (int y = 0; y < c->h1; y++)
+    for (int x = 0; x < c->w1; x++)
+      ImageSetPixel(*img1, x, y, (uint8)(nextRandom() % (uint32_t)c->levels));
+  *img2 = NULL;
+  if (!twoImages(c->op)) return;
+  // (Temporal and binary operations use an img2 of the size of img1.)
+  int w2 = sameSize(c->op) ? c->w1 : c->w2;
+  int h2 = sameSize(c->op) ? c->h1 : c->h2;
+  *img2 = newImage(w2, h2, c->maxval, layout2);
+  for (int y = 0; y < h2; y++) {
+    for (int x = 0; x < w2; x++) {
+      uint8 level;
+      if (c->sub) {
+        level = ImageGetPixel(*img1, c->x + x, c->y + y);
+      } else {
+        level = (uint8)(nextRandom() % (uint32_t)c->levels);
+      }
+      if (y * w2 + x == c->flip) level = (uint8)((level + 1) % (c->maxval + 1));
+      ImageSetPixel(*img2, x, y, level);
+    }
+  }
+}
+
+
+// Build the random chain of stages of case c in st (MAXSTAGES at most).
+// (This uses the random generator, so call it after makeInputs.)
+static void makeStages(const struct testCase* c, ImageStage* st) {
+  rng = c->stageSeed;
+  for (int i = 0; i < c->stages; i++) {
+    memset(&st[i], 0, sizeof(st[i]));
+    st[i].op = randomInt(STAGE_NEGATIVE, STAGE_BLUR);
+    st[i].thr = (uint8)randomInt(0, c->maxval);
+    st[i].factor = randomDouble(0.0, 3.0);
+    st[i].dx = randomInt(0, 3) ? randomInt(0, 4) : randomInt(0, 20);
+    st[i].dy = randomInt(0, 3) ? randomInt(0, 4) : randomInt(0, 20);
+  }
+}
+
+static void printStages(FILE* f, const ImageStage* st, int n) {
+  for (int i = 0; i < n; i++) {
+    switch (st[i].op) {
+    case STAGE_NEGATIVE: fprintf(f, " neg"); break;
+    case STAGE_THRESHOLD: fprintf(f, " thr %d", st[i].thr); break;
+    case STAGE_BRIGHTEN: fprintf(f, " bri %.17g", st[i].factor); break;
+    case STAGE_BLUR: fprintf(f, " blur %d,%d", st[i].dx, st[i].dy); break;
+    }
+  }
+  fprintf(f, "\n");
+}
+
+
+// Comparison
+
+// Compare two images; describe the first difference in msg.
+static int sameImage(Image ref, Image img, char* msg, size_t size) {
+  if (ImageWidth(ref) != ImageWidth(img) || ImageHeight(ref) != ImageHeight(img) ||
+      ImageMaxval(ref) != ImageMaxval(img)) {
+    snprintf(msg, size, "got %dx%d maxval %d, expected %dx%d maxval %d",
+             ImageWidth(img), ImageHeight(img), ImageMaxval(img),
+             ImageWidth(ref), ImageHeight(ref), ImageMaxval(ref));
+    return 0;
+  }
+  for (int y = 0; y < ImageHeight(ref); y++) {
+    for (int x = 0; x < ImageWidth(ref); x++) {
+      if (ImageGetPixel(ref, x, y) != ImageGetPixel(img, x, y)) {
+        snprintf(msg, size, "pixel (%d,%d) is %d, expected %d",
+                 x, y, ImageGetPixel(img, x, y), ImageGetPixel(ref, x, y));
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Convert img to a 16-bit image, with levels (and maxval) times scale.
+static Image16 newWide(Image img, int scale) {
+  Image16 img16 = Image16Create(ImageWidth(img), ImageHeight(img),
+                                (uint16)(ImageMaxval(img) * scale));
+  if (img16 == NULL) error(2, errno, "Creating image: %s", Image16ErrMsg());
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      Image16SetPixel(img16, x, y, (uint16)(ImageGetPixel(img, x, y) * scale));
+  return img16;
+}
+
+// Compare a 16-bit image with an 8-bit one whose levels are scaled by
+// scale; describe the first difference in msg.
+static int sameWide(Image ref, int scale, Image16 img, char* msg, size_t size) {
+  if (ImageWidth(ref) != Image16Width(img) || ImageHeight(ref) != Image16Height(img) ||
+      ImageMaxval(ref) * scale != Image16Maxval(img)) {
+    snprintf(msg, size, "16-bit: got %dx%d maxval %d, expected %dx%d maxval %d",
+             Image16Width(img), Image16Height(img), Image16Maxval(img),
+             ImageWidth(ref), ImageHeight(ref), ImageMaxval(ref) * scale);
+    return 0;
+  }
+  for (int y = 0; y < ImageHeight(ref); y++) {
+    for (int x = 0; x < ImageWidth(ref); x++) {
+      if (ImageGetPixel(ref, x, y) * scale != Image16GetPixel(img, x, y)) {
+        snprintf(msg, size, "16-bit: pixel (%d,%d) is %d, expected %d",
+                 x, y, Image16GetPixel(img, x, y), ImageGetPixel(ref, x, y) * scale);
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Save img to a PGM file, raw or plain, and load it back.
+static Image16 reloadWide(Image16 img, int plain) {
+  char name[64];
+  snprintf(name, sizeof(name), "/tmp/imageDiffTest-%d.pgm", (int)getpid());
+  if (!(plain ? Image16SavePlain(img, name) : Image16Save(img, name))) {
+    error(2, errno, "%s: %s", name, Image16ErrMsg());
+  }
+  Image16 loaded = Image16Load(name);
+  if (loaded == NULL) error(2, errno, "%s: %s", name, Image16ErrMsg());
+  remove(name);
+  return loaded;
+}
+
+// Run case c on the image16bit operations, with the inputs of the case
+// scaled by c->scale, and compare with the reference results, scaled too.
+static int runWide(const struct testCase* c, char* msg, size_t size) {
+  Image ref1, ref2;
+  makeInputs(c, IMAGE_RASTER, IMAGE_RASTER, &ref1, &ref2);
+  int s = c->scale;
+  Image16 img1 = s == 1 ? Image16FromImage(ref1) : newWide(ref1, s);
+  if (img1 == NULL) error(2, errno, "Converting image: %s", Image16ErrMsg());
+  Image16 img2 = ref2 != NULL ? newWide(ref2, s) : NULL;
+  Image16 res = NULL;  // new image returned by the operation
+  Image rres = NULL;   // ... and by the reference
+  int ok = 1;
+
+  switch (c->op) {
+  case STATS: {
+    uint16 min, max;
+    uint8 rmin, rmax;
+    Image16Stats(img1, &min, &max);
+    RefStats(ref1, &rmin, &rmax);
+    // (The range of an empty image is [Pix16Max, 0], instead of [PixMax, 0].)
+    int emin = c->w1 * c->h1 > 0 ? rmin * s : Pix16Max;
+    if (min != emin || max != rmax * s) {
+      snprintf(msg, size, "16-bit: range [%d, %d], expected [%d, %d]",
+               min, max, emin, rmax * s);
+      ok = 0;
+    }
+    break;
+  }
+  case NEG: Image16Negative(img1); RefNegative(ref1); break;
+  case THR: Image16Threshold(img1, (uint16)(c->thr * s)); RefThreshold(ref1, (uint8)c->thr); break;
+  case BRI: Image16Brighten(img1, c->factor); RefBrighten(ref1, c->factor); break;
+  case ROTATE: res = Image16Rotate(img1); rres = RefRotate(ref1); break;
+  case MIRROR: res = Image16Mirror(img1); rres = RefMirror(ref1); break;
+  case CROP:
+    res = Image16Crop(img1, c->x, c->y, c->w2, c->h2);
+    rres = RefCrop(ref1, c->x, c->y, c->w2, c->h2);
+    break;
+  case PASTE: Image16Paste(img1, c->x, c->y, img2); RefPaste(ref1, c->x, c->y, ref2); break;
+  case BLEND:
+    Image16Blend(img1, c->x, c->y, img2, c->factor);
+    RefBlend(ref1, c->x, c->y, ref2, c->factor);
+    break;
+  case MATCH: {
+    int r = Image16MatchSubImage(img1, c->x, c->y, img2);
+    int rr = RefMatchSubImage(ref1, c->x, c->y, ref2);
+    if (r != rr) {
+      snprintf(msg, size, "16-bit: returned %d, expected %d", r, rr);
+      ok = 0;
+    }
+    break;
+  }
+  case LOCATE: {
+    int x = -1, y = -1, rx = -1, ry = -1;
+    int r = Image16LocateSubImage(img1, &x, &y, img2);
+    int rr = RefLocateSubImage(ref1, &rx, &ry, ref2);
+    if (r != rr || x != rx || y != ry) {
+      snprintf(msg, size, "16-bit: returned %d at (%d,%d), expected %d at (%d,%d)",
+               r, x, y, rr, rx, ry);
+      ok = 0;
+    }
+    break;
+  }
+  case BLUR: Image16Blur(img1, c->dx, c->dy); RefBlur(ref1, c->dx, c->dy); break;
+  case IO16: {
+    // Through a raw file with two bytes per pixel (if scaled) or one,
+    // and then through a plain one
+    for (int plain = 0; plain <= 1; plain++) {
+      Image16 loaded = reloadWide(img1, plain);
+      Image16Destroy(&img1);
+      img1 = loaded;
+    }
+    if (s == 1) {
+      // ... and back to 8 bits, unchanged
+      Image img8 = Image16ToImage(img1);
+      if (img8 == NULL) error(2, errno, "Converting image: %s", Image16ErrMsg());
+      ok = sameImage(ref1, img8, msg, size);
+      ImageDestroy(&img8);
+    }
+    break;
+  }
+  }
+
+  if (ok) {
+    if (res != NULL || rres != NULL) {
+      if (res == NULL || rres == NULL) error(2, errno, "%s: %s", opName[c->op], Image16ErrMsg());
+      ok = sameWide(rres, s, res, msg, size);
+    } else {
+      ok = sameWide(ref1, s, img1, msg, size);
+    }
+  }
+
+  ImageDestroy(&ref1);
+  ImageDestroy(&ref2);
+  ImageDestroy(&rres);
+  Image16Destroy(&img1);
+  Image16Destroy(&img2);
+  Image16Destroy(&res);
+  return ok;
+}
+
+// Save img to a plain PGM file and load it back, with the same layout.
+static Image reloadPlain(Image img, int layout) {
+  char name[64];
+  snprintf(name, sizeof(name), "/tmp/imageDiffTest-%d.pgm", (int)getpid());
+  if (!ImageSavePlain(img, name)) error(2, errno, "%s: %s", name, ImageErrMsg());
+  Image loaded = ImageLoadLayout(name, layout);
+  if (loaded == NULL) error(2, errno, "%s: %s", name, ImageErrMsg());
+  remove(name);
+  return loaded;
+}
+
+// Compare the statistics of rectangle (x, y, w, h) of img, from ii, with
+// those of the reference.  Means and variances are computed differently,
+// so they may differ in their last bits.
+static int sameRect(Image img, ImageIntegral ii, int x, int y, int w, int h,
+                    char* msg, size_t size) {
+  uint64_t sum = ImageRectSum(ii, x, y, w, h);
+  uint64_t rsum = RefRectSum(img, x, y, w, h);
+  if (sum != rsum) {
+    snprintf(msg, size, "sum is %" PRIu64 ", expected %" PRIu64, sum, rsum);
+    return 0;
+  }
+  if (w == 0 || h == 0) return 1;
+  double stat[2] = { ImageRectMean(ii, x, y, w, h), ImageRectVariance(ii, x, y, w, h) };
+  double rstat[2] = { RefRectMean(img, x, y, w, h), RefRectVariance(img, x, y, w, h) };
+  for (int i = 0; i < 2; i++) {
+    double diff = stat[i] > rstat[i] ? stat[i] - rstat[i] : rstat[i] - stat[i];
+    if (diff > 1e-9 * (1.0 + rstat[i])) {
+      snprintf(msg, size, "%s is %.17g, expected %.17g",
+               i == 0 ? "mean" : "variance", stat[i], rstat[i]);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Label case c: label the components of the threshold of img1 (so that
+// the density of nonzero pixels varies), and compare the labels and the
+// component table with those of the reference.
+static int runLabel(const struct testCase* c, Image img1, Image ref1, char* msg, size_t size) {
+  RefThreshold(img1, (uint8)c->thr);
+  RefThreshold(ref1, (uint8)c->thr);
+  ImageComponents comps = ImageLabelComponents(img1, c->connectivity);
+  if (comps == NULL) error(2, errno, "label: %s", ImageErrMsg());
+  size_t pixels = (size_t)c->w1 * c->h1;
+  uint32_t* rlabels = (uint32_t*)malloc((pixels + 1) * sizeof(uint32_t));
+  ImageComponent* rtable = (ImageComponent*)malloc((pixels + 1) * sizeof(ImageComponent));
+  long rcount = rlabels != NULL && rtable != NULL ?
+                RefLabelComponents(ref1, c->connectivity, rlabels, rtable) : -1;
+  if (rcount < 0) error(2, ENOMEM, "label");
+
+  size_t count = ImageComponentsCount(comps);
+  const uint32_t* labels = ImageComponentsLabels(comps);
+  const ImageComponent* table = ImageComponentsTable(comps);
+  int ok = count == (size_t)rcount;
+  if (!ok) snprintf(msg, size, "%zu components, expected %ld", count, rcount);
+  for (size_t p = 0; ok && p < pixels; p++) {
+    if (labels[p] == rlabels[p]) continue;
+    snprintf(msg, size, "label of (%d,%d) is %u, expected %u",
+             (int)(p % c->w1), (int)(p / c->w1), labels[p], rlabels[p]);
+    ok = 0;
+  }
+  for (size_t l = 0; ok && l < count; l++) {
+    const ImageComponent* t = &table[l];
+    const ImageComponent* r = &rtable[l];
+    if (t->x == r->x && t->y == r->y && t->width == r->width && t->height == r->height &&
+        t->area == r->area) continue;
+    snprintf(msg, size, "component %zu is %d,%d,%d,%d with area %" PRIu64
+             ", expected %d,%d,%d,%d with area %" PRIu64, l + 1,
+             t->x, t->y, t->width, t->height, t->area, r->x, r->y, r->width, r->height, r->area);
+    ok = 0;
+  }
+  free(rlabels);
+  free(rtable);
+  ImageComponentsDestroy(&comps);
+  return ok;
+}
+
+// Save img to a PBM file and load it back.
+static Image1 reloadBinary(Image1 img) {
+  char name[64];
+  snprintf(name, sizeof(name), "/tmp/imageDiffTest-%d.pbm", (int)getpid());
+  if (!Image1Save(img, name)) error(2, errno, "%s: %s", name, Image1ErrMsg());
+  Image1 loaded = Image1Load(name);
+  if (loaded == NULL) error(2, errno, "%s: %s", name, Image1ErrMsg());
+  remove(name);
+  return loaded;
+}
+
+// Binary case c: threshold img1 and img2 to binary images, combine them,
+// and replace img1 with the result, through a PBM file.  Apply the same
+// to ref1, level by level (with ref2).  Returns 0 if the counts differ.
+static int runBinary(const struct testCase* c, Image* img1, Image img2,
+                     Image ref1, Image ref2, char* msg, size_t size) {
+  Image1 b1 = ImageThresholdToBinary(*img1, (uint8)c->thr);
+  Image1 b2 = ImageThresholdToBinary(img2, (uint8)c->thr);
+  if (b1 == NULL || b2 == NULL) error(2, errno, "binary: %s", Image1ErrMsg());
+  switch (c->logic) {
+  case 0: Image1Not(b1); break;
+  case 1: Image1And(b1, b2); break;
+  case 2: Image1Or(b1, b2); break;
+  case 3: Image1Xor(b1, b2); break;
+  }
+
+  // The reference: threshold and combine level by level (ref2 is kept)
+  uint64_t count = 0;
+  for (int y = 0; y < c->h1; y++) {
+    for (int x = 0; x < c->w1; x++) {
+      int p1 = ImageGetPixel(ref1, x, y) >= c->thr;
+      int p2 = ImageGetPixel(ref2, x, y) >= c->thr;
+      int bit = c->logic == 0 ? !p1 : c->logic == 1 ? p1 & p2 : c->logic == 2 ? p1 | p2 : p1 ^ p2;
+      ImageSetPixel(ref1, x, y, bit ? (uint8)c->maxval : 0);
+      count += bit;
+    }
+  }
+
+  int ok = Image1Count(b1) == count;
+  if (!ok) {
+    snprintf(msg, size, "count is %" PRIu64 ", expected %" PRIu64, Image1Count(b1), count);
+  } else {
+    Image1 loaded = reloadBinary(b1);
+    ImageDestroy(img1);
+    *img1 = Image1ToImage(loaded, (uint8)c->maxval);
+    if (*img1 == NULL) error(2, errno, "binary: %s", Image1ErrMsg());
+    Image1Destroy(&loaded);
+  }
+  Image1Destroy(&b1);
+  Image1Destroy(&b2);
+  return ok;
+}
+
+// Run case c, on the optimized and the reference implementations.
+// Returns 1 if the results are equal; otherwise, describes the difference
+// in msg and returns 0.
+static int runCase(const struct testCase* c, char* msg, size_t size) {
+  static int threads = 0;
+  if (c->threads != threads) {
+    threads = c->threads;
+    ImageSetThreads(threads);
+  }
+
+  Image img1, img2, ref1, ref2;
+  makeInputs(c, c->layout1, c->layout2, &img1, &img2);
+  makeInputs(c, IMAGE_RASTER, IMAGE_RASTER, &ref1, &ref2);
+  Image res = NULL;   // new image returned by the operation
+  Image rres = NULL;  // ... and by the reference
+  int ok = 1;
+
+  switch (c->op) {
+  case STATS: {
+    uint8 min, max, rmin, rmax;
+    ImageStats(img1, &min, &max);
+    RefStats(ref1, &rmin, &rmax);
+    if (min != rmin || max != rmax) {
+      snprintf(msg, size, "range [%d, %d], expected [%d, %d]", min, max, rmin, rmax);
+      ok = 0;
+    }
+    break;
+  }
+  case NEG: ImageNegative(img1); RefNegative(ref1); break;
+  case THR: ImageThreshold(img1, (uint8)c->thr); RefThreshold(ref1, (uint8)c->thr); break;
+  case BRI: ImageBrighten(img1, c->factor); RefBrighten(ref1, c->factor); break;
+  case ROTATE: res = ImageRotate(img1); rres = RefRotate(ref1); break;
+  case MIRROR: res = ImageMirror(img1); rres = RefMirror(ref1); break;
+  case CROP:
+    res = ImageCrop(img1, c->x, c->y, c->w2, c->h2);
+    rres = RefCrop(ref1, c->x, c->y, c->w2, c->h2);
+    break;
+  case PASTE: ImagePaste(img1, c->x, c->y, img2); RefPaste(ref1, c->x, c->y, ref2); break;
+  case BLEND:
+    ImageBlend(img1, c->x, c->y, img2, c->factor);
+    RefBlend(ref1, c->x, c->y, ref2, c->factor);
+    break;
+  case MATCH: {
+    int r = ImageMatchSubImage(img1, c->x, c->y, img2);
+    int rr = RefMatchSubImage(ref1, c->x, c->y, ref2);
+    if (r != rr) {
+      snprintf(msg, size, "returned %d, expected %d", r, rr);
+      ok = 0;
+    }
+    break;
+  }
+  case LOCATE: {
+    int x = -1, y = -1, rx = -1, ry = -1;
+    int r = ImageLocateSubImage(img1, &x, &y, img2);
+    int rr = RefLocateSubImage(ref1, &rx, &ry, ref2);
+    if (r != rr || x != rx || y != ry) {
+      snprintf(msg, size, "returned %d at (%d,%d), expected %d at (%d,%d)", r, x, y, rr, rx, ry);
+      ok = 0;
+    }
+    break;
+  }
+  case BLUR: ImageBlur(img1, c->dx, c->dy); RefBlur(ref1, c->dx, c->dy); break;
+  case DIFF: ImageDifference(img1, img2); RefDifference(ref1, ref2); break;
+  case AVG:
+    ImageRunningAverage(img1, img2, c->factor);
+    RefRunningAverage(ref1, ref2, c->factor);
+    break;
+  case MIN: ImageRunningMin(img1, img2); RefRunningMin(ref1, ref2); break;
+  case MAX: ImageRunningMax(img1, img2); RefRunningMax(ref1, ref2); break;
+  case LABEL: ok = runLabel(c, img1, ref1, msg, size); break;
+  case BINARY: ok = runBinary(c, &img1, img2, ref1, ref2, msg, size); break;
+  case RECT: {
+    // Statistics of the rectangle, and of the whole image, and then a blur,
+    // all from one integral image
+    ImageIntegral ii = ImageIntegralCreate(img1);
+    if (ii == NULL) error(2, errno, "%s: %s", opName[c->op], ImageErrMsg());
+    ok = sameRect(ref1, ii, c->x, c->y, c->w2, c->h2, msg, size) &&
+         sameRect(ref1, ii, 0, 0, c->w1, c->h1, msg, size);
+    if (ok) {
+      ImageBlurIntegral(img1, ii, c->dx, c->dy);
+      RefBlur(ref1, c->dx, c->dy);
+    }
+    ImageIntegralDestroy(&ii);
+    break;
+  }
+  case PLAIN: {
+    Image loaded = reloadPlain(img1, c->layout1);
+    ImageDestroy(&img1);
+    img1 = loaded;
+    break;
+  }
+  case STAGES: {
+    ImageStage st[MAXSTAGES];
+    makeStages(c, st);
+    ImageSetStageTile(c->tile);
+    if (!ImageApplyStages(img1, st, c->stages)) {
+      error(2, errno, "%s: %s", opName[c->op], ImageErrMsg());
+    }
+    for (int i = 0; i < c->stages; i++) {
+      switch (st[i].op) {
+      case STAGE_NEGATIVE: RefNegative(ref1); break;
+      case STAGE_THRESHOLD: RefThreshold(ref1, st[i].thr); break;
+      case STAGE_BRIGHTEN: RefBrighten(ref1, st[i].factor); break;
+      case STAGE_BLUR: RefBlur(ref1, st[i].dx, st[i].dy); break;
+      }
+    }
+    break;
+  }
+  }
+
+  if (ok) {
+    if (res != NULL || rres != NULL) {
+      if (res == NULL || rres == NULL) error(2, errno, "%s: %s", opName[c->op], ImageErrMsg());
+      ok = sameImage(rres, res, msg, size);
+    } else {
+      // Operations in-place modify img1 only
+      ok = sameImage(ref1, img1, msg, size);
+      if (ok && img2 != NULL) {
+        char msg2[128];
+        ok = sameImage(ref2, img2, msg2, sizeof(msg2));
+        if (!ok) snprintf(msg, size, "img2: %s", msg2);
+      }
+    }
+  }
+
+  ImageDestroy(&img1);
+  ImageDestroy(&img2);
+  ImageDestroy(&ref1);
+  ImageDestroy(&ref2);
+  ImageDestroy(&res);
+  ImageDestroy(&rres);
+  if (ok && c->scale > 0) ok = runWide(c, msg, size);
+  return ok;
+}
+
+
+// Shrinking
+
+// Candidate simplifications of an integer field: to lo, halfway, and one less.
+static int shrinkInt(struct testCase* c, int* field, int lo, char* msg, size_t size) {
+  int orig = *field;
+  int cand[3] = { lo, lo + (orig - lo) / 2, orig - 1 };
+  for (int i = 0; i < 3; i++) {
+    if (cand[i] < lo || cand[i] >= orig) continue;
+    *field = cand[i];
+    if (validCase(c) && !runCase(c, msg, size)) return 1;
+    *field = orig;
+  }
+  return 0;
+}
+
+// Candidate simplifications of a double field: fewer significant digits.
+static int shrinkDouble(struct testCase* c, double* field, char* msg, size_t size) {
+  double orig = *field;
+  for (double scale = 1.0; scale <= 1000.0; scale *= 10.0) {
+    double cand = (double)(long)(orig * scale) / scale;
+    if (cand == orig) break;
+    *field = cand;
+    if (runCase(c, msg, size)) {
+      *field = orig;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Shrink failing case c to a (locally) minimal failing case, by applying
+// simplifications while it still fails.
+// The size of the images goes first, as it makes the other steps faster.
+static void shrinkCase(struct testCase* c, char* msg, size_t size) {
+  int progress = 1;
+  while (progress) {
+    progress =
+        shrinkInt(c, &c->w1, 0, msg, size) ||
+        shrinkInt(c, &c->h1, 0, msg, size) ||
+        shrinkInt(c, &c->w2, 0, msg, size) ||
+        shrinkInt(c, &c->h2, 0, msg, size) ||
+        shrinkInt(c, &c->x, 0, msg, size) ||
+        shrinkInt(c, &c->y, 0, msg, size) ||
+        shrinkInt(c, &c->dx, 0, msg, size) ||
+        shrinkInt(c, &c->dy, 0, msg, size) ||
+        shrinkInt(c, &c->levels, 1, msg, size) ||
+        shrinkInt(c, &c->flip, -1, msg, size) ||
+        shrinkInt(c, &c->threads, 1, msg, size) ||
+        shrinkInt(c, &c->layout1, IMAGE_RASTER, msg, size) ||
+        shrinkInt(c, &c->layout2, IMAGE_RASTER, msg, size) ||
+        shrinkInt(c, &c->thr, 0, msg, size) ||
+        shrinkInt(c, &c->stages, 1, msg, size) ||
+        shrinkInt(c, &c->tile, 1, msg, size) ||
+        shrinkDouble(c, &c->factor, msg, size);
+  }
+  // Rerun, to describe the difference of the minimal case
+  runCase(c, msg, size);
+}
+
+// Save the inputs of case c, for reproduction with imageTool.
+static void saveInputs(const struct testCase* c) {
+  Image img1, img2;
+  char name[64];
+  makeInputs(c, IMAGE_RASTER, IMAGE_RASTER, &img1, &img2);
+  snprintf(name, sizeof(name), "diff-%s-1.pgm", opName[c->op]);
+  if (!ImageSave(img1, name)) error(0, errno, "%s: %s", name, ImageErrMsg());
+  if (img2 != NULL) {
+    snprintf(name, sizeof(name), "diff-%s-2.pgm", opName[c->op]);
+    if (!ImageSave(img2, name)) error(0, errno, "%s: %s", name, ImageErrMsg());
+  }
+  ImageDestroy(&img1);
+  ImageDestroy(&img2);
+}
+
+
+// Main
+
+static int parseInt(const char* s, const char* what) {
+  char* end;
+  long v = strtol(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || v < 0 || v > 1000000000) {
+    error(1, 0, "Invalid %s: %s", what, s);
+  }
+  return (int)v;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  uint32_t seed = 1;
+  int selected[NUMOPS];
+  for (int op = 0; op < NUMOPS; op++) selected[op] = 1;
+
+  for (int k = 1; k < ac; k++) {
+    if (strcmp(av[k], "--help") == 0) {
+      printf("%s", USAGE);
+      return 0;
+    }
+    if (k + 1 >= ac) error(1, 0, "Missing argument of %s\n%s", av[k], USAGE);
+    if (strcmp(av[k], "--cases") == 0) {
+      numCases = parseInt(av[++k], "number of cases");
+    } else if (strcmp(av[k], "--seed") == 0) {
+      seed = (uint32_t)parseInt(av[++k], "seed");
+    } else if (strcmp(av[k], "--max-size") == 0) {
+      maxSize = parseInt(av[++k], "size");
+    } else if (strcmp(av[k], "--threads") == 0) {
+      maxThreads = parseInt(av[++k], "number of threads");
+      if (maxThreads < 1) maxThreads = 1;
+    } else if (strcmp(av[k], "--ops") == 0) {
+      char* list = av[++k];
+      for (int op = 0; op < NUMOPS; op++) selected[op] = 0;
+      for (char* name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int op = 0;
+        while (op < NUMOPS && strcmp(name, opName[op]) != 0) op++;
+        if (op == NUMOPS) error(1, 0, "Unknown operation: %s", name);
+        selected[op] = 1;
+      }
+    } else {
+      error(1, 0, "Unknown option: %s\n%s", av[k], USAGE);
+    }
+  }
+
+  ImageInit();
+  // Run even the smallest cases in parallel, when they have several threads
+  ImageSetParallelThreshold(0);
+
+  int failed = 0;
+  char msg[256];
+  for (int op = 0; op < NUMOPS; op++) {
+    if (!selected[op]) continue;
+    rng = seed + op;
+    int k;
+    for (k = 0; k < numCases; k++) {
+      struct testCase c = randomCase(op);
+      if (!validCase(&c)) continue;  // not a requirement of op
+      uint32_t state = rng;  // runCase uses the generator too
+      if (!runCase(&c, msg, sizeof(msg))) {
+        printf("%-8s FAILED at case %d: ", opName[op], k);
+        printCase(stdout, &c);
+        shrinkCase(&c, msg, sizeof(msg));
+        printf("  minimal: ");
+        printCase(stdout, &c);
+        printf("  %s\n", msg);
+        if (op == STAGES) {
+          ImageStage st[MAXSTAGES];
+          makeStages(&c, st);
+          printf("  chain:");
+          printStages(stdout, st, c.stages);
+        }
+        saveInputs(&c);
+        failed++;
+        break;
+      }
+      rng = state;
+    }
+    if (k == numCases) printf("%-8s ok (%d cases)\n", opName[op], numCases);
+  }
+
+  return failed > 0;
+}
@@ -0,0 +1,154 @@
+/// imageKernels - Pixel kernels, generic in the pixel type.
+///
+/// This header is a template, with no include guard: it is included once
+/// per pixel type, after defining PIXEL (the type of pixel levels) and
+/// PIXEL_SUFFIX (appended to the names of the kernels), as in
+///
+///   #define PIXEL uint8
+///   #define PIXEL_SUFFIX 8
+///   #include "imageKernels.h"
+///
+/// which defines negativeLevel8, negativeRun8, ..., specialized for 8-bit
+/// pixels at compile time (PIXEL and PIXEL_SUFFIX are undefined at the end).
+/// image8bit.c and image16bit.c both instantiate it, so the arithmetic
+/// on pixel levels (rounding, saturation, ...) is written once for both.
+///
+/// Levels are transformed one at a time (the ...Level kernels) or in runs
+/// of n consecutive pixels (the ...Run kernels), which the compiler can
+/// vectorize.  Sums of levels are 64-bit for every pixel type.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+
+#if !defined(PIXEL) || !defined(PIXEL_SUFFIX)
+#error "define PIXEL and PIXEL_SUFFIX before including imageKernels.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define KERNEL_NAME_(name, suffix) name##suffix
+#define KERNEL_NAME(name, suffix) KERNEL_NAME_(name, suffix)
+#define K(name) KERNEL_NAME(name, PIXEL_SUFFIX)
+
+// The transformations of one pixel level
+
+static inline PIXEL K(negativeLevel)(PIXEL level, PIXEL maxval) {
+  return maxval - level;
+}
+
+static inline PIXEL K(thresholdLevel)(PIXEL level, PIXEL thr, PIXEL maxval) {
+  return (level < thr) ? 0 : maxval;
+}
+
+static inline PIXEL K(brightenLevel)(PIXEL level, double factor, double maxval) {
+  // Calculate the new pixel level after applying brightness factor
+  double newLevel = level * factor + 0.5;
+
+  // Saturate to [0, maxval], before converting to a pixel level
+  if (newLevel > maxval) newLevel = maxval;
+  if (newLevel < 0.0) newLevel = 0.0;
+  return (PIXEL)newLevel;
+}
+
+static inline PIXEL K(blendLevel)(PIXEL level1, PIXEL level2, double alpha, double maxval) {
+  // Calculate the blended pixel value using alpha
+  double blendedValue = (1.0 - alpha) * level1 + alpha * level2 + 0.5;
+
+  // Saturate to [0, maxval], before converting to a pixel level
+  if (blendedValue > maxval) blendedValue = maxval;
+  if (blendedValue < 0.0) blendedValue = 0.0;
+  return (PIXEL)blendedValue;
+}
+
+// The mean of a window, from its sum and its number of pixels
+static inline PIXEL K(meanLevel)(uint64_t sum, double count) {
+  return (PIXEL)((sum / count) + 0.5);
+}
+
+// The transformations of runs of n pixels, in-place
+
+static inline void K(negativeRun)(PIXEL* p, size_t n, PIXEL maxval) {
+  for (size_t i = 0; i < n; ++i) p[i] = K(negativeLevel)(p[i], maxval);
+}
+
+static inline void K(thresholdRun)(PIXEL* p, size_t n, PIXEL thr, PIXEL maxval) {
+  for (size_t i = 0; i < n; ++i) p[i] = K(thresholdLevel)(p[i], thr, maxval);
+}
+
+static inline void K(brightenRun)(PIXEL* p, size_t n, double factor, double maxval) {
+  for (size_t i = 0; i < n; ++i) p[i] = K(brightenLevel)(p[i], factor, maxval);
+}
+
+// Blend the run p2 into the run p1
+static inline void K(blendRun)(PIXEL* p1, const PIXEL* p2, size_t n,
+                               double alpha, double maxval) {
+  for (size_t i = 0; i < n; ++i) p1[i] = K(blendLevel)(p1[i], p2[i], alpha, maxval);
+}
+
+// Update (*min, *max) with the levels of a run
+static inline void K(minMaxRun)(const PIXEL* p, size_t n, PIXEL* min, PIXEL* max) {
+  PIXEL lo = *min;
+  PIXEL hi = *max;
+  for (size_t i = 0; i < n; ++i) {
+    if (p[i] < lo) lo = p[i];
+    if (p[i] > hi) hi = p[i];
+  }
+  *min = lo;
+  *max = hi;
+}
+
+// Copy the run src into dst, in reverse order
+static inline void K(mirrorRun)(PIXEL* dst, const PIXEL* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) dst[i] = src[n - 1 - i];
+}
+
+// Length of the longest common prefix of two runs
+// (n if they are equal, otherwise the index of the first difference)
+static inline size_t K(matchRun)(const PIXEL* p1, const PIXEL* p2, size_t n) {
+  size_t i = 0;
+  while (i < n && p1[i] == p2[i]) ++i;
+  return i;
+}
+
+// Running sums of a run, continuing from sum: sums[i] = sum + p[0] + ... + p[i].
+// Returns the last one.
+static inline uint64_t K(prefixRun)(const PIXEL* p, size_t n, uint64_t sum, uint64_t* sums) {
+  for (size_t i = 0; i < n; ++i) {
+    sum += p[i];
+    sums[i] = sum;
+  }
+  return sum;
+}
+
+// Running sums of the squares of a run, as prefixRun.
+static inline uint64_t K(prefixSquaresRun)(const PIXEL* p, size_t n, uint64_t sum, uint64_t* sums) {
+  for (size_t i = 0; i < n; ++i) {
+    sum += (uint64_t)p[i] * p[i];
+    sums[i] = sum;
+  }
+  return sum;
+}
+
+// Means of the windows of a row of width pixels, from a summed-area table:
+// top and bottom are the rows of the table (width+1 sums each) above and
+// below the window rows, which are rows in number.  Computes the means at
+// columns [x, x+n[ into out, with windows of dx pixels to each side,
+// clipped to the row as in ImageBlur.
+static inline void K(meanRun)(const uint64_t* top, const uint64_t* bottom, int width,
+                              int dx, double rows, int x, int n, PIXEL* out) {
+  for (int X = x; X < x + n; X++) {
+    // The window, clipped to the row, is [x0, x1[
+    int x0 = X - dx > 0 ? X - dx : 0;
+    int x1 = X + dx < width ? X + dx + 1 : width;
+
+    uint64_t sum = bottom[x1] - bottom[x0] - top[x1] + top[x0];
+    out[X - x] = K(meanLevel)(sum, (double)(x1 - x0) * rows);
+  }
+}
+
+#undef K
+#undef KERNEL_NAME
+#undef KERNEL_NAME_
+#undef PIXEL
+#undef PIXEL_SUFFIX
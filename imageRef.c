@@ -0,0 +1,361 @@
+/// imageRef - Reference implementations of the image8bit operations.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// These are written with the public interface of image8bit only,
+/// one pixel at a time: do NOT optimize them!
+
+#include "imageRef.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+/// Pixel stats
+
+void RefStats(Image img, uint8* min, uint8* max) { ///
+  assert (img != NULL);
+  *min = PixMax;
+  *max = 0;
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      uint8 level = ImageGetPixel(img, x, y);
+      if (level < *min) *min = level;
+      if (level > *max) *max = level;
+    }
+  }
+}
+
+/// Pixel transformations
+
+void RefNegative(Image img) { ///
+  assert (img != NULL);
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      ImageSetPixel(img, x, y, ImageMaxval(img) - ImageGetPixel(img, x, y));
+    }
+  }
+}
+
+void RefThreshold(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      uint8 level = ImageGetPixel(img, x, y) < thr ? 0 : ImageMaxval(img);
+      ImageSetPixel(img, x, y, level);
+    }
+  }
+}
+
+void RefBrighten(Image img, double factor) { ///
+  assert (img != NULL);
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      double level = ImageGetPixel(img, x, y) * factor + 0.5;
+      // Saturate, before converting to a pixel level
+      if (level > ImageMaxval(img)) level = ImageMaxval(img);
+      if (level < 0.0) level = 0.0;
+      ImageSetPixel(img, x, y, (uint8)level);
+    }
+  }
+}
+
+/// Geometric transformations
+
+Image RefRotate(Image img) { ///
+  assert (img != NULL);
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image rotated = ImageCreateLayout(h, w, ImageMaxval(img), ImageLayout(img));
+  if (rotated == NULL) return NULL;
+  // 90 degrees anti-clockwise: the top row becomes the left column
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      ImageSetPixel(rotated, y, w - 1 - x, ImageGetPixel(img, x, y));
+    }
+  }
+  return rotated;
+}
+
+Image RefMirror(Image img) { ///
+  assert (img != NULL);
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image mirrored = ImageCreateLayout(w, h, ImageMaxval(img), ImageLayout(img));
+  if (mirrored == NULL) return NULL;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      ImageSetPixel(mirrored, w - 1 - x, y, ImageGetPixel(img, x, y));
+    }
+  }
+  return mirrored;
+}
+
+Image RefCrop(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  Image cropped = ImageCreateLayout(w, h, ImageMaxval(img), ImageLayout(img));
+  if (cropped == NULL) return NULL;
+  for (int cy = 0; cy < h; cy++) {
+    for (int cx = 0; cx < w; cx++) {
+      ImageSetPixel(cropped, cx, cy, ImageGetPixel(img, x + cx, y + cy));
+    }
+  }
+  return cropped;
+}
+
+/// Operations on two images
+
+void RefPaste(Image img1, int x, int y, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidRect(img1, x, y, ImageWidth(img2), ImageHeight(img2)));
+  for (int cy = 0; cy < ImageHeight(img2); cy++) {
+    for (int cx = 0; cx < ImageWidth(img2); cx++) {
+      ImageSetPixel(img1, x + cx, y + cy, ImageGetPixel(img2, cx, cy));
+    }
+  }
+}
+
+void RefBlend(Image img1, int x, int y, Image img2, double alpha) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidRect(img1, x, y, ImageWidth(img2), ImageHeight(img2)));
+  for (int cy = 0; cy < ImageHeight(img2); cy++) {
+    for (int cx = 0; cx < ImageWidth(img2); cx++) {
+      double level = (1.0 - alpha) * ImageGetPixel(img1, x + cx, y + cy) +
+                     alpha * ImageGetPixel(img2, cx, cy) + 0.5;
+      // Saturate, before converting to a pixel level
+      if (level > ImageMaxval(img1)) level = ImageMaxval(img1);
+      if (level < 0.0) level = 0.0;
+      ImageSetPixel(img1, x + cx, y + cy, (uint8)level);
+    }
+  }
+}
+
+// Compare img2 to the subimage of img1 at (x, y), if there is one.
+static int matchAt(Image img1, int x, int y, Image img2) {
+  if (!ImageValidRect(img1, x, y, ImageWidth(img2), ImageHeight(img2))) {
+    return 0;
+  }
+  for (int cy = 0; cy < ImageHeight(img2); cy++) {
+    for (int cx = 0; cx < ImageWidth(img2); cx++) {
+      if (ImageGetPixel(img1, x + cx, y + cy) != ImageGetPixel(img2, cx, cy)) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+int RefMatchSubImage(Image img1, int x, int y, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageValidPos(img1, x, y));
+  return matchAt(img1, x, y, img2);
+}
+
+int RefLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  // The first match in raster scan order
+  for (int y = 0; y <= ImageHeight(img1) - ImageHeight(img2); y++) {
+    for (int x = 0; x <= ImageWidth(img1) - ImageWidth(img2); x++) {
+      if (matchAt(img1, x, y, img2)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/// Temporal operations
+
+void RefDifference(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageWidth(img1) == ImageWidth(img2) && ImageHeight(img1) == ImageHeight(img2));
+  for (int y = 0; y < ImageHeight(img1); y++) {
+    for (int x = 0; x < ImageWidth(img1); x++) {
+      int d = ImageGetPixel(img1, x, y) - ImageGetPixel(img2, x, y);
+      ImageSetPixel(img1, x, y, (uint8)(d < 0 ? -d : d));
+    }
+  }
+}
+
+void RefRunningAverage(Image img1, Image img2, double alpha) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageWidth(img1) == ImageWidth(img2) && ImageHeight(img1) == ImageHeight(img2));
+  assert (0.0 <= alpha && alpha <= 1.0);
+  // alpha in 1/256 units, as specified
+  int weight = (int)(alpha * 256 + 0.5);
+  for (int y = 0; y < ImageHeight(img1); y++) {
+    for (int x = 0; x < ImageWidth(img1); x++) {
+      int level = ImageGetPixel(img1, x, y) * (256 - weight) +
+                  ImageGetPixel(img2, x, y) * weight;
+      ImageSetPixel(img1, x, y, (uint8)((level + 128) / 256));
+    }
+  }
+}
+
+void RefRunningMin(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageWidth(img1) == ImageWidth(img2) && ImageHeight(img1) == ImageHeight(img2));
+  for (int y = 0; y < ImageHeight(img1); y++) {
+    for (int x = 0; x < ImageWidth(img1); x++) {
+      if (ImageGetPixel(img2, x, y) < ImageGetPixel(img1, x, y)) {
+        ImageSetPixel(img1, x, y, ImageGetPixel(img2, x, y));
+      }
+    }
+  }
+}
+
+void RefRunningMax(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (ImageWidth(img1) == ImageWidth(img2) && ImageHeight(img1) == ImageHeight(img2));
+  for (int y = 0; y < ImageHeight(img1); y++) {
+    for (int x = 0; x < ImageWidth(img1); x++) {
+      if (ImageGetPixel(img2, x, y) > ImageGetPixel(img1, x, y)) {
+        ImageSetPixel(img1, x, y, ImageGetPixel(img2, x, y));
+      }
+    }
+  }
+}
+
+/// Rectangle statistics
+
+uint64_t RefRectSum(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  uint64_t sum = 0;
+  for (int cy = y; cy < y + h; cy++) {
+    for (int cx = x; cx < x + w; cx++) {
+      sum += ImageGetPixel(img, cx, cy);
+    }
+  }
+  return sum;
+}
+
+double RefRectMean(Image img, int x, int y, int w, int h) { ///
+  assert (w > 0 && h > 0);
+  return (double)RefRectSum(img, x, y, w, h) / ((double)w * h);
+}
+
+double RefRectVariance(Image img, int x, int y, int w, int h) { ///
+  double mean = RefRectMean(img, x, y, w, h);
+  // The mean of the squared deviations from the mean
+  double sum = 0;
+  for (int cy = y; cy < y + h; cy++) {
+    for (int cx = x; cx < x + w; cx++) {
+      double d = ImageGetPixel(img, cx, cy) - mean;
+      sum += d * d;
+    }
+  }
+  return sum / ((double)w * h);
+}
+
+/// Connected components
+
+long RefLabelComponents(Image img, int connectivity, uint32_t* labels,
+                        ImageComponent* table) { ///
+  assert(img != NULL);
+  assert(connectivity == 4 || connectivity == 8);
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  size_t pixels = (size_t)w * h;
+  for (size_t p = 0; p < pixels; p++) labels[p] = 0;
+  // Pixels labeled but not yet visited (each is pushed once)
+  size_t* stack = (size_t*)malloc((pixels + 1) * sizeof(size_t));
+  if (stack == NULL) return -1;
+
+  long count = 0;
+  for (size_t p = 0; p < pixels; p++) {
+    if (labels[p] != 0 || ImageGetPixel(img, (int)(p % w), (int)(p / w)) == 0) continue;
+    uint32_t l = (uint32_t)++count;
+    ImageComponent* comp = &table[l - 1];
+    int x0 = w, y0 = h, x1 = -1, y1 = -1;  // bounding box, inclusive
+    comp->area = 0;
+    size_t top = 0;
+    labels[p] = l;
+    stack[top++] = p;
+    while (top > 0) {
+      size_t q = stack[--top];
+      int x = (int)(q % w);
+      int y = (int)(q / w);
+      comp->area++;
+      if (x < x0) x0 = x;
+      if (x > x1) x1 = x;
+      if (y < y0) y0 = y;
+      if (y > y1) y1 = y;
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          if (dx == 0 && dy == 0) continue;
+          if (connectivity == 4 && dx != 0 && dy != 0) continue;
+          int nx = x + dx;
+          int ny = y + dy;
+          if (!ImageValidPos(img, nx, ny)) continue;
+          size_t n = (size_t)ny * w + nx;
+          if (labels[n] != 0 || ImageGetPixel(img, nx, ny) == 0) continue;
+          labels[n] = l;
+          stack[top++] = n;
+        }
+      }
+    }
+    comp->x = x0;
+    comp->y = y0;
+    comp->width = x1 - x0 + 1;
+    comp->height = y1 - y0 + 1;
+  }
+  free(stack);
+  return count;
+}
+
+/// Filtering
+
+// The original implementation of ImageBlur, without instrumentation:
+// each pixel is the mean of the pixels of the window inside the image.
+void RefBlur(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+
+  // Create a copy of the image
+  Image blurredImg = ImageCreate(ImageWidth(img), ImageHeight(img), ImageMaxval(img));
+
+  // Check if image creation was successful
+  if (blurredImg == NULL) {
+    return;
+  }
+
+  // Iterate through the pixels of the original image to apply the blur
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      double sum = 0;
+      double count = 0;
+      // Iterate through the pixels in the neighborhood to calculate the mean
+      for (int cy = y - dy; cy <= y + dy; cy++) {
+        for (int cx = x - dx; cx <= x + dx; cx++) {
+          // Check if the current neighbor pixel is within the image bounds
+          if (ImageValidPos(img, cx, cy)) {
+            // Accumulate pixel values and count valid pixels
+            sum += ImageGetPixel(img, cx, cy);
+            count++;
+          }
+        }
+      }
+      // Calculate the mean value and set the blurred pixel in the temporary image
+      uint8 meanValue = (count > 0) ? (uint8)((sum / count) + 0.5) : 0;
+      ImageSetPixel(blurredImg, x, y, meanValue);
+    }
+  }
+
+  // Copy the blurred result back to the original image
+  RefPaste(img, 0, 0, blurredImg);
+
+  // Destroy the temporary image
+  ImageDestroy(&blurredImg);
+}
@@ -0,0 +1,65 @@
+/// imageRef - Reference implementations of the image8bit operations.
+///
+/// Each function does the same as the image8bit function of the same name
+/// (RefBlur as ImageBlur, ...), in the most straightforward way: pixel by
+/// pixel, with ImageGetPixel and ImageSetPixel only.  They are slow, but
+/// simple enough to be checked by reading them, so they are the oracle
+/// against which the optimized kernels are tested (see imageDiffTest.c).
+///
+/// They follow the specifications in image8bit.h, including their
+/// requirements (checked with assert) and failure conditions.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+
+#ifndef IMAGEREF_H
+#define IMAGEREF_H
+
+#include "image8bit.h"
+
+/// Pixel stats, as ImageStats.
+void RefStats(Image img, uint8* min, uint8* max) ;
+
+/// Pixel transformations, in-place, as ImageNegative, ...
+void RefNegative(Image img) ;
+void RefThreshold(Image img, uint8 thr) ;
+void RefBrighten(Image img, double factor) ;
+
+/// Geometric transformations, as ImageRotate, ...
+/// They return new images with the layout of img (or NULL on failure).
+Image RefRotate(Image img) ;
+Image RefMirror(Image img) ;
+Image RefCrop(Image img, int x, int y, int w, int h) ;
+
+/// Operations on two images, as ImagePaste, ...
+void RefPaste(Image img1, int x, int y, Image img2) ;
+void RefBlend(Image img1, int x, int y, Image img2, double alpha) ;
+int RefMatchSubImage(Image img1, int x, int y, Image img2) ;
+int RefLocateSubImage(Image img1, int* px, int* py, Image img2) ;
+
+/// Temporal operations, as ImageDifference, ...
+void RefDifference(Image img1, Image img2) ;
+void RefRunningAverage(Image img1, Image img2, double alpha) ;
+void RefRunningMin(Image img1, Image img2) ;
+void RefRunningMax(Image img1, Image img2) ;
+
+/// Rectangle statistics, as ImageRectSum, ..., but on the image itself
+/// (summing its pixels, for each query).
+uint64_t RefRectSum(Image img, int x, int y, int w, int h) ;
+double RefRectMean(Image img, int x, int y, int w, int h) ;
+double RefRectVariance(Image img, int x, int y, int w, int h) ;
+
+/// Connected components, as ImageLabelComponents, but into arrays given
+/// by the caller: labels (width*height labels) and table (room for a
+/// component per nonzero pixel).  Each component is flood filled from its
+/// first pixel, in raster order.
+/// Returns the number of components, or -1 if the flood fill stack cannot
+/// be allocated.
+long RefLabelComponents(Image img, int connectivity, uint32_t* labels,
+                        ImageComponent* table) ;
+
+/// Filtering, as ImageBlur (the original implementation).
+/// On failure, img is left unchanged and errno/errCause are set.
+void RefBlur(Image img, int dx, int dy) ;
+
+#endif
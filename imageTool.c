@@ -15,12 +15,21 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <glob.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
+#include "threadpool.h"
 
 static const char* USAGE =
     "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool [OPERATION...] --serve SOCKET\n"
+    "       imageTool [OPERATION...] --batch INPUTS [--out DIR] -- [OPERATION...]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,23 +38,42 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  The buffer has no fixed capacity: each image is destroyed as soon as\n"
+    "  no later operation uses it.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in 8-bit PGM format, raw (P5) or plain (P2), are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
+    "  shm:NAME stands for the image in POSIX shared memory object NAME,\n"
+    "  wherever a FILE is accepted (see ImageCreateShared).\n"
+    "  Files named *.imt are in the compressed tiled format (see\n"
+    "  ImageSaveCompressed): load and save convert from and to it.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
+    "  saveplain FILE  Save CURR to plain (ASCII) PGM file\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  prof            Print counters and times of each operation (scopes).\n"
+    "  perf            Also count cycles, cache misses, etc. (use it first).\n"
+    "  --metrics=FMT FILE  Write a record for each following operation to FILE\n"
+    "                  in format FMT (json or csv): name, size, bytes processed,\n"
+    "                  wall and cpu times, counters and throughput (MB/s)\n"
+    "  layout L        Use pixel layout L (raster, tiled, zorder) for new images\n"
+    "                  created by loading files or by create\n"
+    "\n"
+    "  keep NAME       Keep (a clone of) CURR as resident image NAME\n"
+    "  @NAME           Use resident image NAME, creating new image (a clone)\n"
+    "  drop NAME       Forget resident image NAME\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
+    "  clone           Clone CURR (sharing pixels until modified), creating new image\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
@@ -54,8 +82,30 @@ static const char* USAGE =
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "\n"
+    "  FILE stream ... Apply the operations after stream to each frame of the\n"
+    "                  multi-frame PGM stream FILE (- for stdin, or a FIFO),\n"
+    "                  loaded as I0.  Each save appends a frame to a stream\n"
+    "                  (save - writes to stdout: do not use info then).\n"
+    "  diff            Replace CURR by its difference to the previous frame\n"
+    "  avg ALPHA       Replace CURR by the running average of the frames,\n"
+    "                  ALPHA*CURR + (1-ALPHA)*(previous average)\n"
+    "  min, max        Replace CURR by the running minimum (maximum) of the frames\n"
+    "\n"
+    "  vcrop FILE X,Y,W,H  Crop a rectangle from compressed tiled FILE (*.imt),\n"
+    "                  reading only the tiles it needs, creating new image\n"
+    "  vlocate FILE    Search CURR in compressed tiled FILE, a strip at a time,\n"
+    "                  print matching position, or NOTFOUND\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "\n"
+    "  blobs N         Label the connected components of the nonzero pixels of\n"
+    "                  CURR, with N-connectivity (4 or 8), print their number,\n"
+    "                  and the area and bounding box (X,Y,W,H) of each\n"
+    "\n"
+    "  fuse            Apply each run of consecutive neg, thr, bri and blur\n"
+    "                  operations after this one in a single pass over CURR,\n"
+    "                  tile by tile, in cache (see ImageApplyStages)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
@@ -63,20 +113,241 @@ static const char* USAGE =
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
     "\n"
+    "SERVER:\n"
+    "  --serve SOCKET  After the operations before it, serve requests on the\n"
+    "                  Unix domain socket SOCKET (or on stdin, if SOCKET is -).\n"
+    "                  Each request is a line with a pipeline of operations,\n"
+    "                  as above (except perf, --metrics and --serve).  The reply\n"
+    "                  is its output, then a line with OK or ERROR message.\n"
+    "                  Images are not kept from one request to the next, except\n"
+    "                  resident images (see keep), so load the source images\n"
+    "                  once and keep them.  Results may be saved to files or\n"
+    "                  to shared memory (save shm:NAME), for other processes\n"
+    "                  to open with no copying.  Requests on distinct\n"
+    "                  connections run concurrently.  The request shutdown\n"
+    "                  stops the server.\n"
+    "\n"
+    "BATCH:\n"
+    "  --batch INPUTS [--out DIR] -- PIPELINE\n"
+    "                  After the operations before it, apply the operations\n"
+    "                  of PIPELINE to each input (loaded as I0), and save the\n"
+    "                  final CURR to DIR, with the name of the input.\n"
+    "                  INPUTS is a comma-separated list of files or glob\n"
+    "                  patterns (quote them), or - to read names from stdin.\n"
+    "                  Inputs are processed in parallel (see IMAGE_THREADS),\n"
+    "                  read ahead and saved in the background.  A summary\n"
+    "                  with the result and times of each input is printed.\n"
+    "\n"
     ;
 
 static char* errors[] = {
   "Success",
   "Insufficient operands",
   "Insufficient images",
-  "Image buffer is full",
+  "Cannot allocate the image buffer",
   "Image8bit failure: %s",
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Cannot open metrics file",
+  "Unknown resident image",
+  "Operation not allowed in server requests",
+  "Cannot serve on socket",
+  "Batch failed for some inputs",
+  "Temporal operation outside a stream",
 };
 
 
+// Metrics output (--metrics=FMT FILE)
+//
+// Each operation of the image8bit module reports its metrics through a
+// hook, which writes them to the metrics file, as one JSON object per
+// line, or as one CSV row per operation (after a header row).
+
+struct metricsFile {
+  FILE* f;
+  int json;     // JSON Lines if nonzero, else CSV
+  int records;  // number of records written
+};
+
+static void writeMetrics(const ImageMetrics* m, void* arg) {
+  struct metricsFile* mf = (struct metricsFile*)arg;
+  const InstrSample* s = &m->sample;
+  double mbps = s->wall > 0.0 ? m->bytes / s->wall / 1e6 : 0.0;
+  FILE* f = mf->f;
+  flockfile(f);  // one record at a time, if operations run concurrently
+  if (mf->json) {
+    fprintf(f, "{\"op\":\"%s\",\"width\":%d,\"height\":%d,\"bytes\":%zu,"
+               "\"wall\":%.9f,\"cpu\":%.9f,\"mbps\":%.3f",
+            m->op, m->width, m->height, m->bytes, s->wall, s->cpu, mbps);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        fprintf(f, ",\"%s\":%lu", InstrName[i], s->count[i]);
+    for (int i = 0; i < NUMPERF; i++)
+      if (InstrPerfAvailable(i))
+        fprintf(f, ",\"%s\":%llu", InstrPerfName[i], s->perf[i]);
+    fprintf(f, "}\n");
+  } else {
+    if (mf->records == 0) {
+      fprintf(f, "op,width,height,bytes,wall,cpu,mbps");
+      for (int i = 0; i < NUMCOUNTERS; i++)
+        if (InstrName[i] != NULL)
+          fprintf(f, ",%s", InstrName[i]);
+      for (int i = 0; i < NUMPERF; i++)
+        fprintf(f, ",%s", InstrPerfName[i]);
+      fprintf(f, "\n");
+    }
+    fprintf(f, "%s,%d,%d,%zu,%.9f,%.9f,%.3f",
+            m->op, m->width, m->height, m->bytes, s->wall, s->cpu, mbps);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        fprintf(f, ",%lu", s->count[i]);
+    for (int i = 0; i < NUMPERF; i++) {
+      if (InstrPerfAvailable(i)) fprintf(f, ",%llu", s->perf[i]);
+      else fprintf(f, ",");
+    }
+    fprintf(f, "\n");
+  }
+  fflush(f);
+  mf->records++;
+  funlockfile(f);
+}
+
+
+// Files and shared memory images
+//
+// Images may be loaded from, and saved to, PGM files or (with names
+// shm:NAME) POSIX shared memory objects.
+
+#define SHM_PREFIX "shm:"
+
+// Suffix of the names of compressed tiled files
+#define IMT_SUFFIX ".imt"
+
+// Size of the tile cache of virtual images (in bytes of decoded pixels)
+#define IMT_CACHE (64 << 20)
+
+// Is name that of a compressed tiled file?
+static int isCompressed(const char* name) {
+  size_t n = strlen(name);
+  return n >= strlen(IMT_SUFFIX) && strcmp(name + n - strlen(IMT_SUFFIX), IMT_SUFFIX) == 0;
+}
+
+// Load image from file or shared memory name, with the given layout.
+static Image loadImage(const char* name, int layout) {
+  Image img;
+  if (strncmp(name, SHM_PREFIX, strlen(SHM_PREFIX)) == 0) {
+    img = ImageOpenShared(name + strlen(SHM_PREFIX));
+  } else if (isCompressed(name)) {
+    VImage v = VImageOpen(name, IMT_CACHE);
+    if (v == NULL) return NULL;
+    img = VImageCrop(v, 0, 0, VImageWidth(v), VImageHeight(v));
+    VImageClose(&v);
+  } else {
+    return ImageLoadLayout(name, layout);
+  }
+  if (img != NULL && layout != IMAGE_RASTER) {
+    // These images are raster scans: convert (copying the pixels)
+    Image converted = ImageConvertLayout(img, layout);
+    ImageDestroy(&img);
+    img = converted;
+  }
+  return img;
+}
+
+// Save image to file or shared memory name.  Returns 0 on failure.
+static int saveImage(Image img, const char* name) {
+  if (isCompressed(name)) {
+    return ImageSaveCompressed(img, name, 0);
+  }
+  if (strncmp(name, SHM_PREFIX, strlen(SHM_PREFIX)) != 0) {
+    return ImageSave(img, name);
+  }
+  Image shared = ImageCreateShared(name + strlen(SHM_PREFIX), ImageWidth(img),
+                                   ImageHeight(img), ImageMaxval(img));
+  if (shared == NULL) return 0;
+  ImagePaste(shared, 0, 0, img);  // in place, never fails
+  ImageDestroy(&shared);
+  return 1;
+}
+
+
+// Resident images
+//
+// Images kept by name (with keep), which outlive the pipeline that created
+// them, so that the requests of a server can share them.  Each is a clone:
+// it shares the pixels of the kept image, and later changes to either one
+// copy them first (copy-on-write).  The list is shared by all threads.
+
+struct resident {
+  char* name;
+  Image img;
+  struct resident* next;
+};
+
+static struct resident* residents = NULL;
+static pthread_mutex_t residentsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Find the resident named name (call with the lock held).
+static struct resident** residentFind(const char* name) {
+  struct resident** r = &residents;
+  while (*r != NULL && strcmp((*r)->name, name) != 0) r = &(*r)->next;
+  return r;
+}
+
+// Keep a clone of img as resident name, replacing any previous one.
+// Returns 0 on failure, with errno/ImageErrMsg set.
+static int residentKeep(const char* name, Image img) {
+  Image clone = ImageClone(img);
+  if (clone == NULL) return 0;
+  pthread_mutex_lock(&residentsLock);
+  struct resident** r = residentFind(name);
+  if (*r == NULL) {
+    *r = (struct resident*)calloc(1, sizeof(struct resident));
+    if (*r == NULL || ((*r)->name = strdup(name)) == NULL) {
+      free(*r);
+      *r = NULL;
+      pthread_mutex_unlock(&residentsLock);
+      ImageDestroy(&clone);
+      return 0;
+    }
+  }
+  ImageDestroy(&(*r)->img);
+  (*r)->img = clone;
+  pthread_mutex_unlock(&residentsLock);
+  return 1;
+}
+
+// Return a clone of resident name, or NULL if there is none (errno = 0),
+// or on failure (errno set).
+static Image residentClone(const char* name) {
+  pthread_mutex_lock(&residentsLock);
+  struct resident* r = *residentFind(name);
+  errno = 0;
+  Image clone = r != NULL ? ImageClone(r->img) : NULL;
+  pthread_mutex_unlock(&residentsLock);
+  return clone;
+}
+
+// Forget resident name.  Returns 0 if there is none.
+static int residentDrop(const char* name) {
+  pthread_mutex_lock(&residentsLock);
+  struct resident** r = residentFind(name);
+  struct resident* found = *r;
+  if (found != NULL) *r = found->next;
+  pthread_mutex_unlock(&residentsLock);
+  if (found == NULL) return 0;
+  ImageDestroy(&found->img);
+  free(found->name);
+  free(found);
+  return 1;
+}
+
+static void residentDropAll(void) {
+  while (residents != NULL) residentDrop(residents->name);
+}
+
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations, and
@@ -85,24 +356,197 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Metrics output, if any
+static struct metricsFile metrics = { NULL, 0, 0 };
+
+// Liveness of the images of a pipeline
+//
+// Operations only use CURR and PRED, the last two images created, so a
+// pass over the arguments that tracks the number of images created finds
+// the last operation that uses each image.  The pipeline destroys each
+// image right after that operation, so it holds only the images that are
+// still needed.
+
+// Operations: name, number of operands, number of images used (1: CURR,
+// 2: also PRED), and whether a new image is created.
+// (Other arguments are files or resident images: they create images.)
+struct opInfo {
+  const char* name;
+  int operands;
+  int uses;
+  int creates;
+};
+
+static const struct opInfo opTable[] = {
+  { "info", 0, 1, 0 }, { "tic", 0, 0, 0 }, { "toc", 0, 0, 0 },
+  { "prof", 0, 0, 0 }, { "perf", 0, 0, 0 }, { "layout", 1, 0, 0 },
+  { "keep", 1, 1, 0 }, { "drop", 1, 0, 0 },
+  { "neg", 0, 1, 0 }, { "thr", 1, 1, 0 }, { "bri", 1, 1, 0 },
+  { "create", 1, 0, 1 }, { "clone", 0, 1, 1 }, { "rotate", 0, 1, 1 },
+  { "mirror", 0, 1, 1 }, { "crop", 1, 1, 1 },
+  { "paste", 1, 2, 0 }, { "blend", 1, 2, 0 }, { "locate", 0, 2, 0 },
+  { "blur", 1, 1, 0 }, { "blobs", 1, 1, 0 }, { "save", 1, 1, 0 }, { "saveplain", 1, 1, 0 },
+  { "fuse", 0, 0, 0 },
+  { "vcrop", 2, 0, 1 }, { "vlocate", 1, 1, 0 },
+  { "stream", 0, 0, 0 }, { "diff", 0, 1, 0 }, { "avg", 1, 1, 0 },
+  { "min", 0, 1, 0 }, { "max", 0, 1, 0 },
+};
+
+// Find the last use of each image created by the operations in
+// av[k..ac-1], after the given number of images already in the buffer.
+// Returns the array of positions (in av) of the last operation that uses
+// each image (or that creates it, if none uses it), and sets (*count) to
+// the number of images.  Returns NULL if it cannot be allocated.
+static int* planLiveness(int ac, char* av[], int k, int images, int* count) {
+  int n = images;
+  int cap = n + 16;
+  int* lastUse = (int*)malloc(cap * sizeof(int));
+  if (lastUse == NULL) return NULL;
+  for (int i = 0; i < n; i++) lastUse[i] = k - 1;
+
+  while (k < ac) {
+    struct opInfo info = { NULL, 0, 0, 1 };  // a file, by default
+    if (strncmp(av[k], "--metrics=", 10) == 0) {
+      info.operands = 1;
+      info.creates = 0;
+    }
+    for (size_t i = 0; i < sizeof(opTable) / sizeof(opTable[0]); i++) {
+      if (strcmp(av[k], opTable[i].name) == 0) info = opTable[i];
+    }
+    for (int u = 1; u <= info.uses && u <= n; u++) {
+      lastUse[n - u] = k;
+    }
+    if (info.creates) {
+      if (n == cap) {
+        cap *= 2;
+        int* grown = (int*)realloc(lastUse, cap * sizeof(int));
+        if (grown == NULL) {
+          free(lastUse);
+          return NULL;
+        }
+        lastUse = grown;
+      }
+      lastUse[n++] = k;
+    }
+    k += 1 + info.operands;
   }
+  *count = n;
+  return lastUse;
+}
 
-  ImageInit();
+// Maximum number of operations applied in one pass (longer runs take more)
+#define MAXSTAGES 16
+
+// Parse the operation at av[k] into stage (*st), if it may be fused,
+// and advance k to its last operand.
+// Returns -1 if it may not be fused, 0 on success, or the index of the
+// error message in errors.
+static int parseStage(int ac, char* av[], int* k, ImageStage* st) {
+  memset(st, 0, sizeof(*st));
+  if (strcmp(av[*k], "neg") == 0) {
+    st->op = STAGE_NEGATIVE;
+    return 0;
+  }
+  if (strcmp(av[*k], "thr") == 0) st->op = STAGE_THRESHOLD;
+  else if (strcmp(av[*k], "bri") == 0) st->op = STAGE_BRIGHTEN;
+  else if (strcmp(av[*k], "blur") == 0) st->op = STAGE_BLUR;
+  else return -1;
+  if (++*k >= ac) return 1;
+  if (st->op == STAGE_THRESHOLD) {
+    if (sscanf(av[*k], "%hhu", &st->thr) != 1) return 5;
+  } else if (st->op == STAGE_BRIGHTEN) {
+    if (sscanf(av[*k], "%lf", &st->factor) != 1) return 5;
+  } else {
+    if (sscanf(av[*k], "%d,%d", &st->dx, &st->dy) != 2) return 5;
+    if (st->dx < 0 || st->dy < 0) return 5;   // precondition check!
+  }
+  return 0;
+}
+
+// Streams (FILE stream PIPELINE)
+//
+// The pipeline after stream runs once for each frame of the stream, with
+// the frame as I0.  Each frame is read into the final CURR of the previous
+// one (when it has the same size), so pipelines that work in-place run
+// with no allocation of frame buffers.  Temporal operations keep their
+// state from one frame to the next, and saves append frames to output
+// streams, which stay open until the end.
+
+struct streamOutput {
+  char* name;
+  ImageStream s;
+  struct streamOutput* next;
+};
+
+struct streamState {
+  Image* state;                   // of the temporal operation at each position of av
+  struct streamOutput* outputs;   // the output streams
+};
 
+static int runStream(int ac, char* av[], int k, const char* name, FILE* out, int served);
+
+// Get the output stream named name of ss, opening it the first time.
+// Returns NULL on failure.
+static ImageStream streamOutput(struct streamState* ss, const char* name) {
+  struct streamOutput* o;
+  for (o = ss->outputs; o != NULL; o = o->next) {
+    if (strcmp(o->name, name) == 0) return o->s;
+  }
+  o = (struct streamOutput*)malloc(sizeof(*o));
+  if (o == NULL) return NULL;
+  o->name = strdup(name);
+  o->s = o->name != NULL ? ImageStreamOpenWrite(name) : NULL;
+  if (o->s == NULL) {
+    free(o->name);
+    free(o);
+    return NULL;
+  }
+  o->next = ss->outputs;
+  ss->outputs = o;
+  return o->s;
+}
+
+// Run the pipeline of operations in av[k..ac-1], writing their results
+// to out.  Operations that would change the whole process (perf, metrics)
+// are not allowed if served (in requests to a server).
+// Returns 0 on success, or the index of the error message in errors.
+// If io is not NULL, the pipeline starts with image (*io) as I0 (it takes
+// it over), and on success, it leaves its final CURR in (*io).
+// If ss is not NULL, the pipeline runs on a frame of a stream, with the
+// state ss of the stream.
+static int runPipeline(int ac, char* av[], int k, FILE* out, int served, Image* io,
+                       struct streamState* ss) {
   int err = 0;
   int x, y, w, h;
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
+  // Pixel layout for loaded and created images
+  int layout = IMAGE_RASTER;
+
+  // Apply runs of pixel transformations and blurs in one pass (see fuse)?
+  int fuse = 0;
+
+  // The image buffer, with room for all the images the pipeline creates
+  int N = 0;          // buffer capacity
+  int* lastUse = planLiveness(ac, av, k, io != NULL && *io != NULL, &N);
+  Image* img = (Image*)calloc(N > 0 ? N : 1, sizeof(Image));  // the images
   int n = 0;          // number of images created
+  if (lastUse == NULL || img == NULL) {
+    free(lastUse);
+    free(img);
+    if (io != NULL) ImageDestroy(io);
+    return 3;
+  }
+  if (io != NULL && N > 0) {
+    lastUse[N-1] = ac;  // the final CURR is handed over
+  }
+
+  if (io != NULL && *io != NULL) {
+    img[n++] = *io;
+    *io = NULL;
+  }
 
-  int k = 1;
   while (k < ac) {
+    int op = k;  // position of the operation (k moves to its operands)
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
@@ -111,12 +555,72 @@ int main(int ac, char* av[]) {
       h = ImageHeight(img[n-1]);
       uint8 maxval = ImageMaxval(img[n-1]);
       ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      fprintf(out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+      fprintf(out, "# Gray level range: [%hhu, %hhu]\n", min, max);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
+    } else if (strcmp(av[k], "prof") == 0) {
+      InstrPrintScopes();
+    } else if (strcmp(av[k], "perf") == 0) {
+      if (served) { err = 10; break; }
+      if (InstrPerfOpen() == 0) {
+        fprintf(stderr, "Hardware performance counters not available\n");
+      }
+    } else if (strncmp(av[k], "--metrics=", 10) == 0) {
+      if (served) { err = 10; break; }
+      const char* fmt = av[k] + 10;
+      if (strcmp(fmt, "json") != 0 && strcmp(fmt, "csv") != 0) { err = 5; break; }
+      if (++k >= ac) { err = 1; break; }
+      if (metrics.f != NULL) fclose(metrics.f);
+      metrics.f = fopen(av[k], "w");
+      if (metrics.f == NULL) { err = 8; break; }
+      metrics.json = strcmp(fmt, "json") == 0;
+      metrics.records = 0;
+      ImageSetMetricsHook(writeMetrics, &metrics);
+    } else if (strcmp(av[k], "layout") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (strcmp(av[k], "raster") == 0) layout = IMAGE_RASTER;
+      else if (strcmp(av[k], "tiled") == 0) layout = IMAGE_TILED;
+      else if (strcmp(av[k], "zorder") == 0) layout = IMAGE_ZORDER;
+      else { err = 5; break; }
+    } else if (strcmp(av[k], "keep") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Keeping I%d as @%s\n", n-1, av[k]);
+      if (!residentKeep(av[k], img[n-1])) { err = 4; break; }
+    } else if (strcmp(av[k], "drop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      fprintf(stderr, "Dropping @%s\n", av[k]);
+      if (!residentDrop(av[k])) { err = 9; break; }
+    } else if (av[k][0] == '@') {
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Using @%s -> I%d\n", av[k] + 1, n);
+      img[n] = residentClone(av[k] + 1);
+      if (img[n] == NULL) { err = errno == 0 ? 9 : 4; break; }
+      n++;
+    } else if (strcmp(av[k], "fuse") == 0) {
+      fuse = 1;
+    } else if (fuse && (strcmp(av[k], "neg") == 0 || strcmp(av[k], "thr") == 0 ||
+                        strcmp(av[k], "bri") == 0 || strcmp(av[k], "blur") == 0)) {
+      if (n < 1) { err = 2; break; }
+      // Gather the run of operations that may be fused
+      ImageStage st[MAXSTAGES];
+      int ns = 0;
+      while (k < ac && ns < MAXSTAGES) {
+        int next = k;
+        int r = parseStage(ac, av, &next, &st[ns]);
+        if (r < 0) break;
+        if (r > 0) { err = r; break; }
+        op = k;
+        k = next + 1;
+        ns++;
+      }
+      if (err != 0) break;
+      k--;  // at the last operand of the run
+      fprintf(stderr, "Applying %d fused operations to I%d\n", ns, n-1);
+      if (!ImageApplyStages(img[n-1], st, ns)) { err = 4; break; }
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Negating I%d\n", n-1);
@@ -141,7 +645,21 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
+      img[n] = ImageCreateLayout(w, h, PixMax, layout);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "clone") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Cloning I%d -> I%d\n", n-1, n);
+      if (lastUse[n-1] == op) {
+        // I(n-1) is not used again: just move it, so that it does not
+        // share its pixels, and modifying the clone does not copy them
+        img[n] = img[n-1];
+        img[n-1] = NULL;
+      } else {
+        img[n] = ImageClone(img[n-1]);
+      }
       if (img[n] == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
@@ -191,9 +709,50 @@ int main(int ac, char* av[]) {
       if (n < 2) { err = 2; break; }
       fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
       if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
+        fprintf(out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(out, "# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "vcrop") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      const char* file = av[++k];
+      if (sscanf(av[++k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      VImage v = VImageOpen(file, IMT_CACHE);
+      if (v == NULL) { err = 4; break; }
+      if (x < 0 || y < 0 || w < 0 || h < 0 ||
+          w > VImageWidth(v) - x || h > VImageHeight(v) - y) {   // precondition check!
+        VImageClose(&v);
+        err = 5;
+        break;
+      }
+      img[n] = VImageCrop(v, x, y, w, h);
+      unsigned long hits, misses;
+      VImageCacheStats(v, &hits, &misses);
+      VImageClose(&v);
+      fprintf(stderr, "Cropping %s (%d,%d,%d,%d) -> I%d (%lu tiles read)\n",
+              file, x, y, w, h, n, misses);
+      if (img[n] == NULL) { err = 4; break; }
+      if (layout != IMAGE_RASTER) {
+        Image converted = ImageConvertLayout(img[n], layout);
+        ImageDestroy(&img[n]);
+        img[n] = converted;
+        if (img[n] == NULL) { err = 4; break; }
+      }
+      n++;
+    } else if (strcmp(av[k], "vlocate") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Locating I%d in %s\n", n-1, av[k]);
+      VImage v = VImageOpen(av[k], IMT_CACHE);
+      if (v == NULL) { err = 4; break; }
+      int found = VImageLocateSubImage(v, &x, &y, img[n-1]);
+      VImageClose(&v);
+      if (found < 0) { err = 4; break; }
+      if (found) {
+        fprintf(out, "# FOUND (%d,%d)\n", x, y);
       } else {
-        printf("# NOTFOUND\n");
+        fprintf(out, "# NOTFOUND\n");
       }
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
@@ -202,27 +761,604 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
       ImageBlur(img[n-1], dx, dy);
+    } else if (strcmp(av[k], "blobs") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int connectivity;
+      if (sscanf(av[k], "%d", &connectivity) != 1) { err = 5; break; }
+      if (connectivity != 4 && connectivity != 8) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Labeling the components of I%d\n", n-1);
+      ImageComponents comps = ImageLabelComponents(img[n-1], connectivity);
+      if (comps == NULL) { err = 4; break; }
+      size_t count = ImageComponentsCount(comps);
+      const ImageComponent* table = ImageComponentsTable(comps);
+      fprintf(out, "# Components: %zu\n", count);
+      for (size_t l = 0; l < count; l++) {
+        const ImageComponent* comp = &table[l];
+        fprintf(out, "# %zu: area %" PRIu64 ", box %d,%d,%d,%d\n", l + 1, comp->area,
+                comp->x, comp->y, comp->width, comp->height);
+      }
+      ImageComponentsDestroy(&comps);
+    } else if (strcmp(av[k], "diff") == 0 || strcmp(av[k], "avg") == 0 ||
+               strcmp(av[k], "min") == 0 || strcmp(av[k], "max") == 0) {
+      double alpha = 0.0;
+      if (strcmp(av[k], "avg") == 0) {
+        if (++k >= ac) { err = 1; break; }
+        if (sscanf(av[k], "%lf", &alpha) != 1) { err = 5; break; }
+        if (!(0.0 <= alpha && alpha <= 1.0)) { err = 7; break; }
+      }
+      if (n < 1) { err = 2; break; }
+      if (ss == NULL) { err = 13; break; }
+      Image curr = img[n-1];
+      Image* state = &ss->state[op];
+      if (*state != NULL && (ImageWidth(*state) != ImageWidth(curr) ||
+                             ImageHeight(*state) != ImageHeight(curr))) {
+        ImageDestroy(state);  // the size changed: start over
+      }
+      int first = *state == NULL;
+      if (first) {
+        // The first frame: the state starts as a copy of it
+        *state = ImageCreateLayout(ImageWidth(curr), ImageHeight(curr),
+                                   ImageMaxval(curr), ImageLayout(curr));
+        if (*state == NULL) { err = 4; break; }
+        ImagePaste(*state, 0, 0, curr);
+      }
+      if (strcmp(av[op], "diff") == 0) {
+        fprintf(stderr, "Differencing I%d with the previous frame\n", n-1);
+        // The state becomes the difference, and the frame the new state
+        ImageDifference(*state, curr);
+        img[n-1] = *state;
+        *state = curr;
+      } else if (!first) {  // (the first average, min or max is the frame)
+        if (strcmp(av[op], "avg") == 0) {
+          fprintf(stderr, "Averaging I%d into the running average, alpha=%.3f\n", n-1, alpha);
+          ImageRunningAverage(*state, curr, alpha);
+        } else if (strcmp(av[op], "min") == 0) {
+          fprintf(stderr, "Running minimum of I%d\n", n-1);
+          ImageRunningMin(*state, curr);
+        } else {
+          fprintf(stderr, "Running maximum of I%d\n", n-1);
+          ImageRunningMax(*state, curr);
+        }
+        ImagePaste(curr, 0, 0, *state);
+      }
     } else if (strcmp(av[k], "save") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (ss != NULL && strncmp(av[k], SHM_PREFIX, strlen(SHM_PREFIX)) != 0) {
+        fprintf(stderr, "Streaming %s <- I%d\n", av[k], n-1);
+        ImageStream s = streamOutput(ss, av[k]);
+        if (s == NULL || !ImageStreamWrite(s, img[n-1])) { err = 4; break; }
+      } else {
+        fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
+        if (saveImage(img[n-1], av[k]) == 0) { err = 4; break; }
+      }
+    } else if (strcmp(av[k], "saveplain") == 0) {
+      // Plain files only (they cannot be streamed, nor in shared memory)
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if (ImageSavePlain(img[n-1], av[k]) == 0) { err = 4; break; }
+    } else if (k + 1 < ac && strcmp(av[k+1], "stream") == 0) {
+      if (ss != NULL) { err = 5; break; }  // streams do not nest
+      fprintf(stderr, "Streaming frames of %s\n", av[k]);
+      err = runStream(ac, av, k + 2, av[k], out, served);
+      if (err != 0) break;
+      k = ac - 1;  // the stream ran the rest of the pipeline
     } else {  // image file
       if (n >= N) { err = 3; break; }
       fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      img[n] = loadImage(av[k], layout);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     }
     k++;
+
+    // Destroy the images that no later operation uses
+    // (only the last three may have been used or created by this one)
+    for (int i = n > 3 ? n - 3 : 0; i < n; i++) {
+      if (lastUse[i] <= op) ImageDestroy(&img[i]);
+    }
   }
   
+  // Hand over CURR, if requested
+  if (io != NULL && err == 0 && n > 0) {
+    *io = img[--n];
+  }
+
   // Destroy remaining images
   while (n > 0) {
     ImageDestroy(&img[--n]);
   }
+  free(img);
+  free(lastUse);
+
+  return err;
+}
+
+
+// Run the pipeline of operations in av[k..ac-1] on each frame of the
+// stream name, as in runPipeline.
+static int runStream(int ac, char* av[], int k, const char* name, FILE* out, int served) {
+  struct streamState ss = { (Image*)calloc(ac, sizeof(Image)), NULL };
+  ImageStream in = ImageStreamOpenRead(name);
+  Image frame = NULL;
+  unsigned long frames = 0;
+  int err = ss.state == NULL ? 3 : in == NULL ? 4 : 0;
+  while (err == 0) {
+    int r = ImageStreamRead(in, &frame);
+    if (r <= 0) {
+      if (r < 0) err = 4;
+      break;
+    }
+    err = runPipeline(ac, av, k, out, served, &frame, &ss);
+    frames++;
+  }
+  fprintf(stderr, "Streamed %lu frames of %s\n", frames, name);
+
+  // Cleanup
+  int errsave = errno;
+  ImageDestroy(&frame);
+  ImageStreamClose(&in);
+  while (ss.outputs != NULL) {
+    struct streamOutput* o = ss.outputs;
+    if (!ImageStreamClose(&o->s) && err == 0) {
+      err = 4;
+      errsave = errno;
+    }
+    ss.outputs = o->next;
+    free(o->name);
+    free(o);
+  }
+  for (int i = 0; ss.state != NULL && i < ac; i++) ImageDestroy(&ss.state[i]);
+  free(ss.state);
+  errno = errsave;
+  return err;
+}
+
+// Server (--serve SOCKET)
+//
+// Requests are read one per line, split into words, and run as pipelines.
+// Each connection is served by a thread of its own, so requests on
+// distinct connections run concurrently; their image operations share the
+// worker pool of the image8bit module (an operation that finds it busy
+// runs serially in the thread of its request).
+
+static int listenFd = -1;
+
+// Requests running, and whether the server is stopping (after a shutdown
+// request): then it waits for the running requests, and refuses new ones.
+static pthread_mutex_t serverLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t serverIdle = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+static int stopping = 0;
+
+// Split line into words, in place.  Returns the number of words,
+// stored in (*words), which is reallocated as needed (*cap words).
+static int splitWords(char* line, char*** words, int* cap) {
+  int n = 0;
+  for (char* w = strtok(line, " \t\r\n"); w != NULL; w = strtok(NULL, " \t\r\n")) {
+    if (n + 1 >= *cap) {
+      int newCap = *cap > 0 ? 2 * *cap : 16;
+      char** nw = (char**)realloc(*words, newCap * sizeof(char*));
+      if (nw == NULL) return -1;
+      *words = nw;
+      *cap = newCap;
+    }
+    (*words)[n++] = w;
+  }
+  return n;
+}
+
+// Serve the requests read from in, replying to out, until the end of in.
+static void serveRequests(FILE* in, FILE* out) {
+  char* line = NULL;
+  size_t size = 0;
+  char** words = NULL;
+  int cap = 0;
+  while (getline(&line, &size, in) != -1) {
+    int nw = splitWords(line, &words, &cap);
+    if (nw == 0) continue;
+    int shutdownRequest = nw == 1 && strcmp(words[0], "shutdown") == 0;
+    pthread_mutex_lock(&serverLock);
+    int refused = stopping;
+    if (!refused && shutdownRequest) {
+      stopping = 1;
+      if (listenFd >= 0) shutdown(listenFd, SHUT_RDWR);  // wake up accept
+    } else if (!refused) {
+      running++;
+    }
+    pthread_mutex_unlock(&serverLock);
+    if (refused || shutdownRequest) {
+      fprintf(out, refused ? "ERROR Server is stopping\n" : "OK\n");
+      fflush(out);
+      break;
+    }
+
+    errno = 0;
+    int err = nw < 0 ? 4 : runPipeline(nw, words, 0, out, 1, NULL, NULL);
+    pthread_mutex_lock(&serverLock);
+    if (--running == 0) pthread_cond_signal(&serverIdle);
+    pthread_mutex_unlock(&serverLock);
+    if (err == 0) {
+      fprintf(out, "OK\n");
+    } else {
+      fprintf(out, "ERROR ");
+      fprintf(out, errors[err], ImageErrMsg());
+      if (errno != 0) fprintf(out, ": %s", strerror(errno));
+      fprintf(out, "\n");
+    }
+    fflush(out);
+  }
+  free(words);
+  free(line);
+}
+
+// Serve one connection (in its own thread).
+static void* connectionThread(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  InstrThreadInit();
+  FILE* in = fdopen(fd, "r");
+  int fd2 = dup(fd);
+  FILE* out = fd2 >= 0 ? fdopen(fd2, "w") : NULL;
+  if (in != NULL && out != NULL) {
+    serveRequests(in, out);
+  }
+  if (in != NULL) fclose(in); else close(fd);
+  if (out != NULL) fclose(out); else if (fd2 >= 0) close(fd2);
+  return NULL;
+}
+
+// Serve requests on the Unix domain socket at path, or on stdin and
+// stdout if path is "-".  Returns 0 when shut down, or an error code.
+static int serve(const char* path) {
+  if (strcmp(path, "-") == 0) {
+    serveRequests(stdin, stdout);
+    errno = 0;
+    return 0;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return 11;
+  }
+  strcpy(addr.sun_path, path);
+  listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd < 0) return 11;
+  unlink(path);  // a stale socket of a previous server
+  if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listenFd, 16) != 0) {
+    close(listenFd);
+    return 11;
+  }
+  signal(SIGPIPE, SIG_IGN);  // clients may go away before their replies
+  fprintf(stderr, "Serving on %s\n", path);
+
+  for (;;) {
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;  // shut down (or failed)
+    }
+    pthread_t t;
+    if (pthread_create(&t, NULL, connectionThread, (void*)(intptr_t)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(t);
+  }
+  // Wait for the requests still running
+  pthread_mutex_lock(&serverLock);
+  while (running > 0) pthread_cond_wait(&serverIdle, &serverLock);
+  int err = stopping ? 0 : 11;
+  pthread_mutex_unlock(&serverLock);
+  close(listenFd);
+  unlink(path);
+  if (err == 0) errno = 0;
+  return err;
+}
+
+
+// Batch mode (--batch INPUTS --out DIR -- PIPELINE)
+//
+// Three stages overlap: a reader thread loads the inputs in order, a few
+// ahead of the pipelines; the pipelines run as a job of the worker pool
+// of the image8bit module, one input per index (their image operations,
+// finding the pool busy, run serially in their worker); and a writer
+// thread saves the results as they are completed.  Reads ahead and
+// results not yet saved are both bounded, so memory stays bounded too.
+
+enum { PENDING, LOADED, RUNNING, FINISHED };
+
+// One input of the batch
+struct batchItem {
+  char* input;        // file (or shm:NAME) to load
+  int state;          // PENDING, LOADED, ...
+  Image img;          // loaded image, then the result
+  char* output;       // output of the pipeline (info, locate, ...)
+  size_t outputSize;
+  int err;            // index in errors, 0 on success
+  int errnum;         // errno of the failure
+  char cause[128];    // ImageErrMsg of the failure
+  double load, run, save;  // wall-clock times (seconds)
+};
+
+struct batch {
+  struct batchItem* items;
+  int n;
+  int ac; char** av; int k;  // the pipeline
+  const char* dir;           // output directory, or NULL
+  int window;                // maximum inputs read ahead, results queued
+  int loaded;                // inputs loaded (items [0, loaded))
+  int taken;                 // inputs taken by the pipelines
+  int* queue;                // results to save, by index: [saved, queued)
+  int queued, saved;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+// Record the failure of item, with error code err.
+static void batchFail(struct batchItem* item, int err) {
+  item->err = err;
+  item->errnum = errno;
+  snprintf(item->cause, sizeof(item->cause), "%s", ImageErrMsg());
+}
+
+// Load the inputs, in order, at most window ahead of the pipelines.
+static void* batchReader(void* arg) {
+  struct batch* b = (struct batch*)arg;
+  InstrThreadInit();
+  for (int i = 0; i < b->n; i++) {
+    pthread_mutex_lock(&b->lock);
+    while (b->loaded - b->taken >= b->window) pthread_cond_wait(&b->changed, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+
+    struct batchItem* item = &b->items[i];
+    double t = wall_time();
+    errno = 0;
+    item->img = loadImage(item->input, IMAGE_RASTER);
+    if (item->img == NULL) batchFail(item, 4);
+    item->load = wall_time() - t;
+
+    pthread_mutex_lock(&b->lock);
+    item->state = LOADED;
+    b->loaded++;
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+  }
+  return NULL;
+}
+
+// Run the pipeline on inputs [begin, end), as a job of the worker pool.
+static void batchJob(void* arg, size_t begin, size_t end) {
+  struct batch* b = (struct batch*)arg;
+  InstrThreadInit();
+  for (size_t i = begin; i < end; i++) {
+    struct batchItem* item = &b->items[i];
+    pthread_mutex_lock(&b->lock);
+    while (item->state != LOADED) pthread_cond_wait(&b->changed, &b->lock);
+    item->state = RUNNING;
+    b->taken++;
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+
+    if (item->err == 0) {
+      double t = wall_time();
+      FILE* out = open_memstream(&item->output, &item->outputSize);
+      errno = 0;
+      int err = out == NULL ? 4 : runPipeline(b->ac, b->av, b->k, out, 1, &item->img, NULL);
+      if (err != 0) batchFail(item, err);
+      if (out != NULL) fclose(out);
+      item->run = wall_time() - t;
+    }
+
+    // Queue the result for the writer, when there is room
+    pthread_mutex_lock(&b->lock);
+    while (b->queued - b->saved >= b->window) pthread_cond_wait(&b->changed, &b->lock);
+    b->queue[b->queued++] = (int)i;
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+  }
+}
+
+// Save the results (to dir, with the names of the inputs) as they come.
+static void* batchWriter(void* arg) {
+  struct batch* b = (struct batch*)arg;
+  InstrThreadInit();
+  for (int done = 0; done < b->n; done++) {
+    pthread_mutex_lock(&b->lock);
+    while (b->saved == b->queued) pthread_cond_wait(&b->changed, &b->lock);
+    struct batchItem* item = &b->items[b->queue[b->saved]];
+    pthread_mutex_unlock(&b->lock);
+
+    if (item->err == 0 && b->dir != NULL && item->img != NULL) {
+      double t = wall_time();
+      const char* base = strrchr(item->input, '/');
+      base = base != NULL ? base + 1 : item->input;
+      if (strncmp(base, SHM_PREFIX, strlen(SHM_PREFIX)) == 0) base += strlen(SHM_PREFIX);
+      size_t size = strlen(b->dir) + strlen(base) + 2;
+      char* name = (char*)malloc(size);
+      errno = 0;
+      if (name == NULL) {
+        batchFail(item, 4);
+      } else {
+        snprintf(name, size, "%s/%s", b->dir, base);
+        if (!saveImage(item->img, name)) batchFail(item, 4);
+        free(name);
+      }
+      item->save = wall_time() - t;
+    }
+    ImageDestroy(&item->img);
+
+    pthread_mutex_lock(&b->lock);
+    item->state = FINISHED;
+    b->saved++;
+    pthread_cond_broadcast(&b->changed);
+    pthread_mutex_unlock(&b->lock);
+  }
+  return NULL;
+}
+
+// Append name to the inputs of b.  Returns 0 on failure.
+static int batchAdd(struct batch* b, const char* name, int* cap) {
+  if (b->n == *cap) {
+    int newCap = *cap > 0 ? 2 * *cap : 64;
+    struct batchItem* items = (struct batchItem*)realloc(b->items, newCap * sizeof(*items));
+    if (items == NULL) return 0;
+    b->items = items;
+    *cap = newCap;
+  }
+  struct batchItem* item = &b->items[b->n];
+  memset(item, 0, sizeof(*item));
+  item->input = strdup(name);
+  if (item->input == NULL) return 0;
+  b->n++;
+  return 1;
+}
+
+// Expand the inputs: comma-separated names or glob patterns, or - for
+// the names in the lines of stdin.  Returns 0 on failure.
+static int batchInputs(struct batch* b, char* inputs) {
+  int cap = 0;
+  if (strcmp(inputs, "-") == 0) {
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int ok = 1;
+    while (ok && (len = getline(&line, &size, stdin)) != -1) {
+      while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+      if (len > 0) ok = batchAdd(b, line, &cap);
+    }
+    free(line);
+    return ok;
+  }
+  for (char* pattern = strtok(inputs, ","); pattern != NULL; pattern = strtok(NULL, ",")) {
+    glob_t g;
+    // Names that match no file are kept, to be reported as failed loads
+    if (glob(pattern, GLOB_NOCHECK, NULL, &g) != 0) return 0;
+    int ok = 1;
+    for (size_t i = 0; ok && i < g.gl_pathc; i++) ok = batchAdd(b, g.gl_pathv[i], &cap);
+    globfree(&g);
+    if (!ok) return 0;
+  }
+  return 1;
+}
+
+// Run batch: av[k] is --batch.  Returns 0 on success, or an error code.
+static int runBatch(int ac, char* av[], int k) {
+  struct batch b;
+  memset(&b, 0, sizeof(b));
+  if (++k >= ac) return 1;
+  char* inputs = av[k++];
+  if (k + 1 < ac && strcmp(av[k], "--out") == 0) {
+    b.dir = av[k + 1];
+    k += 2;
+  }
+  if (k >= ac || strcmp(av[k], "--") != 0) return 5;
+  b.ac = ac;
+  b.av = av;
+  b.k = k + 1;
+
+  errno = 0;
+  if (!batchInputs(&b, inputs)) return 4;
+  int threads = PoolThreads();
+  b.window = threads + 1;
+  b.queue = (int*)malloc((b.n > 0 ? b.n : 1) * sizeof(int));
+  if (b.queue == NULL) return 4;
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.changed, NULL);
+
+  double t = wall_time();
+  pthread_t reader, writer;
+  int readerStarted = 0;
+  if (pthread_create(&writer, NULL, batchWriter, &b) != 0) {
+    // No threads: run the stages one after the other, with no bounds
+    b.window = b.n + 1;
+    batchReader(&b);
+    PoolRun(b.n, 1, batchJob, &b);
+    batchWriter(&b);
+  } else {
+    if (pthread_create(&reader, NULL, batchReader, &b) == 0) {
+      readerStarted = 1;
+    } else {
+      pthread_mutex_lock(&b.lock);
+      b.window = b.n + 1;
+      pthread_mutex_unlock(&b.lock);
+      batchReader(&b);
+    }
+    PoolRun(b.n, 1, batchJob, &b);
+    if (readerStarted) pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+  }
+  t = wall_time() - t;
+
+  // Summary
+  int failed = 0;
+  double load = 0.0, run = 0.0, save = 0.0;
+  printf("# %-30s %-6s %9s %9s %9s\n", "input", "result", "load(s)", "run(s)", "save(s)");
+  for (int i = 0; i < b.n; i++) {
+    struct batchItem* item = &b.items[i];
+    printf("%-32s %-6s %9.6f %9.6f %9.6f\n", item->input, item->err == 0 ? "OK" : "FAILED",
+           item->load, item->run, item->save);
+    if (item->output != NULL) fwrite(item->output, 1, item->outputSize, stdout);
+    if (item->err != 0) {
+      failed++;
+      printf("#   ");
+      printf(errors[item->err], item->cause);
+      if (item->errnum != 0) printf(": %s", strerror(item->errnum));
+      printf("\n");
+    }
+    load += item->load;
+    run += item->run;
+    save += item->save;
+    free(item->output);
+    free(item->input);
+  }
+  printf("# %d inputs, %d failed, %d threads: load %.3f s, run %.3f s, save %.3f s,"
+         " wall %.3f s (%.1f inputs/s)\n",
+         b.n, failed, threads, load, run, save, t, t > 0.0 ? b.n / t : 0.0);
+
+  free(b.items);
+  free(b.queue);
+  pthread_mutex_destroy(&b.lock);
+  pthread_cond_destroy(&b.changed);
+  errno = 0;
+  return failed > 0 ? 12 : 0;
+}
+
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  // Operations up to --serve or --batch, if any, prepare the server
+  // or the batch
+  int end = 1;
+  while (end < ac && strcmp(av[end], "--serve") != 0 && strcmp(av[end], "--batch") != 0) end++;
+
+  int err = runPipeline(end, av, 1, stdout, 0, NULL, NULL);
+  if (err == 0 && end < ac && strcmp(av[end], "--batch") == 0) {
+    err = runBatch(ac, av, end);
+  } else if (err == 0 && end < ac) {
+    if (end + 1 >= ac) err = 1;
+    else if (end + 2 < ac) err = 5;
+    else err = serve(av[end + 1]);
+  }
+
+  residentDropAll();
+
+  if (metrics.f != NULL) {
+    ImageSetMetricsHook(NULL, NULL);
+    fclose(metrics.f);
+  }
 
   error(err, errno, errors[err], ImageErrMsg());
   return 0;
 }
-
@@ -9,7 +9,8 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: CTU is measured when first needed
+/// InstrPerfOpen();  // Optional: also count cycles, cache misses, ...
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,14 +19,34 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Counters are per thread: each thread increments its own InstrCount
+/// array, with no synchronization cost.  Reading them (InstrRead, InstrPrint)
+/// merges the counts of all threads.  Threads other than the one that
+/// reads must call InstrThreadInit() once, before counting, to be included.
+///
+/// Code may also be measured in named scopes, which nest:
+///
+/// InstrBegin("blur");
+/// ...  // may call functions with scopes of their own
+/// InstrEnd();
+/// ...
+/// InstrPrintScopes();  // to show the tree of scopes
 
 #include "instrumentation.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock time in seconds (from an arbitrary origin)
+double wall_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
@@ -42,6 +63,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,64 +95,519 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // already a wall-clock time
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one per thread):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
-/// Cpu_time read on previous reset (~seconds)
-double InstrTime;  ///extern
+/// Cpu_time read on previous reset (~seconds), per thread
+_Thread_local double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
-double InstrCTU = 1.0;  ///extern
+/// Wall_time read on previous reset (~seconds), per thread
+_Thread_local double InstrWall;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
-void InstrCalibrate(void) { ///
+/// Names of the hardware performance counters:
+const char* InstrPerfName[NUMPERF] = {
+  "cycles", "instrs", "cmisses", "bmisses"
+};  ///extern
+
+/// Calibrated Time Unit (in seconds, 0 until calibrated)
+double InstrCTU = 0.0;  ///extern
+
+// Calibration takes a few seconds, so it is done lazily (only when a
+// calibrated time is needed) and its result is cached in a file,
+// $XDG_CACHE_HOME/image8bit/ctu (or ~/.cache/image8bit/ctu), that holds
+// one line "CTU<TAB>CPU model" for each CPU model calibrated so far.
+
+static pthread_mutex_t calibration = PTHREAD_MUTEX_INITIALIZER;
+
+// Get the name of the cache file into path (of size n).
+// Returns 0 if it cannot be determined.
+// If mkdirs, creates its directory (and $HOME/.cache) if needed.
+static int cachePath(char* path, size_t n, int mkdirs) {
+  char dir[4096];
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (xdg != NULL && xdg[0] != '\0') {
+    snprintf(dir, sizeof(dir), "%s", xdg);
+  } else if (home != NULL && home[0] != '\0') {
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  } else {
+    return 0;
+  }
+  if (mkdirs) mkdir(dir, 0777);  // may already exist
+  int len = snprintf(path, n, "%s/image8bit", dir);
+  if (len < 0 || (size_t)len >= n) return 0;
+  if (mkdirs && mkdir(path, 0777) != 0 && errno != EEXIST) return 0;
+  len = snprintf(path, n, "%s/image8bit/ctu", dir);
+  return len >= 0 && (size_t)len < n;
+}
+
+// Get the CPU model name into model (of size n), to key the cache.
+static void cpuModel(char* model, size_t n) {
+  snprintf(model, n, "unknown");
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return;
+  char line[512];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+      colon += strspn(colon + 1, " \t") + 1;
+      colon[strcspn(colon, "\n")] = '\0';
+      snprintf(model, n, "%s", colon);
+      break;
+    }
+  }
+  fclose(f);
+}
+
+// Look up the CTU of this CPU model in the cache file.
+// Returns the CTU, or 0.0 if not found.
+static double cacheLoad(const char* model) {
+  char path[4200];
+  if (!cachePath(path, sizeof(path), 0)) return 0.0;
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return 0.0;
+  double ctu = 0.0;
+  char line[600];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* tab = strchr(line, '\t');
+    if (tab == NULL) continue;
+    tab[1 + strcspn(tab + 1, "\n")] = '\0';
+    if (strcmp(tab + 1, model) == 0) {
+      ctu = atof(line);
+    }
+  }
+  fclose(f);
+  return ctu > 0.0 ? ctu : 0.0;
+}
+
+// Append the CTU of this CPU model to the cache file (best effort).
+static void cacheStore(const char* model, double ctu) {
+  char path[4200];
+  if (!cachePath(path, sizeof(path), 1)) return;
+  FILE* f = fopen(path, "a");
+  if (f == NULL) return;
+  fprintf(f, "%.9f\t%s\n", ctu, model);
+  fclose(f);
+}
+
+// Run and time the calibration loop.
+static double measureCTU(void) {
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
-  int array[size];  // alloc array in stack, not initialized on purpose
+  unsigned array[size];  // alloc array in stack, not initialized on purpose
   double time = cpu_time();
   srand((unsigned int)(time*1e9));
   for (int n = 0; n < 40000000; n++) {
     int i = rand() & mask;
     int j = rand() & mask;
     int k = rand() & mask;
-    array[k] ^= array[i] + array[j] + i*j;
+    array[k] ^= array[i] + array[j] + (unsigned)(i*j);
     //printf("%d %d %d\n", i, j, k);  // debug
   }
-  InstrCTU = cpu_time() - time;
+  return cpu_time() - time;
+}
+
+/// Find the Calibrated Time Unit (CTU).
+/// Run and time a loop of basic memory and arithmetic operations to set
+/// a reasonably cpu-independent time unit.
+/// The result is stored in the cache, for later runs on the same CPU model.
+void InstrCalibrate(void) { ///
+  int errsave = errno;
+  char model[256];
+  cpuModel(model, sizeof(model));
+  pthread_mutex_lock(&calibration);
+  InstrCTU = measureCTU();
+  cacheStore(model, InstrCTU);
+  pthread_mutex_unlock(&calibration);
+  errno = errsave;
+}
+
+/// Get the Calibrated Time Unit (CTU).
+/// On first use, reads it from the cache, or calibrates if not cached.
+/// Time spent calibrating is not counted in the caller's measurement,
+/// and errno is preserved.
+double InstrGetCTU(void) { ///
+  pthread_mutex_lock(&calibration);
+  if (InstrCTU <= 0.0) {
+    int errsave = errno;
+    char model[256];
+    cpuModel(model, sizeof(model));
+    InstrCTU = cacheLoad(model);
+    if (InstrCTU <= 0.0) {
+      InstrCTU = measureCTU();
+      cacheStore(model, InstrCTU);
+      InstrTime += InstrCTU;  // discount the calibration time
+    }
+    errno = errsave;
+  }
+  double ctu = InstrCTU;
+  pthread_mutex_unlock(&calibration);
+  return ctu;
+}
+
+// Hardware performance counters.
+//
+// On Linux, perf_event_open counts events of the process, in user space.
+// Counters are inherited by threads created after they are opened, and
+// reading them sums over those threads.  If they cannot be opened (not
+// permitted, not supported, not Linux...), they are simply not reported.
+
+static int perfFd[NUMPERF] = { -1, -1, -1, -1 };
+static int perfOpened = 0;
+
+static _Thread_local unsigned long long perfBase[NUMPERF];  // at last reset
+
+#if defined(__linux__)
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const unsigned long long perfConfig[NUMPERF] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int perfOpen(int i) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = perfConfig[i];
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Read counter i, scaled up if it was multiplexed with other events.
+static unsigned long long perfValue(int i) {
+  unsigned long long v[3];  // value, time enabled, time running
+  if (read(perfFd[i], v, sizeof(v)) != (ssize_t)sizeof(v)) return 0;
+  if (v[2] > 0 && v[2] < v[1]) return (unsigned long long)((double)v[0] * v[1] / v[2]);
+  return v[0];
+}
+
+#else
+
+static int perfOpen(int i) { (void)i; return -1; }
+static unsigned long long perfValue(int i) { (void)i; return 0; }
+
+#endif
+
+int InstrPerfOpen(void) { ///
+  int errsave = errno;
+  if (!perfOpened) {
+    for (int i = 0; i < NUMPERF; i++) {
+      perfFd[i] = perfOpen(i);
+      if (perfFd[i] >= 0) perfOpened++;
+    }
+  }
+  errno = errsave;
+  return perfOpened;
+}
+
+int InstrPerfAvailable(int i) { ///
+  return perfFd[i] >= 0;
+}
+
+unsigned long long InstrPerfCount(int i) { ///
+  int errsave = errno;
+  unsigned long long value = perfFd[i] >= 0 ? perfValue(i) : 0;
+  errno = errsave;
+  return value;
+}
+
+// Registry of the counter arrays of all registered threads.
+//
+// Each registered thread links a node pointing to its InstrCount array.
+// When it terminates, its counts are added to `retired` and the node is
+// unlinked (by a thread-specific data destructor).
+// Merged values are discounted by `base`, the merged values of the other
+// threads at the last reset.
+// Counters of other threads are read while they may be changing, so
+// merged values are approximate while those threads are counting.
+
+struct counters {
+  unsigned long* count;
+  struct counters* next;
+};
+
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+static struct counters* threads = NULL;     // list of registered threads
+static unsigned long retired[NUMCOUNTERS];  // counts of terminated threads
+static unsigned long base[NUMCOUNTERS];     // merged counts at last reset
+
+static _Thread_local struct counters self;  // node of the calling thread
+static _Thread_local int registered = 0;
+
+static pthread_key_t exitKey;
+static pthread_once_t exitKeyOnce = PTHREAD_ONCE_INIT;
+
+// Unlink a terminating thread, keeping its counts.
+static void retire(void* node) {
+  pthread_mutex_lock(&registry);
+  for (struct counters** p = &threads; *p != NULL; p = &(*p)->next) {
+    if (*p == node) {
+      *p = (*p)->next;
+      break;
+    }
+  }
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    retired[i] += ((struct counters*)node)->count[i];
+  pthread_mutex_unlock(&registry);
+}
+
+static void createExitKey(void) {
+  pthread_key_create(&exitKey, retire);
+}
+
+void InstrThreadInit(void) { ///
+  if (registered) return;
+  pthread_once(&exitKeyOnce, createExitKey);
+  pthread_mutex_lock(&registry);
+  self.count = InstrCount;
+  self.next = threads;
+  threads = &self;
+  pthread_mutex_unlock(&registry);
+  pthread_setspecific(exitKey, &self);
+  registered = 1;
+}
+
+// Sum of counter i over all threads.  Requires: registry is locked.
+static unsigned long merged(int i) {
+  unsigned long sum = retired[i];
+  for (struct counters* p = threads; p != NULL; p = p->next)
+    sum += __atomic_load_n(&p->count[i], __ATOMIC_RELAXED);
+  return sum;
 }
 
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) { ///
+  InstrThreadInit();
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  pthread_mutex_lock(&registry);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    base[i] = merged(i);
+  pthread_mutex_unlock(&registry);
+  for (int i = 0; i < NUMPERF; i++)
+    perfBase[i] = InstrPerfCount(i);
+  InstrWall = wall_time();
   InstrTime = cpu_time();
 }
 
+/// Read counter i, merged over all threads, since the last InstrReset.
+unsigned long InstrRead(int i) { ///
+  InstrThreadInit();
+  pthread_mutex_lock(&registry);
+  unsigned long value = merged(i) - base[i];
+  pthread_mutex_unlock(&registry);
+  return value;
+}
+
 // Print times and all named counter values
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  double wall = wall_time() - InstrWall;
+  unsigned long long perf[NUMPERF];
+  for (int i = 0; i < NUMPERF; i++)
+    perf[i] = InstrPerfCount(i) - perfBase[i];
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  double caltime = time / InstrGetCTU();
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  printf("#%14.15s\t%15.15s\t%15.15s", "time", "caltime", "wall");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int i = 0; i < NUMPERF; i++)
+    if (InstrPerfAvailable(i))
+      printf("\t%15.15s", InstrPerfName[i]);
   puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+  printf("%15.6f\t%15.6f\t%15.6f", time, caltime, wall);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", InstrRead(i));
+  for (int i = 0; i < NUMPERF; i++)
+    if (InstrPerfAvailable(i))
+      printf("\t%15llu", perf[i]);
   puts("");
 }
 
+
+// Scopes.
+//
+// Scopes form a tree, shared by all threads, with one node per distinct
+// path of nested names; the root is the implicit outermost scope.
+// Each thread keeps its own stack of open scopes, with the times and
+// counter values at their beginning.  Nodes are never freed, so pointers
+// to them stay valid.
+
+struct scope {
+  const char* name;
+  struct scope* parent;
+  struct scope* child;    // first child
+  struct scope* sibling;  // next child of the same parent
+  unsigned long calls;
+  double wall;
+  double cpu;
+  unsigned long count[NUMCOUNTERS];
+  unsigned long long perf[NUMPERF];
+};
+
+static pthread_mutex_t scopes = PTHREAD_MUTEX_INITIALIZER;
+static struct scope root = { "" };
+
+// An open scope
+struct frame {
+  struct scope* node;
+  double wall;
+  double cpu;
+  unsigned long count[NUMCOUNTERS];
+  unsigned long long perf[NUMPERF];
+};
+
+#define MAXDEPTH 32
+
+static _Thread_local struct frame stack[MAXDEPTH];
+static _Thread_local int depth = 0;  // may exceed MAXDEPTH (frames not kept)
+
+// Find the child of parent with the given name, or add it.
+// Requires: scopes is locked.  Returns NULL if out of memory.
+static struct scope* child(struct scope* parent, const char* name) {
+  struct scope** p = &parent->child;
+  while (*p != NULL && strcmp((*p)->name, name) != 0) {
+    p = &(*p)->sibling;
+  }
+  if (*p == NULL) {
+    *p = (struct scope*)calloc(1, sizeof(struct scope));
+    if (*p == NULL) return NULL;
+    (*p)->name = name;
+    (*p)->parent = parent;
+  }
+  return *p;
+}
+
+void InstrBegin(const char* name) { ///
+  if (depth >= MAXDEPTH) {
+    depth++;  // too deep: not measured
+    return;
+  }
+  struct scope* parent = depth > 0 ? stack[depth-1].node : &root;
+  struct frame* f = &stack[depth++];
+  if (parent == NULL) {
+    f->node = NULL;  // parent not measured: neither is this one
+    return;
+  }
+  int errsave = errno;
+  pthread_mutex_lock(&scopes);
+  f->node = child(parent, name);
+  pthread_mutex_unlock(&scopes);
+  errno = errsave;
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    f->count[i] = InstrCount[i];
+  for (int i = 0; i < NUMPERF; i++)
+    f->perf[i] = InstrPerfCount(i);
+  f->cpu = cpu_time();
+  f->wall = wall_time();
+}
+
+void InstrEnd(void) { ///
+  InstrEndSample(NULL);
+}
+
+int InstrEndSample(InstrSample* sample) { ///
+  if (depth == 0) return 0;  // unbalanced
+  if (--depth >= MAXDEPTH) return 0;
+  struct frame* f = &stack[depth];
+  if (f->node == NULL) return 0;
+  InstrSample s;
+  s.name = f->node->name;
+  s.wall = wall_time() - f->wall;
+  s.cpu = cpu_time() - f->cpu;
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    s.count[i] = InstrCount[i] - f->count[i];
+  for (int i = 0; i < NUMPERF; i++)
+    s.perf[i] = InstrPerfCount(i) - f->perf[i];
+  pthread_mutex_lock(&scopes);
+  struct scope* node = f->node;
+  node->calls++;
+  node->wall += s.wall;
+  node->cpu += s.cpu;
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    node->count[i] += s.count[i];
+  for (int i = 0; i < NUMPERF; i++)
+    node->perf[i] += s.perf[i];
+  pthread_mutex_unlock(&scopes);
+  if (sample != NULL) *sample = s;
+  return 1;
+}
+
+// Zero the accumulated values of node and its descendants.
+// Requires: scopes is locked.
+static void resetScope(struct scope* node) {
+  for (struct scope* c = node->child; c != NULL; c = c->sibling) {
+    c->calls = 0;
+    c->wall = 0.0;
+    c->cpu = 0.0;
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      c->count[i] = 0ul;
+    for (int i = 0; i < NUMPERF; i++)
+      c->perf[i] = 0ull;
+    resetScope(c);
+  }
+}
+
+void InstrResetScopes(void) { ///
+  pthread_mutex_lock(&scopes);
+  resetScope(&root);
+  pthread_mutex_unlock(&scopes);
+}
+
+// Print the children of node, indented by level.
+// Requires: scopes is locked.
+static void printScope(struct scope* node, int level) {
+  for (struct scope* c = node->child; c != NULL; c = c->sibling) {
+    if (c->calls == 0 && c->child == NULL) continue;
+    printf("%*s%-*.*s\t%15lu\t%15.6f\t%15.6f", 2*level, "",
+           15 - 2*level, 15 - 2*level, c->name, c->calls, c->wall, c->cpu);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        printf("\t%15lu", c->count[i]);
+    for (int i = 0; i < NUMPERF; i++)
+      if (InstrPerfAvailable(i))
+        printf("\t%15llu", c->perf[i]);
+    puts("");
+    if (level < 7) printScope(c, level + 1);
+  }
+}
+
+void InstrPrintScopes(void) { ///
+  printf("#%-14.14s\t%15.15s\t%15.15s\t%15.15s", "scope", "calls", "wall", "cpu");
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL)
+      printf("\t%15.15s", InstrName[i]);
+  for (int i = 0; i < NUMPERF; i++)
+    if (InstrPerfAvailable(i))
+      printf("\t%15.15s", InstrPerfName[i]);
+  puts("");
+  pthread_mutex_lock(&scopes);
+  printScope(&root, 0);
+  pthread_mutex_unlock(&scopes);
+}
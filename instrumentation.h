@@ -9,7 +9,8 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: CTU is measured when first needed
+/// InstrPerfOpen();  // Optional: also count cycles, cache misses, ...
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,6 +19,19 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Counters are per thread: each thread increments its own InstrCount
+/// array, with no synchronization cost.  Reading them (InstrRead, InstrPrint)
+/// merges the counts of all threads.  Threads other than the one that
+/// reads must call InstrThreadInit() once, before counting, to be included.
+///
+/// Code may also be measured in named scopes, which nest:
+///
+/// InstrBegin("blur");
+/// ...  // may call functions with scopes of their own
+/// InstrEnd();
+/// ...
+/// InstrPrintScopes();  // to show the tree of scopes
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
@@ -25,30 +39,124 @@
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock time in seconds (from an arbitrary origin)
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one per thread):
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
-/// Cpu_time read on previous reset (~seconds)
-extern double InstrTime;  ///extern
+/// Cpu_time read on previous reset (~seconds), per thread
+extern _Thread_local double InstrTime;  ///extern
+
+/// Wall_time read on previous reset (~seconds), per thread
+extern _Thread_local double InstrWall;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Calibrated Time Unit (in seconds, 0 until calibrated)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// The result is stored in the cache, for later runs on the same CPU model.
 void InstrCalibrate(void) ;
 
+/// Get the Calibrated Time Unit (CTU).
+/// On first use, reads it from the cache file
+/// $XDG_CACHE_HOME/image8bit/ctu (or ~/.cache/image8bit/ctu),
+/// or calibrates (and caches the result) if this CPU model is not there.
+double InstrGetCTU(void) ;
+
+/// Register the counters of the calling thread, so that they are merged
+/// into InstrRead and InstrPrint results.  Call once per thread, before
+/// counting.  (Calling it again is harmless.)  When the thread terminates,
+/// its counts are kept in the merged totals.
+void InstrThreadInit(void) ;
+
 /// Reset counters to zero and store cpu_time.
+/// The counters of the calling thread are zeroed; those of other threads
+/// are not touched, but their current values are discounted from then on.
 void InstrReset(void) ;
 
+/// Read counter i, merged over all threads, since the last InstrReset.
+unsigned long InstrRead(int i) ;
+
+/// Print times and all named counter values (merged over all threads).
+/// Cpu time is that of the whole process: with several threads running,
+/// it exceeds the elapsed wall-clock time, which is also shown.
+/// Hardware performance counters are shown too, if they were opened.
 void InstrPrint(void) ;
 
+/// Hardware performance counters
+
+/// Counters of cpu cycles, instructions, cache misses and branch misses,
+/// read from the processor via perf_event_open (Linux only).
+#define NUMPERF 4
+
+/// Names of the hardware performance counters:
+extern const char* InstrPerfName[NUMPERF];  ///extern
+
+/// Open the hardware performance counters, to count events in user space
+/// of the calling thread and of the threads it creates from then on.
+/// So, call it early: before any thread pool is started.
+/// Returns the number of counters opened, which is 0 if they are not
+/// supported or not permitted (see /proc/sys/kernel/perf_event_paranoid).
+/// Counters that fail to open are not reported.
+int InstrPerfOpen(void) ;
+
+/// Check if hardware performance counter i is open.
+int InstrPerfAvailable(int i) ;
+
+/// Read hardware performance counter i (0 if not open).
+/// Counts are cumulative, and include all inherited threads.
+unsigned long long InstrPerfCount(int i) ;
+
+/// Scopes
+
+/// Scopes measure named sections of code, and may be nested.
+/// They form a tree with one node per distinct path of nested names:
+/// "blur" begun inside "pipeline" is a node apart from a top-level "blur".
+/// Each node accumulates, over all the times it was entered (by any
+/// thread), the number of calls, the wall-clock and cpu times, the
+/// increments of the counters of the thread that entered it, and the
+/// increments of the hardware performance counters, if open.
+/// Scopes do not reset or otherwise disturb the counters, so they may be
+/// used inside code measured with InstrReset/InstrPrint, and vice-versa.
+
+/// Begin a scope named name, nested in the current scope of this thread.
+/// name must remain valid (a string literal, usually).
+/// Nesting deeper than 32 levels is allowed, but not measured.
+void InstrBegin(const char* name) ;
+
+/// End the current scope of this thread, begun by the last InstrBegin.
+void InstrEnd(void) ;
+
+/// Measurements of one execution of a scope
+typedef struct {
+  const char* name;                   // name of the scope
+  double wall;                        // wall-clock time (seconds)
+  double cpu;                         // process cpu time (seconds)
+  unsigned long count[NUMCOUNTERS];   // counter increments (this thread)
+  unsigned long long perf[NUMPERF];   // hardware counter increments
+} InstrSample;
+
+/// End the current scope, as InstrEnd, and also store the measurements
+/// of this execution of the scope in (*sample), if sample is not NULL.
+/// Returns 1 if the scope was measured, or 0 (and *sample is untouched)
+/// if it was not (too deep, or unbalanced).
+int InstrEndSample(InstrSample* sample) ;
+
+/// Zero the calls, times and counters accumulated in all scopes.
+void InstrResetScopes(void) ;
+
+/// Print the tree of scopes, with the values accumulated in each one.
+/// Nested scopes are indented under their parent.
+void InstrPrintScopes(void) ;
+
 #endif
 
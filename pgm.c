@@ -0,0 +1,359 @@
+/// pgm - Parsing and formatting of PGM files.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+
+#include "pgm.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// See also:
+// PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
+
+// Whitespace, as in isspace (in the C locale): ' ', '\t', '\n', '\v', '\f', '\r'
+static inline int isSpace(int c) {
+  return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+static inline int isDigit(int c) {
+  return '0' <= c && c <= '9';
+}
+
+
+/// Headers
+
+// Skip whitespace and comments in f, starting with character c (already read).
+// Returns the first other character (or EOF).
+static int skipSpace(FILE* f, int c) {
+  for (;;) {
+    if (c == '#') {
+      // A comment, up to the end of the line
+      do c = getc_unlocked(f); while (c != '\n' && c != EOF);
+    } else if (!isSpace(c)) {
+      return c;
+    }
+    c = getc_unlocked(f);
+  }
+}
+
+// Parse a decimal number from f, starting with character c (already read).
+// Returns the number, or -1 if there is none or it exceeds max.
+// Sets (*next) to the character after it.
+static long readNumber(FILE* f, int c, long max, int* next) {
+  if (!isDigit(c)) {
+    *next = c;
+    return -1;
+  }
+  long v = 0;
+  do {
+    v = v * 10 + (c - '0');
+    if (v > max) v = max + 1;  // saturate, to detect overflows
+    c = getc_unlocked(f);
+  } while (isDigit(c));
+  *next = c;
+  return v <= max ? v : -1;
+}
+
+/// Read a PGM header from f, up to and including the single whitespace
+/// after maxval.
+const char* PgmReadHeader(FILE* f, PgmHeader* hdr) { ///
+  assert (f != NULL);
+  assert (hdr != NULL);
+  const char* cause = NULL;
+  long width, height;
+  long maxval = 1;  // (P4 files have none)
+
+  flockfile(f);  // (once, for all the getc_unlocked)
+  int magic = getc_unlocked(f);
+  int format = getc_unlocked(f);
+  int c = getc_unlocked(f);
+  if (magic != 'P' || (format != '2' && format != '4' && format != '5') || (!isSpace(c) && c != '#')) {
+    cause = "Invalid file format";
+  } else if ((width = readNumber(f, skipSpace(f, c), INT_MAX, &c)) < 0) {
+    cause = "Invalid width";
+  } else if ((height = readNumber(f, skipSpace(f, c), INT_MAX, &c)) < 0) {
+    cause = "Invalid height";
+  } else if (format != '4' && (maxval = readNumber(f, skipSpace(f, c), PGM_MAXVAL, &c)) < 1) {
+    cause = "Invalid maxval";
+  } else if (!isSpace(c)) {
+    cause = "Whitespace expected";
+  } else {
+    hdr->format = format - '0';
+    hdr->width = (int)width;
+    hdr->height = (int)height;
+    hdr->maxval = (int)maxval;
+  }
+  funlockfile(f);
+  return cause;
+}
+
+// Format the decimal digits of v into out.  Returns their number.
+static size_t formatNumber(unsigned long v, char* out) {
+  char digits[24];
+  size_t n = 0;
+  do {
+    digits[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v > 0);
+  for (size_t i = 0; i < n; i++) out[i] = digits[n - 1 - i];
+  return n;
+}
+
+/// Format the PGM header hdr into buf.
+size_t PgmFormatHeader(char* buf, const PgmHeader* hdr) { ///
+  assert (hdr->format == PGM_PLAIN || hdr->format == PGM_RAW || hdr->format == PBM_RAW);
+  assert (hdr->width >= 0 && hdr->height >= 0);
+  assert (0 < hdr->maxval && hdr->maxval <= PGM_MAXVAL);
+  // "P5\n%d %d\n%d\n" (with no maxval for P4)
+  size_t len = 0;
+  buf[len++] = 'P';
+  buf[len++] = (char)('0' + hdr->format);
+  buf[len++] = '\n';
+  len += formatNumber(hdr->width, buf + len);
+  buf[len++] = ' ';
+  len += formatNumber(hdr->height, buf + len);
+  buf[len++] = '\n';
+  if (hdr->format != PBM_RAW) {
+    len += formatNumber(hdr->maxval, buf + len);
+    buf[len++] = '\n';
+  }
+  return len;
+}
+
+
+/// Plain levels
+
+// Levels are parsed from, and formatted into, buffers of CHUNK bytes,
+// read or written with one fread or fwrite each.
+#define CHUNK (1 << 16)
+
+// Number of bytes the reader keeps available ahead of the next level
+// (unless at the end of the file): levels of up to 64 digits (with leading
+// zeros) are parsed in the buffer, with 8-byte loads.
+#define LOOKAHEAD 64
+
+// 8-byte words with the same byte b in each of their bytes
+#define BYTES(b) (0x0101010101010101ull * (b))
+
+struct pgmReader {
+  FILE* f;
+  int maxval;
+  size_t pos;   // next byte to parse in buf
+  size_t len;   // bytes read into buf (followed by 8 zeros)
+  int eof;      // the end of f was reached
+  char buf[CHUNK + LOOKAHEAD + 8];
+};
+
+/// Create a reader of the levels of file f, up to maxval.
+PgmReader PgmReaderCreate(FILE* f, int maxval) { ///
+  assert (f != NULL);
+  PgmReader r = (PgmReader)malloc(sizeof(struct pgmReader));
+  if (r == NULL) return NULL;
+  r->f = f;
+  r->maxval = maxval;
+  r->pos = r->len = 0;
+  r->eof = 0;
+  memset(r->buf, 0, 8);
+  return r;
+}
+
+/// Destroy the reader pointed to by (*rp).
+void PgmReaderDestroy(PgmReader* rp) { ///
+  assert (rp != NULL);
+  free(*rp);
+  *rp = NULL;
+}
+
+// Move the unparsed bytes to the start of the buffer, and read more,
+// until LOOKAHEAD bytes are available or f ends.
+static const char* refill(PgmReader r) {
+  memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+  r->len -= r->pos;
+  r->pos = 0;
+  while (r->len < LOOKAHEAD && !r->eof) {
+    size_t n = fread(r->buf + r->len, 1, CHUNK, r->f);
+    r->len += n;
+    if (n < CHUNK) {
+      if (ferror(r->f)) return "Reading pixels";
+      r->eof = 1;
+    }
+  }
+  memset(r->buf + r->len, 0, 8);
+  return NULL;
+}
+
+// Parse the len digits at p, one at a time.
+static unsigned parseDigits(const char* p, size_t len) {
+  unsigned long v = 0;
+  for (size_t i = 0; i < len; i++) {
+    v = v * 10 + (p[i] - '0');
+    if (v > PGM_MAXVAL) v = PGM_MAXVAL + 1;  // saturate, to detect overflows
+  }
+  return (unsigned)v;
+}
+
+// Parse the next level (after whitespace and comments) into (*v).
+static const char* nextLevel(PgmReader r, unsigned* v) {
+  // Skip whitespace and comments, refilling the buffer as needed
+  for (;;) {
+    if (r->len - r->pos < LOOKAHEAD && !r->eof) {
+      const char* cause = refill(r);
+      if (cause != NULL) return cause;
+    }
+    if (r->pos >= r->len) return "Reading pixels";  // the file ended
+    char c = r->buf[r->pos];
+    if (isDigit(c)) break;
+    if (c == '#') {
+      while (r->pos < r->len && r->buf[r->pos] != '\n') r->pos++;
+    } else if (isSpace(c)) {
+      r->pos++;
+    } else {
+      return "Invalid pixel level";
+    }
+  }
+
+  const char* p = r->buf + r->pos;
+  size_t len;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // The first 8 bytes, as digit values (the first in the lowest byte)
+  uint64_t x;
+  memcpy(&x, p, 8);
+  x ^= BYTES('0');
+  // The high bit of each byte that is not a digit (x >= 10): adding 0x76
+  // to the low 7 bits sets it for 10..127, and x itself for 128..255
+  uint64_t nondigit = (((x & BYTES(0x7F)) + BYTES(0x76)) | x) & BYTES(0x80);
+  if (nondigit != 0) {
+    len = __builtin_ctzll(nondigit) >> 3;  // digits before the first non-digit
+    // Keep the len digits, moved to the high bytes (after leading zeros),
+    // and combine pairs of digits, then of pairs, then of quads
+    x <<= 64 - 8 * len;
+    x = (x * 10 + (x >> 8)) & 0x00FF00FF00FF00FFull;
+    x = (x * 100 + (x >> 16)) & 0x0000FFFF0000FFFFull;
+    x = (x * 10000 + (x >> 32)) & 0xFFFFFFFFull;
+    *v = (unsigned)x;
+  } else
+#endif
+  {
+    // (On big-endian hosts, or for levels of 8 digits or more)
+    len = 0;
+    while (len < LOOKAHEAD && isDigit(p[len])) len++;
+    *v = parseDigits(p, len);
+  }
+  r->pos += len;
+
+  // A level ends at whitespace, a comment, or the end of the file
+  char c = r->buf[r->pos];
+  if (r->pos < r->len && !isSpace(c) && c != '#') return "Invalid pixel level";
+  if (*v > (unsigned)r->maxval) return "Invalid pixel level";
+  return NULL;
+}
+
+/// Read the next n levels into array levels.
+const char* PgmReadLevels(PgmReader r, void* levels, int size, size_t n) { ///
+  assert (r != NULL);
+  assert (size == 1 || size == 2);
+  const char* cause = NULL;
+  unsigned v;
+  if (size == 1) {
+    uint8_t* out = (uint8_t*)levels;
+    for (size_t i = 0; i < n && (cause = nextLevel(r, &v)) == NULL; i++) out[i] = (uint8_t)v;
+  } else {
+    uint16_t* out = (uint16_t*)levels;
+    for (size_t i = 0; i < n && (cause = nextLevel(r, &v)) == NULL; i++) out[i] = (uint16_t)v;
+  }
+  return cause;
+}
+
+// Maximum length of lines of plain levels
+#define LINE 70
+
+struct pgmWriter {
+  FILE* f;
+  size_t len;  // bytes formatted into buf
+  char buf[CHUNK + 16];
+};
+
+/// Create a writer of levels to file f.
+PgmWriter PgmWriterCreate(FILE* f) { ///
+  assert (f != NULL);
+  PgmWriter w = (PgmWriter)malloc(sizeof(struct pgmWriter));
+  if (w == NULL) return NULL;
+  w->f = f;
+  w->len = 0;
+  return w;
+}
+
+// Write the formatted bytes to the file.
+static const char* flush(PgmWriter w) {
+  size_t n = w->len;
+  w->len = 0;
+  return fwrite(w->buf, 1, n, w->f) == n ? NULL : "Writing pixels failed";
+}
+
+// Format level v (up to PGM_MAXVAL) into out, with an 8-byte store
+// (out must have room for 8 bytes).  Returns its number of digits.
+static inline size_t formatLevel(unsigned v, char* out) {
+  size_t len = 1 + (v >= 10) + (v >= 100) + (v >= 1000) + (v >= 10000);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // The 5 digits of v, as characters, the most significant in the lowest
+  // byte; shifting out the leading zeros leaves the len digits of v
+  uint64_t x = (uint64_t)(v / 10000)
+             | (uint64_t)(v / 1000 % 10) << 8
+             | (uint64_t)(v / 100 % 10) << 16
+             | (uint64_t)(v / 10 % 10) << 24
+             | (uint64_t)(v % 10) << 32;
+  x = (x + BYTES('0')) >> 8 * (5 - len);
+  memcpy(out, &x, 8);
+#else
+  for (size_t i = len; i > 0; i--) {
+    out[i - 1] = (char)('0' + v % 10);
+    v /= 10;
+  }
+#endif
+  return len;
+}
+
+/// Write n levels of array levels (a row of pixels), starting a new line.
+const char* PgmWriteLevels(PgmWriter w, const void* levels, int size, size_t n) { ///
+  assert (w != NULL);
+  assert (size == 1 || size == 2);
+  size_t col = 0;  // length of the current line
+  for (size_t i = 0; i < n; i++) {
+    if (w->len > CHUNK) {
+      const char* cause = flush(w);
+      if (cause != NULL) return cause;
+    }
+    unsigned v = size == 1 ? ((const uint8_t*)levels)[i] : ((const uint16_t*)levels)[i];
+    size_t len;
+    if (i == 0) {
+      len = formatLevel(v, w->buf + w->len);
+      col = len;
+    } else {
+      // Format the level after room for its separator from the previous
+      // one: a space, or a newline if the line would get too long
+      len = formatLevel(v, w->buf + w->len + 1);
+      int wrap = col + 1 + len > LINE;
+      w->buf[w->len++] = wrap ? '\n' : ' ';
+      col = wrap ? len : col + 1 + len;
+    }
+    w->len += len;
+  }
+  w->buf[w->len++] = '\n';
+  return NULL;
+}
+
+/// Write what is left in the buffer of (*wp), and destroy it.
+const char* PgmWriterDestroy(PgmWriter* wp) { ///
+  assert (wp != NULL);
+  const char* cause = NULL;
+  if (*wp != NULL) {
+    cause = flush(*wp);
+    free(*wp);
+    *wp = NULL;
+  }
+  return cause;
+}
@@ -0,0 +1,110 @@
+/// pgm - Parsing and formatting of PGM files.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// It holds what the loaders and savers of image8bit and image16bit share:
+/// the PGM header tokenizer (also for the raw PBM files of image1bit), and
+/// the reader and writer of the levels of plain PGM files (P2: decimal
+/// levels in ASCII).  Nothing here uses
+/// scanf or printf:
+///
+/// - The header is tokenized by hand, straight from the buffer of the
+///   FILE (getc_unlocked), and exactly the header is consumed, up to the
+///   single whitespace after maxval, so that the pixels that follow may
+///   be read from the FILE as usual (even from a pipe).
+/// - Plain levels are parsed from large chunks of the file, a level at a
+///   time with 8-byte words (SWAR: SIMD within a register): the length of
+///   a level is found from a mask of its non-digit bytes, and its digits
+///   are combined in 3 multiplications, with no branch per digit.
+///   They are formatted into a word in the same way, in reverse.
+///
+/// Failures are reported by returning a message (the failure cause),
+/// which the image modules pass on as their errCause; NULL means success.
+/// errno is set by the standard library, on read, write and allocation
+/// failures.
+
+#ifndef PGM_H
+#define PGM_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// PGM formats (the digit of their magic number: P2 or P5), and the
+// raw PBM format (P4), whose header is the same, but with no maxval
+enum {
+  PGM_PLAIN = 2,  // levels in decimal ASCII, separated by whitespace
+  PBM_RAW = 4,    // bits, 8 per byte, most significant first, 1 for black
+  PGM_RAW = 5,    // levels in binary, 1 byte each (2 if maxval > 255)
+};
+
+// Maximum maxval of PGM files
+#define PGM_MAXVAL 65535
+
+// The fields of a PGM header
+typedef struct {
+  int format;         // PGM_PLAIN, PGM_RAW or PBM_RAW
+  int width, height;  // non-negative
+  int maxval;         // in [1, PGM_MAXVAL] (1 for PBM_RAW)
+} PgmHeader;
+
+/// Headers
+
+/// Read a PGM (or PBM P4) header from f, up to and including the single
+/// whitespace after maxval (after height, in P4).  Comments (from # to the
+/// end of the line) may appear wherever whitespace may.
+/// Returns NULL on success, or the failure cause (then, hdr is undefined).
+const char* PgmReadHeader(FILE* f, PgmHeader* hdr) ;
+
+/// Maximum length of a formatted header
+#define PGM_HEADER_MAX 40
+
+/// Format the PGM header hdr into buf (PGM_HEADER_MAX bytes at least).
+/// Returns its length.
+size_t PgmFormatHeader(char* buf, const PgmHeader* hdr) ;
+
+/// Plain levels
+
+/// Levels are stored in arrays of 1 or 2 bytes per level (uint8 or uint16),
+/// as given by argument size.
+
+/// Reader of the plain levels that follow a header in a file.
+typedef struct pgmReader *PgmReader;
+
+/// Create a reader of the levels of file f, up to maxval.
+/// The reader reads f ahead, in chunks: nothing may be read from f after it.
+/// On success, a new reader is returned.
+/// On failure, returns NULL (and errno is set by malloc).
+PgmReader PgmReaderCreate(FILE* f, int maxval) ;
+
+/// Destroy the reader pointed to by (*rp) (but not its file).
+/// If (*rp)==NULL, no operation is performed.
+/// Ensures: (*rp)==NULL.
+void PgmReaderDestroy(PgmReader* rp) ;
+
+/// Read the next n levels into array levels.
+/// Returns NULL on success, or the failure cause (then, some levels may
+/// have been read).
+const char* PgmReadLevels(PgmReader r, void* levels, int size, size_t n) ;
+
+/// Writer of plain levels to a file.
+typedef struct pgmWriter *PgmWriter;
+
+/// Create a writer of levels to file f.
+/// On success, a new writer is returned.
+/// On failure, returns NULL (and errno is set by malloc).
+PgmWriter PgmWriterCreate(FILE* f) ;
+
+/// Write n levels of array levels (a row of pixels), starting a new line.
+/// Lines are broken to keep them within 70 characters.
+/// Returns NULL on success, or the failure cause.
+const char* PgmWriteLevels(PgmWriter w, const void* levels, int size, size_t n) ;
+
+/// Write what is left in the buffer of the writer pointed to by (*wp),
+/// and destroy it (but not its file).
+/// If (*wp)==NULL, no operation is performed.
+/// Ensures: (*wp)==NULL.
+/// Returns NULL on success, or the failure cause.
+const char* PgmWriterDestroy(PgmWriter* wp) ;
+
+#endif
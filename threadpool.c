@@ -0,0 +1,182 @@
+/// threadpool - A pool of worker threads for data-parallel loops.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// See threadpool.h for usage.
+
+#include "threadpool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// The pool state.
+//
+// Workers sleep on `wake` until a new job is published, which is signalled
+// by incrementing `generation`.  Chunks are claimed by atomically advancing
+// `next`.  When a worker runs out of chunks it decrements `pending`, and the
+// last one signals `done`, on which the calling thread waits.
+//
+// Only one job runs at a time: `running` is held by the thread that
+// submitted it, and a thread that cannot acquire it runs its job serially.
+
+static pthread_mutex_t running = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static int nthreads = 1;          // threads that run jobs, including caller
+static pthread_t* workers = NULL; // the nthreads-1 worker threads
+static int quit = 0;              // tells workers to terminate
+static size_t minWork = 1 << 16;  // minimum work for PoolRunIf to use workers
+
+// The current job
+static PoolJob job;
+static void* jobArg;
+static size_t jobSize;
+static size_t jobGrain;
+static size_t next;               // first index of the next unclaimed chunk
+static unsigned generation = 0;   // incremented for each new job
+static int pending = 0;           // workers still processing the current job
+
+// Claim and process chunks of the current job until there are none left.
+static void work(void) {
+  size_t begin;
+  while ((begin = __atomic_fetch_add(&next, jobGrain, __ATOMIC_RELAXED)) < jobSize) {
+    size_t end = begin + jobGrain < jobSize ? begin + jobGrain : jobSize;
+    job(jobArg, begin, end);
+  }
+}
+
+static void* worker(void* unused) {
+  (void)unused;
+  unsigned seen = 0;
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (generation == seen && !quit) {
+      pthread_cond_wait(&wake, &lock);
+    }
+    if (quit) break;
+    seen = generation;
+    pthread_mutex_unlock(&lock);
+
+    work();
+
+    pthread_mutex_lock(&lock);
+    if (--pending == 0) {
+      pthread_cond_signal(&done);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// Stop and join all workers.  Requires: `running` is held.
+static void stopWorkers(void) {
+  pthread_mutex_lock(&lock);
+  quit = 1;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+  for (int i = 0; i < nthreads - 1; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  workers = NULL;
+  quit = 0;
+  nthreads = 1;
+}
+
+// Start n-1 workers.  Requires: `running` is held, no workers exist.
+// If threads cannot be created, the pool runs with fewer of them.
+static void startWorkers(int n) {
+  if (n <= 1) return;
+  workers = (pthread_t*)malloc((n - 1) * sizeof(pthread_t));
+  if (workers == NULL) return;
+  int started = 0;
+  while (started < n - 1 && pthread_create(&workers[started], NULL, worker, NULL) == 0) {
+    started++;
+  }
+  nthreads = started + 1;
+}
+
+// Default number of threads: from the environment, else one per processor.
+static void init(void) {
+  int n = 0;
+  const char* env = getenv(POOL_THREADS_ENV);
+  if (env != NULL) {
+    n = atoi(env);
+  } else {
+#ifdef _SC_NPROCESSORS_ONLN
+    n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+  pthread_mutex_lock(&running);
+  startWorkers(n);
+  pthread_mutex_unlock(&running);
+}
+
+void PoolSetThreads(int n) { ///
+  pthread_once(&once, init);
+  pthread_mutex_lock(&running);
+  stopWorkers();
+  startWorkers(n);
+  pthread_mutex_unlock(&running);
+}
+
+int PoolThreads(void) { ///
+  pthread_once(&once, init);
+  return nthreads;
+}
+
+void PoolRun(size_t n, size_t grain, PoolJob fn, void* arg) { ///
+  assert (grain > 0);
+  pthread_once(&once, init);
+
+  // Serial fallback: one chunk, no workers, or the pool is busy
+  if (n <= grain || nthreads <= 1 || pthread_mutex_trylock(&running) != 0) {
+    if (n > 0) fn(arg, 0, n);
+    return;
+  }
+
+  // Publish the job and wake the workers
+  pthread_mutex_lock(&lock);
+  job = fn;
+  jobArg = arg;
+  jobSize = n;
+  jobGrain = grain;
+  next = 0;
+  pending = nthreads - 1;
+  generation++;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+
+  // Work along, then wait for the workers to finish their chunks
+  work();
+  pthread_mutex_lock(&lock);
+  while (pending > 0) {
+    pthread_cond_wait(&done, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+
+  pthread_mutex_unlock(&running);
+}
+
+void PoolSetMinWork(size_t work) { ///
+  minWork = work;
+}
+
+size_t PoolMinWork(void) { ///
+  return minWork;
+}
+
+void PoolRunIf(size_t work, size_t n, size_t grain, PoolJob fn, void* arg) { ///
+  if (work < minWork) {
+    if (n > 0) fn(arg, 0, n);
+    return;
+  }
+  PoolRun(n, grain, fn, arg);
+}
@@ -0,0 +1,64 @@
+/// threadpool - A pool of worker threads for data-parallel loops.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// A loop over an index range [0, n) is split into chunks of consecutive
+/// indices.  The calling thread and the worker threads repeatedly grab the
+/// next unprocessed chunk until none is left, so threads that get cheap
+/// chunks simply process more of them (dynamic load balancing).
+///
+/// Use as follows:
+///
+/// static void job(void* arg, size_t begin, size_t end) {
+///   for (size_t i = begin; i < end; i++) ...  // process indices [begin, end)
+/// }
+/// ...
+/// PoolSetThreads(4);            // optional: 3 workers + the caller
+/// PoolRun(n, 1024, job, &arg);  // returns when all n indices are processed
+///
+/// Loops whose total work may be small use PoolRunIf instead, which runs
+/// them serially below a minimum amount of work, shared by all callers.
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stddef.h>
+
+/// Environment variable that sets the default number of threads.
+/// When it is not set, the number of online processors is used.
+#define POOL_THREADS_ENV "IMAGE_THREADS"
+
+/// A job processes indices [begin, end) of a loop, using data in arg.
+typedef void (*PoolJob)(void* arg, size_t begin, size_t end);
+
+/// Set the number of threads that run jobs (including the calling thread).
+/// n <= 1 means run everything serially in the calling thread.
+/// Must not be called from within a job.
+void PoolSetThreads(int n) ;
+
+/// Get the number of threads that run jobs (including the calling thread).
+int PoolThreads(void) ;
+
+/// Run job over indices [0, n), in chunks of grain indices.
+/// Chunks are handed out in increasing order of indices.
+/// Returns when every chunk has been processed.
+/// If the pool is already busy (for instance, when called from within
+/// a job, or concurrently from another thread), or if there is just one
+/// chunk, the job runs serially in the calling thread.
+void PoolRun(size_t n, size_t grain, PoolJob job, void* arg) ;
+
+/// Set the minimum amount of work (in whatever units callers measure it,
+/// such as pixels) for PoolRunIf to use the pool.  The default is 65536.
+void PoolSetMinWork(size_t work) ;
+
+/// Get the minimum amount of work for PoolRunIf to use the pool.
+size_t PoolMinWork(void) ;
+
+/// Run job over indices [0, n), in chunks of grain indices, as PoolRun,
+/// if the loop does at least PoolMinWork() units of work in total.
+/// Smaller loops run serially in the calling thread, as the overhead of
+/// waking the workers would dominate.
+void PoolRunIf(size_t work, size_t n, size_t grain, PoolJob job, void* arg) ;
+
+#endif